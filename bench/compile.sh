@@ -0,0 +1,43 @@
+#!/bin/sh
+# Compile throughput: time `cws --compile` (compile and write the cache) on a generated script.
+# Usage : bench/compile.sh [functions] [runs]   (run from the repository root after `make`)
+
+FUNCTIONS=${1:-5000}
+RUNS=${2:-10}
+CWS=./cws
+DIR=$(mktemp -d)
+SCRIPT=$DIR/compile.cws
+trap 'rm -rf "$DIR"' EXIT
+
+# Nested functions, closures, loops and many identifiers, nothing runs at the top level
+awk -v functions="$FUNCTIONS" 'BEGIN {
+    for (f = 0; f < functions; f++) {
+        printf "fungsi f%d(a, b) {\n", f;
+        printf "    andai total = 0;\n";
+        printf "    ulang(andai i = 0; i < a; i = i + 1) {\n";
+        printf "        andai x = i * %d + b;\n", f;
+        printf "        jika(x > 10) { total = total + x; } pula { total = total - \"f%d\".len(); }\n", f;
+        printf "    }\n";
+        printf "    fungsi g(c) { balik c + total + a; }\n";
+        printf "    balik g(total);\n}\n";
+    }
+}' > "$SCRIPT"
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+lines=$(wc -l < "$SCRIPT")
+bytes=$(wc -c < "$SCRIPT")
+
+start=$(now_ms)
+i=0
+while [ $i -lt "$RUNS" ]; do
+    $CWS --compile "$SCRIPT" || exit 1
+    i=$((i + 1))
+done
+elapsed=$(($(now_ms) - start))
+[ "$elapsed" -gt 0 ] || elapsed=1
+
+echo "compile: $lines lines ($bytes bytes), $((elapsed / RUNS)) ms per run"
+echo "         $((lines * RUNS * 1000 / elapsed)) lines/s, $((bytes * RUNS * 1000 / elapsed / 1024)) KiB/s"
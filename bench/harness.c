@@ -0,0 +1,338 @@
+/*
+ * Benchmark harness: runs every script several times with the interpreter and
+ * reports the median and p95 wall time, the instructions retired (when the
+ * kernel lets us count them) and the peak RSS. With a baseline from an earlier
+ * `-o`, a script slower than the threshold is flagged and the exit status is 1.
+ * Built and run by `make bench` and `make bench-baseline`.
+ *
+ * Usage : harness [-n runs] [-t percent] [-b baseline.json] [-o results.json] ./cws script.cws...
+ * */
+#define _GNU_SOURCE
+#include <fcntl.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#endif
+
+#define MAX_RUNS 1000
+#define NAME_MAX_LENGTH 64
+
+typedef struct
+{
+    char name[NAME_MAX_LENGTH];
+    double median_ms;
+    double p95_ms;
+    // -1 when the counter is not available
+    long long instructions;
+    long peak_rss_kb;
+} Result;
+
+typedef struct
+{
+    double wall_ms;
+    long long instructions;
+    long peak_rss_kb;
+} Run;
+
+static double now_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e3 + ts.tv_nsec / 1e6;
+}
+
+/* Counts the user space instructions of `pid` from its exec on, -1 when perf events are not allowed */
+static int open_counter(pid_t pid)
+{
+#ifdef __linux__
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HARDWARE;
+    attr.config = PERF_COUNT_HW_INSTRUCTIONS;
+    attr.disabled = 1;
+    attr.enable_on_exec = 1;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    return (int)syscall(SYS_perf_event_open, &attr, pid, -1, -1, 0);
+#else
+    (void)pid;
+    return -1;
+#endif
+}
+
+static bool run_once(const char *interpreter, const char *script, Run *run)
+{
+    // The child waits on the pipe until its counter exists, so no instruction is missed
+    int gate[2];
+    if (pipe(gate) != 0)
+        return false;
+
+    double start = now_ms();
+    pid_t pid = fork();
+    if (pid < 0)
+        return false;
+
+    if (pid == 0)
+    {
+        char byte;
+        close(gate[1]);
+        if (read(gate[0], &byte, 1) < 0)
+            _exit(127);
+
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0)
+            dup2(null, STDOUT_FILENO);
+
+        execl(interpreter, interpreter, script, (char *)NULL);
+        _exit(127);
+    }
+
+    close(gate[0]);
+    int counter = open_counter(pid);
+    if (write(gate[1], "", 1) < 0)
+        perror("write");
+    close(gate[1]);
+
+    int status;
+    struct rusage usage;
+    if (wait4(pid, &status, 0, &usage) < 0)
+        return false;
+    run->wall_ms = now_ms() - start;
+    run->peak_rss_kb = usage.ru_maxrss;
+
+    run->instructions = -1;
+    if (counter >= 0)
+    {
+        long long count;
+        if (read(counter, &count, sizeof(count)) == sizeof(count))
+            run->instructions = count;
+        close(counter);
+    }
+
+    if (!WIFEXITED(status) || WEXITSTATUS(status) != 0)
+    {
+        fprintf(stderr, "%s failed with status %d\n", script, WIFEXITED(status) ? WEXITSTATUS(status) : -1);
+        return false;
+    }
+    return true;
+}
+
+static int compare_doubles(const void *a, const void *b)
+{
+    double left = *(const double *)a, right = *(const double *)b;
+    return left < right ? -1 : left > right;
+}
+
+/* Nearest rank percentile of sorted values */
+static double percentile(double *sorted, int count, int percent)
+{
+    int rank = (percent * count + 99) / 100;
+    return sorted[rank < 1 ? 0 : rank - 1];
+}
+
+static void script_name(const char *path, char *name)
+{
+    const char *base = strrchr(path, '/');
+    base = base == NULL ? path : base + 1;
+
+    snprintf(name, NAME_MAX_LENGTH, "%s", base);
+    char *extension = strrchr(name, '.');
+    if (extension != NULL)
+        *extension = '\0';
+}
+
+static bool measure(const char *interpreter, const char *script, int runs, Result *result)
+{
+    static double wall[MAX_RUNS];
+    Run run;
+
+    // One warm up run for the page cache
+    if (!run_once(interpreter, script, &run))
+        return false;
+
+    result->instructions = -1;
+    result->peak_rss_kb = 0;
+    for (int i = 0; i < runs; ++i)
+    {
+        if (!run_once(interpreter, script, &run))
+            return false;
+
+        wall[i] = run.wall_ms;
+        if (run.peak_rss_kb > result->peak_rss_kb)
+            result->peak_rss_kb = run.peak_rss_kb;
+        // The fewest instructions is the least disturbed run
+        if (run.instructions >= 0 && (result->instructions < 0 || run.instructions < result->instructions))
+            result->instructions = run.instructions;
+    }
+
+    qsort(wall, runs, sizeof(double), compare_doubles);
+    result->median_ms = runs % 2 ? wall[runs / 2] : (wall[runs / 2 - 1] + wall[runs / 2]) / 2;
+    result->p95_ms = percentile(wall, runs, 95);
+    script_name(script, result->name);
+    return true;
+}
+
+/* ===== RESULTS FILE ===== */
+
+/*
+ * One benchmark per line, so the harness reads back its own files without a
+ * JSON parser :
+ *
+ * {"benchmarks": [
+ *   {"name": "fib", "median_ms": 261.20, "p95_ms": 270.02, "instructions": 2512345678, "peak_rss_kb": 3012},
+ *   ...
+ * ]}
+ * */
+static bool write_results(const char *path, Result *results, int count)
+{
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+        return false;
+
+    fprintf(file, "{\"benchmarks\": [\n");
+    for (int i = 0; i < count; ++i)
+    {
+        Result *result = &results[i];
+        fprintf(file,
+                "  {\"name\": \"%s\", \"median_ms\": %.2f, \"p95_ms\": %.2f, \"instructions\": %lld, "
+                "\"peak_rss_kb\": %ld}%s\n",
+                result->name, result->median_ms, result->p95_ms, result->instructions, result->peak_rss_kb,
+                i + 1 < count ? "," : "");
+    }
+    fprintf(file, "]}\n");
+
+    return fclose(file) == 0;
+}
+
+static bool find_baseline(const char *path, const char *name, Result *baseline)
+{
+    FILE *file = fopen(path, "r");
+    if (file == NULL)
+        return false;
+
+    char line[512];
+    char pattern[NAME_MAX_LENGTH + 16];
+    snprintf(pattern, sizeof(pattern), "\"name\": \"%s\"", name);
+
+    bool is_found = false;
+    while (!is_found && fgets(line, sizeof(line), file) != NULL)
+    {
+        if (strstr(line, pattern) == NULL)
+            continue;
+
+        is_found = sscanf(strstr(line, "\"median_ms\""), "\"median_ms\": %lf, \"p95_ms\": %lf, \"instructions\": %lld",
+                          &baseline->median_ms, &baseline->p95_ms, &baseline->instructions) == 3;
+    }
+
+    fclose(file);
+    return is_found;
+}
+
+static double change(double value, double base)
+{
+    return base > 0 ? (value - base) * 100 / base : 0;
+}
+
+int main(int argc, char **argv)
+{
+    int runs = 10;
+    double threshold = 5;
+    const char *baseline_path = NULL;
+    const char *output_path = NULL;
+
+    int arg = 1;
+    for (; arg + 1 < argc && argv[arg][0] == '-'; arg += 2)
+    {
+        if (strcmp(argv[arg], "-n") == 0)
+            runs = atoi(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-t") == 0)
+            threshold = atof(argv[arg + 1]);
+        else if (strcmp(argv[arg], "-b") == 0)
+            baseline_path = argv[arg + 1];
+        else if (strcmp(argv[arg], "-o") == 0)
+            output_path = argv[arg + 1];
+        else
+            break;
+    }
+
+    if (argc - arg < 2 || runs < 1 || runs > MAX_RUNS)
+    {
+        fprintf(stderr, "Usage : harness [-n runs] [-t percent] [-b baseline.json] [-o results.json] ./cws "
+                        "script.cws...\n");
+        return 64;
+    }
+
+    if (baseline_path != NULL && access(baseline_path, R_OK) != 0)
+    {
+        fprintf(stderr, "No baseline at %s, run `make bench-baseline` to save one\n", baseline_path);
+        baseline_path = NULL;
+    }
+
+    const char *interpreter = argv[arg++];
+    int count = argc - arg;
+    Result *results = calloc(count, sizeof(Result));
+    if (results == NULL)
+        return 74;
+
+    int regressions = 0;
+    printf("%-20s %10s %10s %16s %10s\n", "benchmark", "median ms", "p95 ms", "instructions", "peak KiB");
+    for (int i = 0; i < count; ++i)
+    {
+        Result *result = &results[i];
+        if (!measure(interpreter, argv[arg + i], runs, result))
+            return 1;
+
+        char instructions[32] = "n/a";
+        if (result->instructions >= 0)
+            snprintf(instructions, sizeof(instructions), "%lld", result->instructions);
+        printf("%-20s %10.2f %10.2f %16s %10ld", result->name, result->median_ms, result->p95_ms, instructions,
+               result->peak_rss_kb);
+
+        Result baseline;
+        if (baseline_path != NULL && find_baseline(baseline_path, result->name, &baseline))
+        {
+            double time_change = change(result->median_ms, baseline.median_ms);
+            printf("  %+6.1f%%", time_change);
+
+            // Instructions retired are much steadier than time, when both runs have them
+            bool has_instructions = result->instructions >= 0 && baseline.instructions > 0;
+            double instruction_change = has_instructions ? change(result->instructions, baseline.instructions) : 0;
+            if (has_instructions)
+                printf(" (%+.1f%% instructions)", instruction_change);
+
+            if (time_change > threshold || instruction_change > threshold)
+            {
+                printf("  REGRESSION");
+                ++regressions;
+            }
+        }
+        printf("\n");
+        fflush(stdout);
+    }
+
+    if (output_path != NULL && !write_results(output_path, results, count))
+    {
+        fprintf(stderr, "Failed to write %s\n", output_path);
+        return 74;
+    }
+
+    free(results);
+    if (regressions > 0)
+    {
+        printf("%d benchmark(s) slower than the baseline by more than %.1f%%\n", regressions, threshold);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,62 @@
+/*
+ * Scanner throughput: tokenizes a file in memory several times and reports MB/s.
+ * Built and run by bench/scan.sh, it only links the scanner.
+ * */
+#include "../src/scanner.h"
+
+#include <string.h>
+#include <time.h>
+
+static double now()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char **argv)
+{
+    if (argc < 2)
+    {
+        fprintf(stderr, "Usage : scan <file> [runs]\n");
+        return 64;
+    }
+
+    FILE *fd = fopen(argv[1], "rb");
+    if (fd == NULL)
+    {
+        fprintf(stderr, "Could not open file \"%s\"\n", argv[1]);
+        return 74;
+    }
+
+    fseek(fd, 0, SEEK_END);
+    size_t size = ftell(fd);
+    rewind(fd);
+
+    char *source = malloc(size + 1);
+    if (source == NULL || fread(source, 1, size, fd) != size)
+    {
+        fprintf(stderr, "Failed to read the file\n");
+        return 74;
+    }
+    source[size] = '\0';
+    fclose(fd);
+
+    int runs = argc > 2 ? atoi(argv[2]) : 10;
+    long tokens = 0;
+
+    double start = now();
+    for (int i = 0; i < runs; ++i)
+    {
+        init_scanner(source);
+        while (scan_token().type != TOKEN_EOF)
+            tokens++;
+    }
+    double elapsed = now() - start;
+
+    printf("scan: %zu bytes, %ld tokens per run, %.1f ms per run\n", size, tokens / runs, elapsed * 1000 / runs);
+    printf("      %.1f MB/s, %.1f Mtokens/s\n", size * runs / elapsed / 1e6, tokens / elapsed / 1e6);
+
+    free(source);
+    return 0;
+}
@@ -0,0 +1,30 @@
+#!/bin/sh
+# Scanner throughput in MB/s on a generated script (identifiers, keywords, numbers, strings, comments).
+# Usage : bench/scan.sh [functions] [runs]   (run from the repository root)
+
+FUNCTIONS=${1:-20000}
+RUNS=${2:-10}
+CC=${CC:-gcc}
+DIR=$(mktemp -d)
+SCRIPT=$DIR/scan.cws
+trap 'rm -rf "$DIR"' EXIT
+
+$CC -O2 -std=gnu17 -o "$DIR/scan" bench/scan.c src/scanner.c src/source.c || exit 1
+
+awk -v functions="$FUNCTIONS" 'BEGIN {
+    for (f = 0; f < functions; f++) {
+        printf "// f%d sums the even numbers below a and scales them by b\n", f;
+        printf "fungsi f%d(jumlah_awal, pengali) {\n", f;
+        printf "    andai total = 0;\n";
+        printf "    ulang(andai indeks = 0; indeks < jumlah_awal; indeks = indeks + 1) {\n";
+        printf "        jika(indeks > %d.25 dan total != nihil) {\n", f;
+        printf "            total = total + indeks * pengali;\n";
+        printf "        } pula {\n";
+        printf "            tampil \"lewati baris %d dari fungsi f%d\";\n", f, f;
+        printf "        }\n";
+        printf "    }\n";
+        printf "    balik total;\n}\n\n";
+    }
+}' > "$SCRIPT"
+
+"$DIR/scan" "$SCRIPT" "$RUNS"
@@ -0,0 +1,68 @@
+#!/bin/sh
+# Startup time with and without the bytecode cache (.cwsc) and a heap snapshot (.cwsi).
+# Usage : bench/startup.sh [runs]   (run from the repository root after `make`)
+
+RUNS=${1:-200}
+CWS=./cws
+DIR=$(mktemp -d)
+SCRIPT=$DIR/startup.cws
+LIBRARY=$DIR/library.cws
+MAIN=$DIR/main.cws
+trap 'rm -rf "$DIR"' EXIT
+
+# A script that is expensive to compile but cheap to run: 100 functions, one call
+awk 'BEGIN {
+    for (f = 0; f < 100; f++) {
+        printf "fungsi f%d(a, b) {\n", f;
+        for (i = 0; i < 50; i++)
+            printf "    andai x%d = a * %d + b - %d.5;\n", i, i, i;
+        printf "    balik x0 + x49;\n}\n";
+    }
+    printf "tampil(f99(1, 2));\n";
+}' > "$SCRIPT"
+
+# A library that spends its time computing data (a prime table), and a script using it
+cat > "$LIBRARY" <<'CWS'
+andai saring = [];
+ulang(andai i = 0; i < 200000; i = i + 1) {
+    saring.push(sah);
+}
+andai prima = [];
+ulang(andai n = 2; n < 200000; n = n + 1) {
+    jika(saring[n]) {
+        prima.push(n);
+        ulang(andai k = n * n; k < 200000; k = k + n) {
+            saring[k] = sesat;
+        }
+    }
+}
+CWS
+echo 'tampil(jmlh(prima));' > "$MAIN"
+cat "$LIBRARY" "$MAIN" > "$DIR/combined.cws"
+
+now_ms() {
+    echo $(($(date +%s%N) / 1000000))
+}
+
+run() {
+    start=$(now_ms)
+    i=0
+    while [ $i -lt "$RUNS" ]; do
+        $CWS "$@" > /dev/null || exit 1
+        i=$((i + 1))
+    done
+    echo $(($(now_ms) - start))
+}
+
+source_ms=$(run "$SCRIPT")
+$CWS --compile "$SCRIPT" || exit 1
+cached_ms=$(run "$SCRIPT")
+
+library_ms=$(run "$DIR/combined.cws")
+$CWS --snapshot "$LIBRARY" > /dev/null || exit 1
+image_ms=$(run --image "$LIBRARY"i "$MAIN")
+
+echo "startup (source):   $source_ms ms / $RUNS runs"
+echo "startup (cached):   $cached_ms ms / $RUNS runs"
+echo "library (run):      $library_ms ms / $RUNS runs"
+echo "library (snapshot): $image_ms ms / $RUNS runs"
@@ -0,0 +1,482 @@
+#include "alloc_profiler.h"
+#include "vm.h"
+
+#include <string.h>
+#include <time.h>
+
+/*
+ * ALLOCATION PROFILER
+ *
+ * A site is a (function, line, object type) triple; `sites` holds their
+ * counters and `site_slots` finds them by hash. `objects` maps every live
+ * object to its site and size so a free can be charged back to the site:
+ * open addressing with linear probing, deleted entries are filled by
+ * shifting the rest of their run back, there are no tombstones.
+ *
+ * The functions of the sites are GC roots, an address never names two
+ * functions during a run.
+ * */
+
+// Sites outside of any script function
+#define SITE_VM 0
+#define SITE_COMPILER 1
+
+typedef struct
+{
+    ObjectFunction *function;
+    uint32_t line;
+    ObjType type;
+
+    uint64_t objects;
+    uint64_t bytes;
+    uint64_t freed;
+    uint64_t live;
+    uint64_t live_bytes;
+    uint64_t freed_since_collection;
+} AllocSite;
+
+typedef struct
+{
+    Obj *obj;
+    uint32_t site;
+    uint32_t size;
+} LiveObject;
+
+typedef struct
+{
+    double ms;
+    size_t heap_before;
+    size_t heap_after;
+    size_t allocated_bytes;
+    uint64_t live_objects;
+    uint32_t first_record;
+    uint32_t record_count;
+} Collection;
+
+/* What one site keeps alive after a collection, and what the collection freed from it */
+typedef struct
+{
+    uint32_t site;
+    uint32_t freed;
+    uint64_t live;
+} SiteRecord;
+
+bool is_alloc_profiling = false;
+
+static struct
+{
+    VM *owner;
+    FILE *file;
+    bool is_json;
+    uint64_t start_ns;
+    uint64_t live_objects;
+
+    AllocSite *sites;
+    uint32_t site_count;
+    uint32_t site_capacity;
+    uint32_t *site_slots;
+    uint32_t site_slot_capacity;
+
+    LiveObject *objects;
+    uint32_t object_count;
+    uint32_t object_capacity;
+
+    Collection *collections;
+    uint32_t collection_count;
+    uint32_t collection_capacity;
+
+    SiteRecord *records;
+    uint32_t record_count;
+    uint32_t record_capacity;
+} prof;
+
+static const char *const type_names[] = {
+    [OBJ_STRING] = "string",     [OBJ_FUNCTION] = "function", [OBJ_NATIVE] = "native",
+    [OBJ_CLOSURE] = "closure",   [OBJ_UPVALUE] = "upvalue",   [OBJ_CLASS] = "class",
+    [OBJ_INSTANCE] = "instance", [OBJ_METHOD] = "method",     [OBJ_TABLE] = "table",
+    [OBJ_ARRAY] = "array",       [OBJ_STRING_VIEW] = "string_view",
+    [OBJ_WORKER] = "worker",
+};
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void *grow(void *array, uint32_t *capacity, size_t size)
+{
+    *capacity = *capacity < 64 ? 64 : *capacity * 2;
+    array = realloc(array, *capacity * size);
+    if (array == NULL)
+    {
+        fprintf(stderr, "Not enough memory to profile allocations\n");
+        exit(74);
+    }
+    return array;
+}
+
+static void *zeroed(uint32_t count, size_t size)
+{
+    void *array = calloc(count, size);
+    if (array == NULL)
+    {
+        fprintf(stderr, "Not enough memory to profile allocations\n");
+        exit(74);
+    }
+    return array;
+}
+
+bool start_alloc_profiler(const char *path)
+{
+    prof.file = fopen(path, "w");
+    if (prof.file == NULL)
+        return false;
+
+    size_t length = strlen(path);
+    prof.is_json = length >= 5 && strcmp(path + length - 5, ".json") == 0;
+    prof.owner = vm;
+    prof.start_ns = now_ns();
+    is_alloc_profiling = true;
+    return true;
+}
+
+/* ===== SITES ===== */
+
+static uint32_t hash_site(ObjectFunction *function, uint32_t line, ObjType type)
+{
+    uint64_t hash = ((uintptr_t)function >> 4) * 0x9e3779b97f4a7c15ull;
+    hash ^= ((uint64_t)line << 8 | (uint64_t)type) * 0xff51afd7ed558ccdull;
+    return (uint32_t)(hash >> 32);
+}
+
+static void rehash_sites()
+{
+    free(prof.site_slots);
+    prof.site_slots = zeroed(prof.site_slot_capacity, sizeof(uint32_t));
+
+    uint32_t mask = prof.site_slot_capacity - 1;
+    for (uint32_t i = 0; i < prof.site_count; ++i)
+    {
+        AllocSite *site = &prof.sites[i];
+        uint32_t slot = hash_site(site->function, site->line, site->type) & mask;
+        while (prof.site_slots[slot] != 0)
+            slot = (slot + 1) & mask;
+        prof.site_slots[slot] = i + 1;
+    }
+}
+
+/* The line being executed, ip is stored at every dispatch and points past the opcode */
+static uint32_t current_site(ObjType type)
+{
+    ObjectFunction *function = NULL;
+    uint32_t line = SITE_VM;
+    if (vm->gc_paused > 0)
+    {
+        line = SITE_COMPILER;
+    }
+    else if (vm->frame_count > 0)
+    {
+        CallFrame *frame = &vm->frame[vm->frame_count - 1];
+        function = frame->closure->function;
+        uint32_t offset = (uint32_t)(frame->ip - function->chunk.code);
+        line = get_line(&function->chunk, offset > 0 ? offset - 1 : 0);
+    }
+
+    if ((prof.site_count + 1) * 4 > prof.site_slot_capacity * 3)
+    {
+        prof.site_slot_capacity = prof.site_slot_capacity < 256 ? 256 : prof.site_slot_capacity * 2;
+        rehash_sites();
+    }
+
+    uint32_t mask = prof.site_slot_capacity - 1;
+    uint32_t slot = hash_site(function, line, type) & mask;
+    while (prof.site_slots[slot] != 0)
+    {
+        AllocSite *site = &prof.sites[prof.site_slots[slot] - 1];
+        if (site->function == function && site->line == line && site->type == type)
+            return prof.site_slots[slot] - 1;
+        slot = (slot + 1) & mask;
+    }
+
+    if (prof.site_count == prof.site_capacity)
+        prof.sites = grow(prof.sites, &prof.site_capacity, sizeof(AllocSite));
+
+    prof.sites[prof.site_count] = (AllocSite){.function = function, .line = line, .type = type};
+    prof.site_slots[slot] = ++prof.site_count;
+    return prof.site_count - 1;
+}
+
+/* ===== LIVE OBJECTS ===== */
+
+static uint32_t object_slot(Obj *obj)
+{
+    return (uint32_t)(((uintptr_t)obj >> 4) * 0x9e3779b97f4a7c15ull >> 32) & (prof.object_capacity - 1);
+}
+
+static void insert_object(LiveObject object)
+{
+    uint32_t mask = prof.object_capacity - 1;
+    uint32_t slot = object_slot(object.obj);
+    while (prof.objects[slot].obj != NULL)
+        slot = (slot + 1) & mask;
+    prof.objects[slot] = object;
+}
+
+static void grow_objects()
+{
+    LiveObject *old = prof.objects;
+    uint32_t old_capacity = prof.object_capacity;
+
+    prof.object_capacity = old_capacity < 1024 ? 1024 : old_capacity * 2;
+    prof.objects = zeroed(prof.object_capacity, sizeof(LiveObject));
+    for (uint32_t i = 0; i < old_capacity; ++i)
+    {
+        if (old[i].obj != NULL)
+            insert_object(old[i]);
+    }
+    free(old);
+}
+
+void profile_allocation(Obj *obj, size_t size)
+{
+    if (vm != prof.owner)
+        return;
+
+    uint32_t index = current_site(obj->type);
+    AllocSite *site = &prof.sites[index];
+    site->objects++;
+    site->bytes += size;
+    site->live++;
+    site->live_bytes += size;
+    prof.live_objects++;
+
+    if ((prof.object_count + 1) * 4 > prof.object_capacity * 3)
+        grow_objects();
+    insert_object((LiveObject){obj, index, (uint32_t)size});
+    prof.object_count++;
+}
+
+void profile_free(Obj *obj)
+{
+    if (vm != prof.owner || prof.object_capacity == 0)
+        return;
+
+    uint32_t mask = prof.object_capacity - 1;
+    uint32_t slot = object_slot(obj);
+    while (prof.objects[slot].obj != obj)
+    {
+        // Allocated before the profiler started
+        if (prof.objects[slot].obj == NULL)
+            return;
+        slot = (slot + 1) & mask;
+    }
+
+    LiveObject *object = &prof.objects[slot];
+    AllocSite *site = &prof.sites[object->site];
+    site->freed++;
+    site->freed_since_collection++;
+    site->live--;
+    site->live_bytes -= object->size;
+    prof.live_objects--;
+    prof.object_count--;
+
+    // Moves back the entries after the hole that would no longer be found past it
+    uint32_t hole = slot;
+    prof.objects[hole].obj = NULL;
+    for (uint32_t next = (hole + 1) & mask; prof.objects[next].obj != NULL; next = (next + 1) & mask)
+    {
+        uint32_t home = object_slot(prof.objects[next].obj);
+        if (((next - home) & mask) >= ((next - hole) & mask))
+        {
+            prof.objects[hole] = prof.objects[next];
+            prof.objects[next].obj = NULL;
+            hole = next;
+        }
+    }
+}
+
+/* ===== TIMELINE ===== */
+
+void profile_collection(size_t heap_before)
+{
+    if (vm != prof.owner)
+        return;
+
+    if (prof.collection_count == prof.collection_capacity)
+        prof.collections = grow(prof.collections, &prof.collection_capacity, sizeof(Collection));
+
+    Collection *collection = &prof.collections[prof.collection_count++];
+    *collection = (Collection){
+        .ms = (now_ns() - prof.start_ns) / 1e6,
+        .heap_before = heap_before,
+        .heap_after = vm->current_bytes,
+        .allocated_bytes = vm->allocated_bytes,
+        .live_objects = prof.live_objects,
+        .first_record = prof.record_count,
+    };
+
+    for (uint32_t i = 0; i < prof.site_count; ++i)
+    {
+        AllocSite *site = &prof.sites[i];
+        if (site->live == 0 && site->freed_since_collection == 0)
+            continue;
+
+        if (prof.record_count < ALLOC_TIMELINE_RECORDS_MAX)
+        {
+            if (prof.record_count == prof.record_capacity)
+                prof.records = grow(prof.records, &prof.record_capacity, sizeof(SiteRecord));
+            prof.records[prof.record_count++] = (SiteRecord){i, (uint32_t)site->freed_since_collection, site->live};
+            collection->record_count++;
+        }
+        site->freed_since_collection = 0;
+    }
+}
+
+void mark_alloc_profile()
+{
+    if (vm != prof.owner)
+        return;
+
+    for (uint32_t i = 0; i < prof.site_count; ++i)
+        mark_obj((Obj *)prof.sites[i].function);
+}
+
+/* ===== REPORT ===== */
+
+static void write_site_name(FILE *file, AllocSite *site)
+{
+    if (site->function == NULL)
+    {
+        fputs(site->line == SITE_COMPILER ? "<compiler>" : "<vm>", file);
+        return;
+    }
+
+    if (site->function->name == NULL)
+        fputs("script", file);
+    else
+        fprintf(file, "%.*s", site->function->name->length, site->function->name->chars);
+    fprintf(file, ":%u", site->line);
+}
+
+static uint32_t *sorted_sites()
+{
+    uint32_t *order = zeroed(prof.site_count + 1, sizeof(uint32_t));
+    for (uint32_t i = 0; i < prof.site_count; ++i)
+        order[i] = i;
+
+    // Insertion sort by bytes, scripts have few enough sites
+    for (uint32_t i = 1; i < prof.site_count; ++i)
+    {
+        uint32_t current = order[i];
+        uint32_t j = i;
+        for (; j > 0 && prof.sites[order[j - 1]].bytes < prof.sites[current].bytes; --j)
+            order[j] = order[j - 1];
+        order[j] = current;
+    }
+    return order;
+}
+
+static void write_text(FILE *file)
+{
+    uint64_t objects = 0, bytes = 0, live_bytes = 0;
+    for (uint32_t i = 0; i < prof.site_count; ++i)
+    {
+        objects += prof.sites[i].objects;
+        bytes += prof.sites[i].bytes;
+        live_bytes += prof.sites[i].live_bytes;
+    }
+
+    fprintf(file, "%llu objects allocated (%llu bytes), %llu still live (%llu bytes), %u collections\n\n",
+            (unsigned long long)objects, (unsigned long long)bytes, (unsigned long long)prof.live_objects,
+            (unsigned long long)live_bytes, prof.collection_count);
+
+    fprintf(file, "%12s %14s %12s %12s %14s  %-12s %s\n", "objects", "bytes", "freed", "live", "live bytes", "type",
+            "site");
+    uint32_t *order = sorted_sites();
+    for (uint32_t i = 0; i < prof.site_count; ++i)
+    {
+        AllocSite *site = &prof.sites[order[i]];
+        fprintf(file, "%12llu %14llu %12llu %12llu %14llu  %-12s ", (unsigned long long)site->objects,
+                (unsigned long long)site->bytes, (unsigned long long)site->freed, (unsigned long long)site->live,
+                (unsigned long long)site->live_bytes, type_names[site->type]);
+        write_site_name(file, site);
+        fputc('\n', file);
+    }
+    free(order);
+
+    if (prof.collection_count == 0)
+        return;
+
+    // At most about 50 rows, the JSON output has every collection
+    uint32_t step = (prof.collection_count + 49) / 50;
+    fprintf(file, "\n%8s %10s %14s %14s %16s %12s\n", "gc", "ms", "heap before", "heap after", "allocated",
+            "live objects");
+    for (uint32_t i = 0; i < prof.collection_count; i += step)
+    {
+        Collection *collection = &prof.collections[i];
+        fprintf(file, "%8u %10.2f %14zu %14zu %16zu %12llu\n", i + 1, collection->ms, collection->heap_before,
+                collection->heap_after, collection->allocated_bytes, (unsigned long long)collection->live_objects);
+    }
+}
+
+static void write_json(FILE *file)
+{
+    fprintf(file, "{\"sites\": [");
+    for (uint32_t i = 0; i < prof.site_count; ++i)
+    {
+        AllocSite *site = &prof.sites[i];
+        fprintf(file, "%s\n  {\"id\": %u, \"site\": \"", i == 0 ? "" : ",", i);
+        write_site_name(file, site);
+        fprintf(file,
+                "\", \"type\": \"%s\", \"objects\": %llu, \"bytes\": %llu, \"freed\": %llu, \"live\": %llu, "
+                "\"live_bytes\": %llu}",
+                type_names[site->type], (unsigned long long)site->objects, (unsigned long long)site->bytes,
+                (unsigned long long)site->freed, (unsigned long long)site->live,
+                (unsigned long long)site->live_bytes);
+    }
+
+    // Every collection lists the sites it freed from or that still had live objects: [id, freed, live]
+    fprintf(file, "\n],\n\"collections\": [");
+    for (uint32_t i = 0; i < prof.collection_count; ++i)
+    {
+        Collection *collection = &prof.collections[i];
+        fprintf(file,
+                "%s\n  {\"ms\": %.3f, \"heap_before\": %zu, \"heap_after\": %zu, \"allocated_bytes\": %zu, "
+                "\"live_objects\": %llu, \"sites\": [",
+                i == 0 ? "" : ",", collection->ms, collection->heap_before, collection->heap_after,
+                collection->allocated_bytes, (unsigned long long)collection->live_objects);
+
+        for (uint32_t j = 0; j < collection->record_count; ++j)
+        {
+            SiteRecord *record = &prof.records[collection->first_record + j];
+            fprintf(file, "%s[%u, %u, %llu]", j == 0 ? "" : ", ", record->site, record->freed,
+                    (unsigned long long)record->live);
+        }
+        fputs("]}", file);
+    }
+    fputs("\n]}\n", file);
+}
+
+bool stop_alloc_profiler()
+{
+    if (!is_alloc_profiling)
+        return true;
+    is_alloc_profiling = false;
+
+    FILE *file = prof.file;
+    if (prof.is_json)
+        write_json(file);
+    else
+        write_text(file);
+
+    free(prof.sites);
+    free(prof.site_slots);
+    free(prof.objects);
+    free(prof.collections);
+    free(prof.records);
+    memset(&prof, 0, sizeof(prof));
+
+    return fclose(file) == 0;
+}
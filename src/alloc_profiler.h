@@ -0,0 +1,31 @@
+#ifndef CWS_ALLOC_PROFILER_H
+#define CWS_ALLOC_PROFILER_H
+
+#include "object.h"
+
+/*
+ * ALLOCATION PROFILER (`cws --alloc-profile out.txt script.cws`)
+ *
+ * Attributes every object to its type and to the line that allocated it
+ * (the running function and line, `<compiler>` while a script compiles,
+ * `<vm>` before any code runs), follows it until the GC frees it and, after
+ * every collection, records the heap size and what each site still keeps
+ * alive. The report lists the sites by bytes allocated, then the heap
+ * timeline; a path ending in `.json` gets the whole data as JSON instead.
+ *
+ * Only the VM that started the profiler is followed.
+ */
+
+// Past this many per site records in the timeline, only the heap sizes are kept
+#define ALLOC_TIMELINE_RECORDS_MAX (1 << 22)
+
+extern bool is_alloc_profiling;
+
+bool start_alloc_profiler(const char *path);
+bool stop_alloc_profiler();
+void profile_allocation(Obj *obj, size_t size);
+void profile_free(Obj *obj);
+void profile_collection(size_t heap_before);
+void mark_alloc_profile();
+
+#endif // !CWS_ALLOC_PROFILER_H
@@ -0,0 +1,78 @@
+#include "arena.h"
+
+#include <string.h>
+
+#define ALIGN_UP(size) (((size) + sizeof(max_align_t) - 1) & ~(sizeof(max_align_t) - 1))
+
+void init_arena(Arena *arena)
+{
+    arena->blocks = NULL;
+    arena->total = 0;
+}
+
+static ArenaBlock *new_block(Arena *arena, size_t size)
+{
+    size_t capacity = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+    ArenaBlock *block = malloc(sizeof(ArenaBlock) + capacity);
+    if (block == NULL)
+    {
+        fprintf(stderr, "Not enough memory for the arena\n");
+        exit(74);
+    }
+
+    block->next = arena->blocks;
+    block->capacity = capacity;
+    block->used = 0;
+    block->last = NULL;
+
+    arena->blocks = block;
+    arena->total += capacity;
+    return block;
+}
+
+void *arena_alloc(Arena *arena, size_t size)
+{
+    size = ALIGN_UP(size);
+
+    ArenaBlock *block = arena->blocks;
+    if (block == NULL || block->capacity - block->used < size)
+        block = new_block(arena, size);
+
+    uint8_t *result = (uint8_t *)block->bytes + block->used;
+    block->used += size;
+    block->last = result;
+    return result;
+}
+
+/* Grows in place when `pointer` is the latest allocation, otherwise copies it */
+void *arena_grow(Arena *arena, void *pointer, size_t old_size, size_t new_size)
+{
+    ArenaBlock *block = arena->blocks;
+    if (pointer != NULL && block != NULL && block->last == pointer)
+    {
+        size_t start = (uint8_t *)pointer - (uint8_t *)block->bytes;
+        if (block->capacity - start >= ALIGN_UP(new_size))
+        {
+            block->used = start + ALIGN_UP(new_size);
+            return pointer;
+        }
+    }
+
+    void *result = arena_alloc(arena, new_size);
+    if (pointer != NULL)
+        memcpy(result, pointer, old_size < new_size ? old_size : new_size);
+    return result;
+}
+
+void free_arena(Arena *arena)
+{
+    ArenaBlock *block = arena->blocks;
+    while (block != NULL)
+    {
+        ArenaBlock *next = block->next;
+        free(block);
+        block = next;
+    }
+
+    init_arena(arena);
+}
@@ -0,0 +1,35 @@
+#ifndef CWS_ARENA_H
+#define CWS_ARENA_H
+
+#include "common.h"
+
+#include <stddef.h>
+
+/*
+ * Bump allocator for short lived bookkeeping (the compiler state). Nothing
+ * is freed on its own, every block goes at once in free_arena, and the
+ * memory is never counted as GC heap.
+ * */
+#define ARENA_BLOCK_SIZE (64 * 1024)
+
+typedef struct ArenaBlock
+{
+    struct ArenaBlock *next;
+    size_t capacity;
+    size_t used;
+    uint8_t *last;
+    max_align_t bytes[];
+} ArenaBlock;
+
+typedef struct
+{
+    ArenaBlock *blocks;
+    size_t total;
+} Arena;
+
+void init_arena(Arena *arena);
+void *arena_alloc(Arena *arena, size_t size);
+void *arena_grow(Arena *arena, void *pointer, size_t old_size, size_t new_size);
+void free_arena(Arena *arena);
+
+#endif // !CWS_ARENA_H
@@ -0,0 +1,506 @@
+#include "bytecode.h"
+#include "hash.h"
+#include "vm.h"
+
+#include <string.h>
+#include <sys/stat.h>
+
+/*
+ * BYTECODE CACHE
+ *
+ * Layout (every integer is little endian) :
+ *
+ *   header   : "CWSC", u32 version, i64 mtime sec, i64 mtime nsec,
+ *              u64 source length, u64 source hash (FNV-1a),
+ *              u64 checksum of the globals and the function (FNV-1a)
+ *   globals  : u32 count, then every global name in slot order
+ *   function : the script function, see write_function
+ *
+ * Globals are resolved to slots at compile time, so the loader re-registers
+ * the names in the same order and rejects the cache when a slot moves.
+ * The upvalue descriptors of a closure are part of the code (they follow
+ * OP_CLOSURE), so they need no special handling.
+ *
+ * The source hash only tells whether the cache belongs to the script. The
+ * checksum and check_code guard the body: the VM trusts its operands, so a
+ * cache whose code could read outside the chunk, the constant pool or the
+ * globals is rejected and the script compiled again.
+ * */
+
+typedef enum
+{
+    CONST_NIL,
+    CONST_TRUE,
+    CONST_FALSE,
+    CONST_NUMBER,
+    CONST_STRING,
+    CONST_FUNCTION,
+} ConstantTag;
+
+bool bytecode_path(const char *source_path, char *path, size_t size)
+{
+    int length = snprintf(path, size, "%sc", source_path);
+    return length > 0 && (size_t)length < size;
+}
+
+static bool source_mtime(const char *source_path, int64_t *sec, int64_t *nsec)
+{
+    struct stat st;
+    if (stat(source_path, &st) != 0)
+        return false;
+
+#ifdef _WIN32
+    *sec = st.st_mtime;
+    *nsec = 0;
+#else
+    *sec = st.st_mtim.tv_sec;
+    *nsec = st.st_mtim.tv_nsec;
+#endif
+    return true;
+}
+
+static bool write_constant(Writer *writer, Value value)
+{
+    if (IS_NIL(value))
+    {
+        write_u8(writer, CONST_NIL);
+    }
+    else if (IS_BOOLEAN(value))
+    {
+        write_u8(writer, AS_BOOL(value) ? CONST_TRUE : CONST_FALSE);
+    }
+    else if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+
+        write_u8(writer, CONST_NUMBER);
+        write_u64(writer, bits);
+    }
+    else if (IS_STRING(value))
+    {
+        write_u8(writer, CONST_STRING);
+        write_chars(writer, AS_STRING(value)->chars, AS_STRING(value)->length);
+    }
+    else if (IS_FUNCTION(value))
+    {
+        write_u8(writer, CONST_FUNCTION);
+        return write_function(writer, AS_FUNCTION(value));
+    }
+    else
+    {
+        return false;
+    }
+
+    return true;
+}
+
+/*
+ * function : i32 arity, i32 upvalue count, u8 has name [, name],
+ *            u32 code length, code, u32 constant count, constants,
+ *            u32 line count, (u32 offset, u32 line) * count
+ * */
+bool write_function(Writer *writer, ObjectFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+
+    write_u32(writer, (uint32_t)function->arity);
+    write_u32(writer, (uint32_t)function->upvalue_count);
+
+    write_u8(writer, function->name != NULL);
+    if (function->name != NULL)
+        write_chars(writer, function->name->chars, function->name->length);
+
+    // A function that already ran (a snapshot) may hold quickened instructions, files get the generic ones
+    uint8_t *code = malloc(chunk->count);
+    if (code == NULL)
+        return false;
+    memcpy(code, chunk->code, chunk->count);
+    for (uint32_t offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset))
+        code[offset] = generic_opcode(code[offset]);
+
+    write_u32(writer, chunk->count);
+    write_bytes(writer, code, chunk->count);
+    free(code);
+
+    write_u32(writer, chunk->constants.count);
+    for (uint32_t i = 0; i < chunk->constants.count; ++i)
+    {
+        if (!write_constant(writer, chunk->constants.values[i]))
+            return false;
+    }
+
+    write_u32(writer, chunk->lines->entries);
+    LineCursor cursor;
+    InitLineCursor(&cursor);
+    while (NextLine(chunk->lines, &cursor))
+    {
+        write_u32(writer, cursor.offset);
+        write_u32(writer, cursor.number);
+    }
+
+    return true;
+}
+
+bool dump_bytecode(ObjectFunction *function, const char *source_path, const char *source, size_t source_length)
+{
+    char path[BYTECODE_PATH_MAX];
+    int64_t sec, nsec;
+
+    if (!bytecode_path(source_path, path, sizeof(path)) || !source_mtime(source_path, &sec, &nsec))
+        return false;
+
+    Writer writer;
+    init_writer(&writer);
+    write_bytes(&writer, BYTECODE_MAGIC, 4);
+    write_u32(&writer, BYTECODE_VERSION);
+    write_u64(&writer, (uint64_t)sec);
+    write_u64(&writer, (uint64_t)nsec);
+    write_u64(&writer, source_length);
+    write_u64(&writer, fnv_64a_buf(source, source_length));
+    size_t checksum = reserve_checksum(&writer);
+
+    write_u32(&writer, vm->global_names.count);
+    for (uint32_t i = 0; i < vm->global_names.count; ++i)
+    {
+        ObjectString *name = AS_STRING(vm->global_names.values[i]);
+        write_chars(&writer, name->chars, name->length);
+    }
+
+    bool is_written = write_function(&writer, function);
+    if (is_written)
+    {
+        patch_checksum(&writer, checksum);
+        is_written = write_file(&writer, path);
+    }
+    free_writer(&writer);
+    return is_written;
+}
+
+static bool read_constant(Reader *reader, Value *value)
+{
+    switch (read_u8(reader))
+    {
+    case CONST_NIL:
+        *value = VALUE_NIL;
+        break;
+    case CONST_TRUE:
+        *value = VALUE_BOOL(true);
+        break;
+    case CONST_FALSE:
+        *value = VALUE_BOOL(false);
+        break;
+    case CONST_NUMBER: {
+        uint64_t bits = read_u64(reader);
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        *value = VALUE_NUMBER(number);
+        break;
+    }
+    case CONST_STRING: {
+        ObjectString *string = read_string(reader);
+        if (string == NULL)
+            return false;
+        *value = VALUE_OBJ(string);
+        break;
+    }
+    case CONST_FUNCTION: {
+        ObjectFunction *function = read_function(reader);
+        if (function == NULL)
+            return false;
+        *value = VALUE_OBJ(function);
+        break;
+    }
+    default:
+        reader->is_error = true;
+        return false;
+    }
+
+    return !reader->is_error;
+}
+
+static bool is_constant(Chunk *chunk, uint32_t offset, ObjType type)
+{
+    uint32_t at = offset + 1;
+    uint32_t constant = READ4BYTE(at);
+    return constant < chunk->constants.count && IS_OBJ(chunk->constants.values[constant]) &&
+           AS_OBJ(chunk->constants.values[constant])->type == type;
+}
+
+/* Where the jump at `offset` lands, -1 when it is not a jump */
+static int64_t jump_target(Chunk *chunk, uint32_t offset)
+{
+    uint8_t opcode = chunk->code[offset];
+    if (opcode != OP_JUMP_IF_FALSE && opcode != OP_JUMP_IF_TRUE && opcode != OP_JUMP && opcode != OP_LOOP &&
+        opcode != OP_SWITCH_JUMP)
+        return -1;
+
+    uint8_t *operands = chunk->code + offset + 1;
+    uint16_t jump = (uint16_t)(operands[0] << 8 | operands[1]);
+    if (opcode == OP_LOOP)
+        return (int64_t)offset + 3 - jump;
+    if (opcode != OP_SWITCH_JUMP)
+        return (int64_t)offset + 3 + jump;
+
+    // The distance is read from the OP_MARK_JUMP the first operand points to, see run()
+    uint8_t idx = operands[0];
+    if ((uint32_t)idx + 1 >= chunk->count)
+        return chunk->count;
+    jump = (uint16_t)(chunk->code[idx] | chunk->code[idx + 1]);
+    return (int64_t)offset + 3 + jump - operands[1];
+}
+
+/*
+ * Checks what run() takes on trust : every instruction is a generic one that
+ * ends inside the chunk, constant operands point into the pool and at the
+ * type the instruction reads, upvalue operands stay inside the closure and
+ * every jump lands on an instruction. The chunk ends with OP_RETURN, so the
+ * VM never runs past it. Global slots are checked by check_global_slots
+ * once the globals are known. Local slots and the depth of the stack are
+ * not, a damaged file never gets that far because of the checksum.
+ * */
+static bool check_code(ObjectFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    if (chunk->count == 0 || function->arity < 0 || function->upvalue_count < 0 ||
+        function->upvalue_count > UPVALUE_MAX)
+        return false;
+
+    bool *is_start = calloc(chunk->count, sizeof(bool));
+    if (is_start == NULL)
+        return false;
+
+    bool is_valid = true;
+    uint32_t last = 0;
+    for (uint32_t offset = 0; offset < chunk->count && is_valid;)
+    {
+        uint8_t opcode = chunk->code[offset];
+        if (opcode >= OPCODE_COUNT || generic_opcode(opcode) != opcode)
+        {
+            is_valid = false;
+            break;
+        }
+
+        // OP_CLOSURE's length comes from the function it creates, which has to be there first
+        uint32_t remaining = chunk->count - offset;
+        if (opcode == OP_CLOSURE && (remaining < 5 || !is_constant(chunk, offset, OBJ_FUNCTION)))
+        {
+            is_valid = false;
+            break;
+        }
+
+        uint32_t length = (uint32_t)instruction_length(chunk, offset);
+        if (length > remaining)
+        {
+            is_valid = false;
+            break;
+        }
+
+        uint32_t at = offset + 1;
+        switch (opcode)
+        {
+        case OP_CONSTANT_LONG:
+            is_valid = READ4BYTE(at) < chunk->constants.count;
+            break;
+        case OP_DOT_GET:
+        case OP_DOT_SET:
+        case OP_CLASS:
+        case OP_METHOD:
+            is_valid = is_constant(chunk, offset, OBJ_STRING);
+            break;
+        case OP_INVOKE:
+            is_valid = is_constant(chunk, offset + 1, OBJ_STRING);
+            break;
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+            is_valid = READ4BYTE(at) < (uint32_t)function->upvalue_count;
+            break;
+        case OP_CLOSURE: {
+            // Captured upvalues of the enclosing closure have to exist
+            int upvalue_count = (length - 5) / 5;
+            for (int i = 0; i < upvalue_count && is_valid; ++i)
+            {
+                uint32_t descriptor = offset + 5 + 5 * i;
+                at = descriptor + 1;
+                is_valid = chunk->code[descriptor] != 0 || READ4BYTE(at) < (uint32_t)function->upvalue_count;
+            }
+            break;
+        }
+        default:
+            break;
+        }
+
+        is_start[offset] = true;
+        last = offset;
+        offset += length;
+    }
+
+    is_valid = is_valid && chunk->code[last] == OP_RETURN;
+    for (uint32_t offset = 0; offset < chunk->count && is_valid; offset += instruction_length(chunk, offset))
+    {
+        int64_t target = jump_target(chunk, offset);
+        if (target != -1)
+            is_valid = target >= 0 && target < chunk->count && is_start[target];
+    }
+
+    free(is_start);
+    return is_valid;
+}
+
+/* True when every global operand of `function` and of the functions it defines is below `count` */
+bool check_global_slots(ObjectFunction *function, uint32_t count)
+{
+    Chunk *chunk = &function->chunk;
+    for (uint32_t offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset))
+    {
+        uint8_t opcode = chunk->code[offset];
+        uint32_t at = offset + 1;
+        if ((opcode == OP_GLOBAL_VAR || opcode == OP_GET_GLOBAL || opcode == OP_SET_GLOBAL) && READ4BYTE(at) >= count)
+            return false;
+    }
+
+    for (uint32_t i = 0; i < chunk->constants.count; ++i)
+    {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant) && !check_global_slots(AS_FUNCTION(constant), count))
+            return false;
+    }
+    return true;
+}
+
+/* Every object is kept on the stack while it is being filled, reading may trigger the GC */
+ObjectFunction *read_function(Reader *reader)
+{
+    ObjectFunction *function = new_function();
+    push(VALUE_OBJ(function));
+
+    function->arity = (int)read_u32(reader);
+    function->upvalue_count = (int)read_u32(reader);
+
+    if (read_u8(reader))
+    {
+        function->name = read_string(reader);
+        if (function->name == NULL)
+            return NULL;
+    }
+
+    Chunk *chunk = &function->chunk;
+    uint32_t code_count = read_u32(reader);
+    const uint8_t *code = read_bytes(reader, code_count);
+    if (code == NULL)
+        return NULL;
+
+    chunk->code = GROW_ARRAY(uint8_t, NULL, 0, code_count);
+    memcpy(chunk->code, code, code_count);
+    chunk->capacity = code_count;
+    chunk->count = code_count;
+
+    uint32_t constant_count = read_u32(reader);
+    for (uint32_t i = 0; i < constant_count; ++i)
+    {
+        Value constant;
+        if (!read_constant(reader, &constant))
+            return NULL;
+
+        push(constant);
+        append_long_values(&chunk->constants, constant);
+        pop();
+    }
+
+    uint32_t line_count = read_u32(reader);
+    uint32_t last_offset = 0;
+    for (uint32_t i = 0; i < line_count; ++i)
+    {
+        uint32_t offset = read_u32(reader);
+        uint32_t number = read_u32(reader);
+        if (offset < last_offset || offset >= code_count)
+            return NULL;
+
+        WriteLine(chunk->lines, offset, number);
+        last_offset = offset;
+    }
+
+    if (reader->is_error || !check_code(function))
+        return NULL;
+
+    pop();
+    return function;
+}
+
+static bool read_header(Reader *reader, const char *source_path, const char *source, size_t source_length)
+{
+    int64_t sec, nsec;
+    if (!source_mtime(source_path, &sec, &nsec))
+        return false;
+
+    const uint8_t *magic = read_bytes(reader, 4);
+    if (magic == NULL || memcmp(magic, BYTECODE_MAGIC, 4) != 0 || read_u32(reader) != BYTECODE_VERSION)
+        return false;
+
+    // The mtime rejects a stale cache cheaply, the hash catches edits that keep the mtime
+    if ((int64_t)read_u64(reader) != sec || (int64_t)read_u64(reader) != nsec)
+        return false;
+
+    if (read_u64(reader) != source_length || read_u64(reader) != fnv_64a_buf(source, source_length))
+        return false;
+
+    return read_checksum(reader);
+}
+
+static bool read_globals(Reader *reader, uint32_t *count)
+{
+    *count = read_u32(reader);
+    for (uint32_t i = 0; i < *count; ++i)
+    {
+        ObjectString *name = read_string(reader);
+        if (name == NULL)
+            return false;
+
+        push(VALUE_OBJ(name));
+        uint32_t slot = global_slot(name);
+        pop();
+
+        if (slot != i)
+            return false;
+    }
+
+    return true;
+}
+
+static ObjectFunction *read_bytecode(Reader *reader, const char *source_path, const char *source,
+                                     size_t source_length)
+{
+    uint32_t global_count;
+    if (!read_header(reader, source_path, source, source_length) || !read_globals(reader, &global_count))
+        return NULL;
+
+    int stack_top = vm->stack_top;
+    ObjectFunction *function = read_function(reader);
+    if (function == NULL || reader->cursor != reader->end || !check_global_slots(function, global_count))
+    {
+        vm->stack_top = stack_top;
+        return NULL;
+    }
+
+    return function;
+}
+
+/* Returns NULL when there is no cache or it does not belong to `source` */
+ObjectFunction *load_bytecode(const char *source_path, const char *source, size_t source_length)
+{
+    char path[BYTECODE_PATH_MAX];
+    if (!bytecode_path(source_path, path, sizeof(path)))
+        return NULL;
+
+    MappedFile file;
+    if (!map_file(path, &file))
+        return NULL;
+
+    Reader reader;
+    init_reader(&reader, file.bytes, file.size);
+    ObjectFunction *function = read_bytecode(&reader, source_path, source, source_length);
+
+    unmap_file(&file);
+    return function;
+}
@@ -0,0 +1,24 @@
+#ifndef CWS_BYTECODE_H
+#define CWS_BYTECODE_H
+
+#include "object.h"
+#include "serialize.h"
+
+/*
+ * Compiled scripts are cached next to their source as `<source>c`
+ * (my-program.cws -> my-program.cwsc). Bump the version whenever the
+ * opcodes, the chunk layout or the order of the native globals change.
+ */
+#define BYTECODE_MAGIC "CWSC"
+#define BYTECODE_VERSION 6
+#define BYTECODE_PATH_MAX 4096
+
+bool bytecode_path(const char *source_path, char *path, size_t size);
+bool dump_bytecode(ObjectFunction *function, const char *source_path, const char *source, size_t source_length);
+ObjectFunction *load_bytecode(const char *source_path, const char *source, size_t source_length);
+
+bool write_function(Writer *writer, ObjectFunction *function);
+ObjectFunction *read_function(Reader *reader);
+bool check_global_slots(ObjectFunction *function, uint32_t count);
+
+#endif // !CWS_BYTECODE_H
@@ -20,6 +20,7 @@
 // WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "chunk.h"
+#include "compiler.h"
 #include "debug.h"
 #include "memory.h"
 #include "object.h"
@@ -32,13 +33,8 @@ void init_chunk(Chunk *chunk)
 
     chunk->code = NULL;
 
-    Values *values = malloc(sizeof(Values));
-    init_values(values);
-    chunk->constants = values;
-
-    LongValues *longValues = malloc(sizeof(LongValues));
-    init_long_values(longValues);
-    chunk->constantsLong = longValues;
+    init_long_values(&chunk->constants);
+    chunk->constant_index = NULL;
 
     Lines *lines = malloc(sizeof(Lines));
     InitLines(lines);
@@ -47,28 +43,150 @@ void init_chunk(Chunk *chunk)
 
 void free_chunk(Chunk *chunk)
 {
-    free_values(chunk->constants);
-    free_long_values(chunk->constantsLong);
+    free_long_values(&chunk->constants);
+    finish_chunk(chunk);
 
     FreeLines(chunk->lines);
+    free(chunk->lines);
+    chunk->lines = NULL;
 
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
-    init_chunk(chunk);
+    chunk->code = NULL;
+    chunk->capacity = 0;
+    chunk->count = 0;
+}
+
+/* The dedup index is only needed while the function is being compiled */
+void finish_chunk(Chunk *chunk)
+{
+    chunk->constant_index = NULL;
+}
+
+/* Drops code that already ran, used when a script is compiled one statement at a time */
+void reset_chunk(Chunk *chunk)
+{
+    chunk->count = 0;
+    chunk->constants.count = 0;
+    FreeLines(chunk->lines);
+
+    if (chunk->constant_index != NULL)
+    {
+        chunk->constant_index->count = 0;
+        chunk->constant_index->generation++;
+    }
+}
+
+/* Constants are equal by identity, strings are interned so equal text is the same object */
+static bool is_same_constant(Value a, Value b)
+{
+#ifdef NAN_BOXING
+    return a == b;
+#else
+    if (a.type != b.type)
+        return false;
+
+    switch (a.type)
+    {
+    case TYPE_NUMBER:
+        return memcmp(&a.as.decimal, &b.as.decimal, sizeof(a.as.decimal)) == 0;
+    case TYPE_BOOLEAN:
+        return a.as.boolean == b.as.boolean;
+    case TYPE_OBJ:
+        return a.as.obj == b.as.obj;
+    default:
+        return true;
+    }
+#endif
+}
+
+static uint32_t hash_constant(Value value)
+{
+    uint64_t bits;
+#ifdef NAN_BOXING
+    bits = value;
+#else
+    bits = value.type;
+    if (IS_OBJ(value))
+        bits ^= (uint64_t)(uintptr_t)value.as.obj;
+    else if (IS_NUMBER(value))
+    {
+        uint32_t decimal;
+        memcpy(&decimal, &value.as.decimal, sizeof(decimal));
+        bits ^= (uint64_t)decimal << 8;
+    }
+    else
+        bits ^= (uint64_t)value.as.boolean << 8;
+#endif
+    bits ^= bits >> 33;
+    bits *= 0xff51afd7ed558ccdULL;
+    bits ^= bits >> 33;
+    return (uint32_t)bits;
 }
 
-uint32_t add_long_constant(Chunk *chunk, Value constant)
+static ConstantSlot *find_constant_slot(Chunk *chunk, Value value)
 {
-    append_long_values(chunk->constantsLong, constant);
-    return chunk->constantsLong->count - 1;
+    ConstantIndex *index = chunk->constant_index;
+    uint32_t mask = index->capacity - 1;
+    uint32_t i = hash_constant(value) & mask;
+
+    for (;;)
+    {
+        ConstantSlot *slot = &index->slots[i];
+        if (slot->generation != index->generation ||
+            is_same_constant(chunk->constants.values[slot->constant], value))
+            return slot;
+        i = (i + 1) & mask;
+    }
+}
+
+static void grow_constant_index(Chunk *chunk)
+{
+    ConstantIndex *index = chunk->constant_index;
+    uint32_t old_capacity = index->capacity;
+    ConstantSlot *old_slots = index->slots;
+
+    index->capacity = GROW_CAPACITY(old_capacity);
+    index->slots = arena_alloc(&compile_arena, sizeof(ConstantSlot) * index->capacity);
+    for (uint32_t i = 0; i < index->capacity; ++i)
+        index->slots[i].generation = index->generation - 1;
+
+    for (uint32_t i = 0; i < old_capacity; ++i)
+    {
+        if (old_slots[i].generation == index->generation)
+            *find_constant_slot(chunk, chunk->constants.values[old_slots[i].constant]) = old_slots[i];
+    }
+}
+
+/* Returns the slot of `constant`, appending it only the first time it is seen */
+uint32_t add_constant(Chunk *chunk, Value constant)
+{
+    ConstantIndex *index = chunk->constant_index;
+    if (index == NULL)
+    {
+        append_long_values(&chunk->constants, constant);
+        return chunk->constants.count - 1;
+    }
+
+    if ((index->count + 1) > index->capacity * FACTOR_TERM)
+        grow_constant_index(chunk);
+
+    ConstantSlot *slot = find_constant_slot(chunk, constant);
+    if (slot->generation == index->generation)
+        return slot->constant;
+
+    append_long_values(&chunk->constants, constant);
+    slot->generation = index->generation;
+    slot->constant = chunk->constants.count - 1;
+    index->count++;
+    return slot->constant;
 }
 
 void make_constant(Chunk *chunk, Value value, uint32_t lineNumber)
 {
     push(value);
-    append_long_values(chunk->constantsLong, value);
+    uint32_t constantIndex = add_constant(chunk, value);
     pop();
 
-    uint32_t constantIndex = chunk->constantsLong->count - 1;
     for (size_t i = 0; i < 4; ++i)
     {
         uint8_t chunkIdx = (constantIndex >> (8 * (3 - i)));
@@ -84,36 +202,16 @@ void emit_constant(Chunk *chunk, Value value, uint32_t lineNumber)
     pop();
 }
 
-void writeLine(Chunk *chunk, uint32_t lineNumber)
-{
-    if (chunk->lines->lines == NULL)
-    {
-        Line *line = malloc(sizeof(Line));
-        InitLine(line, chunk->count, lineNumber);
-        WriteLines(chunk->lines, line);
-    }
-    else
-    {
-        Line *prevLine = chunk->lines->lines[chunk->lines->count - 1];
-        if (lineNumber != prevLine->number)
-        {
-            Line *line = malloc(sizeof(Line));
-            InitLine(line, chunk->count, lineNumber);
-            WriteLines(chunk->lines, line);
-        }
-    }
-}
-
 void write_chunk(Chunk *chunk, uint8_t newItem, uint32_t lineNumber)
 {
     if (chunk->capacity < chunk->count + 1)
     {
-        uint8_t oldCapacity = chunk->capacity;
+        uint32_t oldCapacity = chunk->capacity;
         chunk->capacity = GROW_CAPACITY(chunk->capacity);
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
     }
 
-    writeLine(chunk, lineNumber);
+    WriteLine(chunk->lines, chunk->count, lineNumber);
 
     chunk->code[chunk->count] = newItem;
     chunk->count++;
@@ -125,24 +223,13 @@ int simple_instruction(const char *name, int offset)
     return offset + 1;
 }
 
-int constant_instruction(const char *name, Chunk *chunk, int offset)
-{
-    printf("%-20s %d ", name, offset);
-
-    uint8_t constant = chunk->code[offset + 1];
-    print_value(chunk->constants->values[constant], true, 0);
-    printf("\n");
-
-    return offset + 2;
-}
-
 int constantLongInstruction(const char *name, Chunk *chunk, int offset)
 {
     ++offset;
     printf("%-20s %d ", name, offset);
     uint32_t operand = READ4BYTE(offset);
 
-    print_value(chunk->constantsLong->values[operand], true, 0);
+    print_value(chunk->constants.values[operand], true, 0);
     printf("\n");
 
     return offset;
@@ -165,6 +252,19 @@ int get_local_instruction(const char *name, Chunk *chunk, int offset)
     return offset + 1 + 4;
 }
 
+int global_instruction(const char *name, Chunk *chunk, int offset)
+{
+    ++offset;
+    printf("%-20s %d ", name, offset);
+    uint32_t slot = READ4BYTE(offset);
+
+    printf("%d ", slot);
+    print_value(vm->global_names.values[slot], true, 0);
+    printf("\n");
+
+    return offset;
+}
+
 int jump_instruction(const char *name, int sign, Chunk *chunk, int offset)
 {
 
@@ -176,57 +276,102 @@ int jump_instruction(const char *name, int sign, Chunk *chunk, int offset)
     return offset + 3;
 }
 
-uint32_t get_line(Chunk *chunk, uint8_t idx)
+uint32_t get_line(Chunk *chunk, uint32_t offset)
+{
+    uint32_t number, start;
+    if (!LookupLine(chunk->lines, offset, &number, &start))
+        return -1;
+    return number;
+}
+
+int find_line(Chunk *chunk, int offset)
+{
+    uint32_t number, start;
+    if (!LookupLine(chunk->lines, offset, &number, &start))
+        assert(0 && "Unreachable at find line");
+    return number;
+}
+
+/* The instruction a quickened opcode was rewritten from, the opcode itself otherwise */
+uint8_t generic_opcode(uint8_t opcode)
 {
-    for (int i = chunk->lines->count - 1; i >= 0; --i)
+    switch (opcode)
     {
-        Line *line = chunk->lines->lines[i];
-        if (idx >= line->idx)
-        {
-            return line->number;
-        }
+    case OP_ADD_NUM:
+    case OP_ADD_STR:
+        return OP_ADD;
+    case OP_SUBTRACT_NUM:
+        return OP_SUBTRACT;
+    case OP_MULTIPLY_NUM:
+        return OP_MULTIPLY;
+    case OP_DIVIDE_NUM:
+        return OP_DIVIDE;
+    case OP_GREATER_NUM:
+        return OP_GREATER;
+    case OP_LESS_NUM:
+        return OP_LESS;
+    case OP_DOT_GET_INSTANCE:
+        return OP_DOT_GET;
+    default:
+        return opcode;
     }
-    return -1;
 }
 
-int find_line(Chunk *chunk, int offset)
+/* Bytes taken by the instruction at `offset`, as run() reads them */
+int instruction_length(Chunk *chunk, uint32_t offset)
 {
-    for (int i = chunk->lines->count - 1; i >= 0; --i)
+    switch (generic_opcode(chunk->code[offset]))
     {
-        Line *line = chunk->lines->lines[i];
-        if (offset >= line->idx)
-        {
-            return line->number;
-        }
+    case OP_CONSTANT_LONG:
+    case OP_DOT_GET:
+    case OP_DOT_SET:
+    case OP_GLOBAL_VAR:
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE:
+    case OP_CLASS:
+    case OP_METHOD:
+    case OP_TABLE_ITEMS:
+    case OP_ARRAY_ITEMS:
+        return 5;
+    case OP_MARK_JUMP:
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+    case OP_SWITCH_JUMP:
+    case OP_JUMP:
+    case OP_LOOP:
+        return 3;
+    case OP_CALL:
+        return 2;
+    case OP_INVOKE:
+        return 6;
+    case OP_CLOSURE: {
+        uint32_t at = offset + 1;
+        ObjectFunction *function = AS_FUNCTION(chunk->constants.values[READ4BYTE(at)]);
+        return 5 + 5 * function->upvalue_count;
+    }
+    default:
+        return 1;
     }
-    assert(0 && "Unreachable at find line");
 }
 
 int disassemble_instruction(Chunk *chunk, int offset)
 {
     printf("%04d ", offset);
-    for (int i = chunk->lines->count - 1; i >= 0; --i)
-    {
-        Line *line = chunk->lines->lines[i];
-        if (offset > line->idx)
-        {
-            printf("   | ");
-            break;
-        }
-        else if (offset == line->idx)
-        {
-            printf("%4d ", line->number);
-            break;
-        }
-    }
+    uint32_t number, start;
+    if (LookupLine(chunk->lines, offset, &number, &start) && start == (uint32_t)offset)
+        printf("%4d ", number);
+    else
+        printf("   | ");
 
     uint8_t current = chunk->code[offset];
     switch (current)
     {
     case OP_RETURN:
         return simple_instruction("OP_RETURN", offset);
-    case OP_CONSTANT:
-        return constant_instruction("OP_CONSTANT", chunk, offset);
     case OP_CONSTANT_LONG:
         return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
 
@@ -296,13 +441,13 @@ int disassemble_instruction(Chunk *chunk, int offset)
         return simple_instruction("OP_TAKE", offset);
     }
     case OP_GLOBAL_VAR: {
-        return constantLongInstruction("OP_GLOBAL_VAR", chunk, offset);
+        return global_instruction("OP_GLOBAL_VAR", chunk, offset);
     }
     case OP_GET_GLOBAL: {
-        return constantLongInstruction("OP_GET_GLOBAL", chunk, offset);
+        return global_instruction("OP_GET_GLOBAL", chunk, offset);
     }
     case OP_SET_GLOBAL: {
-        return constantLongInstruction("OP_SET_GLOBAL", chunk, offset);
+        return global_instruction("OP_SET_GLOBAL", chunk, offset);
     }
     case OP_GET_LOCAL: {
         return get_local_instruction("OP_GET_LOCAL", chunk, offset);
@@ -344,7 +489,7 @@ int disassemble_instruction(Chunk *chunk, int offset)
         printf("%-20s %d ", "OP_INVOKE", offset);
 
         uint32_t operand = READ4BYTE(offset);
-        print_value(chunk->constantsLong->values[operand], true, 0);
+        print_value(chunk->constants.values[operand], true, 0);
         printf("\n");
 
         return offset;
@@ -354,7 +499,7 @@ int disassemble_instruction(Chunk *chunk, int offset)
         printf("%-20s %d ", "OP_CLOSURE", offset);
         uint32_t operand = READ4BYTE(offset);
 
-        ObjectFunction *fn = AS_FUNCTION(chunk->constantsLong->values[operand]);
+        ObjectFunction *fn = AS_FUNCTION(chunk->constants.values[operand]);
         printf("fn<%s>", fn->name->chars);
         printf("\n");
 
@@ -404,6 +549,25 @@ int disassemble_instruction(Chunk *chunk, int offset)
 
     case OP_ARRAY_PUSH:
         return simple_instruction("OP_ARRAY_PUSH", offset);
+    case OP_PAUSE:
+        return simple_instruction("OP_PAUSE", offset);
+
+    case OP_ADD_NUM:
+        return simple_instruction("OP_ADD_NUM", offset);
+    case OP_ADD_STR:
+        return simple_instruction("OP_ADD_STR", offset);
+    case OP_SUBTRACT_NUM:
+        return simple_instruction("OP_SUBTRACT_NUM", offset);
+    case OP_MULTIPLY_NUM:
+        return simple_instruction("OP_MULTIPLY_NUM", offset);
+    case OP_DIVIDE_NUM:
+        return simple_instruction("OP_DIVIDE_NUM", offset);
+    case OP_GREATER_NUM:
+        return simple_instruction("OP_GREATER_NUM", offset);
+    case OP_LESS_NUM:
+        return simple_instruction("OP_LESS_NUM", offset);
+    case OP_DOT_GET_INSTANCE:
+        return constantLongInstruction("OP_DOT_GET_INSTANCE", chunk, offset);
 
     default:
         return offset + 1;
@@ -420,13 +584,6 @@ void disassemble_chunk(Chunk *chunk, const char *title)
     }
 }
 
-uint8_t add_constant(Chunk *chunk, Value constant)
-{
-    assert(0 && "Small constant is deprecated");
-    append_values(chunk->constants, constant);
-    return chunk->constants->count - 1;
-}
-
 void print_chunk(Chunk *chunk)
 {
     printf("[");
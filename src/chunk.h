@@ -7,7 +7,6 @@
 
 typedef enum
 {
-    OP_CONSTANT,
     OP_CONSTANT_LONG,
     OP_RETURN,
     OP_NEGATE,
@@ -64,17 +63,59 @@ typedef enum
     OP_ARRAY_ITEMS,
     OP_ARRAY_PUSH,
     OP_ARRAY_POP,
+
+    OP_PAUSE,
+
+    /*
+     * Quickened instructions. run() rewrites a generic instruction in place
+     * into one of these once it has seen the types of its operands; each
+     * only guards those types and rewrites itself back to the generic one
+     * when they change. They never leave the VM, see generic_opcode.
+     * */
+    OP_ADD_NUM,
+    OP_ADD_STR,
+    OP_SUBTRACT_NUM,
+    OP_MULTIPLY_NUM,
+    OP_DIVIDE_NUM,
+    OP_GREATER_NUM,
+    OP_LESS_NUM,
+    OP_DOT_GET_INSTANCE,
 } OpCode;
 
+// OP_DOT_GET_INSTANCE stays the last opcode
+#define OPCODE_COUNT (OP_DOT_GET_INSTANCE + 1)
+
+/*
+ * Compile-time index from a constant to its slot in the pool, so every
+ * identifier or literal is stored once per chunk. It belongs to the
+ * compiler and is reused for its next function: slots of an older
+ * generation count as empty.
+ * */
+typedef struct
+{
+    uint32_t generation;
+    uint32_t constant;
+} ConstantSlot;
+
+typedef struct
+{
+    uint32_t capacity;
+    uint32_t count;
+    uint32_t generation;
+
+    ConstantSlot *slots;
+} ConstantIndex;
+
 typedef struct
 {
-    uint16_t capacity;
-    uint16_t count;
+    uint32_t capacity;
+    uint32_t count;
 
     uint8_t *code;
 
-    Values *constants;
-    LongValues *constantsLong;
+    LongValues constants;
+    // Only set while the chunk is being compiled
+    ConstantIndex *constant_index;
     Lines *lines;
 
 } Chunk;
@@ -97,10 +138,13 @@ void init_chunk(Chunk *chunk);
 void write_chunk(Chunk *chunk, uint8_t newItem, uint32_t line);
 void print_chunk(Chunk *chunk);
 void free_chunk(Chunk *chunk);
+void finish_chunk(Chunk *chunk);
+void reset_chunk(Chunk *chunk);
 int find_line(Chunk *chunk, int offset);
-uint32_t get_line(Chunk *chunk, uint8_t idx);
-uint8_t add_constant(Chunk *chunk, Value newConstant);
-uint32_t add_long_constant(Chunk *chunk, Value constant);
+uint32_t get_line(Chunk *chunk, uint32_t offset);
+uint32_t add_constant(Chunk *chunk, Value constant);
+uint8_t generic_opcode(uint8_t opcode);
+int instruction_length(Chunk *chunk, uint32_t offset);
 
 void emit_constant(Chunk *chunk, Value value, uint32_t lineNumber);
 void make_constant(Chunk *chunk, Value value, uint32_t lineNumber);
@@ -15,6 +15,7 @@
 // #define TEST_STRESS_GC
 // #define DEBUG_GC
 // #define DEBUG_PRINT
+// #define DEBUG_OPCODE_STATS
 
 #endif // __EMSCRIPTEN__
 
@@ -20,12 +20,15 @@
 // WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "compiler.h"
+#include "hash.h"
+#include "number.h"
 #include "object.h"
 #include "vm.h"
 
-extern int IS_IN_REPL;
+// Expression statements print their value, set by the REPL in main.c
+_Thread_local int IS_IN_REPL = 0;
 
-int line_number = -1;
+_Thread_local int line_number = -1;
 
 typedef struct
 {
@@ -35,8 +38,10 @@ typedef struct
     int is_panic;
 } Parser;
 
-#define LOCAL_MAX_LENGTH 2056
+// Locals are addressed by 4 byte operands and the arrays grow on demand, this only bounds runaway scripts
+#define LOCAL_MAX_LENGTH (UINT16_MAX + 1)
 #define LOOP_STACK_MAX_LENGTH 2056
+#define STREAM_BATCH_SIZE 4096
 #define JUMP_STACK_MAX_LENGTH 2056
 
 typedef struct
@@ -45,22 +50,44 @@ typedef struct
     int depth;
     int is_assignable;
     bool is_captured;
+
+    // Previous local with the same name, restored when this one goes out of scope
+    int shadowed;
 } Local;
 
+/*
+ * Scope lookup table from a name to its innermost local. Slots of an older
+ * generation are empty, so a reused compiler never has to clear the table.
+ * */
+typedef struct
+{
+    uint32_t generation;
+    uint32_t hash;
+    Token name;
+    int local;
+} LocalName;
+
 typedef struct Compiler
 {
-    // TODO : make this to be a hashmap
-    Local locals[LOCAL_MAX_LENGTH];
+    Local *locals;
     int count;
+    int local_capacity;
     int depth;
 
+    LocalName *names;
+    uint32_t name_count;
+    uint32_t name_capacity;
+    uint32_t generation;
+
     /*continue statement*/
     int loop_count;
-    Loop loop_stack[LOOP_STACK_MAX_LENGTH];
+    int loop_capacity;
+    Loop *loop_stack;
 
     /*break statement*/
     int jump_count;
-    Jump jump_stack[JUMP_STACK_MAX_LENGTH];
+    int jump_capacity;
+    Jump *jump_stack;
 
     FunctionType type;
     ObjectFunction *function;
@@ -68,10 +95,25 @@ typedef struct Compiler
     struct Compiler *enclosing;
 
     int upvalue_count;
-    UpValue upvalue[UPVALUE_MAX];
+    int upvalue_capacity;
+    UpValue *upvalue;
+
+    ConstantIndex constants;
 
 } Compiler;
 
+/*
+ * Compilers nest like the functions they compile, so the one for each
+ * nesting level is kept and reused with its buffers for the next function
+ * on that level instead of being rebuilt on the C stack every time.
+ * */
+typedef struct
+{
+    int count;
+    int capacity;
+    Compiler **compilers;
+} CompilerPool;
+
 typedef struct ClassCompiler
 {
     struct ClassCompiler *enclosing;
@@ -84,14 +126,82 @@ static ParseRule *get_rule(TokenType token_type);
 static void declaration();
 static void statement();
 static uint32_t identifier_constant(const Token *token);
+static uint32_t global_variable(const Token *token);
 static bool match(TokenType type);
 static bool check(TokenType type);
 static void var_declaration(int is_assignable);
 
-Parser parser;
-Chunk *compiling_chunk;
-ClassCompiler *current_class = NULL;
-Compiler *current = NULL;
+// Each thread compiles with its own state, VMs on other threads are never blocked
+_Thread_local Parser parser;
+_Thread_local Chunk *compiling_chunk;
+_Thread_local ClassCompiler *current_class = NULL;
+_Thread_local Compiler *current = NULL;
+_Thread_local CompilerPool compiler_pool = {0, 0, NULL};
+_Thread_local Arena compile_arena = {NULL, 0};
+
+/* Grows a compiler array inside compile_arena, the old copy is reclaimed with the arena */
+#define ENSURE_CAPACITY(type, array, count, capacity)                                                                  \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if ((capacity) < (count) + 1)                                                                                  \
+        {                                                                                                              \
+            int old_capacity = (capacity);                                                                             \
+            (capacity) = GROW_CAPACITY(old_capacity);                                                                  \
+            (array) = arena_grow(&compile_arena, (array), old_capacity * sizeof(type), (capacity) * sizeof(type));     \
+        }                                                                                                              \
+    } while (false)
+
+static Compiler *acquire_compiler()
+{
+    CompilerPool *pool = &compiler_pool;
+    if (pool->count == pool->capacity)
+    {
+        ENSURE_CAPACITY(Compiler *, pool->compilers, pool->count, pool->capacity);
+        for (int i = pool->count; i < pool->capacity; ++i)
+            pool->compilers[i] = NULL;
+    }
+
+    Compiler *compiler = pool->compilers[pool->count];
+    if (compiler == NULL)
+    {
+        compiler = arena_alloc(&compile_arena, sizeof(Compiler));
+        compiler->locals = NULL;
+        compiler->local_capacity = 0;
+        compiler->names = NULL;
+        compiler->name_capacity = 0;
+        compiler->generation = 0;
+        compiler->loop_stack = NULL;
+        compiler->loop_capacity = 0;
+        compiler->jump_stack = NULL;
+        compiler->jump_capacity = 0;
+        compiler->upvalue = NULL;
+        compiler->upvalue_capacity = 0;
+        compiler->constants.capacity = 0;
+        compiler->constants.generation = 0;
+        compiler->constants.slots = NULL;
+        pool->compilers[pool->count] = compiler;
+    }
+
+    pool->count++;
+    return compiler;
+}
+
+/* The compiler stays valid until the next acquire, function() still reads its upvalues */
+static void release_compiler()
+{
+    compiler_pool.count--;
+}
+
+/* Drops every compiler together with the arena holding them */
+static void free_compilers()
+{
+    compiler_pool.count = 0;
+    compiler_pool.capacity = 0;
+    compiler_pool.compilers = NULL;
+    free_arena(&compile_arena);
+}
+
+static void bind_local_name(Compiler *compiler, int idx);
 
 void init_compiler(Compiler *compiler, FunctionType type)
 {
@@ -100,10 +210,16 @@ void init_compiler(Compiler *compiler, FunctionType type)
     compiler->loop_count = 0;
     compiler->jump_count = 0;
     compiler->upvalue_count = 0;
+    compiler->name_count = 0;
+    compiler->generation++;
 
     compiler->function = new_function();
     compiler->type = type;
 
+    compiler->constants.count = 0;
+    compiler->constants.generation++;
+    compiler->function->chunk.constant_index = &compiler->constants;
+
     compiler->enclosing = current;
 
     current = compiler;
@@ -113,19 +229,26 @@ void init_compiler(Compiler *compiler, FunctionType type)
         compiler->function->name = copy_string(parser.previous.start, parser.previous.length);
     }
 
+    ENSURE_CAPACITY(Local, current->locals, current->count, current->local_capacity);
     Local *local = &current->locals[current->count++];
-    local->depth = 1;
+    // The callee slot belongs to the frame, the scope around a script must not pop it
+    local->depth = 0;
     local->is_assignable = 0;
+    local->is_captured = false;
+    local->shadowed = -1;
     if (type == TYPE_METHOD || type == TYPE_INIT)
     {
         local->name.start = "anu";
         local->name.length = 3;
         local->name.type = TOKEN_ANU;
+        bind_local_name(current, 0);
     }
     else
     {
+        // The callee slot has no name and can never be looked up
         local->name.start = "";
         local->name.length = 0;
+        local->name.type = TOKEN_EOF;
     }
 }
 
@@ -266,6 +389,8 @@ ObjectFunction *end_compiler()
 
     ObjectFunction *function = current->function;
     function->upvalue_count = current->upvalue_count;
+    finish_chunk(&function->chunk);
+    release_compiler();
 
 #ifdef DEBUG_PRINT
     if (!parser.is_error)
@@ -405,22 +530,124 @@ bool compare_token(Token *t1, Token *t2)
     return (memcmp(t1->start, t2->start, t1->length) == 0);
 }
 
+static uint32_t hash_token(const Token *token)
+{
+    return fnv_32a_str(token->start, token->length) ^ (uint32_t)token->type;
+}
+
+static LocalName *find_local_name(Compiler *compiler, const Token *token, uint32_t hash)
+{
+    uint32_t mask = compiler->name_capacity - 1;
+    uint32_t i = hash & mask;
+
+    for (;;)
+    {
+        LocalName *name = &compiler->names[i];
+        if (name->generation != compiler->generation)
+            return name;
+
+        if (name->hash == hash && compare_token((Token *)token, &name->name))
+            return name;
+
+        i = (i + 1) & mask;
+    }
+}
+
+static void grow_local_names(Compiler *compiler)
+{
+    uint32_t old_capacity = compiler->name_capacity;
+    LocalName *old_names = compiler->names;
+
+    compiler->name_capacity = GROW_CAPACITY(old_capacity);
+    compiler->names = arena_alloc(&compile_arena, sizeof(LocalName) * compiler->name_capacity);
+    for (uint32_t i = 0; i < compiler->name_capacity; ++i)
+        compiler->names[i].generation = compiler->generation - 1;
+
+    for (uint32_t i = 0; i < old_capacity; ++i)
+    {
+        LocalName *old_name = &old_names[i];
+        if (old_name->generation == compiler->generation)
+            *find_local_name(compiler, &old_name->name, old_name->hash) = *old_name;
+    }
+}
+
+/* Makes locals[idx] the innermost local of its name */
+static void bind_local_name(Compiler *compiler, int idx)
+{
+    if (compiler->name_count + 1 > compiler->name_capacity * FACTOR_TERM)
+        grow_local_names(compiler);
+
+    Local *local = &compiler->locals[idx];
+    uint32_t hash = hash_token(&local->name);
+    LocalName *name = find_local_name(compiler, &local->name, hash);
+
+    if (name->generation != compiler->generation)
+    {
+        name->generation = compiler->generation;
+        name->hash = hash;
+        name->name = local->name;
+        name->local = -1;
+        compiler->name_count++;
+    }
+
+    local->shadowed = name->local;
+    name->local = idx;
+}
+
+static void unbind_local_name(Compiler *compiler, int idx)
+{
+    Local *local = &compiler->locals[idx];
+    if (local->name.length == 0)
+        return;
+
+    LocalName *name = find_local_name(compiler, &local->name, hash_token(&local->name));
+    name->local = local->shadowed;
+}
+
+/* Returns the innermost local named `token`, or -1 */
+static int lookup_local(Compiler *compiler, const Token *token)
+{
+    if (compiler->name_count == 0)
+        return -1;
+
+    LocalName *name = find_local_name(compiler, token, hash_token(token));
+    if (name->generation != compiler->generation)
+        return -1;
+
+    return name->local;
+}
+
 int find_local(Compiler *current, Token token)
 {
-    for (int i = current->count - 1; i >= 0; --i)
+    int i = lookup_local(current, &token);
+    if (i >= 0 && current->locals[i].depth == -1)
     {
-        Local *local = &current->locals[i];
-        if (compare_token(&token, &local->name))
-        {
-            if (local->depth == -1)
-            {
-                error("Tidak dapat membaca variabel lokal pada inisialisasinya sendiri");
-            }
+        error("Tidak dapat membaca variabel lokal pada inisialisasinya sendiri");
+    }
+
+    return i;
+}
+
+static int add_upvalue(Compiler *compiler, int index, bool is_local)
+{
+    // A closure captures a variable once no matter how often it is used
+    for (int i = 0; i < compiler->upvalue_count; ++i)
+    {
+        UpValue *upvalue = &compiler->upvalue[i];
+        if (upvalue->index == index && upvalue->is_local == is_local)
             return i;
-        }
     }
 
-    return -1;
+    if (compiler->upvalue_count == UPVALUE_MAX)
+    {
+        error("Melampaui batas jumlah upvalue");
+        return 0;
+    }
+
+    ENSURE_CAPACITY(UpValue, compiler->upvalue, compiler->upvalue_count, compiler->upvalue_capacity);
+    compiler->upvalue[compiler->upvalue_count].index = index;
+    compiler->upvalue[compiler->upvalue_count].is_local = is_local;
+    return compiler->upvalue_count++;
 }
 
 int resolve_upvalue(Compiler *current, Token token)
@@ -433,18 +660,13 @@ int resolve_upvalue(Compiler *current, Token token)
     if (res >= 0)
     {
         current->enclosing->locals[res].is_captured = true;
-
-        current->upvalue[current->upvalue_count].index = res;
-        current->upvalue[current->upvalue_count].is_local = true;
-        return current->upvalue_count++;
+        return add_upvalue(current, res, true);
     }
 
     res = resolve_upvalue(current->enclosing, token);
     if (res >= 0)
     {
-        current->upvalue[current->upvalue_count].index = res;
-        current->upvalue[current->upvalue_count].is_local = false;
-        return current->upvalue_count++;
+        return add_upvalue(current, res, false);
     }
 
     return -1;
@@ -479,7 +701,7 @@ static void variable(int can_assign)
     {
         OP_GET = OP_GET_GLOBAL;
         OP_SET = OP_SET_GLOBAL;
-        identifier_idx = identifier_constant(&parser.previous);
+        identifier_idx = global_variable(&parser.previous);
     }
 
     if (can_assign && check(TOKEN_EQUAL))
@@ -542,7 +764,7 @@ static void _number(int can_assign)
     if (can_assign)
     {
     }
-    Value value = VALUE_NUMBER(strtod(parser.previous.start, NULL));
+    Value value = VALUE_NUMBER(chars_to_number(parser.previous.start, parser.previous.length));
     emit_constant(current_chunk(), value, parser.previous.line_number);
 }
 
@@ -889,31 +1111,39 @@ static void declare_local(Token identifier, int is_assignable)
         return;
     }
 
+    ENSURE_CAPACITY(Local, current->locals, current->count, current->local_capacity);
     Local *local = &current->locals[current->count++];
 
+    // Top level names outlive the source window they were scanned from when streaming
+    if (current->type == TYPE_SCRIPT)
+    {
+        char *name = arena_alloc(&compile_arena, identifier.length);
+        memcpy(name, identifier.start, identifier.length);
+        identifier.start = name;
+    }
+
     local->name = identifier;
     local->depth = -1;
     local->is_assignable = is_assignable;
     local->is_captured = false;
+    bind_local_name(current, current->count - 1);
+}
+
+/* Only the innermost local of a name can clash with a new one in the same scope */
+static bool is_redeclared(const Token *identifier)
+{
+    int i = lookup_local(current, identifier);
+    return i >= 0 && current->locals[i].depth == current->depth;
 }
 
 static void declare(bool is_assignable)
 {
     if (current->depth > 0)
     {
-        for (int i = current->count - 1; i >= 0; --i)
+        if (is_redeclared(&parser.previous))
         {
-            Local *local = &current->locals[i];
-            if (local->depth == -1 || local->depth < current->depth)
-            {
-                break;
-            }
-
-            if (compare_token(&parser.previous, &local->name))
-            {
-                error("Deklarasi ulang variabel");
-                return;
-            }
+            error("Deklarasi ulang variabel");
+            return;
         }
 
         declare_local(parser.previous, is_assignable);
@@ -946,6 +1176,7 @@ static void begin_loop(int offset, int depth)
 {
     assert(current->loop_count <= LOOP_STACK_MAX_LENGTH && "Already reach max length of loop stack");
 
+    ENSURE_CAPACITY(Loop, current->loop_stack, current->loop_count, current->loop_capacity);
     Loop *loop = &current->loop_stack[current->loop_count++];
     loop->offset = offset;
     loop->depth = depth;
@@ -967,6 +1198,7 @@ static void begin_jump(int offset, int depth)
 {
     assert(current->jump_count <= JUMP_STACK_MAX_LENGTH && "Already reach max length of jump stack");
 
+    ENSURE_CAPACITY(Jump, current->jump_stack, current->jump_count, current->jump_capacity);
     Jump *jump = &current->jump_stack[current->jump_count++];
     jump->idx = offset;
     jump->depth = depth;
@@ -1002,6 +1234,7 @@ static void end_scope()
                 emit_byte(OP_POP);
             }
 
+            unbind_local_name(current, i);
             current->count--;
         }
         else
@@ -1423,11 +1656,20 @@ static uint32_t identifier_constant(const Token *token)
 {
     ObjectString *string = copy_string(token->start, token->length);
     push(VALUE_OBJ(string));
-    uint32_t res = add_long_constant(current_chunk(), VALUE_OBJ(string));
+    uint32_t res = add_constant(current_chunk(), VALUE_OBJ(string));
     pop();
     return res;
 }
 
+static uint32_t global_variable(const Token *token)
+{
+    ObjectString *string = copy_string(token->start, token->length);
+    push(VALUE_OBJ(string));
+    uint32_t slot = global_slot(string);
+    pop();
+    return slot;
+}
+
 static void define_variable(uint32_t identifier_idx)
 {
     if (current->depth > 0)
@@ -1449,19 +1691,10 @@ static int parse_variable(int is_assignable)
 
     if (current->depth > 0)
     {
-        for (int i = current->count - 1; i >= 0; --i)
+        if (is_redeclared(&parser.previous))
         {
-            Local *local = &current->locals[i];
-            if (local->depth == -1 || local->depth < current->depth)
-            {
-                break;
-            }
-
-            if (compare_token(&parser.previous, &local->name))
-            {
-                error("Deklarasi ulang variabel");
-                return 0;
-            }
+            error("Deklarasi ulang variabel");
+            return 0;
         }
 
         declare_local(parser.previous, is_assignable);
@@ -1469,7 +1702,7 @@ static int parse_variable(int is_assignable)
     }
     else
     {
-        return identifier_constant(&parser.previous);
+        return global_variable(&parser.previous);
     }
 }
 
@@ -1504,8 +1737,8 @@ static void function(FunctionType type)
 {
     define_local();
 
-    Compiler compiler;
-    init_compiler(&compiler, type);
+    Compiler *compiler = acquire_compiler();
+    init_compiler(compiler, type);
 
     begin_scope();
 
@@ -1533,10 +1766,10 @@ static void function(FunctionType type)
     make_constant(current_chunk(), VALUE_OBJ(function), parser.previous.line_number);
     pop();
 
-    for (int i = 0; i < compiler.upvalue_count; ++i)
+    for (int i = 0; i < compiler->upvalue_count; ++i)
     {
-        emit_byte(compiler.upvalue[i].is_local);
-        emit_int(compiler.upvalue[i].index);
+        emit_byte(compiler->upvalue[i].is_local);
+        emit_int(compiler->upvalue[i].index);
     }
 }
 
@@ -1551,12 +1784,13 @@ static void class_declaration()
 {
     consume(TOKEN_IDENTIFIER, "Diharapkan nama kelas");
     int klass_name = identifier_constant(&parser.previous);
+    uint32_t klass_slot = current->depth > 0 ? 0 : global_variable(&parser.previous);
     declare(false);
 
     emit_byte(OP_CLASS);
     emit_constant_byte(klass_name);
 
-    define_variable(klass_name);
+    define_variable(klass_slot);
 
     variable(false);
 
@@ -1573,7 +1807,7 @@ static void class_declaration()
 
         uint32_t name_method = identifier_constant(&parser.previous);
         FunctionType func_type = TYPE_METHOD;
-        if (memcmp(vm.init_string->chars, parser.previous.start, vm.init_string->length) == 0)
+        if (memcmp(vm->init_string->chars, parser.previous.start, vm->init_string->length) == 0)
         {
             func_type = TYPE_INIT;
         }
@@ -1621,35 +1855,126 @@ static void declaration()
     }
 }
 
-ObjectFunction *compile(const char *source)
+/*
+ * The GC stays off while compiling: the functions being built are only
+ * reachable from the compilers, and the compiler state itself lives in
+ * compile_arena, which is released in one go once the script is compiled.
+ * */
+static ObjectFunction *compile_script(const char *source, bool is_library)
 {
+    vm->gc_paused++;
 
     parser.is_error = 0;
     parser.is_panic = 0;
 
     init_scanner(source);
 
-    Compiler compiler;
-    init_compiler(&compiler, TYPE_SCRIPT);
+    Compiler *compiler = acquire_compiler();
+    init_compiler(compiler, TYPE_SCRIPT);
 
-    begin_scope();
+    // Top level declarations of a library are globals so they outlive the script
+    if (!is_library)
+        begin_scope();
 
     advance();
     while (!match(TOKEN_EOF))
     {
         declaration();
     }
-    end_scope();
 
-    return end_compiler();
+    if (!is_library)
+        end_scope();
+
+    ObjectFunction *function = end_compiler();
+    free_compilers();
+
+    vm->gc_paused--;
+    return function;
+}
+
+ObjectFunction *compile(const char *source)
+{
+    return compile_script(source, false);
+}
+
+ObjectFunction *compile_library(const char *source)
+{
+    return compile_script(source, true);
+}
+
+/* ===== STREAMING ===== */
+
+/* Starts compiling a script read from `stream`, returns its (still empty) function */
+ObjectFunction *begin_stream(SourceStream *stream)
+{
+    vm->gc_paused++;
+
+    parser.is_error = 0;
+    parser.is_panic = 0;
+
+    init_scanner_stream(stream);
+
+    Compiler *compiler = acquire_compiler();
+    init_compiler(compiler, TYPE_SCRIPT);
+    begin_scope();
+    advance();
+
+    vm->gc_paused--;
+    return compiler->function;
 }
 
-void mark_compiler()
+static void end_stream()
 {
-    Compiler *c = current;
-    while (c != NULL)
+    end_scope();
+    end_compiler();
+    free_compilers();
+}
+
+/*
+ * Replaces the code of the streamed script with its next top-level
+ * declarations (about STREAM_BATCH_SIZE bytes of code) followed by
+ * OP_PAUSE, or by the end of the script once the file is exhausted. The
+ * code that already ran is dropped, so memory stays bounded by the largest
+ * declaration. After a compile error the rest of the file is still parsed
+ * to report every error, but nothing runs.
+ * */
+StreamStatus compile_stream(SourceStream *stream)
+{
+    vm->gc_paused++;
+
+    StreamStatus status = STREAM_PAUSED;
+    reset_chunk(current_chunk());
+
+    while (!check(TOKEN_EOF) && current_chunk()->count < STREAM_BATCH_SIZE && !parser.is_error)
+    {
+        declaration();
+        release_source(stream);
+    }
+
+    if (match(TOKEN_EOF))
     {
-        mark_obj((Obj *)c->function);
-        c = c->enclosing;
+        end_stream();
+        status = STREAM_DONE;
     }
+    else
+    {
+        emit_byte(OP_PAUSE);
+    }
+
+    if (parser.is_error)
+    {
+        while (current != NULL && !match(TOKEN_EOF))
+        {
+            reset_chunk(current_chunk());
+            declaration();
+            release_source(stream);
+        }
+
+        if (current != NULL)
+            end_stream();
+        status = STREAM_ERROR;
+    }
+
+    vm->gc_paused--;
+    return status;
 }
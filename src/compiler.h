@@ -1,12 +1,28 @@
 #ifndef CWS_COMPILER_H
 #define CWS_COMPILER_H
 
+#include "arena.h"
 #include "chunk.h"
 #include "debug.h"
 #include "scanner.h"
 #include "value.h"
 
 ObjectFunction *compile(const char *code);
+ObjectFunction *compile_library(const char *code);
+
+typedef enum
+{
+    STREAM_PAUSED,
+    STREAM_DONE,
+    STREAM_ERROR,
+} StreamStatus;
+
+ObjectFunction *begin_stream(SourceStream *stream);
+StreamStatus compile_stream(SourceStream *stream);
+
+/* Holds the compiler state of the script being compiled, freed once it is done */
+extern _Thread_local Arena compile_arena;
+extern _Thread_local int IS_IN_REPL;
 
 typedef enum
 {
@@ -46,6 +62,5 @@ typedef struct
 } Loop;
 
 
-void mark_compiler();
 
 #endif // !CWS_COMPILER_H
@@ -0,0 +1,281 @@
+#include "cws.h"
+#include "object.h"
+#include "vm.h"
+
+#include <stdarg.h>
+#include <string.h>
+
+/*
+ * EMBEDDING API
+ *
+ * Thin wrappers over the VM: each entry point makes its VM the current one
+ * for the duration of the call, so a host can drive several VMs from one
+ * thread, and restores the previous one (a native calling back into the API
+ * runs inside the VM that called it).
+ * */
+
+#define ENTER(instance) VM *previous = use_vm(instance)
+#define LEAVE() use_vm(previous)
+
+static Value *stack_slot(int index)
+{
+    assert(index < 0 && vm->stack_top + index >= 0 && "Stack index out of range");
+    return &vm->stack.items[vm->stack_top + index];
+}
+
+CwsVM *cws_new_vm(void)
+{
+    return new_vm();
+}
+
+void cws_free_vm(CwsVM *instance)
+{
+    free_vm(instance);
+}
+
+CwsResult cws_compile(CwsVM *instance, const char *source)
+{
+    ENTER(instance);
+
+    // Compiled like a library so the host can reach the top level declarations
+    ObjectFunction *function = compile_library(source);
+    if (function == NULL)
+    {
+        LEAVE();
+        return CWS_COMPILE_ERROR;
+    }
+
+    push(VALUE_OBJ(function));
+    ObjectClosure *closure = new_closure(function);
+    pop();
+    push(VALUE_OBJ(closure));
+
+    LEAVE();
+    return CWS_OK;
+}
+
+CwsResult cws_run(CwsVM *instance, const char *source)
+{
+    CwsResult result = cws_compile(instance, source);
+    if (result != CWS_OK)
+        return result;
+
+    result = cws_call(instance, 0);
+    cws_pop(instance, 1);
+    return result;
+}
+
+CwsResult cws_call(CwsVM *instance, int args_count)
+{
+    return (CwsResult)interpret_call(instance, args_count);
+}
+
+/* ===== STACK ===== */
+
+void cws_push_nil(CwsVM *instance)
+{
+    ENTER(instance);
+    push(VALUE_NIL);
+    LEAVE();
+}
+
+void cws_push_bool(CwsVM *instance, bool value)
+{
+    ENTER(instance);
+    push(VALUE_BOOL(value));
+    LEAVE();
+}
+
+void cws_push_number(CwsVM *instance, double value)
+{
+    ENTER(instance);
+    push(VALUE_NUMBER(value));
+    LEAVE();
+}
+
+void cws_push_string(CwsVM *instance, const char *chars, int length)
+{
+    ENTER(instance);
+    push(VALUE_OBJ(copy_string(chars, length)));
+    LEAVE();
+}
+
+void cws_push_value(CwsVM *instance, int index)
+{
+    ENTER(instance);
+    push(*stack_slot(index));
+    LEAVE();
+}
+
+void cws_pop(CwsVM *instance, int count)
+{
+    ENTER(instance);
+    for (int i = 0; i < count; ++i)
+        pop();
+    LEAVE();
+}
+
+CwsType cws_type(CwsVM *instance, int index)
+{
+    ENTER(instance);
+    Value value = *stack_slot(index);
+    LEAVE();
+
+    if (IS_NIL(value))
+        return CWS_NIL;
+    if (IS_BOOLEAN(value))
+        return CWS_BOOL;
+    if (IS_NUMBER(value))
+        return CWS_NUMBER;
+    if (IS_ANY_STRING(value))
+        return CWS_STRING;
+    if (IS_CLOSURE(value) || IS_NATIVE(value) || IS_METHOD(value) || IS_CLASS(value))
+        return CWS_FUNCTION;
+    return CWS_OBJECT;
+}
+
+bool cws_to_bool(CwsVM *instance, int index)
+{
+    ENTER(instance);
+    Value value = *stack_slot(index);
+    LEAVE();
+
+    return !is_falsy(value);
+}
+
+double cws_to_number(CwsVM *instance, int index)
+{
+    ENTER(instance);
+    Value value = *stack_slot(index);
+    LEAVE();
+
+    return IS_NUMBER(value) ? AS_NUMBER(value) : 0;
+}
+
+const char *cws_to_string(CwsVM *instance, int index, int *length)
+{
+    ENTER(instance);
+    Value *slot = stack_slot(index);
+
+    if (!IS_ANY_STRING(*slot))
+    {
+        LEAVE();
+        return NULL;
+    }
+
+    // A view is not terminated, the host gets an interned copy in its place
+    if (IS_STRING_VIEW(*slot))
+    {
+        StringRef ref = string_ref(*slot);
+        *slot = VALUE_OBJ(copy_string(ref.chars, ref.length));
+    }
+
+    ObjectString *string = AS_STRING(*slot);
+    LEAVE();
+
+    if (length != NULL)
+        *length = string->length;
+    return string->chars;
+}
+
+/* ===== GLOBALS ===== */
+
+bool cws_get_global(CwsVM *instance, const char *name)
+{
+    ENTER(instance);
+
+    ObjectString *string = copy_string(name, strlen(name));
+    Value slot;
+    Value value = VALUE_UNDEFINED;
+    if (map_get(&vm->globals, string, &slot))
+        value = vm->global_values.values[(uint32_t)AS_NUMBER(slot)];
+
+    bool is_defined = !IS_UNDEFINED(value);
+    push(is_defined ? value : VALUE_NIL);
+
+    LEAVE();
+    return is_defined;
+}
+
+void cws_set_global(CwsVM *instance, const char *name)
+{
+    ENTER(instance);
+
+    ObjectString *string = copy_string(name, strlen(name));
+    push(VALUE_OBJ(string));
+    uint32_t slot = global_slot(string);
+    pop();
+
+    vm->global_values.values[slot] = pop();
+
+    LEAVE();
+}
+
+void cws_register(CwsVM *instance, const char *name, CwsNative function, void *userdata)
+{
+    ENTER(instance);
+
+    ObjectNative *native = new_native(NULL);
+    native->host = function;
+    native->userdata = userdata;
+    push(VALUE_OBJ(native));
+
+    LEAVE();
+    cws_set_global(instance, name);
+}
+
+void cws_error(CwsVM *instance, const char *format, ...)
+{
+    (void)instance;
+
+    va_list args;
+    va_start(args, format);
+    fputs("Kesalahan Runtime : ", stderr);
+    vfprintf(stderr, format, args);
+    va_end(args);
+
+    fputs("\n", stderr);
+}
+
+/* ===== REFERENCES ===== */
+
+int cws_ref(CwsVM *instance)
+{
+    ENTER(instance);
+
+    Value value = pop();
+    int ref;
+    if (vm->free_ref >= 0)
+    {
+        ref = vm->free_ref;
+        vm->free_ref = (int)AS_NUMBER(vm->refs.values[ref]);
+        vm->refs.values[ref] = value;
+    }
+    else
+    {
+        // Still reachable from the stack while the array grows
+        push(value);
+        append_long_values(&vm->refs, value);
+        pop();
+        ref = vm->refs.count - 1;
+    }
+
+    LEAVE();
+    return ref;
+}
+
+void cws_push_ref(CwsVM *instance, int ref)
+{
+    ENTER(instance);
+    assert(ref >= 0 && (uint32_t)ref < vm->refs.count && "Unknown reference");
+    push(vm->refs.values[ref]);
+    LEAVE();
+}
+
+void cws_unref(CwsVM *instance, int ref)
+{
+    ENTER(instance);
+    vm->refs.values[ref] = VALUE_NUMBER(vm->free_ref);
+    vm->free_ref = ref;
+    LEAVE();
+}
@@ -0,0 +1,110 @@
+#ifndef CWS_H
+#define CWS_H
+
+#include <stdbool.h>
+
+/*
+ * EMBEDDING API
+ *
+ * Everything a host application needs to run scripts: link with libcws.a
+ * (`make libcws.a`) and include this header only.
+ *
+ * Values are exchanged through the stack of the VM, like the interpreter
+ * itself does. Indices count from the top: -1 is the last value pushed.
+ * Values that must outlive the stack (a compiled script, a closure the host
+ * calls on every request) are kept with cws_ref, which protects them from
+ * the GC until cws_unref.
+ *
+ *   CwsVM *vm = cws_new_vm();
+ *   cws_compile(vm, "fungsi sapa(nama) { balik \"halo \" + nama; }");
+ *   cws_call(vm, 0);                  // runs the script, defines `sapa`
+ *   cws_pop(vm, 1);
+ *
+ *   cws_get_global(vm, "sapa");
+ *   int sapa = cws_ref(vm);           // no lookup on later calls
+ *
+ *   cws_push_ref(vm, sapa);
+ *   cws_push_string(vm, "dunia", 5);
+ *   if (cws_call(vm, 1) == CWS_OK)
+ *       puts(cws_to_string(vm, -1, NULL));
+ *   cws_pop(vm, 1);
+ *
+ *   cws_free_vm(vm);
+ *
+ * A VM is used by one thread at a time, different VMs can run on different
+ * threads concurrently.
+ * */
+
+typedef struct VM CwsVM;
+
+typedef enum
+{
+    CWS_OK,
+    CWS_RUNTIME_ERROR,
+    CWS_COMPILE_ERROR,
+} CwsResult;
+
+typedef enum
+{
+    CWS_NIL,
+    CWS_BOOL,
+    CWS_NUMBER,
+    CWS_STRING,
+    CWS_FUNCTION,
+    // Arrays, tables, instances... they can be stored and passed back, not inspected
+    CWS_OBJECT,
+} CwsType;
+
+/*
+ * A function the host registers with cws_register. Its arguments are the top
+ * `args_count` values of the stack (the first one at -args_count) and must
+ * stay there; its result is the last value it pushes above them, or nihil
+ * when it pushes nothing. Returning false aborts the script with a runtime
+ * error, report it with cws_error first.
+ * */
+typedef bool (*CwsNative)(CwsVM *vm, int args_count, void *userdata);
+
+CwsVM *cws_new_vm(void);
+void cws_free_vm(CwsVM *vm);
+
+/* Compiles and runs a script. Top level declarations become globals */
+CwsResult cws_run(CwsVM *vm, const char *source);
+
+/* Compiles a script and pushes it as a function of no arguments, to be run with cws_call */
+CwsResult cws_compile(CwsVM *vm, const char *source);
+
+/*
+ * Calls the value below the top `args_count` values and replaces all of them
+ * with the result, or with nihil when the call fails. Works from inside a
+ * native too.
+ * */
+CwsResult cws_call(CwsVM *vm, int args_count);
+
+void cws_push_nil(CwsVM *vm);
+void cws_push_bool(CwsVM *vm, bool value);
+void cws_push_number(CwsVM *vm, double value);
+void cws_push_string(CwsVM *vm, const char *chars, int length);
+/* Pushes a copy of the value at `index`, e.g. to call a closure passed to a native */
+void cws_push_value(CwsVM *vm, int index);
+void cws_pop(CwsVM *vm, int count);
+
+CwsType cws_type(CwsVM *vm, int index);
+bool cws_to_bool(CwsVM *vm, int index);
+double cws_to_number(CwsVM *vm, int index);
+/* NULL when the value is not a string. Valid while the value is on the stack or referenced */
+const char *cws_to_string(CwsVM *vm, int index, int *length);
+
+/* Pushes the global, or nihil and returns false when it is not defined */
+bool cws_get_global(CwsVM *vm, const char *name);
+/* Pops the top value into the global */
+void cws_set_global(CwsVM *vm, const char *name);
+
+void cws_register(CwsVM *vm, const char *name, CwsNative function, void *userdata);
+void cws_error(CwsVM *vm, const char *format, ...);
+
+/* Pops the top value and keeps it alive, returns a handle to push it again */
+int cws_ref(CwsVM *vm);
+void cws_push_ref(CwsVM *vm, int ref);
+void cws_unref(CwsVM *vm, int ref);
+
+#endif // !CWS_H
@@ -27,3 +27,17 @@ Fnv32_t fnv_32a_str(const char *str, int length)
     /* return our new hash value */
     return hval;
 }
+
+Fnv64_t fnv_64a_buf(const char *buf, size_t length)
+{
+    Fnv64_t hval = 0xcbf29ce484222325ULL;
+    unsigned char *s = (unsigned char *)buf;
+
+    for (size_t i = 0; i < length; ++i)
+    {
+        hval ^= (Fnv64_t)*s++;
+        hval *= 0x100000001b3ULL;
+    }
+
+    return hval;
+}
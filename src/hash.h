@@ -3,6 +3,9 @@
 #include "common.h"
 
 typedef uint32_t Fnv32_t;
+typedef uint64_t Fnv64_t;
+
 Fnv32_t fnv_32a_str(const char *str, int length);
+Fnv64_t fnv_64a_buf(const char *buf, size_t length);
 
 #endif // !CWS_HASH_H
@@ -67,10 +67,22 @@ void adjust_capacity(Map *old, size_t capacity)
         old->size++;
     }
 
+    free(old->entries);
     old->entries = entries;
     old->capacity = capacity;
 }
 
+/* Grows the map up front so `count` more keys fit without rehashing on the way */
+void map_reserve(Map *h, size_t count)
+{
+    size_t capacity = h->capacity < 8 ? 8 : h->capacity;
+    while (capacity * FACTOR_TERM <= h->size + count)
+        capacity *= 2;
+
+    if (capacity != h->capacity)
+        adjust_capacity(h, capacity);
+}
+
 bool map_set_value(Map *h, Value key, Value value)
 {
     ObjectString *str_key = stringify(key);
@@ -147,26 +159,33 @@ bool map_delete(Map *h, ObjectString *key)
     return true;
 }
 
-void print_map(Map *h, int level)
+void print_indent(int level)
+{
+    for (int i = 0; i < level; ++i)
+    {
+        printf("  ");
+    }
+}
+
+void print_map_entries(Map *h, int level)
 {
-    printf("{\n");
     for (size_t i = 0; i < h->capacity; ++i)
     {
         Entry *entry = &h->entries[i];
         if (entry->key != NULL)
         {
-            for (int i = 0; i < level; ++i)
-            {
-                printf("  ");
-            }
+            print_indent(level);
             printf("%s: ", entry->key->chars);
             print_value(entry->value, false, level + 1);
             printf(",\n");
         }
     }
-    for (int i = 0; i < level-1; ++i)
-    {
-        printf("  ");
-    }
+}
+
+void print_map(Map *h, int level)
+{
+    printf("{\n");
+    print_map_entries(h, level);
+    print_indent(level - 1);
     printf("}");
 }
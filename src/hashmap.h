@@ -26,9 +26,12 @@ void init_map(Map *h);
 void free_map(Map *h);
 bool map_set_value(Map *h, Value key, Value value);
 bool map_set(Map *h, ObjectString *key, Value value);
+void map_reserve(Map *h, size_t count);
 bool map_get(Map *h, ObjectString *key, Value *value);
 bool map_get_value(Map *h, Value key, Value *value);
 bool map_delete(Map *h, ObjectString *key);
 void print_map(Map *h, int level);
+void print_map_entries(Map *h, int level);
+void print_indent(int level);
 
 #endif // !HASH_MAP_H
@@ -0,0 +1,408 @@
+#include "heap_dump.h"
+#include "object.h"
+#include "vm.h"
+
+#include <string.h>
+
+/*
+ * HEAP DUMP
+ *
+ * The walk is breadth first so the first retainer of an object is on a
+ * shortest path from the roots. Visited objects are flagged with the GC's
+ * `is_marked`, which is clear for every object between collections and is
+ * cleared again once the dump is written. Nothing here allocates on the
+ * heap, so the GC can not run in the middle of a dump.
+ * */
+
+// Strings longer than this are cut in the labels
+#define LABEL_MAX 64
+
+typedef struct
+{
+    Obj *obj;
+    Obj *retainer;
+    uint32_t root;
+} Pending;
+
+typedef struct
+{
+    FILE *file;
+    uint32_t root_count;
+
+    Pending *queue;
+    size_t head;
+    size_t count;
+    size_t capacity;
+
+    Obj **refs;
+    size_t ref_count;
+    size_t ref_capacity;
+} HeapDump;
+
+static void *grow(void *array, size_t *capacity, size_t size)
+{
+    *capacity = *capacity < 64 ? 64 : *capacity * 2;
+    array = realloc(array, *capacity * size);
+    if (array == NULL)
+    {
+        fprintf(stderr, "Not enough memory to dump the heap\n");
+        exit(74);
+    }
+    return array;
+}
+
+static void put_u8(FILE *file, uint8_t value)
+{
+    fputc(value, file);
+}
+
+static void put_u32(FILE *file, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        fputc((value >> (8 * i)) & 0xff, file);
+}
+
+static void put_u64(FILE *file, uint64_t value)
+{
+    for (int i = 0; i < 8; ++i)
+        fputc((value >> (8 * i)) & 0xff, file);
+}
+
+static void put_chars(FILE *file, const char *chars, int length)
+{
+    put_u32(file, (uint32_t)length);
+    fwrite(chars, 1, length, file);
+}
+
+/* ===== ROOTS ===== */
+
+static const char *function_name(ObjectFunction *function)
+{
+    return function->name == NULL ? "script" : function->name->chars;
+}
+
+static bool enqueue(HeapDump *dump, Obj *obj, Obj *retainer, uint32_t root)
+{
+    if (obj == NULL || obj->is_marked)
+        return false;
+
+    obj->is_marked = true;
+    if (dump->count == dump->capacity)
+        dump->queue = grow(dump->queue, &dump->capacity, sizeof(Pending));
+    dump->queue[dump->count++] = (Pending){obj, retainer, root};
+    return true;
+}
+
+/* A root that only leads to objects an earlier root already holds is not written */
+static void add_root(HeapDump *dump, HeapRootKind kind, Value value, const char *format, ...)
+{
+    if (!IS_OBJ(value) || !enqueue(dump, AS_OBJ(value), NULL, dump->root_count + 1))
+        return;
+    dump->root_count++;
+
+    char name[256];
+    va_list args;
+    va_start(args, format);
+    int length = vsnprintf(name, sizeof(name), format, args);
+    va_end(args);
+    if (length >= (int)sizeof(name))
+        length = sizeof(name) - 1;
+
+    put_u8(dump->file, HEAP_DUMP_ROOT);
+    put_u8(dump->file, kind);
+    put_chars(dump->file, name, length);
+}
+
+static void add_map_roots(HeapDump *dump, HeapRootKind kind, Map *map, const char *prefix)
+{
+    for (size_t i = 0; i < map->capacity; ++i)
+    {
+        Entry *entry = &map->entries[i];
+        if (entry->key == NULL)
+            continue;
+        add_root(dump, kind, VALUE_OBJ(entry->key), "%s %s", prefix, entry->key->chars);
+        add_root(dump, kind, entry->value, "%s %s", prefix, entry->key->chars);
+    }
+}
+
+/* The names come first so the paths start from them rather than from the stack */
+static void add_roots(HeapDump *dump)
+{
+    for (uint32_t i = 0; i < vm->global_values.count; ++i)
+    {
+        const char *name = AS_STRING(vm->global_names.values[i])->chars;
+        add_root(dump, ROOT_GLOBAL, vm->global_values.values[i], "global %s", name);
+    }
+
+    for (int i = 0; i < vm->frame_count; ++i)
+    {
+        ObjectFunction *function = vm->frame[i].closure->function;
+        add_root(dump, ROOT_FRAME, VALUE_OBJ(vm->frame[i].closure), "frame %d %s", i, function_name(function));
+    }
+
+    int frame = -1;
+    for (int i = 0; i < vm->stack_top; ++i)
+    {
+        while (frame + 1 < vm->frame_count && vm->frame[frame + 1].slots <= i)
+            frame++;
+
+        if (frame < 0)
+            add_root(dump, ROOT_STACK, vm->stack.items[i], "stack %d", i);
+        else
+            add_root(dump, ROOT_STACK, vm->stack.items[i], "%s slot %d",
+                     function_name(vm->frame[frame].closure->function), i - vm->frame[frame].slots);
+    }
+
+    for (ObjectUpValue *upvalue = vm->upvalues; upvalue != NULL; upvalue = upvalue->next)
+        add_root(dump, ROOT_UPVALUE, VALUE_OBJ(upvalue), "open upvalue");
+
+    for (uint32_t i = 0; i < vm->refs.count; ++i)
+        add_root(dump, ROOT_HOST, vm->refs.values[i], "host ref %u", i);
+
+    for (uint32_t i = 0; i < vm->global_names.count; ++i)
+        add_root(dump, ROOT_VM, vm->global_names.values[i], "global names");
+    add_map_roots(dump, ROOT_VM, &vm->globals, "global slot");
+    add_map_roots(dump, ROOT_VM, &vm->string_methods, "string method");
+    add_map_roots(dump, ROOT_VM, &vm->worker_methods, "worker method");
+    add_root(dump, ROOT_VM, VALUE_OBJ(vm->init_string), "init string");
+}
+
+/* ===== OBJECTS ===== */
+
+static void add_ref(HeapDump *dump, Obj *obj)
+{
+    if (obj == NULL)
+        return;
+
+    if (dump->ref_count == dump->ref_capacity)
+        dump->refs = grow(dump->refs, &dump->ref_capacity, sizeof(Obj *));
+    dump->refs[dump->ref_count++] = obj;
+}
+
+static void add_value_ref(HeapDump *dump, Value value)
+{
+    if (IS_OBJ(value))
+        add_ref(dump, AS_OBJ(value));
+}
+
+static void add_map_refs(HeapDump *dump, Map *map)
+{
+    for (size_t i = 0; i < map->capacity; ++i)
+    {
+        add_ref(dump, (Obj *)map->entries[i].key);
+        add_value_ref(dump, map->entries[i].value);
+    }
+}
+
+/* The same references mark_references() follows, keep the two in step */
+static void collect_refs(HeapDump *dump, Obj *obj)
+{
+    dump->ref_count = 0;
+
+    switch (obj->type)
+    {
+    case OBJ_FUNCTION: {
+        ObjectFunction *function = (ObjectFunction *)obj;
+        add_ref(dump, (Obj *)function->name);
+        for (uint32_t i = 0; i < function->chunk.constants.count; ++i)
+            add_value_ref(dump, function->chunk.constants.values[i]);
+        break;
+    }
+    case OBJ_STRING_VIEW:
+        add_ref(dump, (Obj *)((ObjectStringView *)obj)->parent);
+        break;
+    case OBJ_CLOSURE: {
+        ObjectClosure *closure = (ObjectClosure *)obj;
+        add_ref(dump, (Obj *)closure->function);
+        for (int i = 0; i < closure->upvalue_count; ++i)
+            add_ref(dump, (Obj *)closure->upvalues[i]);
+        break;
+    }
+    case OBJ_UPVALUE:
+        add_value_ref(dump, ((ObjectUpValue *)obj)->val);
+        break;
+    case OBJ_CLASS: {
+        ObjectClass *klass = (ObjectClass *)obj;
+        add_ref(dump, (Obj *)klass->name);
+        add_map_refs(dump, &klass->methods);
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjectInstance *instance = (ObjectInstance *)obj;
+        add_ref(dump, (Obj *)instance->klass);
+        add_map_refs(dump, &instance->table);
+        break;
+    }
+    case OBJ_METHOD: {
+        ObjectMethod *method = (ObjectMethod *)obj;
+        add_ref(dump, (Obj *)method->closure);
+        add_value_ref(dump, method->receiver);
+        break;
+    }
+    case OBJ_TABLE: {
+        ObjectTable *table = (ObjectTable *)obj;
+        for (uint32_t i = 0; i < table->array_cap; ++i)
+            add_value_ref(dump, table->array[i]);
+        add_map_refs(dump, &table->values);
+        break;
+    }
+    case OBJ_ARRAY: {
+        ObjectArray *array = (ObjectArray *)obj;
+        for (uint32_t i = 0; i < array->count; ++i)
+            add_value_ref(dump, array->values[i]);
+        add_map_refs(dump, &array->methods);
+        break;
+    }
+    case OBJ_STRING:
+    case OBJ_NATIVE:
+    case OBJ_WORKER:
+        break;
+    }
+}
+
+static uint64_t object_size(Obj *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_STRING:
+        return sizeof(ObjectString) + ((ObjectString *)obj)->length + 1;
+    case OBJ_FUNCTION: {
+        Chunk *chunk = &((ObjectFunction *)obj)->chunk;
+        uint64_t size = sizeof(ObjectFunction) + chunk->capacity + chunk->constants.capacity * sizeof(Value);
+        if (chunk->lines != NULL)
+            size += sizeof(Lines) + chunk->lines->capacity + chunk->lines->checkpoint_capacity * sizeof(LineCheckpoint);
+        return size;
+    }
+    case OBJ_NATIVE:
+        return sizeof(ObjectNative);
+    case OBJ_CLOSURE:
+        return sizeof(ObjectClosure) + ((ObjectClosure *)obj)->upvalue_count * sizeof(ObjectUpValue *);
+    case OBJ_UPVALUE:
+        return sizeof(ObjectUpValue);
+    case OBJ_CLASS:
+        return sizeof(ObjectClass) + ((ObjectClass *)obj)->methods.capacity * sizeof(Entry);
+    case OBJ_INSTANCE:
+        return sizeof(ObjectInstance) + ((ObjectInstance *)obj)->table.capacity * sizeof(Entry);
+    case OBJ_METHOD:
+        return sizeof(ObjectMethod);
+    case OBJ_TABLE: {
+        ObjectTable *table = (ObjectTable *)obj;
+        return sizeof(ObjectTable) + table->array_cap * sizeof(Value) + table->values.capacity * sizeof(Entry);
+    }
+    case OBJ_ARRAY: {
+        ObjectArray *array = (ObjectArray *)obj;
+        return sizeof(ObjectArray) + array->cap * sizeof(Value) + array->methods.capacity * sizeof(Entry);
+    }
+    case OBJ_STRING_VIEW:
+        return sizeof(ObjectStringView);
+    case OBJ_WORKER:
+        return sizeof(ObjectWorker);
+    }
+    return 0;
+}
+
+/* What the object is called: the start of a string, the name of a function or class */
+static void put_label(FILE *file, Obj *obj)
+{
+    const char *chars = "";
+    int length = 0;
+
+    switch (obj->type)
+    {
+    case OBJ_STRING:
+        chars = ((ObjectString *)obj)->chars;
+        length = ((ObjectString *)obj)->length;
+        break;
+    case OBJ_STRING_VIEW: {
+        StringRef ref = string_ref(VALUE_OBJ(obj));
+        chars = ref.chars;
+        length = ref.length;
+        break;
+    }
+    case OBJ_FUNCTION:
+        chars = function_name((ObjectFunction *)obj);
+        break;
+    case OBJ_CLOSURE:
+        chars = function_name(((ObjectClosure *)obj)->function);
+        break;
+    case OBJ_METHOD:
+        chars = function_name(((ObjectMethod *)obj)->closure->function);
+        break;
+    case OBJ_CLASS:
+        chars = ((ObjectClass *)obj)->name->chars;
+        break;
+    case OBJ_INSTANCE:
+        chars = ((ObjectInstance *)obj)->klass->name->chars;
+        break;
+    default:
+        break;
+    }
+
+    if (length == 0)
+        length = (int)strlen(chars);
+    put_chars(file, chars, length < LABEL_MAX ? length : LABEL_MAX);
+}
+
+static void write_object(HeapDump *dump, Pending *pending)
+{
+    FILE *file = dump->file;
+    put_u8(file, HEAP_DUMP_OBJECT);
+    put_u64(file, (uintptr_t)pending->obj);
+    put_u8(file, pending->obj->type);
+    put_u64(file, object_size(pending->obj));
+    put_u64(file, (uintptr_t)pending->retainer);
+    put_u32(file, pending->root);
+    put_label(file, pending->obj);
+
+    put_u32(file, (uint32_t)dump->ref_count);
+    for (size_t i = 0; i < dump->ref_count; ++i)
+        put_u64(file, (uintptr_t)dump->refs[i]);
+}
+
+bool write_heap_dump(const char *path)
+{
+    HeapDump dump = {0};
+    dump.file = fopen(path, "wb");
+    if (dump.file == NULL)
+        return false;
+
+    fwrite(HEAP_DUMP_MAGIC, 1, 4, dump.file);
+    put_u32(dump.file, HEAP_DUMP_VERSION);
+
+    add_roots(&dump);
+
+    uint64_t object_count = 0;
+    while (dump.head < dump.count)
+    {
+        Pending pending = dump.queue[dump.head++];
+        collect_refs(&dump, pending.obj);
+        for (size_t i = 0; i < dump.ref_count; ++i)
+            enqueue(&dump, dump.refs[i], pending.obj, pending.root);
+
+        write_object(&dump, &pending);
+        object_count++;
+    }
+
+    for (Obj *obj = vm->objects; obj != NULL; obj = obj->next)
+    {
+        if (obj->is_marked)
+        {
+            obj->is_marked = false;
+            continue;
+        }
+
+        Pending pending = {obj, NULL, 0};
+        collect_refs(&dump, obj);
+        write_object(&dump, &pending);
+        object_count++;
+    }
+
+    put_u8(dump.file, HEAP_DUMP_END);
+    put_u64(dump.file, object_count);
+
+    free(dump.queue);
+    free(dump.refs);
+
+    bool is_written = !ferror(dump.file);
+    return fclose(dump.file) == 0 && is_written;
+}
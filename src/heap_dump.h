@@ -0,0 +1,48 @@
+#ifndef CWS_HEAP_DUMP_H
+#define CWS_HEAP_DUMP_H
+
+#include <stdbool.h>
+
+/*
+ * HEAP DUMP (`heap_dump("out.cwsd")`, `cws --heap-dump-on-exit out.cwsd`)
+ *
+ * Writes every object of the heap for `tools/heapdump`, which computes the
+ * retained sizes and the dominators offline. Unlike the heap snapshot
+ * (snapshot.h) nothing is ever read back into a VM. Records are streamed
+ * to the file as the heap is walked, little endian:
+ *
+ *   header : "CWSD", u32 version
+ *   root   : 'r', u8 kind, u32 length, name
+ *   object : 'o', u64 id, u8 type, u64 size, u64 retainer, u32 root,
+ *            u32 length, label, u32 count, u64 id of every reference
+ *   end    : 'e', u64 object count
+ *
+ * An object is identified by its address. Objects come breadth first from
+ * the roots: `retainer` is the object the walk found it through (0 for the
+ * object a root holds) and `root` the root the walk started from, counted
+ * from 1 in the order of the root records, so following the retainers
+ * gives the shortest path from a root. Objects reached from no root
+ * (garbage the GC has not collected yet) come last with root 0. `size`
+ * counts the buffers the object owns, the references are the ones the GC
+ * follows.
+ */
+#define HEAP_DUMP_MAGIC "CWSD"
+#define HEAP_DUMP_VERSION 1
+
+#define HEAP_DUMP_ROOT 'r'
+#define HEAP_DUMP_OBJECT 'o'
+#define HEAP_DUMP_END 'e'
+
+typedef enum
+{
+    ROOT_STACK,
+    ROOT_FRAME,
+    ROOT_GLOBAL,
+    ROOT_UPVALUE,
+    ROOT_HOST,
+    ROOT_VM,
+} HeapRootKind;
+
+bool write_heap_dump(const char *path);
+
+#endif // !CWS_HEAP_DUMP_H
@@ -0,0 +1,1275 @@
+#include "jit.h"
+#include "object.h"
+#include "profiler.h"
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+
+uint32_t jit_threshold = JIT_THRESHOLD;
+
+#ifdef HAS_JIT
+
+#include <sys/mman.h>
+#include <unistd.h>
+
+/*
+ * BASELINE JIT
+ *
+ * entry(vm, frame, target) saves the callee saved registers, loads the ones
+ * below and jumps to `target`, the native address of the instruction the
+ * frame resumes at. Every exit goes through the epilogue with a JitStatus.
+ *
+ *   rbx  &vm->stack.items[frame->slots], reloaded after every helper call
+ *   r12  vm
+ *   r13  frame
+ *   r14  QNAN
+ *   r15  frame->slots
+ *
+ * Everything is malloc'd or mmap'd outside the GC heap, compiling never
+ * collects.
+ * */
+
+typedef JitStatus (*JitEntry)(VM *vm, CallFrame *frame, uint8_t *target);
+
+struct JitCode
+{
+    uint8_t *code;
+    size_t size;
+
+    // Native offset of every instruction
+    uint32_t *offsets;
+    // Stack depth the code can be entered with at an instruction, -1 where it cannot
+    int32_t *entry_depths;
+};
+
+typedef enum
+{
+    RAX,
+    RCX,
+    RDX,
+    RBX,
+    RSP,
+    RBP,
+    RSI,
+    RDI,
+    R8,
+    R9,
+    R10,
+    R11,
+    R12,
+    R13,
+    R14,
+    R15,
+} Register;
+
+#define REG_STACK RBX
+#define REG_VM R12
+#define REG_FRAME R13
+#define REG_QNAN R14
+#define REG_SLOTS R15
+
+typedef enum
+{
+    CC_E = 0x4,
+    CC_NE = 0x5,
+    CC_A = 0x7,
+} Condition;
+
+/* ===== ASSEMBLER ===== */
+
+typedef struct
+{
+    uint8_t *bytes;
+    uint32_t count;
+    uint32_t capacity;
+} Assembler;
+
+static void emit_byte(Assembler *as, uint8_t byte)
+{
+    if (as->count == as->capacity)
+    {
+        as->capacity = as->capacity < 256 ? 256 : as->capacity * 2;
+        as->bytes = realloc(as->bytes, as->capacity);
+        if (as->bytes == NULL)
+        {
+            fprintf(stderr, "Not enough memory to compile\n");
+            exit(74);
+        }
+    }
+    as->bytes[as->count++] = byte;
+}
+
+static void emit_u32(Assembler *as, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        emit_byte(as, (uint8_t)(value >> (8 * i)));
+}
+
+static void emit_u64(Assembler *as, uint64_t value)
+{
+    emit_u32(as, (uint32_t)value);
+    emit_u32(as, (uint32_t)(value >> 32));
+}
+
+static void patch_u32(Assembler *as, uint32_t at, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        as->bytes[at + i] = (uint8_t)(value >> (8 * i));
+}
+
+static void emit_rex(Assembler *as, bool wide, int reg, int index, int base)
+{
+    uint8_t rex = 0x40 | (wide << 3) | ((reg & 8) >> 1) | ((index & 8) >> 2) | ((base & 8) >> 3);
+    if (rex != 0x40)
+        emit_byte(as, rex);
+}
+
+/* ModRM (and SIB) for [base + index * 2^scale + disp], `index` -1 for none */
+static void emit_memory(Assembler *as, int reg, int base, int index, int scale, int32_t disp)
+{
+    int mod = 2;
+    if (disp == 0 && (base & 7) != RBP)
+        mod = 0;
+    else if (disp >= -128 && disp <= 127)
+        mod = 1;
+
+    if (index < 0 && (base & 7) != RSP)
+    {
+        emit_byte(as, (uint8_t)(mod << 6 | (reg & 7) << 3 | (base & 7)));
+    }
+    else
+    {
+        emit_byte(as, (uint8_t)(mod << 6 | (reg & 7) << 3 | 4));
+        emit_byte(as, (uint8_t)(scale << 6 | (index < 0 ? 4 : index & 7) << 3 | (base & 7)));
+    }
+
+    if (mod == 1)
+        emit_byte(as, (uint8_t)disp);
+    else if (mod == 2)
+        emit_u32(as, (uint32_t)disp);
+}
+
+/* `op reg, [base + index * 2^scale + disp]` for the one byte opcodes */
+static void emit_op_memory(Assembler *as, bool wide, uint8_t op, int reg, int base, int index, int scale, int32_t disp)
+{
+    emit_rex(as, wide, reg, index < 0 ? 0 : index, base);
+    emit_byte(as, op);
+    emit_memory(as, reg, base, index, scale, disp);
+}
+
+/* `op rm, reg` between registers for the one byte opcodes */
+static void emit_op_registers(Assembler *as, bool wide, uint8_t op, int rm, int reg)
+{
+    emit_rex(as, wide, reg, 0, rm);
+    emit_byte(as, op);
+    emit_byte(as, (uint8_t)(0xc0 | (reg & 7) << 3 | (rm & 7)));
+}
+
+static void emit_load(Assembler *as, Register dst, Register base, int32_t disp)
+{
+    emit_op_memory(as, true, 0x8b, dst, base, -1, 0, disp);
+}
+
+static void emit_store(Assembler *as, Register base, int32_t disp, Register src)
+{
+    emit_op_memory(as, true, 0x89, src, base, -1, 0, disp);
+}
+
+static void emit_store32(Assembler *as, Register base, int32_t disp, Register src)
+{
+    emit_op_memory(as, false, 0x89, src, base, -1, 0, disp);
+}
+
+/* movsxd dst, dword [base + disp] */
+static void emit_load_int(Assembler *as, Register dst, Register base, int32_t disp)
+{
+    emit_op_memory(as, true, 0x63, dst, base, -1, 0, disp);
+}
+
+static void emit_lea(Assembler *as, Register dst, Register base, int32_t disp)
+{
+    emit_op_memory(as, true, 0x8d, dst, base, -1, 0, disp);
+}
+
+static void emit_mov_imm(Assembler *as, Register dst, uint64_t imm)
+{
+    if (imm <= UINT32_MAX)
+    {
+        // mov r32, imm32 clears the upper half
+        emit_rex(as, false, 0, 0, dst);
+        emit_byte(as, (uint8_t)(0xb8 + (dst & 7)));
+        emit_u32(as, (uint32_t)imm);
+        return;
+    }
+    emit_rex(as, true, 0, 0, dst);
+    emit_byte(as, (uint8_t)(0xb8 + (dst & 7)));
+    emit_u64(as, imm);
+}
+
+static void emit_mov(Assembler *as, Register dst, Register src)
+{
+    emit_op_registers(as, true, 0x89, dst, src);
+}
+
+static void emit_add(Assembler *as, Register dst, Register src)
+{
+    emit_op_registers(as, true, 0x01, dst, src);
+}
+
+static void emit_and(Assembler *as, Register dst, Register src)
+{
+    emit_op_registers(as, true, 0x21, dst, src);
+}
+
+static void emit_xor(Assembler *as, Register dst, Register src)
+{
+    emit_op_registers(as, true, 0x31, dst, src);
+}
+
+static void emit_cmp(Assembler *as, Register a, Register b)
+{
+    emit_op_registers(as, true, 0x39, a, b);
+}
+
+static void emit_test8(Assembler *as, Register a, Register b)
+{
+    emit_op_registers(as, false, 0x84, a, b);
+}
+
+static void emit_cmp_imm(Assembler *as, Register dst, int32_t imm)
+{
+    emit_rex(as, true, 0, 0, dst);
+    emit_byte(as, 0x81);
+    emit_byte(as, (uint8_t)(0xc0 | 7 << 3 | (dst & 7)));
+    emit_u32(as, (uint32_t)imm);
+}
+
+static void emit_push(Assembler *as, Register reg)
+{
+    emit_rex(as, false, 0, 0, reg);
+    emit_byte(as, (uint8_t)(0x50 + (reg & 7)));
+}
+
+static void emit_pop(Assembler *as, Register reg)
+{
+    emit_rex(as, false, 0, 0, reg);
+    emit_byte(as, (uint8_t)(0x58 + (reg & 7)));
+}
+
+static void emit_call(Assembler *as, const void *function)
+{
+    emit_mov_imm(as, RAX, (uint64_t)(uintptr_t)function);
+    emit_byte(as, 0xff);
+    emit_byte(as, 0xd0);
+}
+
+/* Returns where the rel32 to patch is */
+static uint32_t emit_jump(Assembler *as)
+{
+    emit_byte(as, 0xe9);
+    emit_u32(as, 0);
+    return as->count - 4;
+}
+
+static uint32_t emit_jump_if(Assembler *as, Condition condition)
+{
+    emit_byte(as, 0x0f);
+    emit_byte(as, (uint8_t)(0x80 + condition));
+    emit_u32(as, 0);
+    return as->count - 4;
+}
+
+static void patch_jump(Assembler *as, uint32_t at, uint32_t target)
+{
+    patch_u32(as, at, target - (at + 4));
+}
+
+static void emit_jump_to(Assembler *as, uint32_t target)
+{
+    patch_jump(as, emit_jump(as), target);
+}
+
+static void emit_jump_if_to(Assembler *as, Condition condition, uint32_t target)
+{
+    patch_jump(as, emit_jump_if(as, condition), target);
+}
+
+/* eax = condition ? VALUE_TRUE : VALUE_FALSE */
+static void emit_bool(Assembler *as, Condition condition)
+{
+    // setcc al, movzx eax, al, lea rax, [r14 + rax + TYPE_FALSE]
+    emit_byte(as, 0x0f);
+    emit_byte(as, (uint8_t)(0x90 + condition));
+    emit_byte(as, 0xc0);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0xb6);
+    emit_byte(as, 0xc0);
+    emit_op_memory(as, true, 0x8d, RAX, REG_QNAN, RAX, 0, TYPE_FALSE);
+}
+
+/* movq xmm, r64 */
+static void emit_to_double(Assembler *as, int xmm, Register src)
+{
+    emit_byte(as, 0x66);
+    emit_rex(as, true, xmm, 0, src);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x6e);
+    emit_byte(as, (uint8_t)(0xc0 | (xmm & 7) << 3 | (src & 7)));
+}
+
+/* movq r64, xmm */
+static void emit_from_double(Assembler *as, Register dst, int xmm)
+{
+    emit_byte(as, 0x66);
+    emit_rex(as, true, xmm, 0, dst);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x7e);
+    emit_byte(as, (uint8_t)(0xc0 | (xmm & 7) << 3 | (dst & 7)));
+}
+
+/* addsd (0x58), mulsd (0x59), subsd (0x5c) and divsd (0x5e) between xmm0..7 */
+static void emit_double_op(Assembler *as, uint8_t op, int dst, int src)
+{
+    emit_byte(as, 0xf2);
+    emit_byte(as, 0x0f);
+    emit_byte(as, op);
+    emit_byte(as, (uint8_t)(0xc0 | dst << 3 | src));
+}
+
+static void emit_ucomisd(Assembler *as, int a, int b)
+{
+    emit_byte(as, 0x66);
+    emit_byte(as, 0x0f);
+    emit_byte(as, 0x2e);
+    emit_byte(as, (uint8_t)(0xc0 | a << 3 | b));
+}
+
+/* ===== COMPILER ===== */
+
+/* What the compiler knows a stack slot holds, forgotten at jump targets */
+typedef enum
+{
+    KIND_UNKNOWN,
+    KIND_NUMBER,
+    KIND_BOOL,
+} SlotKind;
+
+typedef enum
+{
+    // Leaves to the interpreter at the instruction
+    STUB_EXIT,
+    // Calls a helper and goes back to `resume`
+    STUB_CALL,
+} StubKind;
+
+typedef struct
+{
+    StubKind kind;
+    uint32_t patch;
+    uint32_t offset;
+    int depth;
+    const void *helper;
+    bool checked;
+    uint32_t resume;
+} Stub;
+
+typedef struct
+{
+    uint32_t patch;
+    uint32_t target;
+} JumpPatch;
+
+typedef struct
+{
+    ObjectFunction *function;
+    Assembler as;
+
+    int32_t *depths;
+    bool *is_target;
+    uint32_t *offsets;
+    int max_depth;
+
+    SlotKind *kinds;
+
+    Stub *stubs;
+    uint32_t stub_count;
+    uint32_t stub_capacity;
+
+    JumpPatch *jumps;
+    uint32_t jump_count;
+    uint32_t jump_capacity;
+
+    uint32_t epilogue;
+    uint32_t error;
+} JitCompiler;
+
+static void *grow(void *array, uint32_t *capacity, size_t size)
+{
+    *capacity = *capacity < 16 ? 16 : *capacity * 2;
+    array = realloc(array, *capacity * size);
+    if (array == NULL)
+    {
+        fprintf(stderr, "Not enough memory to compile\n");
+        exit(74);
+    }
+    return array;
+}
+
+static uint32_t read_long(uint8_t *ip)
+{
+    return (uint32_t)ip[0] << 24 | (uint32_t)ip[1] << 16 | (uint32_t)ip[2] << 8 | ip[3];
+}
+
+static uint16_t read_short(uint8_t *ip)
+{
+    return (uint16_t)(ip[0] << 8 | ip[1]);
+}
+
+/* How many values the instruction leaves on the stack minus how many it takes */
+static int stack_effect(Chunk *chunk, uint32_t offset)
+{
+    uint8_t *ip = &chunk->code[offset];
+    switch (generic_opcode(*ip))
+    {
+    case OP_CONSTANT_LONG:
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NIL:
+    case OP_COMPARE:
+    case OP_GET_GLOBAL:
+    case OP_GET_LOCAL:
+    case OP_GET_UPVALUE:
+    case OP_SWITCH:
+    case OP_CLOSURE:
+    case OP_CLASS:
+    case OP_TABLE:
+    case OP_ARRAY:
+        return 1;
+    case OP_TERNARY:
+    case OP_SQR_BRACKET_SET:
+    case OP_DEL:
+        return -2;
+    case OP_GREATER:
+    case OP_LESS:
+    case OP_EQUAL_EQUAL:
+    case OP_ADD:
+    case OP_SUBTRACT:
+    case OP_DIVIDE:
+    case OP_MULTIPLY:
+    case OP_DOT_SET:
+    case OP_SQR_BRACKET_GET:
+    case OP_PRINT:
+    case OP_POP:
+    case OP_GLOBAL_VAR:
+    case OP_CASE_COMPARE:
+    case OP_CLOSE_UPVALUE:
+    case OP_METHOD:
+        return -1;
+    case OP_CALL:
+        return -ip[1];
+    case OP_INVOKE:
+        return -ip[1];
+    case OP_TABLE_ITEMS:
+        return -2 * (int)read_long(ip + 1);
+    case OP_ARRAY_ITEMS:
+        return -(int)read_long(ip + 1);
+    default:
+        return 0;
+    }
+}
+
+static void set_depth(JitCompiler *compiler, uint32_t *worklist, uint32_t *pending, uint32_t offset, int depth,
+                      bool is_jump, bool *consistent)
+{
+    if (offset >= compiler->function->chunk.count)
+    {
+        *consistent = false;
+        return;
+    }
+
+    if (is_jump)
+        compiler->is_target[offset] = true;
+
+    if (compiler->depths[offset] < 0)
+    {
+        compiler->depths[offset] = depth;
+        worklist[(*pending)++] = offset;
+    }
+    else if (compiler->depths[offset] != depth)
+    {
+        *consistent = false;
+    }
+}
+
+/* Finds the stack depth at every reachable instruction, false if it is not the same on every path */
+static bool analyze_depths(JitCompiler *compiler)
+{
+    Chunk *chunk = &compiler->function->chunk;
+    uint32_t *worklist = malloc(chunk->count * sizeof(uint32_t));
+    uint32_t pending = 0;
+    bool consistent = true;
+
+    set_depth(compiler, worklist, &pending, 0, compiler->function->arity + 1, false, &consistent);
+    while (pending > 0 && consistent)
+    {
+        uint32_t offset = worklist[--pending];
+        int depth = compiler->depths[offset];
+        uint8_t op = generic_opcode(chunk->code[offset]);
+        uint32_t next = offset + instruction_length(chunk, offset);
+
+        if (op >= OPCODE_COUNT || op == OP_SWITCH_JUMP)
+        {
+            // The switch jump reads its target from the code at run time
+            consistent = false;
+            break;
+        }
+
+        int after = depth + stack_effect(chunk, offset);
+        if (after < 1)
+        {
+            consistent = false;
+            break;
+        }
+        if (after > compiler->max_depth)
+            compiler->max_depth = after;
+        if (depth > compiler->max_depth)
+            compiler->max_depth = depth;
+
+        switch (op)
+        {
+        case OP_RETURN:
+        case OP_PAUSE:
+            break;
+        case OP_JUMP:
+            set_depth(compiler, worklist, &pending, next + read_short(&chunk->code[offset + 1]), after, true,
+                      &consistent);
+            break;
+        case OP_LOOP: {
+            uint16_t jump = read_short(&chunk->code[offset + 1]);
+            if (jump > next)
+            {
+                consistent = false;
+                break;
+            }
+            set_depth(compiler, worklist, &pending, next - jump, after, true, &consistent);
+            break;
+        }
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE:
+            set_depth(compiler, worklist, &pending, next + read_short(&chunk->code[offset + 1]), after, true,
+                      &consistent);
+            set_depth(compiler, worklist, &pending, next, after, false, &consistent);
+            break;
+        default:
+            set_depth(compiler, worklist, &pending, next, after, false, &consistent);
+            break;
+        }
+    }
+
+    free(worklist);
+    return consistent;
+}
+
+/* ----- code generation ----- */
+
+#define SLOT(depth) ((int32_t)((depth) * (int32_t)sizeof(Value)))
+
+static void add_stub(JitCompiler *compiler, Stub stub)
+{
+    if (compiler->stub_count == compiler->stub_capacity)
+        compiler->stubs = grow(compiler->stubs, &compiler->stub_capacity, sizeof(Stub));
+    compiler->stubs[compiler->stub_count++] = stub;
+}
+
+/* Jumps to a stub leaving at `offset` with `depth` values on the stack when `condition` holds */
+static void exit_if(JitCompiler *compiler, Condition condition, uint32_t offset, int depth)
+{
+    Stub stub = {.kind = STUB_EXIT, .offset = offset, .depth = depth};
+    stub.patch = emit_jump_if(&compiler->as, condition);
+    add_stub(compiler, stub);
+}
+
+/* Jumps to a stub calling `helper` when `condition` holds, which comes back to the next instruction emitted */
+static uint32_t call_if(JitCompiler *compiler, Condition condition, uint32_t offset, int depth, const void *helper,
+                        bool checked)
+{
+    Stub stub = {.kind = STUB_CALL, .offset = offset, .depth = depth, .helper = helper, .checked = checked};
+    stub.patch = emit_jump_if(&compiler->as, condition);
+    add_stub(compiler, stub);
+    return compiler->stub_count - 1;
+}
+
+static void jump_to_instruction(JitCompiler *compiler, uint32_t patch, uint32_t target)
+{
+    if (compiler->jump_count == compiler->jump_capacity)
+        compiler->jumps = grow(compiler->jumps, &compiler->jump_capacity, sizeof(JumpPatch));
+    compiler->jumps[compiler->jump_count++] = (JumpPatch){patch, target};
+}
+
+/* What a helper and the interpreter need: `stack_top` and the frame's ip */
+static void emit_sync(JitCompiler *compiler, int depth, uint8_t *ip)
+{
+    Assembler *as = &compiler->as;
+    emit_op_memory(as, false, 0x8d, RAX, REG_SLOTS, -1, 0, depth);
+    emit_store32(as, REG_VM, offsetof(VM, stack_top), RAX);
+    emit_mov_imm(as, RAX, (uint64_t)(uintptr_t)ip);
+    emit_store(as, REG_FRAME, offsetof(CallFrame, ip), RAX);
+}
+
+/* The stack may have moved during a helper */
+static void emit_reload_stack(Assembler *as)
+{
+    emit_load(as, RAX, REG_VM, offsetof(VM, stack) + offsetof(Stack, items));
+    emit_op_memory(as, true, 0x8d, REG_STACK, RAX, REG_SLOTS, 3, 0);
+}
+
+/* Calls `helper` with the stack synced, leaving through the error stub when a checked helper returns false */
+static void emit_helper(JitCompiler *compiler, uint32_t offset, int depth, const void *helper, bool checked)
+{
+    Assembler *as = &compiler->as;
+    emit_sync(compiler, depth, &compiler->function->chunk.code[offset + 1]);
+    emit_call(as, helper);
+    if (checked)
+    {
+        emit_test8(as, RAX, RAX);
+        emit_jump_if_to(as, CC_E, compiler->error);
+    }
+    emit_reload_stack(as);
+}
+
+/* Sets ZF when `reg` does not hold a number, clobbers rdx */
+static void emit_is_not_number(Assembler *as, Register reg)
+{
+    emit_mov(as, RDX, reg);
+    emit_and(as, RDX, REG_QNAN);
+    emit_cmp(as, RDX, REG_QNAN);
+}
+
+static void emit_check_number(JitCompiler *compiler, Register reg, int depth_slot, uint32_t offset, int depth)
+{
+    if (compiler->kinds[depth_slot] == KIND_NUMBER)
+        return;
+    emit_is_not_number(&compiler->as, reg);
+    exit_if(compiler, CC_E, offset, depth);
+}
+
+/* Jumps to the instruction at `target` when the value in rax is (not) falsy, `falsy` selects which */
+static void emit_branch_falsy(JitCompiler *compiler, SlotKind kind, bool falsy, uint32_t target)
+{
+    Assembler *as = &compiler->as;
+
+    emit_lea(as, RCX, REG_QNAN, TYPE_FALSE);
+    emit_cmp(as, RAX, RCX);
+    if (kind == KIND_BOOL)
+    {
+        jump_to_instruction(compiler, emit_jump_if(as, falsy ? CC_E : CC_NE), target);
+        return;
+    }
+
+    // nihil, salah, 0 and -0 are falsy
+    uint32_t is_falsy = emit_jump_if(as, CC_E);
+    emit_lea(as, RCX, REG_QNAN, TYPE_NIL);
+    emit_cmp(as, RAX, RCX);
+    uint32_t is_nil = emit_jump_if(as, CC_E);
+    emit_add(as, RAX, RAX);
+    uint32_t is_zero = emit_jump_if(as, CC_E);
+
+    if (falsy)
+    {
+        uint32_t truthy = emit_jump(as);
+        patch_jump(as, is_falsy, as->count);
+        patch_jump(as, is_nil, as->count);
+        patch_jump(as, is_zero, as->count);
+        jump_to_instruction(compiler, emit_jump(as), target);
+        patch_jump(as, truthy, as->count);
+    }
+    else
+    {
+        jump_to_instruction(compiler, emit_jump(as), target);
+        patch_jump(as, is_falsy, as->count);
+        patch_jump(as, is_nil, as->count);
+        patch_jump(as, is_zero, as->count);
+    }
+}
+
+/* `a op b` on the two numbers on top of the stack */
+static void emit_arithmetic(JitCompiler *compiler, uint8_t op, uint32_t offset, int depth)
+{
+    Assembler *as = &compiler->as;
+    emit_load(as, RAX, REG_STACK, SLOT(depth - 2));
+    emit_load(as, RCX, REG_STACK, SLOT(depth - 1));
+    emit_check_number(compiler, RAX, depth - 2, offset, depth);
+    emit_check_number(compiler, RCX, depth - 1, offset, depth);
+    emit_to_double(as, 0, RAX);
+    emit_to_double(as, 1, RCX);
+    emit_double_op(as, op, 0, 1);
+    emit_from_double(as, RAX, 0);
+    emit_store(as, REG_STACK, SLOT(depth - 2), RAX);
+}
+
+static void emit_prologue(JitCompiler *compiler)
+{
+    Assembler *as = &compiler->as;
+    emit_push(as, RBX);
+    emit_push(as, R12);
+    emit_push(as, R13);
+    emit_push(as, R14);
+    emit_push(as, R15);
+
+    // The target waits in rbx, the registers are not loaded yet
+    emit_mov(as, RBX, RDX);
+    emit_mov(as, REG_VM, RDI);
+    emit_mov(as, REG_FRAME, RSI);
+    emit_mov_imm(as, REG_QNAN, QNAN);
+    emit_load_int(as, REG_SLOTS, REG_FRAME, offsetof(CallFrame, slots));
+
+    // Every slot the code writes without push() has to exist
+    emit_load_int(as, RAX, REG_VM, offsetof(VM, stack) + offsetof(Stack, capacity));
+    emit_op_registers(as, true, 0x29, RAX, REG_SLOTS);
+    emit_cmp_imm(as, RAX, compiler->max_depth);
+    emit_byte(as, 0x7d); // jge over the call
+    uint32_t reserved = as->count;
+    emit_byte(as, 0);
+    emit_op_memory(as, false, 0x8d, RDI, REG_SLOTS, -1, 0, compiler->max_depth);
+    emit_call(as, reserve_stack);
+    as->bytes[reserved] = (uint8_t)(as->count - reserved - 1);
+
+    emit_mov(as, RDX, RBX);
+    emit_reload_stack(as);
+    // jmp rdx
+    emit_byte(as, 0xff);
+    emit_byte(as, 0xe2);
+
+    compiler->epilogue = as->count;
+    emit_pop(as, R15);
+    emit_pop(as, R14);
+    emit_pop(as, R13);
+    emit_pop(as, R12);
+    emit_pop(as, RBX);
+    emit_byte(as, 0xc3);
+
+    compiler->error = as->count;
+    emit_mov_imm(as, RAX, JIT_ERROR);
+    emit_jump_to(as, compiler->epilogue);
+}
+
+static void emit_exit(JitCompiler *compiler, uint32_t offset, int depth)
+{
+    Assembler *as = &compiler->as;
+    emit_sync(compiler, depth, &compiler->function->chunk.code[offset]);
+    emit_mov_imm(as, RAX, JIT_EXITED);
+    emit_jump_to(as, compiler->epilogue);
+}
+
+static void emit_stubs(JitCompiler *compiler)
+{
+    Assembler *as = &compiler->as;
+    for (uint32_t i = 0; i < compiler->stub_count; ++i)
+    {
+        Stub *stub = &compiler->stubs[i];
+        patch_jump(as, stub->patch, as->count);
+
+        if (stub->kind == STUB_EXIT)
+        {
+            emit_exit(compiler, stub->offset, stub->depth);
+            continue;
+        }
+
+        emit_helper(compiler, stub->offset, stub->depth, stub->helper, stub->checked);
+        emit_jump_to(as, stub->resume);
+    }
+}
+
+static bool emit_instruction(JitCompiler *compiler, uint32_t offset)
+{
+    Assembler *as = &compiler->as;
+    Chunk *chunk = &compiler->function->chunk;
+    uint8_t *ip = &chunk->code[offset];
+    uint8_t op = generic_opcode(*ip);
+    uint32_t next = offset + instruction_length(chunk, offset);
+    int depth = compiler->depths[offset];
+    SlotKind *kinds = compiler->kinds;
+
+    switch (op)
+    {
+    case OP_CONSTANT_LONG: {
+        Value value = chunk->constants.values[read_long(ip + 1)];
+        emit_mov_imm(as, RAX, value);
+        emit_store(as, REG_STACK, SLOT(depth), RAX);
+        kinds[depth] = IS_NUMBER(value) ? KIND_NUMBER : KIND_UNKNOWN;
+        break;
+    }
+    case OP_TRUE:
+    case OP_FALSE:
+    case OP_NIL:
+        emit_lea(as, RAX, REG_QNAN, op == OP_TRUE ? TYPE_TRUE : op == OP_FALSE ? TYPE_FALSE : TYPE_NIL);
+        emit_store(as, REG_STACK, SLOT(depth), RAX);
+        kinds[depth] = op == OP_NIL ? KIND_UNKNOWN : KIND_BOOL;
+        break;
+
+    case OP_POP:
+    case OP_MARK_JUMP:
+        break;
+
+    case OP_GET_LOCAL:
+    case OP_SET_LOCAL: {
+        uint32_t idx = read_long(ip + 1);
+        if (idx > INT32_MAX / sizeof(Value))
+            return false;
+
+        if (op == OP_GET_LOCAL)
+        {
+            emit_load(as, RAX, REG_STACK, SLOT(idx));
+            emit_store(as, REG_STACK, SLOT(depth), RAX);
+            kinds[depth] = KIND_UNKNOWN;
+        }
+        else
+        {
+            emit_load(as, RAX, REG_STACK, SLOT(depth - 1));
+            emit_store(as, REG_STACK, SLOT(idx), RAX);
+        }
+        break;
+    }
+
+    case OP_GET_GLOBAL:
+    case OP_SET_GLOBAL:
+    case OP_GLOBAL_VAR: {
+        uint32_t slot = read_long(ip + 1);
+        if (slot > INT32_MAX / sizeof(Value))
+            return false;
+
+        emit_load(as, RCX, REG_VM, offsetof(VM, global_values) + offsetof(LongValues, values));
+        if (op == OP_GLOBAL_VAR)
+        {
+            emit_load(as, RAX, REG_STACK, SLOT(depth - 1));
+            emit_store(as, RCX, SLOT(slot), RAX);
+            break;
+        }
+
+        // Reading or assigning a global that is not declared yet is the interpreter's error
+        emit_load(as, RAX, RCX, SLOT(slot));
+        emit_lea(as, RDX, REG_QNAN, TYPE_UNDEFINED);
+        emit_cmp(as, RAX, RDX);
+        exit_if(compiler, CC_E, offset, depth);
+        if (op == OP_GET_GLOBAL)
+        {
+            emit_store(as, REG_STACK, SLOT(depth), RAX);
+            kinds[depth] = KIND_UNKNOWN;
+        }
+        else
+        {
+            emit_load(as, RAX, REG_STACK, SLOT(depth - 1));
+            emit_store(as, RCX, SLOT(slot), RAX);
+        }
+        break;
+    }
+
+    case OP_GET_UPVALUE:
+    case OP_SET_UPVALUE: {
+        uint32_t idx = read_long(ip + 1);
+        if (idx > INT32_MAX / sizeof(Value))
+            return false;
+
+        emit_load(as, RCX, REG_FRAME, offsetof(CallFrame, closure));
+        emit_load(as, RCX, RCX, offsetof(ObjectClosure, upvalues));
+        emit_load(as, RCX, RCX, SLOT(idx));
+        // An open upvalue (p_val is NULL) still lives in its stack slot
+        emit_load(as, RDX, RCX, offsetof(ObjectUpValue, p_val));
+        emit_op_registers(as, true, 0x85, RDX, RDX);
+        uint32_t closed = emit_jump_if(as, CC_NE);
+        emit_load_int(as, RCX, RCX, offsetof(ObjectUpValue, idx));
+        emit_load(as, RDX, REG_VM, offsetof(VM, stack) + offsetof(Stack, items));
+        emit_op_memory(as, true, 0x8d, RDX, RDX, RCX, 3, 0);
+        patch_jump(as, closed, as->count);
+
+        if (op == OP_GET_UPVALUE)
+        {
+            emit_load(as, RAX, RDX, 0);
+            emit_store(as, REG_STACK, SLOT(depth), RAX);
+            kinds[depth] = KIND_UNKNOWN;
+        }
+        else
+        {
+            emit_load(as, RAX, REG_STACK, SLOT(depth - 1));
+            emit_store(as, RDX, 0, RAX);
+        }
+        break;
+    }
+
+    case OP_ADD: {
+        bool numbers = kinds[depth - 2] == KIND_NUMBER && kinds[depth - 1] == KIND_NUMBER;
+        emit_load(as, RAX, REG_STACK, SLOT(depth - 2));
+        emit_load(as, RCX, REG_STACK, SLOT(depth - 1));
+
+        // Anything but two numbers is concatenated (or an error) by the helper
+        uint32_t first = 0, second = 0;
+        if (kinds[depth - 2] != KIND_NUMBER)
+        {
+            emit_is_not_number(as, RAX);
+            first = call_if(compiler, CC_E, offset, depth, jit_add, true);
+        }
+        if (kinds[depth - 1] != KIND_NUMBER)
+        {
+            emit_is_not_number(as, RCX);
+            second = call_if(compiler, CC_E, offset, depth, jit_add, true);
+        }
+        emit_to_double(as, 0, RAX);
+        emit_to_double(as, 1, RCX);
+        emit_double_op(as, 0x58, 0, 1);
+        emit_from_double(as, RAX, 0);
+        emit_store(as, REG_STACK, SLOT(depth - 2), RAX);
+
+        if (kinds[depth - 2] != KIND_NUMBER)
+            compiler->stubs[first].resume = as->count;
+        if (kinds[depth - 1] != KIND_NUMBER)
+            compiler->stubs[second].resume = as->count;
+        kinds[depth - 2] = numbers ? KIND_NUMBER : KIND_UNKNOWN;
+        break;
+    }
+    case OP_SUBTRACT:
+    case OP_MULTIPLY:
+    case OP_DIVIDE:
+        emit_arithmetic(compiler, op == OP_SUBTRACT ? 0x5c : op == OP_MULTIPLY ? 0x59 : 0x5e, offset, depth);
+        kinds[depth - 2] = KIND_NUMBER;
+        break;
+
+    case OP_NEGATE: {
+        emit_load(as, RAX, REG_STACK, SLOT(depth - 1));
+        emit_check_number(compiler, RAX, depth - 1, offset, depth);
+        emit_mov_imm(as, RCX, SIGNED_BIT);
+        emit_xor(as, RAX, RCX);
+        emit_store(as, REG_STACK, SLOT(depth - 1), RAX);
+        kinds[depth - 1] = KIND_NUMBER;
+        break;
+    }
+
+    case OP_GREATER:
+    case OP_LESS: {
+        emit_load(as, RAX, REG_STACK, SLOT(depth - 2));
+        emit_load(as, RCX, REG_STACK, SLOT(depth - 1));
+        emit_check_number(compiler, RAX, depth - 2, offset, depth);
+        emit_check_number(compiler, RCX, depth - 1, offset, depth);
+        emit_to_double(as, 0, RAX);
+        emit_to_double(as, 1, RCX);
+        // a > b and b < a are both "above", which is false when unordered (NaN)
+        if (op == OP_GREATER)
+            emit_ucomisd(as, 0, 1);
+        else
+            emit_ucomisd(as, 1, 0);
+        emit_bool(as, CC_A);
+        emit_store(as, REG_STACK, SLOT(depth - 2), RAX);
+        kinds[depth - 2] = KIND_BOOL;
+        break;
+    }
+
+    case OP_EQUAL_EQUAL: {
+        emit_load(as, RAX, REG_STACK, SLOT(depth - 2));
+        emit_load(as, RCX, REG_STACK, SLOT(depth - 1));
+        emit_cmp(as, RAX, RCX);
+        // Values with other bits are only equal when two objects are strings with the same characters
+        uint32_t same = emit_jump_if(as, CC_E);
+        emit_mov(as, RDX, RAX);
+        emit_and(as, RDX, RCX);
+        emit_mov_imm(as, RSI, SIGNED_BIT | QNAN);
+        emit_and(as, RDX, RSI);
+        emit_cmp(as, RDX, RSI);
+        uint32_t objects = call_if(compiler, CC_E, offset, depth, jit_equal, false);
+        patch_jump(as, same, as->count);
+        emit_bool(as, CC_E);
+        emit_store(as, REG_STACK, SLOT(depth - 2), RAX);
+        compiler->stubs[objects].resume = as->count;
+        kinds[depth - 2] = KIND_BOOL;
+        break;
+    }
+
+    case OP_BANG: {
+        emit_load(as, RAX, REG_STACK, SLOT(depth - 1));
+        emit_lea(as, RCX, REG_QNAN, TYPE_FALSE);
+        emit_cmp(as, RAX, RCX);
+        uint32_t is_false = emit_jump_if(as, CC_E);
+        emit_lea(as, RCX, REG_QNAN, TYPE_NIL);
+        emit_cmp(as, RAX, RCX);
+        uint32_t is_nil = emit_jump_if(as, CC_E);
+        emit_add(as, RAX, RAX);
+        patch_jump(as, is_false, as->count);
+        patch_jump(as, is_nil, as->count);
+        // ZF is set exactly for the falsy values
+        emit_bool(as, CC_E);
+        emit_store(as, REG_STACK, SLOT(depth - 1), RAX);
+        kinds[depth - 1] = KIND_BOOL;
+        break;
+    }
+
+    case OP_JUMP_IF_FALSE:
+    case OP_JUMP_IF_TRUE:
+        emit_load(as, RAX, REG_STACK, SLOT(depth - 1));
+        emit_branch_falsy(compiler, kinds[depth - 1], op == OP_JUMP_IF_FALSE, next + read_short(ip + 1));
+        break;
+
+    case OP_JUMP:
+        jump_to_instruction(compiler, emit_jump(as), next + read_short(ip + 1));
+        break;
+
+    case OP_LOOP: {
+        // The profiler's safepoint
+        emit_mov_imm(as, RAX, (uint64_t)(uintptr_t)&profile_pending);
+        emit_byte(as, 0x83);
+        emit_byte(as, 0x38);
+        emit_byte(as, 0x00);
+        uint32_t sample = call_if(compiler, CC_NE, offset, depth, take_sample, false);
+        compiler->stubs[sample].resume = as->count;
+        jump_to_instruction(compiler, emit_jump(as), next - read_short(ip + 1));
+        break;
+    }
+
+    case OP_CALL:
+    case OP_INVOKE: {
+        emit_sync(compiler, depth, next == offset + 2 ? ip + 2 : ip + 6);
+        emit_mov_imm(as, RDI, ip[1]);
+        if (op == OP_INVOKE)
+        {
+            emit_mov_imm(as, RSI, chunk->constants.values[read_long(ip + 2)]);
+            emit_call(as, jit_invoke);
+        }
+        else
+        {
+            emit_call(as, jit_call);
+        }
+        emit_test8(as, RAX, RAX);
+        emit_jump_if_to(as, CC_E, compiler->error);
+        emit_reload_stack(as);
+        kinds[depth - ip[1] - 1] = KIND_UNKNOWN;
+
+        emit_mov_imm(as, RAX, (uint64_t)(uintptr_t)&profile_pending);
+        emit_byte(as, 0x83);
+        emit_byte(as, 0x38);
+        emit_byte(as, 0x00);
+        uint32_t sample = call_if(compiler, CC_NE, offset, depth - ip[1], take_sample, false);
+        compiler->stubs[sample].resume = as->count;
+        break;
+    }
+
+    case OP_RETURN:
+        emit_sync(compiler, depth, ip + 1);
+        emit_call(as, jit_return);
+        emit_mov_imm(as, RAX, JIT_RETURNED);
+        emit_jump_to(as, compiler->epilogue);
+        break;
+
+    case OP_DOT_GET:
+    case OP_DOT_SET:
+        emit_mov_imm(as, RDI, chunk->constants.values[read_long(ip + 1)]);
+        emit_helper(compiler, offset, depth, op == OP_DOT_GET ? (void *)jit_dot_get : (void *)jit_dot_set, true);
+        kinds[depth - 1 + stack_effect(chunk, offset)] = KIND_UNKNOWN;
+        break;
+
+    case OP_SQR_BRACKET_GET:
+    case OP_SQR_BRACKET_SET:
+        emit_helper(compiler, offset, depth, op == OP_SQR_BRACKET_GET ? (void *)jit_index_get : (void *)jit_index_set,
+                    true);
+        kinds[depth - 1 + stack_effect(chunk, offset)] = KIND_UNKNOWN;
+        break;
+
+    case OP_LEN:
+        emit_helper(compiler, offset, depth, jit_len, true);
+        kinds[depth - 1] = KIND_NUMBER;
+        break;
+
+    case OP_PRINT:
+        emit_helper(compiler, offset, depth, jit_print, false);
+        break;
+
+    case OP_CLOSE_UPVALUE:
+        emit_helper(compiler, offset, depth, jit_close_upvalue, false);
+        break;
+
+    case OP_CLOSURE:
+        emit_mov_imm(as, RDI, (uint64_t)(uintptr_t)(ip + 1));
+        emit_helper(compiler, offset, depth, jit_closure, false);
+        kinds[depth] = KIND_UNKNOWN;
+        break;
+
+    case OP_TABLE:
+    case OP_ARRAY:
+        emit_helper(compiler, offset, depth, op == OP_TABLE ? (void *)jit_table : (void *)jit_array, false);
+        kinds[depth] = KIND_UNKNOWN;
+        break;
+
+    case OP_TABLE_ITEMS:
+    case OP_ARRAY_ITEMS:
+        emit_mov_imm(as, RDI, read_long(ip + 1));
+        emit_helper(compiler, offset, depth,
+                    op == OP_TABLE_ITEMS ? (void *)jit_table_items : (void *)jit_array_items, false);
+        break;
+
+    case OP_ARRAY_PUSH:
+        emit_helper(compiler, offset, depth, jit_array_push, false);
+        break;
+
+    case OP_ARRAY_POP:
+        emit_helper(compiler, offset, depth, jit_array_pop, true);
+        break;
+
+    default:
+        // Classes, `hapus`, switch and the streamed script's pause run in the interpreter
+        emit_exit(compiler, offset, depth);
+        break;
+    }
+
+    return true;
+}
+
+static void free_compiler(JitCompiler *compiler)
+{
+    free(compiler->as.bytes);
+    free(compiler->depths);
+    free(compiler->is_target);
+    free(compiler->kinds);
+    free(compiler->stubs);
+    free(compiler->jumps);
+}
+
+static JitCode *install(JitCompiler *compiler)
+{
+    long page = sysconf(_SC_PAGESIZE);
+    size_t size = (compiler->as.count + page - 1) / page * page;
+
+    uint8_t *code = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (code == MAP_FAILED)
+        return NULL;
+
+    memcpy(code, compiler->as.bytes, compiler->as.count);
+    if (mprotect(code, size, PROT_READ | PROT_EXEC) != 0)
+    {
+        munmap(code, size);
+        return NULL;
+    }
+
+    JitCode *jit = malloc(sizeof(JitCode));
+    uint32_t count = compiler->function->chunk.count;
+    jit->code = code;
+    jit->size = size;
+    jit->offsets = compiler->offsets;
+    jit->entry_depths = malloc(count * sizeof(int32_t));
+    for (uint32_t i = 0; i < count; ++i)
+    {
+        // Only loop headers and the start forget the slot kinds, so only they can be entered
+        bool is_entry = i == 0 || compiler->is_target[i];
+        jit->entry_depths[i] = is_entry ? compiler->depths[i] : -1;
+    }
+
+    compiler->offsets = NULL;
+    return jit;
+}
+
+/* ===== INTERFACE ===== */
+
+void init_jit()
+{
+    const char *setting = getenv("CWS_JIT");
+    if (setting != NULL && setting[0] != '\0')
+        jit_threshold = (uint32_t)strtoul(setting, NULL, 10);
+}
+
+bool compile_jit(ObjectFunction *function)
+{
+    Chunk *chunk = &function->chunk;
+    if (jit_threshold == 0 || function->jit != NULL || chunk->count == 0)
+        return false;
+
+    JitCompiler compiler = {0};
+    compiler.function = function;
+    compiler.depths = malloc(chunk->count * sizeof(int32_t));
+    compiler.is_target = calloc(chunk->count, sizeof(bool));
+    compiler.offsets = malloc(chunk->count * sizeof(uint32_t));
+    for (uint32_t i = 0; i < chunk->count; ++i)
+    {
+        compiler.depths[i] = -1;
+        compiler.offsets[i] = 0;
+    }
+
+    bool compiled = analyze_depths(&compiler) && compiler.max_depth < STACK_MAX;
+    if (compiled)
+    {
+        compiler.kinds = calloc(compiler.max_depth + 1, sizeof(SlotKind));
+        emit_prologue(&compiler);
+
+        for (uint32_t offset = 0; offset < chunk->count && compiled; offset += instruction_length(chunk, offset))
+        {
+            if (compiler.depths[offset] < 0)
+                continue;
+
+            if (compiler.is_target[offset])
+                memset(compiler.kinds, 0, (compiler.max_depth + 1) * sizeof(SlotKind));
+            compiler.offsets[offset] = compiler.as.count;
+            compiled = emit_instruction(&compiler, offset);
+        }
+    }
+
+    if (compiled)
+    {
+        emit_stubs(&compiler);
+        for (uint32_t i = 0; i < compiler.jump_count; ++i)
+            patch_jump(&compiler.as, compiler.jumps[i].patch, compiler.offsets[compiler.jumps[i].target]);
+        function->jit = install(&compiler);
+    }
+
+    free(compiler.offsets);
+    free_compiler(&compiler);
+    return function->jit != NULL;
+}
+
+JitStatus run_jit(CallFrame *frame, uint8_t *ip)
+{
+    ObjectFunction *function = frame->closure->function;
+    JitCode *jit = function->jit;
+    uint32_t offset = ip - function->chunk.code;
+
+    if (offset >= function->chunk.count || jit->entry_depths[offset] != vm->stack_top - frame->slots)
+        return JIT_EXITED;
+
+    JitEntry entry = (JitEntry)(void *)jit->code;
+    return entry(vm, frame, jit->code + jit->offsets[offset]);
+}
+
+void free_jit(ObjectFunction *function)
+{
+    JitCode *jit = function->jit;
+    if (jit == NULL)
+        return;
+
+    munmap(jit->code, jit->size);
+    free(jit->offsets);
+    free(jit->entry_depths);
+    free(jit);
+    function->jit = NULL;
+    function->hotness = 0;
+}
+
+#else
+
+void init_jit()
+{
+    jit_threshold = 0;
+}
+
+bool compile_jit(ObjectFunction *function)
+{
+    (void)function;
+    return false;
+}
+
+JitStatus run_jit(CallFrame *frame, uint8_t *ip)
+{
+    (void)frame;
+    (void)ip;
+    return JIT_EXITED;
+}
+
+void free_jit(ObjectFunction *function)
+{
+    (void)function;
+}
+
+#endif // HAS_JIT
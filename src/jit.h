@@ -0,0 +1,75 @@
+#ifndef CWS_JIT_H
+#define CWS_JIT_H
+
+#include "vm.h"
+
+/*
+ * BASELINE JIT (x86-64 Linux, `CWS_JIT=0` turns it off)
+ *
+ * A function whose calls and loop back edges reach the threshold is
+ * translated instruction by instruction into machine code that works on
+ * the VM stack exactly like run() does, so the interpreter and the
+ * compiled code hand a frame to each other at any loop header: run()
+ * enters the code after a call and at loop back edges (on-stack
+ * replacement), the code leaves to the interpreter at the instructions it
+ * does not compile (classes, `hapus`, switch, ...) and at the uncommon case
+ * of the ones it does (an undefined global, a non-number operand to `-`).
+ *
+ * Numbers are handled inline, checked against the NaN boxing of value.h;
+ * everything touching objects calls back into the jit_* helpers of vm.c.
+ * The stack depth of every instruction is known when compiling, so stack
+ * slots are plain memory operands and `stack_top` and the frame's ip are
+ * only written before calling a helper or leaving.
+ *
+ * `CWS_JIT=<n>` sets the threshold instead (1 compiles everything that
+ * runs, to test the compiler).
+ * */
+#if defined(__x86_64__) && defined(__linux__) && defined(NAN_BOXING) && !defined(DEBUG_OPCODE_STATS) &&             \
+    !defined(DEBUG_TRACE_EXECUTION)
+#define HAS_JIT
+#endif
+
+#define JIT_THRESHOLD 1000
+
+typedef struct JitCode JitCode;
+
+typedef enum
+{
+    // The function returned, its frame is popped and its result pushed
+    JIT_RETURNED,
+    // The interpreter carries on from frame->ip with `stack_top` synced
+    JIT_EXITED,
+    // A runtime error was reported and the stack reset
+    JIT_ERROR,
+} JitStatus;
+
+extern uint32_t jit_threshold;
+
+void init_jit();
+bool compile_jit(ObjectFunction *function);
+JitStatus run_jit(CallFrame *frame, uint8_t *ip);
+void free_jit(ObjectFunction *function);
+
+/* Runtime helpers the compiled code calls, in vm.c. `stack_top` and the frame's ip are synced */
+void reserve_stack(int size);
+bool jit_call(int args_count);
+bool jit_invoke(int args_count, Value name);
+void jit_return();
+bool jit_add();
+void jit_equal();
+bool jit_dot_get(Value key);
+bool jit_dot_set(Value key);
+bool jit_index_get();
+bool jit_index_set();
+bool jit_len();
+void jit_print();
+void jit_closure(uint8_t *ip);
+void jit_close_upvalue();
+void jit_table();
+void jit_table_items(uint32_t count);
+void jit_array();
+void jit_array_items(uint32_t count);
+void jit_array_push();
+bool jit_array_pop();
+
+#endif // !CWS_JIT_H
@@ -1,45 +1,158 @@
 #include "line.h"
 #include "memory.h"
 
-void InitLine(Line *line, uint8_t idx, uint32_t number)
-{
-    line->idx = idx;
-    line->number = number;
-}
-
 void InitLines(Lines *lines)
 {
     lines->capacity = 0;
     lines->count = 0;
-    lines->lines = NULL;
+    lines->bytes = NULL;
+
+    lines->checkpoint_capacity = 0;
+    lines->checkpoint_count = 0;
+    lines->checkpoints = NULL;
+
+    lines->entries = 0;
+    lines->last_offset = 0;
+    lines->last_number = 0;
 }
 
-void WriteLines(Lines *lines, Line *newItem)
+static void write_byte(Lines *lines, uint8_t byte)
 {
-
     if (lines->capacity < lines->count + 1)
     {
-        uint8_t oldCapacity = lines->capacity;
+        uint32_t oldCapacity = lines->capacity;
         lines->capacity = GROW_CAPACITY(lines->capacity);
-        lines->lines = GROW_ARRAY(Line *, lines->lines, oldCapacity, lines->capacity);
+        lines->bytes = GROW_ARRAY(uint8_t, lines->bytes, oldCapacity, lines->capacity);
     }
-    lines->lines[lines->count] = newItem;
+    lines->bytes[lines->count] = byte;
     lines->count++;
 }
 
-void FreeLine(Line *line)
+static void write_varint(Lines *lines, uint32_t value)
 {
-    free(line);
+    while (value >= 0x80)
+    {
+        write_byte(lines, (uint8_t)(value | 0x80));
+        value >>= 7;
+    }
+    write_byte(lines, (uint8_t)value);
 }
 
-void FreeLines(Lines *lines)
+static uint32_t read_varint(Lines *lines, uint32_t *position)
+{
+    uint32_t value = 0;
+    for (int shift = 0; *position < lines->count; shift += 7)
+    {
+        uint8_t byte = lines->bytes[(*position)++];
+        value |= (uint32_t)(byte & 0x7f) << shift;
+        if (!(byte & 0x80))
+            break;
+    }
+    return value;
+}
+
+static void write_checkpoint(Lines *lines, uint32_t offset, uint32_t number)
 {
-    for (size_t i = 0; i < lines->count; ++i)
+    if (lines->checkpoint_capacity < lines->checkpoint_count + 1)
     {
-        FreeLine(lines->lines[i]);
+        uint32_t oldCapacity = lines->checkpoint_capacity;
+        lines->checkpoint_capacity = GROW_CAPACITY(lines->checkpoint_capacity);
+        lines->checkpoints =
+            GROW_ARRAY(LineCheckpoint, lines->checkpoints, oldCapacity, lines->checkpoint_capacity);
     }
 
-    FREE_ARRAY(Line *, lines->lines, lines->capacity);
+    LineCheckpoint *checkpoint = &lines->checkpoints[lines->checkpoint_count++];
+    checkpoint->offset = offset;
+    checkpoint->number = number;
+    checkpoint->position = lines->count;
+}
+
+/* Offsets only grow, an entry is added only when the line differs from the last one */
+void WriteLine(Lines *lines, uint32_t offset, uint32_t number)
+{
+    if (lines->entries != 0 && number == lines->last_number)
+        return;
+
+    if (lines->entries % LINE_CHECKPOINT == 0)
+        write_checkpoint(lines, offset, number);
+
+    int32_t delta = (int32_t)(number - lines->last_number);
+    write_varint(lines, offset - lines->last_offset);
+    write_varint(lines, ((uint32_t)delta << 1) ^ (uint32_t)(delta >> 31));
+
+    lines->entries++;
+    lines->last_offset = offset;
+    lines->last_number = number;
+}
+
+static void decode_entry(Lines *lines, LineCursor *cursor)
+{
+    cursor->offset += read_varint(lines, &cursor->position);
+    uint32_t zigzag = read_varint(lines, &cursor->position);
+    cursor->number += (zigzag >> 1) ^ -(zigzag & 1);
+}
+
+/* Finds the entry covering `offset`, `start` receives the offset where that entry begins */
+bool LookupLine(Lines *lines, uint32_t offset, uint32_t *number, uint32_t *start)
+{
+    if (lines->checkpoint_count == 0 || offset < lines->checkpoints[0].offset)
+        return false;
+
+    uint32_t low = 0;
+    uint32_t high = lines->checkpoint_count - 1;
+    while (low < high)
+    {
+        uint32_t mid = low + (high - low + 1) / 2;
+        if (lines->checkpoints[mid].offset <= offset)
+            low = mid;
+        else
+            high = mid - 1;
+    }
+
+    LineCheckpoint *checkpoint = &lines->checkpoints[low];
+    LineCursor cursor = {checkpoint->position, 0, 0};
+    decode_entry(lines, &cursor);
+
+    // The checkpoint entry is encoded relative to the entry before it
+    *start = checkpoint->offset;
+    *number = checkpoint->number;
+
+    uint32_t end = low + 1 < lines->checkpoint_count ? lines->checkpoints[low + 1].position : lines->count;
+    cursor.offset = checkpoint->offset;
+    cursor.number = checkpoint->number;
+    while (cursor.position < end)
+    {
+        decode_entry(lines, &cursor);
+        if (cursor.offset > offset)
+            break;
+
+        *start = cursor.offset;
+        *number = cursor.number;
+    }
+
+    return true;
+}
+
+void InitLineCursor(LineCursor *cursor)
+{
+    cursor->position = 0;
+    cursor->offset = 0;
+    cursor->number = 0;
+}
+
+bool NextLine(Lines *lines, LineCursor *cursor)
+{
+    if (cursor->position >= lines->count)
+        return false;
+
+    decode_entry(lines, cursor);
+    return true;
+}
+
+void FreeLines(Lines *lines)
+{
+    FREE_ARRAY(uint8_t, lines->bytes, lines->capacity);
+    FREE_ARRAY(LineCheckpoint, lines->checkpoints, lines->checkpoint_capacity);
 
     InitLines(lines);
 }
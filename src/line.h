@@ -3,24 +3,50 @@
 
 #include "common.h"
 
+/*
+ * Line table of a chunk. A new entry starts whenever the line changes and
+ * is stored as (offset delta, line delta) varints in one packed buffer, the
+ * line delta zigzag encoded because loops jump back to earlier lines.
+ * Every LINE_CHECKPOINT entries the absolute position is kept aside so a
+ * lookup binary searches the checkpoints and decodes a few entries only.
+ * */
+#define LINE_CHECKPOINT 16
+
 typedef struct
 {
-    uint8_t idx;
+    uint32_t offset;
     uint32_t number;
-} Line;
-
-void InitLine(Line *line, uint8_t idx, uint32_t number);
+    uint32_t position;
+} LineCheckpoint;
 
 typedef struct
 {
-    uint8_t capacity;
-    uint8_t count;
+    uint32_t capacity;
+    uint32_t count;
+    uint8_t *bytes;
 
-    Line **lines;
+    uint32_t checkpoint_capacity;
+    uint32_t checkpoint_count;
+    LineCheckpoint *checkpoints;
+
+    uint32_t entries;
+    uint32_t last_offset;
+    uint32_t last_number;
 } Lines;
 
+/* Walks the entries in order, see NextLine */
+typedef struct
+{
+    uint32_t position;
+    uint32_t offset;
+    uint32_t number;
+} LineCursor;
+
 void InitLines(Lines *lines);
-void WriteLines(Lines *lines, Line *newItem);
+void WriteLine(Lines *lines, uint32_t offset, uint32_t number);
+bool LookupLine(Lines *lines, uint32_t offset, uint32_t *number, uint32_t *start);
+void InitLineCursor(LineCursor *cursor);
+bool NextLine(Lines *lines, LineCursor *cursor);
 void FreeLines(Lines *lines);
 
 #endif // !CWS_LINE_H
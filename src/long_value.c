@@ -33,7 +33,7 @@ void append_long_values(LongValues *values, Value newItem)
 {
     if (values->capacity < values->count + 1)
     {
-        uint8_t oldCapacity = values->capacity;
+        uint32_t oldCapacity = values->capacity;
         values->capacity = GROW_CAPACITY(values->capacity);
         values->values = GROW_ARRAY(Value, values->values, oldCapacity, values->capacity);
     }
@@ -0,0 +1,1025 @@
+#include "loop_trace.h"
+#include "jit.h"
+#include "object.h"
+#include "profiler.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+uint32_t trace_threshold = TRACE_THRESHOLD;
+
+struct TraceSite
+{
+    // Offset of the loop header in the chunk
+    uint32_t header;
+    uint32_t hotness;
+    // Recordings that failed so far, each doubles the back edges to the next one
+    uint32_t failures;
+    struct Trace *trace;
+
+    TraceSite *next;
+};
+
+/*
+ * LOOP TRACES
+ *
+ * A trace is a list of three address instructions over a register file of
+ * Values on the C stack. Registers are allocated as the recorder needs
+ * them: the locals below the loop header's stack depth, the globals and
+ * the upvalues the iteration touched (entries, loaded and checked when
+ * entering, written back when leaving), the constants, then one register
+ * for each value an instruction computes.
+ *
+ * Every register always holds the same kind of value, a number or not, at
+ * a given instruction: entries are checked when entering, constants do
+ * not change, arithmetic makes numbers and comparisons booleans, and a
+ * loop only closes when the entries it wrote keep the kind they were
+ * entered with. So the recorder decides types from the values it computes,
+ * and the number instructions read their operands unchecked.
+ *
+ * Side paths are appended after the main one and end with their own jump
+ * to the start, the guard they grew from goes on there instead of leaving.
+ * Nothing here allocates on the heap, traces are malloc'd and hold only
+ * constants of their function's chunk.
+ * */
+
+#ifdef HAS_TRACE
+
+// Limits of one trace, the side paths included
+#define TRACE_REGISTER_MAX 256
+#define TRACE_CODE_MAX 1024
+// Bytecode instructions a recording follows before giving up
+#define TRACE_LENGTH_MAX 512
+#define TRACE_STACK_MAX 32
+// Failed recordings before a header is left to the interpreter
+#define TRACE_ATTEMPTS 4
+// Exits a guard takes before its path is recorded
+#define TRACE_EXIT_THRESHOLD 8
+
+typedef enum
+{
+    TRACE_OP_MOVE,
+    // Numbers only
+    TRACE_OP_ADD,
+    TRACE_OP_SUBTRACT,
+    TRACE_OP_MULTIPLY,
+    TRACE_OP_DIVIDE,
+    TRACE_OP_NEGATE,
+    TRACE_OP_GREATER,
+    TRACE_OP_LESS,
+    // Any values
+    TRACE_OP_EQUAL,
+    TRACE_OP_NOT,
+    // Leave through `exit` unless `a` is truthy (falsy)
+    TRACE_OP_GUARD_TRUTHY,
+    TRACE_OP_GUARD_FALSY,
+    // `dst` = a < b (a > b) of numbers, then leave through `exit` unless it is true (false)
+    TRACE_OP_GUARD_LESS,
+    TRACE_OP_GUARD_NOT_LESS,
+    TRACE_OP_GUARD_GREATER,
+    TRACE_OP_GUARD_NOT_GREATER,
+    // Back to the first instruction
+    TRACE_OP_LOOP,
+} TraceOp;
+
+typedef struct
+{
+    uint8_t op;
+    uint16_t dst;
+    uint16_t a;
+    uint16_t b;
+    uint16_t exit;
+} TraceInstruction;
+
+typedef enum
+{
+    ENTRY_LOCAL,
+    ENTRY_GLOBAL,
+    // Top level variables, as functions see them
+    ENTRY_UPVALUE,
+} EntryType;
+
+typedef struct
+{
+    // Slot of the local in the frame, of the global or of the upvalue in the closure
+    uint32_t index;
+    EntryType type;
+    // The kind the trace is entered with and keeps
+    bool is_number;
+    bool is_written;
+    uint16_t reg;
+} TraceEntry;
+
+typedef struct
+{
+    Value value;
+    uint16_t reg;
+} TraceConstant;
+
+typedef struct
+{
+    // Bytecode offset run() resumes at
+    uint32_t offset;
+    // The stack above the header's depth, registers in `stacks`
+    uint32_t stack;
+    uint32_t stack_count;
+    uint32_t hits;
+    // Instruction the path recorded from here starts at, 0 until it is recorded
+    uint32_t side;
+} TraceExit;
+
+typedef struct Trace
+{
+    // Stack depth of the header, from frame->slots
+    int depth;
+    uint32_t register_count;
+
+    TraceEntry *entries;
+    uint32_t entry_count;
+    uint32_t entry_capacity;
+
+    TraceConstant *constants;
+    uint32_t constant_count;
+    uint32_t constant_capacity;
+
+    TraceInstruction *code;
+    uint32_t code_count;
+    uint32_t code_capacity;
+
+    // Exit 0 leaves at the header, for the profiler
+    TraceExit *exits;
+    uint32_t exit_count;
+    uint32_t exit_capacity;
+
+    uint16_t *stacks;
+    uint32_t stack_count;
+    uint32_t stack_capacity;
+} Trace;
+
+typedef struct
+{
+    Trace *trace;
+    Chunk *chunk;
+    CallFrame *frame;
+    uint32_t header;
+
+    // What the trace held before the recording, it is cut back there when the recording fails
+    uint32_t first_register;
+    uint32_t first_entry;
+    uint32_t first_constant;
+    uint32_t first_instruction;
+    uint32_t first_exit;
+    uint32_t first_stack;
+
+    // Values of the registers along the recorded iteration
+    Value registers[TRACE_REGISTER_MAX];
+    bool is_written[TRACE_REGISTER_MAX];
+
+    uint16_t stack[TRACE_STACK_MAX];
+    int stack_count;
+
+    // Back edges other than the header's one, a loop nested in the trace is not followed twice
+    uint32_t loops[TRACE_STACK_MAX];
+    int loop_count;
+
+    bool is_failed;
+} TraceRecorder;
+
+static void *grow(void *array, uint32_t *capacity, size_t size)
+{
+    *capacity = *capacity < 16 ? 16 : *capacity * 2;
+    array = realloc(array, *capacity * size);
+    if (array == NULL)
+    {
+        fprintf(stderr, "Not enough memory to record a trace\n");
+        exit(74);
+    }
+    return array;
+}
+
+// Where the value of an entry lives while the trace does not hold it
+static Value *entry_value(TraceEntry *entry, CallFrame *frame)
+{
+    switch (entry->type)
+    {
+    case ENTRY_LOCAL:
+        return &vm->stack.items[frame->slots + entry->index];
+    case ENTRY_GLOBAL:
+        return &vm->global_values.values[entry->index];
+    case ENTRY_UPVALUE: {
+        ObjectUpValue *upvalue = frame->closure->upvalues[entry->index];
+        return upvalue->p_val == NULL ? &vm->stack.items[upvalue->idx] : upvalue->p_val;
+    }
+    }
+    return NULL;
+}
+
+static void free_trace(Trace *trace)
+{
+    free(trace->entries);
+    free(trace->constants);
+    free(trace->code);
+    free(trace->exits);
+    free(trace->stacks);
+    free(trace);
+}
+
+/* ===== RECORDING ===== */
+
+static uint16_t new_register(TraceRecorder *recorder)
+{
+    Trace *trace = recorder->trace;
+    if (trace->register_count == TRACE_REGISTER_MAX)
+    {
+        recorder->is_failed = true;
+        return 0;
+    }
+    return trace->register_count++;
+}
+
+static bool is_constant(TraceRecorder *recorder, uint16_t reg)
+{
+    Trace *trace = recorder->trace;
+    for (uint32_t i = 0; i < trace->constant_count; ++i)
+    {
+        if (trace->constants[i].reg == reg)
+            return true;
+    }
+    return false;
+}
+
+static bool is_temporary(TraceRecorder *recorder, uint16_t reg)
+{
+    Trace *trace = recorder->trace;
+    for (uint32_t i = 0; i < trace->entry_count; ++i)
+    {
+        if (trace->entries[i].reg == reg)
+            return false;
+    }
+    return !is_constant(recorder, reg);
+}
+
+static uint32_t trace_entry(TraceRecorder *recorder, uint32_t index, EntryType type)
+{
+    Trace *trace = recorder->trace;
+    for (uint32_t i = 0; i < trace->entry_count; ++i)
+    {
+        if (trace->entries[i].index == index && trace->entries[i].type == type)
+            return i;
+    }
+
+    // Not in the trace yet, so nothing holds a newer value than memory
+    TraceEntry entry = {.index = index, .type = type};
+    Value value = *entry_value(&entry, recorder->frame);
+    if (IS_UNDEFINED(value))
+    {
+        recorder->is_failed = true;
+        return 0;
+    }
+
+    if (trace->entry_count == trace->entry_capacity)
+        trace->entries = grow(trace->entries, &trace->entry_capacity, sizeof(TraceEntry));
+
+    uint16_t reg = new_register(recorder);
+    recorder->registers[reg] = value;
+    entry.is_number = IS_NUMBER(value);
+    entry.is_written = false;
+    entry.reg = reg;
+    trace->entries[trace->entry_count] = entry;
+    return trace->entry_count++;
+}
+
+static uint16_t trace_constant(TraceRecorder *recorder, Value value)
+{
+    Trace *trace = recorder->trace;
+    for (uint32_t i = 0; i < trace->constant_count; ++i)
+    {
+        if (memcmp(&trace->constants[i].value, &value, sizeof(Value)) == 0)
+            return trace->constants[i].reg;
+    }
+
+    if (trace->constant_count == trace->constant_capacity)
+        trace->constants = grow(trace->constants, &trace->constant_capacity, sizeof(TraceConstant));
+
+    uint16_t reg = new_register(recorder);
+    recorder->registers[reg] = value;
+    trace->constants[trace->constant_count++] = (TraceConstant){.value = value, .reg = reg};
+    return reg;
+}
+
+static void push_register(TraceRecorder *recorder, uint16_t reg)
+{
+    if (recorder->stack_count == TRACE_STACK_MAX)
+    {
+        recorder->is_failed = true;
+        return;
+    }
+    recorder->stack[recorder->stack_count++] = reg;
+}
+
+static uint16_t pop_register(TraceRecorder *recorder)
+{
+    // Below the header's depth: the loop is left
+    if (recorder->stack_count == 0)
+    {
+        recorder->is_failed = true;
+        return 0;
+    }
+    return recorder->stack[--recorder->stack_count];
+}
+
+// What run_trace computes for `instruction`, for the recorder
+static void evaluate(const TraceInstruction *instruction, Value *registers)
+{
+    Value a = registers[instruction->a];
+    Value b = registers[instruction->b];
+    Value *dst = &registers[instruction->dst];
+
+    switch (instruction->op)
+    {
+    case TRACE_OP_MOVE:
+        *dst = a;
+        break;
+    case TRACE_OP_ADD:
+        *dst = VALUE_NUMBER(AS_NUMBER(a) + AS_NUMBER(b));
+        break;
+    case TRACE_OP_SUBTRACT:
+        *dst = VALUE_NUMBER(AS_NUMBER(a) - AS_NUMBER(b));
+        break;
+    case TRACE_OP_MULTIPLY:
+        *dst = VALUE_NUMBER(AS_NUMBER(a) * AS_NUMBER(b));
+        break;
+    case TRACE_OP_DIVIDE:
+        *dst = VALUE_NUMBER(AS_NUMBER(a) / AS_NUMBER(b));
+        break;
+    case TRACE_OP_NEGATE:
+        *dst = VALUE_NUMBER(AS_NUMBER(a) * -1);
+        break;
+    case TRACE_OP_GREATER:
+        *dst = VALUE_BOOL(AS_NUMBER(a) > AS_NUMBER(b));
+        break;
+    case TRACE_OP_LESS:
+        *dst = VALUE_BOOL(AS_NUMBER(a) < AS_NUMBER(b));
+        break;
+    case TRACE_OP_EQUAL:
+        *dst = VALUE_BOOL(compare(a, b));
+        break;
+    case TRACE_OP_NOT:
+        *dst = VALUE_BOOL(is_falsy(a));
+        break;
+    }
+}
+
+static uint32_t emit(TraceRecorder *recorder, TraceOp op, uint16_t dst, uint16_t a, uint16_t b)
+{
+    Trace *trace = recorder->trace;
+    if (trace->code_count == TRACE_CODE_MAX)
+    {
+        recorder->is_failed = true;
+        return 0;
+    }
+    if (trace->code_count == trace->code_capacity)
+        trace->code = grow(trace->code, &trace->code_capacity, sizeof(TraceInstruction));
+
+    trace->code[trace->code_count] = (TraceInstruction){.op = op, .dst = dst, .a = a, .b = b, .exit = 0};
+    return trace->code_count++;
+}
+
+// Computes `op` of the values on top of the stack into a new register
+static void emit_value(TraceRecorder *recorder, TraceOp op, int operands, bool is_numeric)
+{
+    uint16_t b = operands == 2 ? pop_register(recorder) : 0;
+    uint16_t a = pop_register(recorder);
+    if (recorder->is_failed)
+        return;
+
+    // Anything else takes the generic instruction, which may convert, allocate or fail
+    if (is_numeric && (!IS_NUMBER(recorder->registers[a]) || !IS_NUMBER(recorder->registers[b])))
+    {
+        recorder->is_failed = true;
+        return;
+    }
+
+    uint16_t dst = new_register(recorder);
+    uint32_t at = emit(recorder, op, dst, a, b);
+    if (recorder->is_failed)
+        return;
+    evaluate(&recorder->trace->code[at], recorder->registers);
+    push_register(recorder, dst);
+}
+
+static uint32_t add_exit(TraceRecorder *recorder, uint32_t offset)
+{
+    Trace *trace = recorder->trace;
+    if (trace->exit_count == trace->exit_capacity)
+        trace->exits = grow(trace->exits, &trace->exit_capacity, sizeof(TraceExit));
+
+    while (trace->stack_count + recorder->stack_count > trace->stack_capacity)
+        trace->stacks = grow(trace->stacks, &trace->stack_capacity, sizeof(uint16_t));
+
+    if (recorder->stack_count > 0)
+        memcpy(&trace->stacks[trace->stack_count], recorder->stack, recorder->stack_count * sizeof(uint16_t));
+    trace->exits[trace->exit_count] = (TraceExit){
+        .offset = offset,
+        .stack = trace->stack_count,
+        .stack_count = (uint32_t)recorder->stack_count,
+        .hits = 0,
+        .side = 0,
+    };
+    trace->stack_count += recorder->stack_count;
+    return trace->exit_count++;
+}
+
+// The branch the iteration took on `condition` must be taken again, the other way leaves at `other`
+static void emit_guard(TraceRecorder *recorder, uint16_t condition, uint32_t other)
+{
+    // A constant condition always goes the same way
+    if (is_constant(recorder, condition))
+        return;
+
+    Trace *trace = recorder->trace;
+    bool is_falsy_kept = is_falsy(recorder->registers[condition]);
+    uint32_t exit_index = add_exit(recorder, other);
+    if (exit_index > UINT16_MAX)
+    {
+        recorder->is_failed = true;
+        return;
+    }
+
+    // `i < n` and the jump on it are one instruction
+    uint32_t count = trace->code_count;
+    TraceInstruction *last = count > recorder->first_instruction ? &trace->code[count - 1] : NULL;
+    if (last != NULL && last->dst == condition && (last->op == TRACE_OP_LESS || last->op == TRACE_OP_GREATER))
+    {
+        if (last->op == TRACE_OP_LESS)
+            last->op = is_falsy_kept ? TRACE_OP_GUARD_NOT_LESS : TRACE_OP_GUARD_LESS;
+        else
+            last->op = is_falsy_kept ? TRACE_OP_GUARD_NOT_GREATER : TRACE_OP_GUARD_GREATER;
+        last->exit = (uint16_t)exit_index;
+        return;
+    }
+
+    uint32_t at = emit(recorder, is_falsy_kept ? TRACE_OP_GUARD_FALSY : TRACE_OP_GUARD_TRUTHY, 0, condition, 0);
+    if (!recorder->is_failed)
+        trace->code[at].exit = (uint16_t)exit_index;
+}
+
+// The stack still refers to the value `reg` held before this write, it keeps it in a copy
+static void preserve_register(TraceRecorder *recorder, uint16_t reg)
+{
+    uint16_t copy = 0;
+    bool is_copied = false;
+    for (int i = 0; i < recorder->stack_count; ++i)
+    {
+        if (recorder->stack[i] != reg)
+            continue;
+
+        if (!is_copied)
+        {
+            copy = new_register(recorder);
+            emit(recorder, TRACE_OP_MOVE, copy, reg, 0);
+            recorder->registers[copy] = recorder->registers[reg];
+            is_copied = true;
+        }
+        recorder->stack[i] = copy;
+    }
+}
+
+// Assignment to an entry, the value stays on the stack
+static void write_entry(TraceRecorder *recorder, uint32_t entry)
+{
+    if (recorder->is_failed || recorder->stack_count == 0)
+    {
+        recorder->is_failed = true;
+        return;
+    }
+
+    Trace *trace = recorder->trace;
+    uint16_t reg = trace->entries[entry].reg;
+    uint16_t value = recorder->stack[recorder->stack_count - 1];
+    uint32_t last = trace->code_count - 1;
+
+    bool is_shared = false;
+    for (int i = 0; i < recorder->stack_count - 1; ++i)
+        is_shared |= recorder->stack[i] == value || recorder->stack[i] == reg;
+
+    // `x = x + 1` computes straight into the entry instead of through a temporary
+    if (!is_shared && trace->code_count > recorder->first_instruction && trace->code[last].dst == value &&
+        trace->code[last].op < TRACE_OP_GUARD_TRUTHY && is_temporary(recorder, value))
+    {
+        trace->code[last].dst = reg;
+    }
+    else
+    {
+        preserve_register(recorder, reg);
+        emit(recorder, TRACE_OP_MOVE, reg, value, 0);
+    }
+
+    recorder->registers[reg] = recorder->registers[value];
+    recorder->is_written[entry] = true;
+    recorder->stack[recorder->stack_count - 1] = reg;
+}
+
+// The recorded path came back to the header
+static bool close_loop(TraceRecorder *recorder)
+{
+    Trace *trace = recorder->trace;
+    if (recorder->stack_count != 0)
+        return false;
+
+    for (uint32_t i = 0; i < trace->entry_count; ++i)
+    {
+        TraceEntry *entry = &trace->entries[i];
+        if (IS_NUMBER(recorder->registers[entry->reg]) != entry->is_number)
+            return false;
+    }
+
+    emit(recorder, TRACE_OP_LOOP, 0, 0, 0);
+    return !recorder->is_failed;
+}
+
+/*
+ * Follows the bytecode from `offset` with the stack in the recorder, as
+ * run() would with the values of the registers, until it comes back to the
+ * header. False for an instruction traces do not hold.
+ * */
+static bool record_path(TraceRecorder *recorder, uint32_t offset)
+{
+    Chunk *chunk = recorder->chunk;
+    Trace *trace = recorder->trace;
+
+    for (int length = 0; length < TRACE_LENGTH_MAX && !recorder->is_failed; ++length)
+    {
+        uint8_t *ip = &chunk->code[offset];
+        uint32_t next = offset + instruction_length(chunk, offset);
+        uint32_t at = offset + 1;
+
+        switch (generic_opcode(*ip))
+        {
+        case OP_CONSTANT_LONG:
+            push_register(recorder, trace_constant(recorder, chunk->constants.values[READ4BYTE(at)]));
+            break;
+        case OP_TRUE:
+            push_register(recorder, trace_constant(recorder, VALUE_BOOL(true)));
+            break;
+        case OP_FALSE:
+            push_register(recorder, trace_constant(recorder, VALUE_BOOL(false)));
+            break;
+        case OP_NIL:
+            push_register(recorder, trace_constant(recorder, VALUE_NIL));
+            break;
+
+        case OP_GET_LOCAL: {
+            uint32_t idx = READ4BYTE(at);
+            if (idx < (uint32_t)trace->depth)
+            {
+                uint32_t entry = trace_entry(recorder, idx, ENTRY_LOCAL);
+                push_register(recorder, recorder->is_failed ? 0 : trace->entries[entry].reg);
+            }
+            else if (idx - trace->depth < (uint32_t)recorder->stack_count)
+            {
+                // A local of the loop body lives on the stack
+                push_register(recorder, recorder->stack[idx - trace->depth]);
+            }
+            else
+            {
+                recorder->is_failed = true;
+            }
+            break;
+        }
+        case OP_SET_LOCAL: {
+            uint32_t idx = READ4BYTE(at);
+            if (idx < (uint32_t)trace->depth)
+                write_entry(recorder, trace_entry(recorder, idx, ENTRY_LOCAL));
+            else if (idx - trace->depth < (uint32_t)recorder->stack_count)
+                recorder->stack[idx - trace->depth] = recorder->stack[recorder->stack_count - 1];
+            else
+                recorder->is_failed = true;
+            break;
+        }
+        case OP_GET_GLOBAL: {
+            uint32_t entry = trace_entry(recorder, READ4BYTE(at), ENTRY_GLOBAL);
+            push_register(recorder, recorder->is_failed ? 0 : trace->entries[entry].reg);
+            break;
+        }
+        case OP_SET_GLOBAL:
+            write_entry(recorder, trace_entry(recorder, READ4BYTE(at), ENTRY_GLOBAL));
+            break;
+        case OP_GET_UPVALUE: {
+            uint32_t entry = trace_entry(recorder, READ4BYTE(at), ENTRY_UPVALUE);
+            push_register(recorder, recorder->is_failed ? 0 : trace->entries[entry].reg);
+            break;
+        }
+        case OP_SET_UPVALUE:
+            write_entry(recorder, trace_entry(recorder, READ4BYTE(at), ENTRY_UPVALUE));
+            break;
+
+        case OP_ADD:
+            emit_value(recorder, TRACE_OP_ADD, 2, true);
+            break;
+        case OP_SUBTRACT:
+            emit_value(recorder, TRACE_OP_SUBTRACT, 2, true);
+            break;
+        case OP_MULTIPLY:
+            emit_value(recorder, TRACE_OP_MULTIPLY, 2, true);
+            break;
+        case OP_DIVIDE:
+            emit_value(recorder, TRACE_OP_DIVIDE, 2, true);
+            break;
+        case OP_NEGATE:
+            emit_value(recorder, TRACE_OP_NEGATE, 1, true);
+            break;
+        case OP_GREATER:
+            emit_value(recorder, TRACE_OP_GREATER, 2, true);
+            break;
+        case OP_LESS:
+            emit_value(recorder, TRACE_OP_LESS, 2, true);
+            break;
+        case OP_EQUAL_EQUAL:
+            emit_value(recorder, TRACE_OP_EQUAL, 2, false);
+            break;
+        case OP_BANG:
+            emit_value(recorder, TRACE_OP_NOT, 1, false);
+            break;
+
+        case OP_POP:
+            pop_register(recorder);
+            break;
+        case OP_MARK_JUMP:
+            break;
+        case OP_JUMP:
+            next += (uint16_t)(ip[1] << 8 | ip[2]);
+            break;
+        case OP_JUMP_IF_FALSE:
+        case OP_JUMP_IF_TRUE: {
+            if (recorder->stack_count == 0)
+                return false;
+
+            uint16_t condition = recorder->stack[recorder->stack_count - 1];
+            uint32_t target = next + (uint16_t)(ip[1] << 8 | ip[2]);
+            bool is_taken = is_falsy(recorder->registers[condition]) == (*ip == OP_JUMP_IF_FALSE);
+            emit_guard(recorder, condition, is_taken ? next : target);
+            if (is_taken)
+                next = target;
+            break;
+        }
+        case OP_LOOP: {
+            uint32_t target = next - (uint16_t)(ip[1] << 8 | ip[2]);
+            if (target == recorder->header)
+                return close_loop(recorder);
+
+            // The other back edge of a `ulang` (increment to condition) is taken once, an inner loop is not
+            for (int i = 0; i < recorder->loop_count; ++i)
+            {
+                if (recorder->loops[i] == offset)
+                    return false;
+            }
+            if (recorder->loop_count == TRACE_STACK_MAX)
+                return false;
+            recorder->loops[recorder->loop_count++] = offset;
+            next = target;
+            break;
+        }
+
+        default:
+            return false;
+        }
+
+        offset = next;
+    }
+    return false;
+}
+
+static void init_recorder(TraceRecorder *recorder, Trace *trace, CallFrame *frame, uint32_t header)
+{
+    recorder->trace = trace;
+    recorder->chunk = &frame->closure->function->chunk;
+    recorder->frame = frame;
+    recorder->header = header;
+
+    recorder->first_register = trace->register_count;
+    recorder->first_entry = trace->entry_count;
+    recorder->first_constant = trace->constant_count;
+    recorder->first_instruction = trace->code_count;
+    recorder->first_exit = trace->exit_count;
+    recorder->first_stack = trace->stack_count;
+
+    memset(recorder->is_written, 0, sizeof(recorder->is_written));
+    recorder->stack_count = 0;
+    recorder->loop_count = 0;
+    recorder->is_failed = false;
+}
+
+// Keeps what the recording added when it succeeded, drops it otherwise
+static bool finish_recording(TraceRecorder *recorder, bool is_recorded)
+{
+    Trace *trace = recorder->trace;
+    if (!is_recorded || recorder->is_failed)
+    {
+        trace->register_count = recorder->first_register;
+        trace->entry_count = recorder->first_entry;
+        trace->constant_count = recorder->first_constant;
+        trace->code_count = recorder->first_instruction;
+        trace->exit_count = recorder->first_exit;
+        trace->stack_count = recorder->first_stack;
+        return false;
+    }
+
+    for (uint32_t i = 0; i < trace->entry_count; ++i)
+        trace->entries[i].is_written |= recorder->is_written[i];
+    return true;
+}
+
+static Trace *record_trace(CallFrame *frame, uint32_t header)
+{
+    Trace *trace = calloc(1, sizeof(Trace));
+    if (trace == NULL)
+        return NULL;
+    trace->depth = vm->stack_top - frame->slots;
+
+    TraceRecorder *recorder = malloc(sizeof(TraceRecorder));
+    if (recorder == NULL)
+    {
+        free(trace);
+        return NULL;
+    }
+
+    init_recorder(recorder, trace, frame, header);
+    add_exit(recorder, header);
+    bool is_recorded = finish_recording(recorder, record_path(recorder, header));
+    free(recorder);
+
+    if (!is_recorded)
+    {
+        free_trace(trace);
+        return NULL;
+    }
+    return trace;
+}
+
+/*
+ * Records the path from a hot exit, with the values the trace has there,
+ * and has the guards leaving there go on with it. `registers` gets the entries and
+ * constants the path added.
+ * */
+static bool extend_trace(Trace *trace, CallFrame *frame, uint32_t header, uint32_t exit_index, Value *registers)
+{
+    TraceRecorder *recorder = malloc(sizeof(TraceRecorder));
+    if (recorder == NULL)
+        return false;
+
+    TraceExit side = trace->exits[exit_index];
+    init_recorder(recorder, trace, frame, header);
+    memcpy(recorder->registers, registers, trace->register_count * sizeof(Value));
+    if (side.stack_count > 0)
+        memcpy(recorder->stack, &trace->stacks[side.stack], side.stack_count * sizeof(uint16_t));
+    recorder->stack_count = (int)side.stack_count;
+
+    uint32_t start = trace->code_count;
+    bool is_recorded = finish_recording(recorder, record_path(recorder, side.offset));
+    if (is_recorded)
+    {
+        // The recorder's registers are past the path already, memory still has the values at the exit
+        for (uint32_t i = recorder->first_entry; i < trace->entry_count; ++i)
+        {
+            TraceEntry *entry = &trace->entries[i];
+            registers[entry->reg] = *entry_value(entry, frame);
+        }
+        for (uint32_t i = recorder->first_constant; i < trace->constant_count; ++i)
+            registers[trace->constants[i].reg] = trace->constants[i].value;
+        trace->exits[exit_index].side = start;
+    }
+
+    free(recorder);
+    return is_recorded;
+}
+
+/* ===== EXECUTION ===== */
+
+static void leave_trace(Trace *trace, CallFrame *frame, uint32_t exit_index, Value *registers)
+{
+    for (uint32_t i = 0; i < trace->entry_count; ++i)
+    {
+        TraceEntry *entry = &trace->entries[i];
+        if (entry->is_written)
+            *entry_value(entry, frame) = registers[entry->reg];
+    }
+
+    TraceExit *leave = &trace->exits[exit_index];
+    reserve_stack(vm->stack_top + (int)leave->stack_count);
+    for (uint32_t i = 0; i < leave->stack_count; ++i)
+        vm->stack.items[vm->stack_top++] = registers[trace->stacks[leave->stack + i]];
+
+    frame->ip = frame->closure->function->chunk.code + leave->offset;
+}
+
+/*
+ * A guard failed: goes on with the path recorded from there, recording it
+ * when the exit got hot, or leaves the trace and returns NULL.
+ * */
+static TraceInstruction *take_exit(Trace *trace, CallFrame *frame, uint32_t header, uint32_t exit_index,
+                                   Value *registers)
+{
+    TraceExit *leave = &trace->exits[exit_index];
+    if (leave->side == 0 && leave->hits <= TRACE_EXIT_THRESHOLD && ++leave->hits == TRACE_EXIT_THRESHOLD)
+        extend_trace(trace, frame, header, exit_index, registers);
+
+    // Recording may have moved the exits and the code
+    leave = &trace->exits[exit_index];
+    if (leave->side != 0)
+        return &trace->code[leave->side];
+
+    leave_trace(trace, frame, exit_index, registers);
+    return NULL;
+}
+
+// False when the values at the header are not of the kinds the trace was recorded with
+static bool run_trace(Trace *trace, CallFrame *frame, uint32_t header)
+{
+    if (vm->stack_top - frame->slots != trace->depth)
+        return false;
+
+    Value registers[TRACE_REGISTER_MAX];
+    for (uint32_t i = 0; i < trace->entry_count; ++i)
+    {
+        TraceEntry *entry = &trace->entries[i];
+        Value value = *entry_value(entry, frame);
+        if (IS_NUMBER(value) != entry->is_number || IS_UNDEFINED(value))
+            return false;
+        registers[entry->reg] = value;
+    }
+    for (uint32_t i = 0; i < trace->constant_count; ++i)
+        registers[trace->constants[i].reg] = trace->constants[i].value;
+
+    TraceInstruction *next = trace->code;
+    for (;;)
+    {
+        TraceInstruction *instruction = next++;
+        Value *dst = &registers[instruction->dst];
+        Value a = registers[instruction->a];
+        Value b = registers[instruction->b];
+
+        switch (instruction->op)
+        {
+        case TRACE_OP_MOVE:
+            *dst = a;
+            break;
+        case TRACE_OP_ADD:
+            *dst = VALUE_NUMBER(AS_NUMBER(a) + AS_NUMBER(b));
+            break;
+        case TRACE_OP_SUBTRACT:
+            *dst = VALUE_NUMBER(AS_NUMBER(a) - AS_NUMBER(b));
+            break;
+        case TRACE_OP_MULTIPLY:
+            *dst = VALUE_NUMBER(AS_NUMBER(a) * AS_NUMBER(b));
+            break;
+        case TRACE_OP_DIVIDE:
+            *dst = VALUE_NUMBER(AS_NUMBER(a) / AS_NUMBER(b));
+            break;
+        case TRACE_OP_NEGATE:
+            *dst = VALUE_NUMBER(AS_NUMBER(a) * -1);
+            break;
+        case TRACE_OP_GREATER:
+            *dst = VALUE_BOOL(AS_NUMBER(a) > AS_NUMBER(b));
+            break;
+        case TRACE_OP_LESS:
+            *dst = VALUE_BOOL(AS_NUMBER(a) < AS_NUMBER(b));
+            break;
+        case TRACE_OP_EQUAL:
+            *dst = VALUE_BOOL(compare(a, b));
+            break;
+        case TRACE_OP_NOT:
+            *dst = VALUE_BOOL(is_falsy(a));
+            break;
+
+        case TRACE_OP_GUARD_TRUTHY:
+            if (is_falsy(a) && (next = take_exit(trace, frame, header, instruction->exit, registers)) == NULL)
+                return true;
+            break;
+        case TRACE_OP_GUARD_FALSY:
+            if (!is_falsy(a) && (next = take_exit(trace, frame, header, instruction->exit, registers)) == NULL)
+                return true;
+            break;
+        case TRACE_OP_GUARD_LESS:
+        case TRACE_OP_GUARD_NOT_LESS: {
+            bool is_less = AS_NUMBER(a) < AS_NUMBER(b);
+            *dst = VALUE_BOOL(is_less);
+            if (is_less != (instruction->op == TRACE_OP_GUARD_LESS) &&
+                (next = take_exit(trace, frame, header, instruction->exit, registers)) == NULL)
+                return true;
+            break;
+        }
+        case TRACE_OP_GUARD_GREATER:
+        case TRACE_OP_GUARD_NOT_GREATER: {
+            bool is_greater = AS_NUMBER(a) > AS_NUMBER(b);
+            *dst = VALUE_BOOL(is_greater);
+            if (is_greater != (instruction->op == TRACE_OP_GUARD_GREATER) &&
+                (next = take_exit(trace, frame, header, instruction->exit, registers)) == NULL)
+                return true;
+            break;
+        }
+
+        case TRACE_OP_LOOP:
+            // run() takes the sample at the back edge and comes back
+            if (profile_pending)
+            {
+                leave_trace(trace, frame, 0, registers);
+                return true;
+            }
+            next = trace->code;
+            break;
+        }
+    }
+}
+
+/* ===== INTERFACE ===== */
+
+void init_trace()
+{
+    const char *setting = getenv("CWS_TRACE");
+    if (setting != NULL && setting[0] != '\0')
+        trace_threshold = (uint32_t)strtoul(setting, NULL, 10);
+}
+
+bool enter_trace(CallFrame *frame)
+{
+    ObjectFunction *function = frame->closure->function;
+    if (trace_threshold == 0)
+        return false;
+#ifdef HAS_JIT
+    // The JIT gets the function first, traces take the loops of the ones it refused
+    if (jit_threshold != 0 && function->hotness < jit_threshold)
+        return false;
+#endif
+
+    uint32_t header = frame->ip - function->chunk.code;
+    TraceSite *site = function->traces;
+    while (site != NULL && site->header != header)
+        site = site->next;
+
+    if (site == NULL)
+    {
+        site = malloc(sizeof(TraceSite));
+        if (site == NULL)
+            return false;
+        *site = (TraceSite){.header = header, .next = function->traces};
+        function->traces = site;
+    }
+
+    if (site->trace == NULL)
+    {
+        if (site->failures == TRACE_ATTEMPTS || ++site->hotness < trace_threshold << site->failures)
+            return false;
+
+        site->hotness = 0;
+        site->trace = record_trace(frame, header);
+        if (site->trace == NULL)
+        {
+            site->failures++;
+            return false;
+        }
+    }
+
+    if (run_trace(site->trace, frame, header))
+        return true;
+
+    // The kinds at the header changed since the recording, record them again
+    free_trace(site->trace);
+    site->trace = NULL;
+    site->failures++;
+    return false;
+}
+
+void free_traces(ObjectFunction *function)
+{
+    TraceSite *site = function->traces;
+    while (site != NULL)
+    {
+        TraceSite *next = site->next;
+        if (site->trace != NULL)
+            free_trace(site->trace);
+        free(site);
+        site = next;
+    }
+    function->traces = NULL;
+}
+
+#else
+
+void init_trace()
+{
+    trace_threshold = 0;
+}
+
+bool enter_trace(CallFrame *frame)
+{
+    (void)frame;
+    return false;
+}
+
+void free_traces(ObjectFunction *function)
+{
+    function->traces = NULL;
+}
+
+#endif
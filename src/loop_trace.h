@@ -0,0 +1,44 @@
+#ifndef CWS_LOOP_TRACE_H
+#define CWS_LOOP_TRACE_H
+
+#include "vm.h"
+
+/*
+ * TRACES OF HOT LOOPS (`CWS_TRACE=0` turns them off)
+ *
+ * Every loop header counts the back edges jumping to it. Once a header is
+ * hot, the recorder follows one iteration from it, computing the values as
+ * run() would, and writes the instructions it passed through into a linear
+ * trace: variables and constants become registers, the stack disappears,
+ * the branches it took become guards and the loop back edge a jump to the
+ * start. The types the iteration saw are checked once when entering the
+ * trace, not at every instruction: whatever the trace writes keeps the
+ * type it was entered with, so the arithmetic inside needs no checks.
+ *
+ * A failing guard leaves the trace: the registers holding variables are
+ * written back, the stack the interpreter expects there is pushed and
+ * run() carries on at that instruction. A guard failing often gets its own
+ * path recorded from there and appended to the trace.
+ *
+ * Traces only hold number arithmetic, comparisons, branches and moves
+ * between variables; a loop calling or allocating is not traced.
+ * Functions the JIT (jit.h) compiles run its code instead, traces run the
+ * loops it does not: without the JIT and in functions it refused.
+ * `CWS_TRACE=<n>` sets the number of back edges making a header hot.
+ * */
+#if !defined(DEBUG_OPCODE_STATS) && !defined(DEBUG_TRACE_EXECUTION)
+#define HAS_TRACE
+#endif
+
+#define TRACE_THRESHOLD 56
+
+typedef struct TraceSite TraceSite;
+
+extern uint32_t trace_threshold;
+
+void init_trace();
+// Counts a back edge to frame->ip and runs the trace there, true when it ran and moved frame->ip
+bool enter_trace(CallFrame *frame);
+void free_traces(ObjectFunction *function);
+
+#endif // !CWS_LOOP_TRACE_H
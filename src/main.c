@@ -1,10 +1,19 @@
+#include "alloc_profiler.h"
+#include "bytecode.h"
+#include "heap_dump.h"
+#include "profiler.h"
+#include "snapshot.h"
+#include "tracer.h"
 #include "vm.h"
 
+#include <sys/stat.h>
+
 #ifdef __EMSCRIPTEN__
 #include <emscripten/emscripten.h>
 #endif
 
-int IS_IN_REPL = 0;
+// Scripts at least this large run while they are read, unless a bytecode cache exists
+#define STREAM_MIN_SIZE (1024 * 1024)
 
 void rep()
 {
@@ -21,7 +30,7 @@ void rep()
         if (line[0] == '\n')
             break;
 
-        interpret(line);
+        interpret(vm, line);
     }
 }
 
@@ -57,10 +66,51 @@ char *read_file(const char *file_path)
     return buff;
 }
 
+void stream_file(const char *file_path)
+{
+    SourceStream stream;
+    if (!open_source(&stream, file_path))
+    {
+        fprintf(stderr, "Cannot open the file\n");
+        exit(60);
+    }
+
+    InterpretResult result = interpret_stream(vm, &stream);
+    close_source(&stream);
+
+    if (result == INTERPRET_RUNTIME_ERROR)
+        exit(65);
+    if (result == INTERPRET_COMPILE_ERROR)
+        exit(70);
+}
+
+static bool should_stream(const char *file_path)
+{
+    struct stat st;
+    if (stat(file_path, &st) != 0 || st.st_size < STREAM_MIN_SIZE)
+        return false;
+
+    char path[BYTECODE_PATH_MAX];
+    return !bytecode_path(file_path, path, sizeof(path)) || stat(path, &st) != 0;
+}
+
 void run_file(const char *file_path)
 {
+    if (should_stream(file_path))
+    {
+        stream_file(file_path);
+        return;
+    }
+
     char *source = read_file(file_path);
-    InterpretResult result = interpret(source);
+
+    // A valid cache from `cws --compile` skips scanning and parsing entirely
+    InterpretResult result;
+    ObjectFunction *function = load_bytecode(file_path, source, strlen(source));
+    if (function != NULL)
+        result = interpret_function(vm, function);
+    else
+        result = interpret(vm, source);
     free(source);
 
     if (result == INTERPRET_RUNTIME_ERROR)
@@ -69,35 +119,195 @@ void run_file(const char *file_path)
         exit(70);
 }
 
+void compile_file(const char *file_path)
+{
+    char *source = read_file(file_path);
+    ObjectFunction *function = compile(source);
+    if (function == NULL)
+    {
+        free(source);
+        exit(70);
+    }
+
+    push(VALUE_OBJ(function));
+    bool is_dumped = dump_bytecode(function, file_path, source, strlen(source));
+    pop();
+    free(source);
+
+    if (!is_dumped)
+    {
+        fprintf(stderr, "Failed to write the bytecode cache\n");
+        exit(74);
+    }
+}
+
+void snapshot_file(const char *file_path)
+{
+    char path[BYTECODE_PATH_MAX];
+    if (!snapshot_path(file_path, path, sizeof(path)))
+    {
+        fprintf(stderr, "Path is too long\n");
+        exit(74);
+    }
+
+    char *source = read_file(file_path);
+    ObjectFunction *function = compile_library(source);
+    free(source);
+    if (function == NULL)
+        exit(70);
+
+    if (interpret_function(vm, function) != INTERPRET_OK)
+        exit(65);
+
+    if (!dump_snapshot(path))
+    {
+        fprintf(stderr, "Failed to write the heap snapshot\n");
+        exit(74);
+    }
+}
+
+static const char *profile_path = NULL;
+
+/* Also runs from exit() when the script fails, the profile of a crash is worth keeping */
+static void finish_profile()
+{
+    if (profile_path == NULL)
+        return;
+
+    stop_profiler();
+    if (!write_profile(profile_path))
+        fprintf(stderr, "Failed to write the profile\n");
+    profile_path = NULL;
+}
+
+static void finish_trace()
+{
+    if (is_tracing && !stop_tracer())
+        fprintf(stderr, "Failed to write the trace\n");
+}
+
+static void finish_alloc_profile()
+{
+    if (is_alloc_profiling && !stop_alloc_profiler())
+        fprintf(stderr, "Failed to write the allocation profile\n");
+}
+
+static const char *heap_dump_path = NULL;
+
+static void finish_heap_dump()
+{
+    if (heap_dump_path == NULL)
+        return;
+
+    if (!write_heap_dump(heap_dump_path))
+        fprintf(stderr, "Failed to write the heap dump\n");
+    heap_dump_path = NULL;
+}
+
 #ifdef __EMSCRIPTEN__
 #define EXTERN
 EXTERN EMSCRIPTEN_KEEPALIVE void RUN_SOURCE(const char *source)
 {
-    init_vm();
-    interpret(source);
-    free_vm();
+    VM *instance = new_vm();
+    interpret(instance, source);
+    free_vm(instance);
 }
 
 #else
 int main(int argc, char **args)
 {
-    init_vm();
+    VM *instance = new_vm();
+    use_vm(instance);
 
     // if (argc == 1)
     // {
     //     rep();
     // }
-    if (argc == 2)
+    // Options taking a value come first, the command and the script last
+    int arg = 1;
+    for (; argc - arg > 2; arg += 2)
+    {
+        if (strcmp(args[arg], "--image") == 0)
+        {
+            if (!load_snapshot(args[arg + 1]))
+            {
+                fprintf(stderr, "Failed to load the heap snapshot '%s': missing or invalid snapshot\n", args[arg + 1]);
+                return 74;
+            }
+        }
+        else if (strcmp(args[arg], "--profile") == 0)
+        {
+            profile_path = args[arg + 1];
+        }
+        else if (strcmp(args[arg], "--trace") == 0)
+        {
+            if (!start_tracer(args[arg + 1]))
+            {
+                fprintf(stderr, "Cannot open the trace file\n");
+                return 74;
+            }
+            atexit(finish_trace);
+        }
+        else if (strcmp(args[arg], "--alloc-profile") == 0)
+        {
+            if (!start_alloc_profiler(args[arg + 1]))
+            {
+                fprintf(stderr, "Cannot open the allocation profile file\n");
+                return 74;
+            }
+            atexit(finish_alloc_profile);
+        }
+        else if (strcmp(args[arg], "--heap-dump-on-exit") == 0)
+        {
+            heap_dump_path = args[arg + 1];
+            atexit(finish_heap_dump);
+        }
+        else
+        {
+            break;
+        }
+    }
+
+    if (profile_path != NULL)
+    {
+        if (!start_profiler(args[argc - 1]))
+        {
+            fprintf(stderr, "Failed to start the profiler\n");
+            return 74;
+        }
+        atexit(finish_profile);
+    }
+
+    if (argc - arg == 1)
+    {
+        run_file(args[arg]);
+    }
+    else if (argc - arg == 2 && strcmp(args[arg], "--compile") == 0)
+    {
+        compile_file(args[arg + 1]);
+    }
+    else if (argc - arg == 2 && strcmp(args[arg], "--snapshot") == 0)
+    {
+        snapshot_file(args[arg + 1]);
+    }
+    else if (argc - arg == 2 && strcmp(args[arg], "--stream") == 0)
     {
-        run_file(args[1]);
+        stream_file(args[arg + 1]);
     }
     else
     {
-        printf("Usage : cws ./my-program.cws\n");
+        printf("Usage : cws [--image ./library.cwsi] [--profile ./out.folded | ./out.pb] [--trace ./out.json] "
+               "[--alloc-profile ./out.txt | ./out.json] "
+               "[--heap-dump-on-exit ./out.cwsd] [--compile | --snapshot | --stream] ./my-program.cws\n");
         return 64;
     }
 
-    free_vm();
+    // Before the VM goes away, the recorded stacks point into its heap
+    finish_profile();
+    finish_trace();
+    finish_alloc_profile();
+    finish_heap_dump();
+    free_vm(instance);
 
     return 0;
 }
@@ -20,11 +20,12 @@
 // WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN THE SOFTWARE.
 
 #include "memory.h"
+#include "alloc_profiler.h"
 #include "object.h"
+#include "profiler.h"
+#include "tracer.h"
 #include "vm.h"
 
-extern VM vm;
-
 void mark_obj(Obj *obj)
 {
     if (obj == NULL)
@@ -41,20 +42,20 @@ void mark_obj(Obj *obj)
 
     obj->is_marked = true;
 
-    if (vm.grey_cap < vm.grey_count + 1)
+    if (vm->grey_cap < vm->grey_count + 1)
     {
-        int old_cap = vm.grey_cap;
-        vm.grey_cap = GROW_CAPACITY(old_cap);
-        size_t s = vm.grey_cap * sizeof(Obj *);
-        vm.grey_stack = (Obj **)(realloc(vm.grey_stack, s));
+        int old_cap = vm->grey_cap;
+        vm->grey_cap = GROW_CAPACITY(old_cap);
+        size_t s = vm->grey_cap * sizeof(Obj *);
+        vm->grey_stack = (Obj **)(realloc(vm->grey_stack, s));
     }
 
-    if (vm.grey_stack == NULL)
+    if (vm->grey_stack == NULL)
     {
         exit(1);
     }
 
-    vm.grey_stack[vm.grey_count++] = obj;
+    vm->grey_stack[vm->grey_count++] = obj;
 }
 
 void mark_value(Value val)
@@ -76,29 +77,38 @@ static void mark_table(Map *table)
     }
 }
 
+static void mark_array(Value *val, int count);
+
 static void mark_roots()
 {
-    for (int i = 0; i < vm.stack_top; ++i)
+    for (int i = 0; i < vm->stack_top; ++i)
     {
-        mark_value(vm.stack->items[i]);
+        mark_value(vm->stack.items[i]);
     }
 
-    mark_table(&vm.globals);
+    mark_table(&vm->globals);
+    mark_array(vm->global_values.values, vm->global_values.count);
+    mark_array(vm->global_names.values, vm->global_names.count);
+    mark_table(&vm->string_methods);
+    mark_table(&vm->worker_methods);
+    mark_array(vm->refs.values, vm->refs.count);
 
-    ObjectUpValue *upvalue = vm.upvalues;
+    ObjectUpValue *upvalue = vm->upvalues;
     while (upvalue != NULL)
     {
         mark_obj((Obj *)upvalue);
         upvalue = upvalue->next;
     }
 
-    for (int i = 0; i < vm.frame_count; ++i)
+    for (int i = 0; i < vm->frame_count; ++i)
     {
-        CallFrame frame = vm.frame[i];
+        CallFrame frame = vm->frame[i];
         mark_obj((Obj *)frame.closure);
     }
 
-    mark_compiler();
+    mark_profile();
+    mark_tracer();
+    mark_alloc_profile();
 }
 
 static void mark_array(Value *val, int count)
@@ -109,11 +119,12 @@ static void mark_array(Value *val, int count)
     }
 }
 
+/* collect_refs() in heap_dump.c follows the same references, keep the two in step */
 static void mark_references()
 {
-    while (vm.grey_count > 0)
+    while (vm->grey_count > 0)
     {
-        Obj *obj = vm.grey_stack[--vm.grey_count];
+        Obj *obj = vm->grey_stack[--vm->grey_count];
 
 #ifdef DEBUG_GC
         printf("%p blacken :  %d ", obj, obj->is_marked);
@@ -126,7 +137,7 @@ static void mark_references()
         case OBJ_FUNCTION: {
             ObjectFunction *function = (ObjectFunction *)obj;
             mark_obj((Obj *)function->name);
-            mark_array(function->chunk.constantsLong->values, function->chunk.constantsLong->count);
+            mark_array(function->chunk.constants.values, function->chunk.constants.count);
             break;
         }
 
@@ -134,6 +145,11 @@ static void mark_references()
             break;
         }
 
+        case OBJ_STRING_VIEW: {
+            mark_obj((Obj *)((ObjectStringView *)obj)->parent);
+            break;
+        }
+
         case OBJ_CLOSURE: {
             ObjectClosure *closure = (ObjectClosure *)obj;
             mark_obj((Obj *)closure->function);
@@ -149,7 +165,8 @@ static void mark_references()
             break;
         }
 
-        case OBJ_NATIVE: {
+        case OBJ_NATIVE:
+        case OBJ_WORKER: {
             break;
         }
 
@@ -175,6 +192,7 @@ static void mark_references()
 
         case OBJ_TABLE: {
             ObjectTable *table = (ObjectTable *)obj;
+            mark_array(table->array, table->array_cap);
             mark_table(&table->values);
             break;
         }
@@ -216,7 +234,7 @@ void sweep_strings(Map *strings)
 static void sweep()
 {
     Obj *prev = NULL;
-    Obj *curr = vm.objects;
+    Obj *curr = vm->objects;
 
     while (curr != NULL)
     {
@@ -226,7 +244,7 @@ static void sweep()
             curr = curr->next;
             if (prev == NULL)
             {
-                vm.objects = curr;
+                vm->objects = curr;
             }
             else
             {
@@ -247,29 +265,36 @@ void collect_garbage()
 {
 #ifdef DEBUG_GC
     printf("--gc begin\n");
-    size_t before = vm.current_bytes;
+    size_t before = vm->current_bytes;
 #endif
 
 #ifdef ENABLE_GC
+    size_t heap_before = vm->current_bytes;
+
     mark_roots();
     mark_references();
-    mark_obj((Obj *)vm.init_string);
+    mark_obj((Obj *)vm->init_string);
 
-    sweep_strings(&vm.strings);
+    sweep_strings(&vm->strings);
     sweep();
 
-    vm.next_gc = vm.current_bytes * GC_GROW_FACTOR;
+    vm->next_gc = vm->current_bytes * GC_GROW_FACTOR;
+
+    if (is_alloc_profiling)
+        profile_collection(heap_before);
 #endif
 
 #ifdef DEBUG_GC
     printf("--gc end\n");
-    printf("Collected : %zu, before : %zu, after : %zu\n", before - vm.current_bytes, before, vm.current_bytes);
+    printf("Collected : %zu, before : %zu, after : %zu\n", before - vm->current_bytes, before, vm->current_bytes);
 #endif
 }
 
 void *reallocate(void *array, int oldSize, int newSize)
 {
-    vm.current_bytes += newSize - oldSize;
+    vm->current_bytes += newSize - oldSize;
+    if (newSize > oldSize)
+        vm->allocated_bytes += newSize - oldSize;
 
     if (newSize == 0)
     {
@@ -277,10 +302,12 @@ void *reallocate(void *array, int oldSize, int newSize)
         return NULL;
     }
 
+    // Paused while compiling, see compile_script
 #ifdef TEST_STRESS_GC
-    collect_garbage();
+    if (vm->gc_paused == 0)
+        collect_garbage();
 #else
-    if (vm.current_bytes > vm.next_gc)
+    if (vm->gc_paused == 0 && vm->current_bytes > vm->next_gc)
     {
         collect_garbage();
     }
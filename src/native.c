@@ -1,4 +1,9 @@
+#define _GNU_SOURCE
 #include "native.h"
+#include "heap_dump.h"
+#include "number.h"
+#include <limits.h>
+#include <math.h>
 #include <time.h>
 
 /*
@@ -8,9 +13,9 @@
  * Then we can get the args by shifting the index manually
  *
  * Example : 
- * Value first_arg = vm.stack->items[stack_ptr + 0];
- * Value second_arg = vm.stack->items[stack_ptr + 1];
- * Value third_arg = vm.stack->items[stack_ptr + 2];
+ * Value first_arg = vm->stack.items[stack_ptr + 0];
+ * Value second_arg = vm->stack.items[stack_ptr + 1];
+ * Value third_arg = vm->stack.items[stack_ptr + 2];
  * ...etc
  *
  * */
@@ -19,7 +24,7 @@ bool check_arity(int expected, int retrieved)
 {
     if (expected != retrieved)
     {
-        runtime_error("Expected %d arguments but got %d", expected, retrieved);
+        runtime_error("Diharapkan %d argumen namun mendapat %d", expected, retrieved);
         return false;
     }
     return true;
@@ -31,13 +36,453 @@ bool time_native(int args_count, int stack_ptr, Value *returned)
     if (!check_arity(1, args_count))
         return false;
 
-    Value x = vm.stack->items[stack_ptr + 0];
+    Value x = vm->stack.items[stack_ptr + 0];
 
     if(!IS_NUMBER(x)) {
-        runtime_error("Expected first argument to be a number");
+        runtime_error("Diharapkan argumen ke-1 bertipe number");
         return false;
     }
 
     *returned = VALUE_NUMBER((double)clock() / CLOCKS_PER_SEC + AS_NUMBER(x));
     return true;
 }
+
+/* heap_dump("out.cwsd") writes the whole heap for tools/heapdump, see heap_dump.h */
+bool heap_dump_native(int args_count, int stack_ptr, Value *returned)
+{
+    if (!check_arity(1, args_count))
+        return false;
+
+    Value path = vm->stack.items[stack_ptr + 0];
+    if (!IS_ANY_STRING(path))
+    {
+        runtime_error("Diharapkan argumen ke-1 bertipe string");
+        return false;
+    }
+
+    // A view is not terminated, fopen needs its own copy
+    StringRef ref = string_ref(path);
+    char *chars = malloc(ref.length + 1);
+    if (chars == NULL)
+        exit(69);
+    memcpy(chars, ref.chars, ref.length);
+    chars[ref.length] = '\0';
+
+    *returned = VALUE_BOOL(write_heap_dump(chars));
+    free(chars);
+    return true;
+}
+
+/*
+ * STRING METHODS
+ *
+ * Called through OP_INVOKE on a string receiver, e.g. "a,b".split(",").
+ * The receiver sits right below the arguments on the stack.
+ * */
+
+// Lengths are stored in an int and the terminator takes one more byte
+#define STRING_LENGTH_MAX (INT_MAX - 1)
+
+#define RECEIVER_VALUE(stack_ptr) (vm->stack.items[(stack_ptr)-1])
+#define RECEIVER(stack_ptr) (string_ref(RECEIVER_VALUE(stack_ptr)))
+#define ARG(stack_ptr, i) (vm->stack.items[(stack_ptr) + (i)])
+
+static bool check_arity_range(int min, int max, int retrieved)
+{
+    if (retrieved < min || retrieved > max)
+    {
+        runtime_error("Diharapkan %d sampai %d argumen namun mendapat %d", min, max, retrieved);
+        return false;
+    }
+    return true;
+}
+
+static bool string_arg(int stack_ptr, int i, StringRef *result)
+{
+    Value arg = ARG(stack_ptr, i);
+    if (!IS_ANY_STRING(arg))
+    {
+        runtime_error("Diharapkan argumen ke-%d bertipe string", i + 1);
+        return false;
+    }
+    *result = string_ref(arg);
+    return true;
+}
+
+static bool number_arg(int stack_ptr, int i, int *result)
+{
+    Value arg = ARG(stack_ptr, i);
+    if (!IS_NUMBER(arg))
+    {
+        runtime_error("Diharapkan argumen ke-%d bertipe number", i + 1);
+        return false;
+    }
+
+    // Casting NaN or a double outside the range of int is undefined, NaN counts as 0 and the rest saturates
+    double number = AS_NUMBER(arg);
+    if (isnan(number))
+        *result = 0;
+    else if (number <= (double)INT_MIN)
+        *result = INT_MIN;
+    else if (number >= (double)INT_MAX)
+        *result = INT_MAX;
+    else
+        *result = (int)number;
+    return true;
+}
+
+static int clamp_index(int idx, int length)
+{
+    if (idx < 0)
+        return 0;
+    if (idx > length)
+        return length;
+    return idx;
+}
+
+/* memchr for single characters, two-way search (memmem) for longer needles */
+static int find_substring(StringRef haystack, int from, StringRef needle)
+{
+    if (from > haystack.length)
+        return -1;
+    if (needle.length == 0)
+        return from;
+
+    const char *start = haystack.chars + from;
+    size_t remaining = haystack.length - from;
+    const char *found;
+    if (needle.length == 1)
+        found = memchr(start, needle.chars[0], remaining);
+    else
+        found = memmem(start, remaining, needle.chars, needle.length);
+
+    if (found == NULL)
+        return -1;
+
+    return (int)(found - haystack.chars);
+}
+
+bool string_split_native(int args_count, int stack_ptr, Value *returned)
+{
+    StringRef separator;
+    if (!check_arity(1, args_count) || !string_arg(stack_ptr, 0, &separator))
+        return false;
+
+    StringRef string = RECEIVER(stack_ptr);
+    ObjectArray *array = new_array();
+    push(VALUE_OBJ(array));
+
+    if (separator.length == 0)
+    {
+        for (int i = 0; i < string.length; ++i)
+        {
+            Value part = VALUE_OBJ(copy_string(string.chars + i, 1));
+            push(part);
+            append_array(array, part);
+            pop();
+        }
+    }
+    else
+    {
+        int start = 0;
+        for (;;)
+        {
+            int found = find_substring(string, start, separator);
+            int end = found == -1 ? string.length : found;
+
+            Value part = slice_string(RECEIVER_VALUE(stack_ptr), start, end);
+            push(part);
+            append_array(array, part);
+            pop();
+
+            if (found == -1)
+                break;
+            start = found + separator.length;
+        }
+    }
+
+    pop();
+    *returned = VALUE_OBJ(array);
+    return true;
+}
+
+bool string_join_native(int args_count, int stack_ptr, Value *returned)
+{
+    if (!check_arity(1, args_count))
+        return false;
+
+    Value arg = ARG(stack_ptr, 0);
+    if (!IS_ARRAY(arg))
+    {
+        runtime_error("Diharapkan argumen ke-1 bertipe array");
+        return false;
+    }
+
+    StringRef separator = RECEIVER(stack_ptr);
+    ObjectArray *array = AS_ARRAY(arg);
+    char number[NUMBER_BUFFER_MAX];
+
+    size_t length = 0;
+    for (uint32_t i = 0; i < array->count; ++i)
+    {
+        Value item = array->values[i];
+        if (IS_ANY_STRING(item))
+            length += string_ref(item).length;
+        else if (IS_NUMBER(item))
+            length += number_to_chars(AS_NUMBER(item), number);
+        else
+        {
+            runtime_error("Item ke-%d harus bertipe string atau number", i);
+            return false;
+        }
+
+        if (i != 0)
+            length += separator.length;
+    }
+
+    char *result = ALLOC(char, length + 1);
+    char *cursor = result;
+    for (uint32_t i = 0; i < array->count; ++i)
+    {
+        if (i != 0)
+        {
+            memcpy(cursor, separator.chars, separator.length);
+            cursor += separator.length;
+        }
+
+        Value item = array->values[i];
+        if (IS_ANY_STRING(item))
+        {
+            StringRef ref = string_ref(item);
+            memcpy(cursor, ref.chars, ref.length);
+            cursor += ref.length;
+        }
+        else
+        {
+            int n = number_to_chars(AS_NUMBER(item), number);
+            memcpy(cursor, number, n);
+            cursor += n;
+        }
+    }
+    result[length] = '\0';
+
+    *returned = VALUE_OBJ(take_string(result, length));
+    return true;
+}
+
+bool string_index_of_native(int args_count, int stack_ptr, Value *returned)
+{
+    StringRef needle;
+    int from = 0;
+    if (!check_arity_range(1, 2, args_count) || !string_arg(stack_ptr, 0, &needle))
+        return false;
+    if (args_count == 2 && !number_arg(stack_ptr, 1, &from))
+        return false;
+
+    StringRef string = RECEIVER(stack_ptr);
+    from = clamp_index(from, string.length);
+
+    *returned = VALUE_NUMBER(find_substring(string, from, needle));
+    return true;
+}
+
+bool string_replace_native(int args_count, int stack_ptr, Value *returned)
+{
+    StringRef pattern, replacement;
+    if (!check_arity(2, args_count) || !string_arg(stack_ptr, 0, &pattern) ||
+        !string_arg(stack_ptr, 1, &replacement))
+        return false;
+
+    if (pattern.length == 0)
+    {
+        runtime_error("Pola yang diganti tidak boleh kosong");
+        return false;
+    }
+
+    StringRef string = RECEIVER(stack_ptr);
+
+    int count = 0;
+    for (int i = find_substring(string, 0, pattern); i != -1;
+         i = find_substring(string, i + pattern.length, pattern))
+    {
+        count++;
+    }
+
+    if (count == 0)
+    {
+        *returned = RECEIVER_VALUE(stack_ptr);
+        return true;
+    }
+
+    // Many replacements longer than the pattern can go past what an int length holds
+    int64_t total = (int64_t)string.length + (int64_t)count * (replacement.length - pattern.length);
+    if (total > STRING_LENGTH_MAX)
+    {
+        runtime_error("Hasil replace melebihi panjang maksimal string (%d karakter)", STRING_LENGTH_MAX);
+        return false;
+    }
+
+    int length = (int)total;
+    char *result = ALLOC(char, length + 1);
+    char *cursor = result;
+
+    int start = 0;
+    for (int i = find_substring(string, 0, pattern); i != -1;
+         i = find_substring(string, start, pattern))
+    {
+        memcpy(cursor, string.chars + start, i - start);
+        cursor += i - start;
+        memcpy(cursor, replacement.chars, replacement.length);
+        cursor += replacement.length;
+        start = i + pattern.length;
+    }
+    memcpy(cursor, string.chars + start, string.length - start);
+    result[length] = '\0';
+
+    *returned = VALUE_OBJ(take_string(result, length));
+    return true;
+}
+
+bool string_slice_native(int args_count, int stack_ptr, Value *returned)
+{
+    StringRef string = RECEIVER(stack_ptr);
+    int start = 0;
+    int end = string.length;
+
+    if (!check_arity_range(1, 2, args_count) || !number_arg(stack_ptr, 0, &start))
+        return false;
+    if (args_count == 2 && !number_arg(stack_ptr, 1, &end))
+        return false;
+
+    // Negative index counts from the end of the string
+    if (start < 0)
+        start += string.length;
+    if (end < 0)
+        end += string.length;
+
+    start = clamp_index(start, string.length);
+    end = clamp_index(end, string.length);
+    if (end < start)
+        end = start;
+
+    *returned = slice_string(RECEIVER_VALUE(stack_ptr), start, end);
+    return true;
+}
+
+bool string_substring_native(int args_count, int stack_ptr, Value *returned)
+{
+    StringRef string = RECEIVER(stack_ptr);
+    int start = 0;
+    int end = string.length;
+
+    if (!check_arity_range(1, 2, args_count) || !number_arg(stack_ptr, 0, &start))
+        return false;
+    if (args_count == 2 && !number_arg(stack_ptr, 1, &end))
+        return false;
+
+    // Negative index is treated as 0 and the bounds are swapped if needed
+    start = clamp_index(start, string.length);
+    end = clamp_index(end, string.length);
+    if (end < start)
+    {
+        int tmp = start;
+        start = end;
+        end = tmp;
+    }
+
+    *returned = slice_string(RECEIVER_VALUE(stack_ptr), start, end);
+    return true;
+}
+
+static bool change_case(int args_count, int stack_ptr, Value *returned, bool upper)
+{
+    if (!check_arity(0, args_count))
+        return false;
+
+    StringRef string = RECEIVER(stack_ptr);
+    char *result = ALLOC(char, string.length + 1);
+    for (int i = 0; i < string.length; ++i)
+    {
+        char c = string.chars[i];
+        result[i] = (char)(upper ? toupper((unsigned char)c) : tolower((unsigned char)c));
+    }
+    result[string.length] = '\0';
+
+    *returned = VALUE_OBJ(take_string(result, string.length));
+    return true;
+}
+
+bool string_upper_native(int args_count, int stack_ptr, Value *returned)
+{
+    return change_case(args_count, stack_ptr, returned, true);
+}
+
+bool string_lower_native(int args_count, int stack_ptr, Value *returned)
+{
+    return change_case(args_count, stack_ptr, returned, false);
+}
+
+bool string_trim_native(int args_count, int stack_ptr, Value *returned)
+{
+    if (!check_arity(0, args_count))
+        return false;
+
+    StringRef string = RECEIVER(stack_ptr);
+    int start = 0;
+    int end = string.length;
+    while (start < end && isspace((unsigned char)string.chars[start]))
+        start++;
+    while (end > start && isspace((unsigned char)string.chars[end - 1]))
+        end--;
+
+    *returned = slice_string(RECEIVER_VALUE(stack_ptr), start, end);
+    return true;
+}
+
+bool string_starts_with_native(int args_count, int stack_ptr, Value *returned)
+{
+    StringRef prefix;
+    if (!check_arity(1, args_count) || !string_arg(stack_ptr, 0, &prefix))
+        return false;
+
+    StringRef string = RECEIVER(stack_ptr);
+    bool result = prefix.length <= string.length && memcmp(string.chars, prefix.chars, prefix.length) == 0;
+
+    *returned = VALUE_BOOL(result);
+    return true;
+}
+
+bool string_ends_with_native(int args_count, int stack_ptr, Value *returned)
+{
+    StringRef suffix;
+    if (!check_arity(1, args_count) || !string_arg(stack_ptr, 0, &suffix))
+        return false;
+
+    StringRef string = RECEIVER(stack_ptr);
+    bool result = suffix.length <= string.length &&
+                  memcmp(string.chars + string.length - suffix.length, suffix.chars, suffix.length) == 0;
+
+    *returned = VALUE_BOOL(result);
+    return true;
+}
+
+bool string_char_code_at_native(int args_count, int stack_ptr, Value *returned)
+{
+    int idx;
+    if (!check_arity(1, args_count) || !number_arg(stack_ptr, 0, &idx))
+        return false;
+
+    StringRef string = RECEIVER(stack_ptr);
+    if (idx < 0 || idx >= string.length)
+    {
+        *returned = VALUE_NIL;
+        return true;
+    }
+
+    *returned = VALUE_NUMBER((unsigned char)string.chars[idx]);
+    return true;
+}
+
+#undef RECEIVER
+#undef RECEIVER_VALUE
+#undef ARG
@@ -1,4 +1,21 @@
 #include "vm.h"
 #include "object.h"
 
+bool check_arity(int expected, int retrieved);
+
 bool time_native(int args_count, int stack_ptr, Value *returned);
+bool heap_dump_native(int args_count, int stack_ptr, Value *returned);
+
+/* String methods, the receiver is at vm->stack.items[stack_ptr - 1] */
+bool string_split_native(int args_count, int stack_ptr, Value *returned);
+bool string_join_native(int args_count, int stack_ptr, Value *returned);
+bool string_index_of_native(int args_count, int stack_ptr, Value *returned);
+bool string_replace_native(int args_count, int stack_ptr, Value *returned);
+bool string_slice_native(int args_count, int stack_ptr, Value *returned);
+bool string_substring_native(int args_count, int stack_ptr, Value *returned);
+bool string_upper_native(int args_count, int stack_ptr, Value *returned);
+bool string_lower_native(int args_count, int stack_ptr, Value *returned);
+bool string_trim_native(int args_count, int stack_ptr, Value *returned);
+bool string_starts_with_native(int args_count, int stack_ptr, Value *returned);
+bool string_ends_with_native(int args_count, int stack_ptr, Value *returned);
+bool string_char_code_at_native(int args_count, int stack_ptr, Value *returned);
@@ -0,0 +1,482 @@
+/*
+ * NUMBER <-> STRING CONVERSION
+ *
+ * number_to_chars writes a string that reads back to the same double,
+ * the shortest one in almost all cases. Integers take a fast path,
+ * everything else goes through Grisu2 (Florian Loitsch, "Printing
+ * Floating-Point Numbers Quickly and Accurately with Integers", this follows
+ * the layout of Milo Yip's dtoa); for a few values Grisu2 gives a digit or
+ * two more than needed, e.g. 2.2547669557164902e-227.
+ *
+ * chars_to_number parses a decimal literal exactly when the digits fit in
+ * 53 bits and the power of ten is exact (Clinger's fast path), and falls back
+ * to strtod otherwise.
+ * */
+
+#include "number.h"
+#include "string.h"
+
+typedef struct
+{
+    uint64_t f;
+    int e;
+} DiyFp;
+
+#define DP_SIGNIFICAND_SIZE 52
+#define DP_EXPONENT_BIAS (0x3FF + DP_SIGNIFICAND_SIZE)
+#define DP_MIN_EXPONENT (-DP_EXPONENT_BIAS)
+#define DP_EXPONENT_MASK 0x7FF0000000000000ULL
+#define DP_SIGNIFICAND_MASK 0x000FFFFFFFFFFFFFULL
+#define DP_HIDDEN_BIT 0x0010000000000000ULL
+
+/* 10^k for k = -348, -340, ..., 340 normalized to 64 bit significands */
+static const uint64_t cached_powers_f[] = {
+    0xfa8fd5a0081c0288ULL, 0xbaaee17fa23ebf76ULL, 0x8b16fb203055ac76ULL,
+    0xcf42894a5dce35eaULL, 0x9a6bb0aa55653b2dULL, 0xe61acf033d1a45dfULL,
+    0xab70fe17c79ac6caULL, 0xff77b1fcbebcdc4fULL, 0xbe5691ef416bd60cULL,
+    0x8dd01fad907ffc3cULL, 0xd3515c2831559a83ULL, 0x9d71ac8fada6c9b5ULL,
+    0xea9c227723ee8bcbULL, 0xaecc49914078536dULL, 0x823c12795db6ce57ULL,
+    0xc21094364dfb5637ULL, 0x9096ea6f3848984fULL, 0xd77485cb25823ac7ULL,
+    0xa086cfcd97bf97f4ULL, 0xef340a98172aace5ULL, 0xb23867fb2a35b28eULL,
+    0x84c8d4dfd2c63f3bULL, 0xc5dd44271ad3cdbaULL, 0x936b9fcebb25c996ULL,
+    0xdbac6c247d62a584ULL, 0xa3ab66580d5fdaf6ULL, 0xf3e2f893dec3f126ULL,
+    0xb5b5ada8aaff80b8ULL, 0x87625f056c7c4a8bULL, 0xc9bcff6034c13053ULL,
+    0x964e858c91ba2655ULL, 0xdff9772470297ebdULL, 0xa6dfbd9fb8e5b88fULL,
+    0xf8a95fcf88747d94ULL, 0xb94470938fa89bcfULL, 0x8a08f0f8bf0f156bULL,
+    0xcdb02555653131b6ULL, 0x993fe2c6d07b7facULL, 0xe45c10c42a2b3b06ULL,
+    0xaa242499697392d3ULL, 0xfd87b5f28300ca0eULL, 0xbce5086492111aebULL,
+    0x8cbccc096f5088ccULL, 0xd1b71758e219652cULL, 0x9c40000000000000ULL,
+    0xe8d4a51000000000ULL, 0xad78ebc5ac620000ULL, 0x813f3978f8940984ULL,
+    0xc097ce7bc90715b3ULL, 0x8f7e32ce7bea5c70ULL, 0xd5d238a4abe98068ULL,
+    0x9f4f2726179a2245ULL, 0xed63a231d4c4fb27ULL, 0xb0de65388cc8ada8ULL,
+    0x83c7088e1aab65dbULL, 0xc45d1df942711d9aULL, 0x924d692ca61be758ULL,
+    0xda01ee641a708deaULL, 0xa26da3999aef774aULL, 0xf209787bb47d6b85ULL,
+    0xb454e4a179dd1877ULL, 0x865b86925b9bc5c2ULL, 0xc83553c5c8965d3dULL,
+    0x952ab45cfa97a0b3ULL, 0xde469fbd99a05fe3ULL, 0xa59bc234db398c25ULL,
+    0xf6c69a72a3989f5cULL, 0xb7dcbf5354e9beceULL, 0x88fcf317f22241e2ULL,
+    0xcc20ce9bd35c78a5ULL, 0x98165af37b2153dfULL, 0xe2a0b5dc971f303aULL,
+    0xa8d9d1535ce3b396ULL, 0xfb9b7cd9a4a7443cULL, 0xbb764c4ca7a44410ULL,
+    0x8bab8eefb6409c1aULL, 0xd01fef10a657842cULL, 0x9b10a4e5e9913129ULL,
+    0xe7109bfba19c0c9dULL, 0xac2820d9623bf429ULL, 0x80444b5e7aa7cf85ULL,
+    0xbf21e44003acdd2dULL, 0x8e679c2f5e44ff8fULL, 0xd433179d9c8cb841ULL,
+    0x9e19db92b4e31ba9ULL, 0xeb96bf6ebadf77d9ULL, 0xaf87023b9bf0ee6bULL,
+};
+
+static const int16_t cached_powers_e[] = {
+    -1220, -1193, -1166, -1140, -1113, -1087, -1060, -1034, -1007, -980,
+    -954, -927, -901, -874, -847, -821, -794, -768, -741, -715,
+    -688, -661, -635, -608, -582, -555, -529, -502, -475, -449,
+    -422, -396, -369, -343, -316, -289, -263, -236, -210, -183,
+    -157, -130, -103, -77, -50, -24, 3, 30, 56, 83,
+    109, 136, 162, 189, 216, 242, 269, 295, 322, 348,
+    375, 402, 428, 455, 481, 508, 534, 561, 588, 614,
+    641, 667, 694, 720, 747, 774, 800, 827, 853, 880,
+    907, 933, 960, 986, 1013, 1039, 1066,
+};
+
+static const uint64_t pow10_u64[] = {
+    1ULL,
+    10ULL,
+    100ULL,
+    1000ULL,
+    10000ULL,
+    100000ULL,
+    1000000ULL,
+    10000000ULL,
+    100000000ULL,
+    1000000000ULL,
+    10000000000ULL,
+    100000000000ULL,
+    1000000000000ULL,
+    10000000000000ULL,
+    100000000000000ULL,
+    1000000000000000ULL,
+    10000000000000000ULL,
+    100000000000000000ULL,
+    1000000000000000000ULL,
+    10000000000000000000ULL,
+};
+
+static const double pow10_f64[] = {
+    1e0,  1e1,  1e2,  1e3,  1e4,  1e5,  1e6,  1e7,  1e8,  1e9,  1e10, 1e11,
+    1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22,
+};
+
+static const char digit_pairs[] = "00010203040506070809"
+                                  "10111213141516171819"
+                                  "20212223242526272829"
+                                  "30313233343536373839"
+                                  "40414243444546474849"
+                                  "50515253545556575859"
+                                  "60616263646566676869"
+                                  "70717273747576777879"
+                                  "80818283848586878889"
+                                  "90919293949596979899";
+
+static DiyFp diy_fp(uint64_t f, int e)
+{
+    DiyFp fp = {.f = f, .e = e};
+    return fp;
+}
+
+static DiyFp diy_fp_from_double(double value)
+{
+    uint64_t bits;
+    memcpy(&bits, &value, sizeof(bits));
+
+    int biased_e = (int)((bits & DP_EXPONENT_MASK) >> DP_SIGNIFICAND_SIZE);
+    uint64_t significand = bits & DP_SIGNIFICAND_MASK;
+    if (biased_e != 0)
+        return diy_fp(significand + DP_HIDDEN_BIT, biased_e - DP_EXPONENT_BIAS);
+
+    return diy_fp(significand, DP_MIN_EXPONENT + 1);
+}
+
+static DiyFp diy_fp_multiply(DiyFp a, DiyFp b)
+{
+    __uint128_t p = (__uint128_t)a.f * b.f;
+    uint64_t h = (uint64_t)(p >> 64);
+    uint64_t l = (uint64_t)p;
+    if (l & (1ULL << 63))
+        h++;
+
+    return diy_fp(h, a.e + b.e + 64);
+}
+
+static DiyFp diy_fp_normalize(DiyFp fp)
+{
+    int shift = __builtin_clzll(fp.f);
+    return diy_fp(fp.f << shift, fp.e - shift);
+}
+
+static void normalized_boundaries(DiyFp v, DiyFp *minus, DiyFp *plus)
+{
+    DiyFp pl = diy_fp((v.f << 1) + 1, v.e - 1);
+    while (!(pl.f & (DP_HIDDEN_BIT << 1)))
+    {
+        pl.f <<= 1;
+        pl.e--;
+    }
+    pl.f <<= (64 - DP_SIGNIFICAND_SIZE - 2);
+    pl.e -= (64 - DP_SIGNIFICAND_SIZE - 2);
+
+    DiyFp mi = (v.f == DP_HIDDEN_BIT) ? diy_fp((v.f << 2) - 1, v.e - 2) : diy_fp((v.f << 1) - 1, v.e - 1);
+    mi.f <<= mi.e - pl.e;
+    mi.e = pl.e;
+
+    *plus = pl;
+    *minus = mi;
+}
+
+static DiyFp cached_power(int e, int *K)
+{
+    double dk = (-61 - e) * 0.30102999566398114 + 347;
+    int k = (int)dk;
+    if (dk - k > 0.0)
+        k++;
+
+    unsigned index = (unsigned)((k >> 3) + 1);
+    *K = -(-348 + (int)(index << 3));
+
+    return diy_fp(cached_powers_f[index], cached_powers_e[index]);
+}
+
+static void grisu_round(char *buffer, int length, uint64_t delta, uint64_t rest, uint64_t ten_kappa, uint64_t wp_w)
+{
+    while (rest < wp_w && delta - rest >= ten_kappa &&
+           (rest + ten_kappa < wp_w || wp_w - rest > rest + ten_kappa - wp_w))
+    {
+        buffer[length - 1]--;
+        rest += ten_kappa;
+    }
+}
+
+static int count_decimal_digit32(uint32_t n)
+{
+    int digits = 1;
+    while (digits < 10 && n >= pow10_u64[digits])
+        digits++;
+
+    return digits;
+}
+
+static int digit_gen(DiyFp W, DiyFp Mp, uint64_t delta, char *buffer, int *K)
+{
+    DiyFp one = diy_fp(1ULL << -Mp.e, Mp.e);
+    uint64_t wp_w = Mp.f - W.f;
+    uint32_t p1 = (uint32_t)(Mp.f >> -one.e);
+    uint64_t p2 = Mp.f & (one.f - 1);
+    int kappa = count_decimal_digit32(p1);
+    int length = 0;
+
+    while (kappa > 0)
+    {
+        uint32_t div = (uint32_t)pow10_u64[kappa - 1];
+        uint32_t d = p1 / div;
+        p1 %= div;
+
+        if (d || length)
+            buffer[length++] = (char)('0' + d);
+
+        kappa--;
+        uint64_t tmp = ((uint64_t)p1 << -one.e) + p2;
+        if (tmp <= delta)
+        {
+            *K += kappa;
+            grisu_round(buffer, length, delta, tmp, pow10_u64[kappa] << -one.e, wp_w);
+            return length;
+        }
+    }
+
+    for (;;)
+    {
+        p2 *= 10;
+        delta *= 10;
+        char d = (char)(p2 >> -one.e);
+        if (d || length)
+            buffer[length++] = (char)('0' + d);
+
+        p2 &= one.f - 1;
+        kappa--;
+        if (p2 < delta)
+        {
+            *K += kappa;
+            int index = -kappa;
+            grisu_round(buffer, length, delta, p2, one.f, wp_w * (index < 20 ? pow10_u64[index] : 0));
+            return length;
+        }
+    }
+}
+
+static int grisu2(double value, char *buffer, int *K)
+{
+    DiyFp v = diy_fp_from_double(value);
+    DiyFp w_m, w_p;
+    normalized_boundaries(v, &w_m, &w_p);
+
+    DiyFp c_mk = cached_power(w_p.e, K);
+    DiyFp W = diy_fp_multiply(diy_fp_normalize(v), c_mk);
+    DiyFp Wp = diy_fp_multiply(w_p, c_mk);
+    DiyFp Wm = diy_fp_multiply(w_m, c_mk);
+    Wm.f++;
+    Wp.f--;
+
+    return digit_gen(W, Wp, Wp.f - Wm.f, buffer, K);
+}
+
+static int write_exponent(int K, char *buffer)
+{
+    int length = 0;
+    if (K < 0)
+    {
+        buffer[length++] = '-';
+        K = -K;
+    }
+    else
+    {
+        buffer[length++] = '+';
+    }
+
+    if (K >= 100)
+    {
+        buffer[length++] = (char)('0' + K / 100);
+        K %= 100;
+        buffer[length++] = digit_pairs[K * 2];
+        buffer[length++] = digit_pairs[K * 2 + 1];
+    }
+    else if (K >= 10)
+    {
+        buffer[length++] = digit_pairs[K * 2];
+        buffer[length++] = digit_pairs[K * 2 + 1];
+    }
+    else
+    {
+        buffer[length++] = (char)('0' + K);
+    }
+
+    return length;
+}
+
+/* Place the decimal point into digits * 10^k the same way javascript does */
+static int prettify(char *buffer, int length, int k)
+{
+    int kk = length + k;
+
+    if (0 <= k && kk <= 21)
+    {
+        // 1234e7 -> 12340000000
+        for (int i = length; i < kk; ++i)
+            buffer[i] = '0';
+
+        return kk;
+    }
+
+    if (0 < kk && kk <= 21)
+    {
+        // 1234e-2 -> 12.34
+        memmove(&buffer[kk + 1], &buffer[kk], length - kk);
+        buffer[kk] = '.';
+        return length + 1;
+    }
+
+    if (-6 < kk && kk <= 0)
+    {
+        // 1234e-6 -> 0.001234
+        int offset = 2 - kk;
+        memmove(&buffer[offset], &buffer[0], length);
+        buffer[0] = '0';
+        buffer[1] = '.';
+        for (int i = 2; i < offset; ++i)
+            buffer[i] = '0';
+
+        return length + offset;
+    }
+
+    if (length == 1)
+    {
+        // 1e30
+        buffer[1] = 'e';
+        return 2 + write_exponent(kk - 1, &buffer[2]);
+    }
+
+    // 1234e30 -> 1.234e+33
+    memmove(&buffer[2], &buffer[1], length - 1);
+    buffer[1] = '.';
+    buffer[length + 1] = 'e';
+    return length + 2 + write_exponent(kk - 1, &buffer[length + 2]);
+}
+
+static int integer_to_chars(uint64_t value, char *buffer)
+{
+    char tmp[24];
+    int pos = sizeof(tmp);
+
+    while (value >= 100)
+    {
+        int pair = (int)(value % 100) * 2;
+        value /= 100;
+        tmp[--pos] = digit_pairs[pair + 1];
+        tmp[--pos] = digit_pairs[pair];
+    }
+
+    if (value >= 10)
+    {
+        int pair = (int)value * 2;
+        tmp[--pos] = digit_pairs[pair + 1];
+        tmp[--pos] = digit_pairs[pair];
+    }
+    else
+    {
+        tmp[--pos] = (char)('0' + value);
+    }
+
+    int length = sizeof(tmp) - pos;
+    memcpy(buffer, &tmp[pos], length);
+    return length;
+}
+
+/*
+ * Writes `value` into `buffer` (at least NUMBER_BUFFER_MAX bytes), returns
+ * the length. The result is NUL terminated.
+ * */
+int number_to_chars(double value, char *buffer)
+{
+    int length = 0;
+
+    if (value != value)
+    {
+        memcpy(buffer, "nan", 4);
+        return 3;
+    }
+
+    if (value < 0)
+    {
+        buffer[length++] = '-';
+        value = -value;
+    }
+
+    if (value == 0)
+    {
+        // Covers -0 as well, which is printed as 0
+        buffer[0] = '0';
+        buffer[1] = '\0';
+        return 1;
+    }
+
+    if (value > 1.7976931348623157e308)
+    {
+        memcpy(&buffer[length], "inf", 4);
+        return length + 3;
+    }
+
+    if (value < 9007199254740992.0 && value == (double)(uint64_t)value)
+    {
+        length += integer_to_chars((uint64_t)value, &buffer[length]);
+        buffer[length] = '\0';
+        return length;
+    }
+
+    int K;
+    int digits = grisu2(value, &buffer[length], &K);
+    length += prettify(&buffer[length], digits, K);
+    buffer[length] = '\0';
+    return length;
+}
+
+static double slow_chars_to_number(const char *start, int length)
+{
+    char tmp[64];
+    char *copy = tmp;
+    if (length >= (int)sizeof(tmp))
+        copy = malloc(length + 1);
+
+    memcpy(copy, start, length);
+    copy[length] = '\0';
+
+    double result = strtod(copy, NULL);
+
+    if (copy != tmp)
+        free(copy);
+
+    return result;
+}
+
+double chars_to_number(const char *start, int length)
+{
+    const char *p = start;
+    const char *end = start + length;
+
+    uint64_t mantissa = 0;
+    int exponent = 0;
+    bool truncated = false;
+
+    for (; p < end && *p >= '0' && *p <= '9'; ++p)
+    {
+        if (mantissa < 100000000000000000ULL)
+            mantissa = mantissa * 10 + (*p - '0');
+        else
+            truncated = true;
+    }
+
+    if (p < end && *p == '.')
+    {
+        ++p;
+        for (; p < end && *p >= '0' && *p <= '9'; ++p)
+        {
+            if (mantissa < 100000000000000000ULL)
+            {
+                mantissa = mantissa * 10 + (*p - '0');
+                exponent--;
+            }
+            else
+            {
+                truncated = true;
+            }
+        }
+    }
+
+    if (p != end || truncated || mantissa > (1ULL << 53) || exponent < -22)
+        return slow_chars_to_number(start, length);
+
+    return (double)mantissa / pow10_f64[-exponent];
+}
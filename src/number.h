@@ -0,0 +1,12 @@
+#ifndef CWS_NUMBER_H
+#define CWS_NUMBER_H
+
+#include "common.h"
+
+/* Enough for "-1.2345678901234567e-308" plus the terminator */
+#define NUMBER_BUFFER_MAX 32
+
+int number_to_chars(double value, char *buffer);
+double chars_to_number(const char *start, int length);
+
+#endif // !CWS_NUMBER_H
@@ -1,5 +1,9 @@
 #include "object.h"
+#include "alloc_profiler.h"
+#include "jit.h"
+#include "loop_trace.h"
 #include "vm.h"
+#include "worker.h"
 
 ObjectString *find_string(Map *m, const char *key, int length)
 {
@@ -31,7 +35,7 @@ ObjectString *find_string(Map *m, const char *key, int length)
 
 ObjectString *take_string(char *chars, int length)
 {
-    ObjectString *allocated = find_string(&vm.strings, chars, length);
+    ObjectString *allocated = find_string(&vm->strings, chars, length);
     if (allocated != NULL)
     {
         FREE_ARRAY(char, chars, length + 1);
@@ -57,20 +61,67 @@ ObjectString *allocate_string(const char *chars, int length)
     uint32_t hash = fnv_32a_str(string->chars, length);
     string->hash = hash;
 
-    map_set(&vm.strings, string, VALUE_NIL);
+    map_set(&vm->strings, string, VALUE_NIL);
 
     return string;
 }
 
 ObjectString *copy_string(const char *chars, int length)
 {
-    ObjectString *allocated = find_string(&vm.strings, chars, length);
+    ObjectString *allocated = find_string(&vm->strings, chars, length);
     if (allocated != NULL)
         return allocated;
 
     return allocate_string(chars, length);
 }
 
+static ObjectStringView *new_string_view(ObjectString *parent, int start, int length)
+{
+    ObjectStringView *view = ALLOC_OBJ(ObjectStringView, OBJ_STRING_VIEW);
+    view->parent = parent;
+    view->start = start;
+    view->length = length;
+    return view;
+}
+
+/*
+ * Returns string[start:end] of a string or a view, either as a view over the
+ * original parent or as an interned copy when the slice is small.
+ * */
+Value slice_string(Value string, int start, int end)
+{
+    StringRef ref = string_ref(string);
+    int length = end - start;
+
+    if (start == 0 && length == ref.length)
+        return string;
+
+    ObjectString *parent;
+    if (IS_STRING(string))
+    {
+        parent = AS_STRING(string);
+    }
+    else
+    {
+        parent = AS_STRING_VIEW(string)->parent;
+        start += AS_STRING_VIEW(string)->start;
+    }
+
+    if (length < STRING_VIEW_MIN_LENGTH || (size_t)length * STRING_VIEW_MAX_RATIO < (size_t)parent->length)
+        return VALUE_OBJ(copy_string(parent->chars + start, length));
+
+    return VALUE_OBJ(new_string_view(parent, start, length));
+}
+
+ObjectString *materialize_string(Value string)
+{
+    if (IS_STRING(string))
+        return AS_STRING(string);
+
+    StringRef ref = string_ref(string);
+    return copy_string(ref.chars, ref.length);
+}
+
 ObjectFunction *new_function()
 {
     ObjectFunction *function = ALLOC_OBJ(ObjectFunction, OBJ_FUNCTION);
@@ -78,6 +129,9 @@ ObjectFunction *new_function()
     function->name = NULL;
     function->arity = 0;
     function->upvalue_count = 0;
+    function->hotness = 0;
+    function->jit = NULL;
+    function->traces = NULL;
     init_chunk(&function->chunk);
 
     return function;
@@ -87,6 +141,8 @@ ObjectNative *new_native(NativeFn function)
 {
     ObjectNative *native = ALLOC_OBJ(ObjectNative, OBJ_NATIVE);
     native->function = function;
+    native->host = NULL;
+    native->userdata = NULL;
 
     return native;
 }
@@ -146,6 +202,9 @@ ObjectMethod *new_method(Value receiver, ObjectClosure *closure)
 ObjectTable *new_table()
 {
     ObjectTable *table = ALLOC_OBJ(ObjectTable, OBJ_TABLE);
+    table->array_cap = 0;
+    table->array_count = 0;
+    table->array = NULL;
     init_map(&table->values);
     return table;
 }
@@ -224,11 +283,18 @@ ObjectArray *new_array()
     return array;
 }
 
+ObjectWorker *new_worker(struct Worker *worker)
+{
+    ObjectWorker *handle = ALLOC_OBJ(ObjectWorker, OBJ_WORKER);
+    handle->worker = worker;
+    return handle;
+}
+
 void append_array(ObjectArray *array, Value newItem)
 {
     if (array->cap < array->count + 1)
     {
-        uint16_t oldCapacity = array->cap;
+        uint32_t oldCapacity = array->cap;
         array->cap = GROW_CAPACITY(array->cap);
         array->values = GROW_ARRAY(Value, array->values, oldCapacity, array->cap);
     }
@@ -245,9 +311,12 @@ Obj *allocate_obj(ObjType type, size_t size)
 {
     Obj *obj = (Obj *)reallocate(NULL, 0, size);
     obj->type = type;
-    obj->next = vm.objects;
+    obj->next = vm->objects;
     obj->is_marked = false;
-    vm.objects = obj;
+    vm->objects = obj;
+
+    if (is_alloc_profiling)
+        profile_allocation(obj, size);
 
 #ifdef DEBUG_GC
     printf("Object %p allocate %zu of type %d\n", obj, size, obj->type);
@@ -256,13 +325,6 @@ Obj *allocate_obj(ObjType type, size_t size)
     return obj;
 }
 
-double number_value(Value value)
-{
-    double number;
-    memcpy(&number, &value, sizeof(Value));
-    return number;
-}
-
 void free_obj(Obj *obj)
 {
 
@@ -270,6 +332,9 @@ void free_obj(Obj *obj)
     printf("%p free type %d\n", obj, obj->type);
 #endif
 
+    if (is_alloc_profiling)
+        profile_free(obj);
+
     switch (obj->type)
     {
     case OBJ_STRING: {
@@ -278,6 +343,8 @@ void free_obj(Obj *obj)
     }
     case OBJ_FUNCTION: {
         ObjectFunction *function = (ObjectFunction *)(obj);
+        free_jit(function);
+        free_traces(function);
         free_chunk(&function->chunk);
         FREE(ObjectFunction, obj);
         break;
@@ -287,6 +354,8 @@ void free_obj(Obj *obj)
         break;
     }
     case OBJ_CLOSURE: {
+        ObjectClosure *closure = (ObjectClosure *)obj;
+        FREE_ARRAY(ObjectUpValue *, closure->upvalues, closure->upvalue_count);
         FREE(ObjectClosure, obj);
         break;
     }
@@ -317,6 +386,7 @@ void free_obj(Obj *obj)
 
     case OBJ_TABLE: {
         ObjectTable *table = (ObjectTable *)obj;
+        FREE_ARRAY(Value, table->array, table->array_cap);
         free_map(&table->values);
         FREE(ObjectTable, obj);
         break;
@@ -325,10 +395,23 @@ void free_obj(Obj *obj)
     case OBJ_ARRAY: {
         ObjectArray *array = (ObjectArray *)obj;
         free(array->values);
+        free_map(&array->methods);
         FREE(ObjectArray, obj);
         break;
     }
 
+    case OBJ_STRING_VIEW: {
+        FREE(ObjectStringView, obj);
+        break;
+    }
+
+    case OBJ_WORKER: {
+        // An unreachable worker keeps running on its own
+        drop_worker(((ObjectWorker *)obj)->worker);
+        FREE(ObjectWorker, obj);
+        break;
+    }
+
     default:
         assert(0 && "TODO : implement free for another type");
         break;
@@ -3,6 +3,7 @@
 
 #include "chunk.h"
 #include "common.h"
+#include "cws.h"
 #include "hash.h"
 #include "hashmap.h"
 #include "memory.h"
@@ -23,6 +24,8 @@ typedef enum
     OBJ_METHOD,
     OBJ_TABLE,
     OBJ_ARRAY,
+    OBJ_STRING_VIEW,
+    OBJ_WORKER,
 } ObjType;
 
 struct Obj
@@ -40,6 +43,30 @@ struct ObjectString
     char chars[];
 };
 
+/*
+ * A slice of `parent` that was not copied. `parent` is always a real string,
+ * slicing a view references the original parent. Views are only turned into
+ * interned strings (materialized) when they are needed as a key.
+ */
+typedef struct
+{
+    Obj object;
+    ObjectString *parent;
+    int start;
+    int length;
+} ObjectStringView;
+
+/* Slices shorter than this are copied, copying is cheaper than the view */
+#define STRING_VIEW_MIN_LENGTH 16
+/* Slices smaller than parent / ratio are copied so they don't pin the parent */
+#define STRING_VIEW_MAX_RATIO 4096
+
+typedef struct
+{
+    const char *chars;
+    int length;
+} StringRef;
+
 typedef struct
 {
     bool is_local;
@@ -54,6 +81,12 @@ struct ObjectFunction
     Chunk chunk;
 
     int upvalue_count;
+
+    // Calls and loop back edges so far, the JIT (jit.h) compiles the function at its threshold
+    uint32_t hotness;
+    struct JitCode *jit;
+    // Back edge counts and traces of its loop headers, see loop_trace.h
+    struct TraceSite *traces;
 };
 
 struct ObjectClosure
@@ -95,17 +128,26 @@ struct ObjectMethod
     ObjectClosure *closure;
 };
 
+/*
+ * Tables keep integer keys 0..array_cap-1 in a contiguous array part and
+ * every other key in the `values` hash part. Holes in the array part are
+ * marked with VALUE_UNDEFINED.
+ */
 struct ObjectTable
 {
     Obj object;
+    uint32_t array_cap;
+    uint32_t array_count;
+    Value *array;
+
     Map values;
 };
 
 struct ObjectArray
 {
     Obj object;
-    uint16_t count;
-    uint16_t cap;
+    uint32_t count;
+    uint32_t cap;
     Value *values;
 
     Map methods;
@@ -117,8 +159,18 @@ typedef struct
     Obj object;
     NativeFn function;
 
+    // Natives registered through cws.h are called with the VM and their userdata instead
+    CwsNative host;
+    void *userdata;
 } ObjectNative;
 
+/* The script's handle on a worker thread, the thread shares the Worker and not this object, see worker.h */
+typedef struct
+{
+    Obj object;
+    struct Worker *worker;
+} ObjectWorker;
+
 typedef enum
 {
     TYPE_SCRIPT,
@@ -154,6 +206,8 @@ struct Obj *allocate_obj(ObjType type, size_t size);
 #define AS_METHOD(value) ((ObjectMethod *)AS_OBJ(value))
 #define AS_TABLE(value) ((ObjectTable *)AS_OBJ(value))
 #define AS_ARRAY(value) ((ObjectArray *)AS_OBJ(value))
+#define AS_STRING_VIEW(value) ((ObjectStringView *)AS_OBJ(value))
+#define AS_WORKER(value) ((ObjectWorker *)AS_OBJ(value))
 
 #define OBJ_TYPE(value) (AS_OBJ(value)->type)
 #define ALLOC_OBJ(type, obj_type) ((type *)allocate_obj(obj_type, sizeof(type)))
@@ -168,6 +222,9 @@ struct Obj *allocate_obj(ObjType type, size_t size);
 #define IS_INSTANCE(value) IsObjType(value, OBJ_INSTANCE)
 #define IS_TABLE(value) IsObjType(value, OBJ_TABLE)
 #define IS_ARRAY(value) IsObjType(value, OBJ_ARRAY)
+#define IS_STRING_VIEW(value) IsObjType(value, OBJ_STRING_VIEW)
+#define IS_WORKER(value) IsObjType(value, OBJ_WORKER)
+#define IS_ANY_STRING(value) (IS_STRING(value) || IS_STRING_VIEW(value))
 
 #define FREE_OBJ(ptr) (reallocate(ptr, sizeof(Obj), 0))
 #define FREE(type, ptr) (reallocate(ptr, sizeof(type), 0))
@@ -177,6 +234,24 @@ static inline int IsObjType(Value value, ObjType type)
     return ((IS_OBJ(value)) && OBJ_TYPE(value) == type);
 }
 
+static inline StringRef string_ref(Value value)
+{
+    StringRef ref;
+    if (IS_STRING(value))
+    {
+        ref.chars = AS_STRING(value)->chars;
+        ref.length = AS_STRING(value)->length;
+    }
+    else
+    {
+        ObjectStringView *view = AS_STRING_VIEW(value);
+        ref.chars = view->parent->chars + view->start;
+        ref.length = view->length;
+    }
+    return ref;
+}
+
+ObjectString *find_string(Map *m, const char *key, int length);
 ObjectString *allocate_string(const char *chars, int length);
 ObjectString *copy_string(const char *start, int length);
 ObjectString *take_string(char *chars, int length);
@@ -189,11 +264,13 @@ ObjectInstance *new_instance(ObjectClass *klass);
 ObjectMethod *new_method(Value receiver, ObjectClosure *closure);
 ObjectTable *new_table();
 ObjectArray *new_array();
+ObjectWorker *new_worker(struct Worker *worker);
+Value slice_string(Value string, int start, int end);
+ObjectString *materialize_string(Value string);
 
 void append_array(ObjectArray *array, Value newItem);
 void pop_array(ObjectArray *array);
 
-double number_value(Value value);
 
 void free_obj(Obj *obj);
 
@@ -0,0 +1,198 @@
+#include "opstats.h"
+
+#ifdef DEBUG_OPCODE_STATS
+
+#include <string.h>
+
+/*
+ * OPCODE STATISTICS
+ *
+ * CSV, one row per opcode then one per executed pair :
+ *
+ *   kind,opcode,next,count,samples,<unit>,<unit>_per_op
+ *   op,OP_GET_LOCAL,,1200,19,912,48.0
+ *   pair,OP_GET_LOCAL,OP_CONSTANT_LONG,800,,,
+ *
+ * Pairs are sorted by count, the most frequent fusion candidates first.
+ * */
+
+OpcodeStats opcode_stats[OPCODE_COUNT];
+uint64_t opcode_pairs[OPCODE_COUNT][OPCODE_COUNT];
+
+static const char *const opcode_names[OPCODE_COUNT] = {
+    [OP_CONSTANT_LONG] = "OP_CONSTANT_LONG",
+    [OP_RETURN] = "OP_RETURN",
+    [OP_NEGATE] = "OP_NEGATE",
+    [OP_BANG] = "OP_BANG",
+    [OP_TERNARY] = "OP_TERNARY",
+    [OP_GREATER] = "OP_GREATER",
+    [OP_LESS] = "OP_LESS",
+    [OP_EQUAL_EQUAL] = "OP_EQUAL_EQUAL",
+    [OP_ADD] = "OP_ADD",
+    [OP_SUBTRACT] = "OP_SUBTRACT",
+    [OP_DIVIDE] = "OP_DIVIDE",
+    [OP_DOT_GET] = "OP_DOT_GET",
+    [OP_DOT_SET] = "OP_DOT_SET",
+    [OP_SQR_BRACKET_GET] = "OP_SQR_BRACKET_GET",
+    [OP_SQR_BRACKET_SET] = "OP_SQR_BRACKET_SET",
+    [OP_MULTIPLY] = "OP_MULTIPLY",
+    [OP_TRUE] = "OP_TRUE",
+    [OP_FALSE] = "OP_FALSE",
+    [OP_NIL] = "OP_NIL",
+    [OP_PRINT] = "OP_PRINT",
+    [OP_COMPARE] = "OP_COMPARE",
+    [OP_POP] = "OP_POP",
+    [OP_GLOBAL_VAR] = "OP_GLOBAL_VAR",
+    [OP_GET_GLOBAL] = "OP_GET_GLOBAL",
+    [OP_SET_GLOBAL] = "OP_SET_GLOBAL",
+    [OP_GET_LOCAL] = "OP_GET_LOCAL",
+    [OP_SET_LOCAL] = "OP_SET_LOCAL",
+    [OP_GET_UPVALUE] = "OP_GET_UPVALUE",
+    [OP_SET_UPVALUE] = "OP_SET_UPVALUE",
+    [OP_MARK_JUMP] = "OP_MARK_JUMP",
+    [OP_JUMP_IF_FALSE] = "OP_JUMP_IF_FALSE",
+    [OP_JUMP_IF_TRUE] = "OP_JUMP_IF_TRUE",
+    [OP_SWITCH_JUMP] = "OP_SWITCH_JUMP",
+    [OP_JUMP] = "OP_JUMP",
+    [OP_LOOP] = "OP_LOOP",
+    [OP_SWITCH] = "OP_SWITCH",
+    [OP_CASE_COMPARE] = "OP_CASE_COMPARE",
+    [OP_LEN] = "OP_LEN",
+    [OP_CALL] = "OP_CALL",
+    [OP_INVOKE] = "OP_INVOKE",
+    [OP_CLOSURE] = "OP_CLOSURE",
+    [OP_CLOSE_UPVALUE] = "OP_CLOSE_UPVALUE",
+    [OP_CLASS] = "OP_CLASS",
+    [OP_METHOD] = "OP_METHOD",
+    [OP_DEL] = "OP_DEL",
+    [OP_TABLE] = "OP_TABLE",
+    [OP_TABLE_ITEMS] = "OP_TABLE_ITEMS",
+    [OP_ARRAY] = "OP_ARRAY",
+    [OP_ARRAY_ITEMS] = "OP_ARRAY_ITEMS",
+    [OP_ARRAY_PUSH] = "OP_ARRAY_PUSH",
+    [OP_ARRAY_POP] = "OP_ARRAY_POP",
+    [OP_PAUSE] = "OP_PAUSE",
+    [OP_ADD_NUM] = "OP_ADD_NUM",
+    [OP_ADD_STR] = "OP_ADD_STR",
+    [OP_SUBTRACT_NUM] = "OP_SUBTRACT_NUM",
+    [OP_MULTIPLY_NUM] = "OP_MULTIPLY_NUM",
+    [OP_DIVIDE_NUM] = "OP_DIVIDE_NUM",
+    [OP_GREATER_NUM] = "OP_GREATER_NUM",
+    [OP_LESS_NUM] = "OP_LESS_NUM",
+    [OP_DOT_GET_INSTANCE] = "OP_DOT_GET_INSTANCE",
+};
+
+typedef struct
+{
+    uint8_t first;
+    uint8_t second;
+    uint64_t count;
+} OpcodePair;
+
+static const char *opcode_name(int opcode)
+{
+    static char unknown[16];
+    if (opcode_names[opcode] != NULL)
+        return opcode_names[opcode];
+
+    snprintf(unknown, sizeof(unknown), "OP_%d", opcode);
+    return unknown;
+}
+
+static int compare_pairs(const void *a, const void *b)
+{
+    uint64_t left = ((const OpcodePair *)a)->count, right = ((const OpcodePair *)b)->count;
+    return left < right ? 1 : left > right ? -1 : 0;
+}
+
+static double ticks_per_op(OpcodeStats *stats)
+{
+    return stats->samples == 0 ? 0 : (double)stats->ticks / (double)stats->samples;
+}
+
+static void write_csv(FILE *file, OpcodePair *pairs, int pair_count)
+{
+    fprintf(file, "kind,opcode,next,count,samples,%s,%s_per_op\n", OPCODE_TICK_UNIT, OPCODE_TICK_UNIT);
+    for (int i = 0; i < OPCODE_COUNT; ++i)
+    {
+        OpcodeStats *stats = &opcode_stats[i];
+        if (stats->count == 0)
+            continue;
+
+        fprintf(file, "op,%s,,%llu,%llu,%llu,%.1f\n", opcode_name(i), (unsigned long long)stats->count,
+                (unsigned long long)stats->samples, (unsigned long long)stats->ticks, ticks_per_op(stats));
+    }
+
+    for (int i = 0; i < pair_count; ++i)
+    {
+        fprintf(file, "pair,%s,", opcode_name(pairs[i].first));
+        fprintf(file, "%s,%llu,,,\n", opcode_name(pairs[i].second), (unsigned long long)pairs[i].count);
+    }
+}
+
+static void write_json(FILE *file, OpcodePair *pairs, int pair_count)
+{
+    fprintf(file, "{\n  \"unit\": \"%s\",\n  \"sample_every\": %d,\n  \"opcodes\": [", OPCODE_TICK_UNIT,
+            OPCODE_SAMPLE_EVERY);
+
+    bool is_first = true;
+    for (int i = 0; i < OPCODE_COUNT; ++i)
+    {
+        OpcodeStats *stats = &opcode_stats[i];
+        if (stats->count == 0)
+            continue;
+
+        fprintf(file,
+                "%s\n    {\"name\": \"%s\", \"count\": %llu, \"samples\": %llu, \"ticks\": %llu, "
+                "\"ticks_per_op\": %.1f}",
+                is_first ? "" : ",", opcode_name(i), (unsigned long long)stats->count,
+                (unsigned long long)stats->samples, (unsigned long long)stats->ticks, ticks_per_op(stats));
+        is_first = false;
+    }
+
+    fprintf(file, "\n  ],\n  \"pairs\": [");
+    for (int i = 0; i < pair_count; ++i)
+    {
+        fprintf(file, "%s\n    {\"first\": \"%s\", ", i == 0 ? "" : ",", opcode_name(pairs[i].first));
+        fprintf(file, "\"second\": \"%s\", \"count\": %llu}", opcode_name(pairs[i].second),
+                (unsigned long long)pairs[i].count);
+    }
+    fprintf(file, "\n  ]\n}\n");
+}
+
+/* Runs after main returns or exit() is called, whichever way the script ended */
+__attribute__((destructor)) static void dump_opcode_stats()
+{
+    static OpcodePair pairs[OPCODE_COUNT * OPCODE_COUNT];
+    int pair_count = 0;
+    for (int i = 0; i < OPCODE_COUNT; ++i)
+    {
+        for (int j = 0; j < OPCODE_COUNT; ++j)
+        {
+            if (opcode_pairs[i][j] != 0)
+                pairs[pair_count++] = (OpcodePair){(uint8_t)i, (uint8_t)j, opcode_pairs[i][j]};
+        }
+    }
+    qsort(pairs, pair_count, sizeof(OpcodePair), compare_pairs);
+
+    const char *path = getenv("CWS_OPCODE_STATS");
+    if (path == NULL || path[0] == '\0')
+        path = "opcodes.csv";
+
+    FILE *file = fopen(path, "w");
+    if (file == NULL)
+    {
+        fprintf(stderr, "Cannot write the opcode statistics to %s\n", path);
+        return;
+    }
+
+    size_t length = strlen(path);
+    if (length >= 5 && strcmp(path + length - 5, ".json") == 0)
+        write_json(file, pairs, pair_count);
+    else
+        write_csv(file, pairs, pair_count);
+
+    fclose(file);
+}
+
+#endif // DEBUG_OPCODE_STATS
@@ -0,0 +1,90 @@
+#ifndef CWS_OPSTATS_H
+#define CWS_OPSTATS_H
+
+#include "chunk.h"
+
+/*
+ * OPCODE STATISTICS, only built with DEBUG_OPCODE_STATS (`make clean &&
+ * make OPCODE_STATS=1`). run() counts every instruction it dispatches, every
+ * pair of consecutive instructions (candidates for superinstructions) and
+ * times a random sample of them with the cycle counter. The counters are
+ * written when the process exits, to $CWS_OPCODE_STATS or `opcodes.csv`;
+ * a path ending in `.json` gets JSON instead of CSV. A timed instruction
+ * includes its dispatch and the counting around it, the cycles compare
+ * opcodes with each other rather than measure them exactly.
+ *
+ * The counters are process wide, run one VM at a time when collecting them.
+ */
+#ifdef DEBUG_OPCODE_STATS
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define OPCODE_TICK_UNIT "cycles"
+#define read_ticks() __rdtsc()
+#else
+#include <time.h>
+#define OPCODE_TICK_UNIT "nanoseconds"
+static inline uint64_t read_ticks()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+#endif
+
+// Instructions between two timed ones, on average
+#define OPCODE_SAMPLE_EVERY 64
+
+typedef struct
+{
+    uint64_t count;
+    uint64_t samples;
+    uint64_t ticks;
+} OpcodeStats;
+
+/* Per run() call, so a nested run() does not pair or time across the outer one */
+typedef struct
+{
+    int previous;
+    int timed;
+    uint32_t countdown;
+    uint32_t random;
+    uint64_t start;
+} OpcodeTimer;
+
+extern OpcodeStats opcode_stats[OPCODE_COUNT];
+extern uint64_t opcode_pairs[OPCODE_COUNT][OPCODE_COUNT];
+
+#define INIT_OPCODE_TIMER {.previous = -1, .timed = -1, .countdown = 1, .random = 2463534242u}
+
+static inline void count_opcode(OpcodeTimer *timer, uint8_t opcode)
+{
+    // The timed instruction ran from the end of the last call to here, dispatch included
+    if (timer->timed >= 0)
+    {
+        opcode_stats[timer->timed].ticks += read_ticks() - timer->start;
+        opcode_stats[timer->timed].samples++;
+        timer->timed = -1;
+    }
+
+    opcode_stats[opcode].count++;
+    if (timer->previous >= 0)
+        opcode_pairs[timer->previous][opcode]++;
+    timer->previous = opcode;
+
+    // A random stride, a fixed one would keep timing the same instruction of a loop
+    if (--timer->countdown == 0)
+    {
+        timer->random ^= timer->random << 13;
+        timer->random ^= timer->random >> 17;
+        timer->random ^= timer->random << 5;
+        timer->countdown = 1 + timer->random % (2 * OPCODE_SAMPLE_EVERY - 1);
+
+        timer->timed = opcode;
+        timer->start = read_ticks();
+    }
+}
+
+#endif // DEBUG_OPCODE_STATS
+
+#endif // !CWS_OPSTATS_H
@@ -0,0 +1,533 @@
+#include "profiler.h"
+#include "serialize.h"
+#include "vm.h"
+
+#include <string.h>
+#include <time.h>
+
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#include <sys/time.h>
+#define HAS_PROFILER
+#endif
+
+/*
+ * SAMPLING PROFILER
+ *
+ * A sample is the list of (function, line) pairs of the live frames, leaf
+ * first. `frames` stores the pairs of every distinct stack back to back,
+ * `stacks` counts how often each one was seen and `slots` indexes them by
+ * hash (open addressing, 0 is an empty slot, otherwise stack index + 1).
+ * Everything is malloc'd outside the GC heap: a sample never collects.
+ * */
+
+typedef struct
+{
+    ObjectFunction *function;
+    uint32_t line;
+} ProfileFrame;
+
+typedef struct
+{
+    uint64_t hash;
+    uint64_t count;
+    uint32_t first;
+    uint32_t depth;
+} ProfileStack;
+
+/* Maps a (pointer, line) key to a dense id starting at 1, for the pprof tables */
+typedef struct
+{
+    const void *pointer;
+    uint32_t line;
+    uint32_t id;
+} IdEntry;
+
+typedef struct
+{
+    IdEntry *entries;
+    uint32_t count;
+    uint32_t capacity;
+} IdTable;
+
+volatile sig_atomic_t profile_pending = 0;
+
+static struct
+{
+    VM *owner;
+    const char *script_path;
+    uint64_t start_time;
+    uint64_t start_clock;
+    uint64_t start_cpu;
+    uint64_t duration;
+    uint64_t cpu_time;
+    uint64_t ticks;
+
+    ProfileFrame *frames;
+    uint32_t frame_count;
+    uint32_t frame_capacity;
+
+    ProfileStack *stacks;
+    uint32_t stack_count;
+    uint32_t stack_capacity;
+
+    uint32_t *slots;
+    uint32_t slot_capacity;
+} profile;
+
+static void *grow(void *array, uint32_t *capacity, size_t size)
+{
+    *capacity = *capacity < 64 ? 64 : *capacity * 2;
+    array = realloc(array, *capacity * size);
+    if (array == NULL)
+    {
+        fprintf(stderr, "Not enough memory to profile\n");
+        exit(74);
+    }
+    return array;
+}
+
+static uint64_t now(clockid_t clock)
+{
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+/* ===== SAMPLING ===== */
+
+#ifdef HAS_PROFILER
+static void on_sigprof(int signal)
+{
+    (void)signal;
+    profile_pending++;
+}
+#endif
+
+bool start_profiler(const char *script_path)
+{
+#ifdef HAS_PROFILER
+    profile.owner = vm;
+    profile.script_path = script_path;
+    profile.start_time = now(CLOCK_REALTIME);
+    profile.start_clock = now(CLOCK_MONOTONIC);
+    profile.start_cpu = now(CLOCK_PROCESS_CPUTIME_ID);
+
+    struct sigaction action;
+    memset(&action, 0, sizeof(action));
+    action.sa_handler = on_sigprof;
+    action.sa_flags = SA_RESTART;
+    sigemptyset(&action.sa_mask);
+    if (sigaction(SIGPROF, &action, NULL) != 0)
+        return false;
+
+    struct itimerval timer;
+    timer.it_interval.tv_sec = 0;
+    timer.it_interval.tv_usec = PROFILE_INTERVAL_USEC;
+    timer.it_value = timer.it_interval;
+    return setitimer(ITIMER_PROF, &timer, NULL) == 0;
+#else
+    (void)script_path;
+    return false;
+#endif
+}
+
+void stop_profiler()
+{
+#ifdef HAS_PROFILER
+    struct itimerval timer;
+    memset(&timer, 0, sizeof(timer));
+    setitimer(ITIMER_PROF, &timer, NULL);
+    signal(SIGPROF, SIG_IGN);
+#endif
+
+    if (profile.owner != NULL && profile.duration == 0)
+    {
+        profile.duration = now(CLOCK_MONOTONIC) - profile.start_clock;
+        profile.cpu_time = now(CLOCK_PROCESS_CPUTIME_ID) - profile.start_cpu;
+    }
+    profile_pending = 0;
+}
+
+static uint64_t hash_frame(uint64_t hash, ProfileFrame *frame)
+{
+    hash = (hash ^ (uintptr_t)frame->function) * 0x100000001b3ull;
+    return (hash ^ frame->line) * 0x100000001b3ull;
+}
+
+static bool same_stack(ProfileStack *stack, uint64_t hash, ProfileFrame *frames, uint32_t depth)
+{
+    if (stack->hash != hash || stack->depth != depth)
+        return false;
+
+    ProfileFrame *recorded = &profile.frames[stack->first];
+    for (uint32_t i = 0; i < depth; ++i)
+    {
+        if (recorded[i].function != frames[i].function || recorded[i].line != frames[i].line)
+            return false;
+    }
+    return true;
+}
+
+static void rehash_stacks()
+{
+    free(profile.slots);
+    profile.slots = calloc(profile.slot_capacity, sizeof(uint32_t));
+    if (profile.slots == NULL)
+    {
+        fprintf(stderr, "Not enough memory to profile\n");
+        exit(74);
+    }
+
+    uint32_t mask = profile.slot_capacity - 1;
+    for (uint32_t i = 0; i < profile.stack_count; ++i)
+    {
+        uint32_t slot = (uint32_t)profile.stacks[i].hash & mask;
+        while (profile.slots[slot] != 0)
+            slot = (slot + 1) & mask;
+        profile.slots[slot] = i + 1;
+    }
+}
+
+static void count_stack(ProfileFrame *frames, uint32_t depth, uint32_t ticks)
+{
+    uint64_t hash = 0xcbf29ce484222325ull;
+    for (uint32_t i = 0; i < depth; ++i)
+        hash = hash_frame(hash, &frames[i]);
+
+    if ((profile.stack_count + 1) * 4 > profile.slot_capacity * 3)
+    {
+        profile.slot_capacity = profile.slot_capacity < 256 ? 256 : profile.slot_capacity * 2;
+        rehash_stacks();
+    }
+
+    uint32_t mask = profile.slot_capacity - 1;
+    uint32_t slot = (uint32_t)hash & mask;
+    while (profile.slots[slot] != 0)
+    {
+        ProfileStack *stack = &profile.stacks[profile.slots[slot] - 1];
+        if (same_stack(stack, hash, frames, depth))
+        {
+            stack->count += ticks;
+            return;
+        }
+        slot = (slot + 1) & mask;
+    }
+
+    while (profile.frame_count + depth > profile.frame_capacity)
+        profile.frames = grow(profile.frames, &profile.frame_capacity, sizeof(ProfileFrame));
+    memcpy(&profile.frames[profile.frame_count], frames, depth * sizeof(ProfileFrame));
+
+    if (profile.stack_count == profile.stack_capacity)
+        profile.stacks = grow(profile.stacks, &profile.stack_capacity, sizeof(ProfileStack));
+    profile.stacks[profile.stack_count] = (ProfileStack){
+        .hash = hash,
+        .count = ticks,
+        .first = profile.frame_count,
+        .depth = depth,
+    };
+
+    profile.frame_count += depth;
+    profile.slots[slot] = ++profile.stack_count;
+}
+
+/* Called by run() at a safepoint, with the ip of the current frame stored */
+void take_sample()
+{
+    if (vm != profile.owner)
+        return;
+
+    // Every tick since the last safepoint is charged to this stack
+    uint32_t ticks = (uint32_t)profile_pending;
+    profile_pending = 0;
+    profile.ticks += ticks;
+
+    ProfileFrame frames[FRAME_MAX];
+    uint32_t depth = 0;
+    for (int i = vm->frame_count - 1; i >= 0; --i)
+    {
+        CallFrame *frame = &vm->frame[i];
+        ObjectFunction *function = frame->closure->function;
+
+        // ip points past the instruction being executed, or at the entry of a fresh frame
+        uint32_t offset = (uint32_t)(frame->ip - function->chunk.code);
+        frames[depth++] = (ProfileFrame){
+            .function = function,
+            .line = get_line(&function->chunk, offset > 0 ? offset - 1 : 0),
+        };
+    }
+
+    if (depth > 0)
+        count_stack(frames, depth, ticks);
+}
+
+/* The functions of recorded stacks may be unreachable by the end of the script */
+void mark_profile()
+{
+    if (vm != profile.owner)
+        return;
+
+    for (uint32_t i = 0; i < profile.frame_count; ++i)
+        mark_obj((Obj *)profile.frames[i].function);
+}
+
+/* ===== FOLDED STACKS ===== */
+
+static void write_text(Writer *writer, const char *text)
+{
+    write_bytes(writer, text, strlen(text));
+}
+
+static void write_frame_name(Writer *writer, ObjectFunction *function)
+{
+    if (function->name == NULL)
+        write_text(writer, "script");
+    else
+        write_bytes(writer, function->name->chars, function->name->length);
+}
+
+/* One line per stack, root first: `script:12;hitung:30;fib:5 42` */
+static void write_folded(Writer *writer)
+{
+    char number[32];
+    for (uint32_t i = 0; i < profile.stack_count; ++i)
+    {
+        ProfileStack *stack = &profile.stacks[i];
+        for (uint32_t j = stack->depth; j-- > 0;)
+        {
+            ProfileFrame *frame = &profile.frames[stack->first + j];
+            write_frame_name(writer, frame->function);
+            snprintf(number, sizeof(number), ":%u%s", frame->line, j > 0 ? ";" : "");
+            write_text(writer, number);
+        }
+
+        snprintf(number, sizeof(number), " %llu\n", (unsigned long long)stack->count);
+        write_text(writer, number);
+    }
+}
+
+/* ===== PPROF ===== */
+
+/*
+ * profile.proto, only the fields below. Strings are indices in the string
+ * table, whose first entry must be "". Location and function ids start at 1.
+ *
+ *   Profile   : 1 sample_type, 2 sample, 4 location, 5 function,
+ *               6 string_table, 9 time_nanos, 10 duration_nanos,
+ *               11 period_type, 12 period
+ *   ValueType : 1 type, 2 unit
+ *   Sample    : 1 location_id (packed, leaf first), 2 value (packed)
+ *   Location  : 1 id, 4 line
+ *   Line      : 1 function_id, 2 line
+ *   Function  : 1 id, 2 name, 3 system_name, 4 filename, 5 start_line
+ * */
+enum
+{
+    WIRE_VARINT = 0,
+    WIRE_BYTES = 2,
+};
+
+static void write_varint(Writer *writer, uint64_t value)
+{
+    uint8_t bytes[10];
+    int count = 0;
+    do
+    {
+        bytes[count++] = (uint8_t)((value & 0x7f) | (value >= 0x80 ? 0x80 : 0));
+        value >>= 7;
+    } while (value != 0);
+    write_bytes(writer, bytes, count);
+}
+
+static void write_varint_field(Writer *writer, int field, uint64_t value)
+{
+    write_varint(writer, (uint64_t)field << 3 | WIRE_VARINT);
+    write_varint(writer, value);
+}
+
+static void write_bytes_field(Writer *writer, int field, const void *bytes, size_t count)
+{
+    write_varint(writer, (uint64_t)field << 3 | WIRE_BYTES);
+    write_varint(writer, count);
+    write_bytes(writer, bytes, count);
+}
+
+/* Embedded messages are built in `message` first, their length precedes them */
+static void write_message_field(Writer *writer, int field, Writer *message)
+{
+    write_bytes_field(writer, field, message->bytes, message->count);
+    message->count = 0;
+}
+
+static uint32_t id_of(IdTable *table, const void *pointer, uint32_t line, bool *is_new)
+{
+    if ((table->count + 1) * 4 > table->capacity * 3)
+    {
+        IdTable grown = {.count = table->count, .capacity = table->capacity < 64 ? 64 : table->capacity * 2};
+        grown.entries = calloc(grown.capacity, sizeof(IdEntry));
+        if (grown.entries == NULL)
+        {
+            fprintf(stderr, "Not enough memory to profile\n");
+            exit(74);
+        }
+
+        for (uint32_t i = 0; i < table->capacity; ++i)
+        {
+            IdEntry *entry = &table->entries[i];
+            if (entry->id == 0)
+                continue;
+
+            ProfileFrame key = {(ObjectFunction *)entry->pointer, entry->line};
+            uint32_t slot = (uint32_t)hash_frame(0, &key) & (grown.capacity - 1);
+            while (grown.entries[slot].id != 0)
+                slot = (slot + 1) & (grown.capacity - 1);
+            grown.entries[slot] = *entry;
+        }
+
+        free(table->entries);
+        *table = grown;
+    }
+
+    ProfileFrame key = {(ObjectFunction *)pointer, line};
+    uint32_t slot = (uint32_t)hash_frame(0, &key) & (table->capacity - 1);
+    while (table->entries[slot].id != 0)
+    {
+        IdEntry *entry = &table->entries[slot];
+        if (entry->pointer == pointer && entry->line == line)
+        {
+            *is_new = false;
+            return entry->id;
+        }
+        slot = (slot + 1) & (table->capacity - 1);
+    }
+
+    table->entries[slot] = (IdEntry){pointer, line, ++table->count};
+    *is_new = true;
+    return table->count;
+}
+
+/* Function names are interned, so a string is identified by its object */
+static uint32_t string_index(IdTable *strings, Writer *writer, const void *key, const char *chars, size_t length)
+{
+    bool is_new;
+    uint32_t id = id_of(strings, key, 0, &is_new);
+    if (is_new)
+        write_bytes_field(writer, 6, chars, length);
+    return id;
+}
+
+static void write_value_type(Writer *writer, Writer *message, int field, uint32_t type, uint32_t unit)
+{
+    write_varint_field(message, 1, type);
+    write_varint_field(message, 2, unit);
+    write_message_field(writer, field, message);
+}
+
+static void write_pprof(Writer *writer)
+{
+    // The kernel rounds the timer up to its tick, the measured CPU time tells the real period
+    uint64_t period = PROFILE_INTERVAL_USEC * 1000ull;
+    if (profile.ticks > 0 && profile.cpu_time > 0)
+        period = profile.cpu_time / profile.ticks;
+    const char *script_path = profile.script_path != NULL ? profile.script_path : "";
+
+    Writer message, line;
+    init_writer(&message);
+    init_writer(&line);
+    IdTable strings = {0}, functions = {0}, locations = {0};
+
+    // The empty string has index 0, the fixed names follow it
+    static const char *const names[] = {"", "samples", "count", "cpu", "nanoseconds", "script"};
+    uint32_t name_index[sizeof(names) / sizeof(names[0])];
+    for (size_t i = 0; i < sizeof(names) / sizeof(names[0]); ++i)
+        name_index[i] = string_index(&strings, writer, names[i], names[i], strlen(names[i])) - 1;
+    uint32_t path_index = string_index(&strings, writer, script_path, script_path, strlen(script_path)) - 1;
+
+    write_value_type(writer, &message, 1, name_index[1], name_index[2]);
+    write_value_type(writer, &message, 1, name_index[3], name_index[4]);
+
+    for (uint32_t i = 0; i < profile.stack_count; ++i)
+    {
+        ProfileStack *stack = &profile.stacks[i];
+
+        Writer ids;
+        init_writer(&ids);
+        for (uint32_t j = 0; j < stack->depth; ++j)
+        {
+            ProfileFrame *frame = &profile.frames[stack->first + j];
+            ObjectFunction *function = frame->function;
+
+            bool is_new;
+            uint32_t function_id = id_of(&functions, function, 0, &is_new);
+            if (is_new)
+            {
+                uint32_t name = function->name == NULL
+                                    ? name_index[5]
+                                    : string_index(&strings, writer, function->name, function->name->chars,
+                                                   function->name->length) -
+                                          1;
+                write_varint_field(&message, 1, function_id);
+                write_varint_field(&message, 2, name);
+                write_varint_field(&message, 3, name);
+                write_varint_field(&message, 4, path_index);
+                write_varint_field(&message, 5, get_line(&function->chunk, 0));
+                write_message_field(writer, 5, &message);
+            }
+
+            uint32_t location_id = id_of(&locations, function, frame->line, &is_new);
+            if (is_new)
+            {
+                write_varint_field(&line, 1, function_id);
+                write_varint_field(&line, 2, frame->line);
+                write_varint_field(&message, 1, location_id);
+                write_message_field(&message, 4, &line);
+                write_message_field(writer, 4, &message);
+            }
+
+            write_varint(&ids, location_id);
+        }
+
+        write_message_field(&message, 1, &ids);
+        free_writer(&ids);
+
+        Writer values;
+        init_writer(&values);
+        write_varint(&values, stack->count);
+        write_varint(&values, stack->count * period);
+        write_message_field(&message, 2, &values);
+        free_writer(&values);
+
+        write_message_field(writer, 2, &message);
+    }
+
+    write_varint_field(writer, 9, profile.start_time);
+    write_varint_field(writer, 10, profile.duration);
+    write_value_type(writer, &message, 11, name_index[3], name_index[4]);
+    write_varint_field(writer, 12, period);
+
+    free(strings.entries);
+    free(functions.entries);
+    free(locations.entries);
+    free_writer(&message);
+    free_writer(&line);
+}
+
+static bool has_suffix(const char *path, const char *suffix)
+{
+    size_t length = strlen(path), suffix_length = strlen(suffix);
+    return length >= suffix_length && strcmp(path + length - suffix_length, suffix) == 0;
+}
+
+bool write_profile(const char *path)
+{
+    Writer writer;
+    init_writer(&writer);
+
+    if (has_suffix(path, ".pb"))
+        write_pprof(&writer);
+    else
+        write_folded(&writer);
+
+    bool is_written = write_file(&writer, path);
+    free_writer(&writer);
+    return is_written;
+}
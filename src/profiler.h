@@ -0,0 +1,33 @@
+#ifndef CWS_PROFILER_H
+#define CWS_PROFILER_H
+
+#include "object.h"
+
+#include <signal.h>
+
+/*
+ * SAMPLING PROFILER (`cws --profile out.folded script.cws`)
+ *
+ * A SIGPROF timer fires every PROFILE_INTERVAL_USEC of CPU time and only
+ * counts the tick in `profile_pending`; run() takes the sample at its next
+ * safepoint (a loop back edge, a call or a return), where every frame's ip
+ * is known and walking the frames is safe, and charges it every pending
+ * tick. Time spent in a native shows up on the line that called it.
+ *
+ * Identical stacks are counted once. The profile is written as folded
+ * stacks (`script:3;fib:5 120`, for flamegraph.pl and speedscope) or, when
+ * the path ends in `.pb`, as an uncompressed pprof protobuf.
+ *
+ * Only the VM that started the profiler is sampled.
+ */
+#define PROFILE_INTERVAL_USEC 1000
+
+extern volatile sig_atomic_t profile_pending;
+
+bool start_profiler(const char *script_path);
+void stop_profiler();
+void take_sample();
+void mark_profile();
+bool write_profile(const char *path);
+
+#endif // !CWS_PROFILER_H
@@ -23,32 +23,121 @@
 #include "scanner.h"
 #include "string.h"
 
-Scanner scanner;
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+
+_Thread_local Scanner scanner;
+
+/* ===== CHARACTER CLASSES ===== */
+
+#define CHAR_SPACE 0x01
+#define CHAR_DIGIT 0x02
+#define CHAR_ALPHA 0x04
+#define CHAR_WORD (CHAR_DIGIT | CHAR_ALPHA)
+
+/*
+ * Control characters up to 0x07, the isspace() set and every byte of a
+ * UTF-8 sequence are skipped between tokens. 0x08 and the NUL are not.
+ * */
+static const uint8_t char_class[256] = {
+    [0x01 ... 0x07] = CHAR_SPACE,
+    ['\t' ... '\r'] = CHAR_SPACE,
+    [' '] = CHAR_SPACE,
+    ['0' ... '9'] = CHAR_DIGIT,
+    ['a' ... 'z'] = CHAR_ALPHA,
+    ['A' ... 'Z'] = CHAR_ALPHA,
+    ['_'] = CHAR_ALPHA,
+    [0x80 ... 0xFF] = CHAR_SPACE,
+};
+
+/* ===== KEYWORDS ===== */
+
+/*
+ * Perfect hash over the first character, the last character and the length:
+ * every keyword lands in its own slot, so one comparison decides. Redefining
+ * a slot is a -Woverride-init warning, which catches a colliding keyword.
+ * */
+#define KEYWORD_MIN_LENGTH 3
+#define KEYWORD_MAX_LENGTH 6
+#define KEYWORD_HASH(first, last, length) (((uint8_t)(first) * 14 + (uint8_t)(last) * 4 + (length)) & 63)
+#define KEYWORD(first, last, name, type) [KEYWORD_HASH(first, last, sizeof(name) - 1)] = {name, sizeof(name) - 1, type}
+
+typedef struct
+{
+    const char *name;
+    int length;
+    TokenType type;
+} Keyword;
+
+static const Keyword keywords[64] = {
+    KEYWORD('a', 'i', "andai", TOKEN_ANDAI), KEYWORD('a', 'u', "anu", TOKEN_ANU),
+    KEYWORD('a', 'u', "atau", TOKEN_ATAU), KEYWORD('b', 'k', "balik", TOKEN_BALIK),
+    KEYWORD('b', 'i', "basmi", TOKEN_BASMI), KEYWORD('b', 'n', "bawaan", TOKEN_BAWAAN),
+    KEYWORD('d', 'n', "dan", TOKEN_DAN), KEYWORD('f', 'i', "fungsi", TOKEN_FUNGSI),
+    KEYWORD('h', 'l', "hal", TOKEN_HAL), KEYWORD('j', 'a', "jika", TOKEN_JIKA),
+    KEYWORD('j', 'h', "jmlh", TOKEN_JMLH), KEYWORD('k', 'l', "kawal", TOKEN_KAWAL),
+    KEYWORD('k', 'r', "kelar", TOKEN_KELAR), KEYWORD('k', 's', "kelas", TOKEN_KELAS),
+    KEYWORD('k', 't', "konst", TOKEN_KONST), KEYWORD('l', 'i', "lagi", TOKEN_LAGI),
+    KEYWORD('n', 'l', "nihil", TOKEN_NIHIL), KEYWORD('p', 'a', "pula", TOKEN_PULA),
+    KEYWORD('s', 't', "saat", TOKEN_SAAT), KEYWORD('s', 'h', "sah", TOKEN_SAH),
+    KEYWORD('s', 't', "sesat", TOKEN_SESAT), KEYWORD('s', 'r', "super", TOKEN_SUPER),
+    KEYWORD('t', 'l', "tampil", TOKEN_TAMPIL), KEYWORD('u', 'g', "ulang", TOKEN_ULANG),
+};
 
-char advance()
+static TokenType get_token_type()
 {
-    scanner.current++;
-    return scanner.current[-1];
+    int length = (int)(scanner.current - scanner.start);
+    if (length < KEYWORD_MIN_LENGTH || length > KEYWORD_MAX_LENGTH)
+        return TOKEN_IDENTIFIER;
+
+    const Keyword *keyword = &keywords[KEYWORD_HASH(scanner.start[0], scanner.start[length - 1], length)];
+    if (keyword->length == length && memcmp(keyword->name, scanner.start, length) == 0)
+        return keyword->type;
+
+    return TOKEN_IDENTIFIER;
 }
 
-char peek()
+/* ===== INPUT ===== */
+
+/*
+ * Pulls more input when `at` is the terminator of the current window, keeping
+ * the token being scanned. Returns false when there is nothing more to read.
+ * */
+static bool refill(const char *at)
 {
-    return scanner.current[0];
+    SourceStream *stream = scanner.stream;
+    if (stream == NULL || at != scanner.end || stream->is_eof)
+        return false;
+
+    const char *start = refill_source(stream, scanner.start);
+    scanner.current = start + (scanner.current - scanner.start);
+    scanner.start = start;
+    scanner.end = stream->buffer + stream->length;
+    return true;
+}
+
+static char advance()
+{
+    scanner.current++;
+    return scanner.current[-1];
 }
 
-char peek_next()
+static char peek()
 {
-    return scanner.current[1];
+    if (scanner.current[0] == '\0')
+        refill(scanner.current);
+    return scanner.current[0];
 }
 
-char is_at_end()
+static char is_at_end()
 {
     return peek() == '\0';
 }
 
-bool match(char c)
+static bool match(char c)
 {
-    if (c == scanner.current[0])
+    if (c == peek())
     {
         scanner.current++;
         return true;
@@ -57,6 +146,31 @@ bool match(char c)
     return false;
 }
 
+/* Advances over every character of `class`, across windows */
+static void skip_class(uint8_t class)
+{
+    do
+    {
+        const char *current = scanner.current;
+        while (char_class[(uint8_t)*current] & class)
+            current++;
+        scanner.current = current;
+    } while (refill(scanner.current));
+}
+
+static int count_lines(const char *from, const char *to)
+{
+    int count = 0;
+    while ((from = memchr(from, '\n', to - from)) != NULL)
+    {
+        count++;
+        from++;
+    }
+    return count;
+}
+
+/* ===== TOKENS ===== */
+
 static Token make_token(TokenType type)
 {
     Token token;
@@ -81,238 +195,141 @@ static Token error_token(char *message)
 
 static bool is_digit(char c)
 {
-    return (c >= '0' && c <= '9');
+    return char_class[(uint8_t)c] & CHAR_DIGIT;
 }
 
 static bool is_alpha(char c)
 {
-    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') || (c == '_');
+    return char_class[(uint8_t)c] & CHAR_ALPHA;
 }
 
 static Token number()
 {
-    while (is_digit(peek()))
-        advance();
+    skip_class(CHAR_DIGIT);
 
     if (peek() == '.')
     {
         advance();
-        while (is_digit(peek()))
-            advance();
+        skip_class(CHAR_DIGIT);
     }
 
     return make_token(TOKEN_NUMBER);
 }
 
-static TokenType match_token(int start, int rest_length, char *rest, TokenType type)
+static Token identifier()
 {
-    int dist = (int)(scanner.current - scanner.start);
-    int compare = (memcmp(scanner.start + start, rest, rest_length) == 0);
-    if ((dist == rest_length + start) && compare)
-    {
-        return type;
-    }
-    return TOKEN_IDENTIFIER;
+    skip_class(CHAR_WORD);
+    return make_token(get_token_type());
 }
 
-static TokenType get_token_type()
+/* memchr is vectorized by the C library, a comment is skipped a block at a time */
+static Token comment()
 {
-    switch (scanner.start[0])
+    do
     {
-    case 'a': {
-        if ((scanner.current - scanner.start) > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'n': {
-                switch (scanner.start[2])
-                {
-                case 'u':
-                    return match_token(3, 0, "", TOKEN_ANU);
-                case 'd':
-                    return match_token(3, 2, "ai", TOKEN_ANDAI);
-                }
-            }
-            break;
-            case 't': {
-                return match_token(2, 2, "au", TOKEN_ATAU);
-            }
-            break;
-            }
-        }
-        break;
-    }
-    case 'b': {
-        if ((scanner.current - scanner.start) > 1)
-        {
-            if (scanner.start[1] == 'a')
-            {
-                switch (scanner.start[2])
-                {
-                case 'w':
-                    return match_token(3, 3, "aan", TOKEN_BAWAAN);
-                case 's':
-                    return match_token(3, 2, "mi", TOKEN_BASMI);
-                case 'l':
-                    return match_token(3, 2, "ik", TOKEN_BALIK);
-                }
-            }
-        }
-        break;
-    }
-    case 'd':
-        return match_token(1, 2, "an", TOKEN_DAN);
-    case 'f':
-        return match_token(1, 5, "ungsi", TOKEN_FUNGSI);
-    case 'h':
-        return match_token(1, 2, "al", TOKEN_HAL);
-    case 'j': {
-        if ((scanner.current - scanner.start) > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'm':
-                return match_token(2, 2, "lh", TOKEN_JMLH);
-            case 'i':
-                return match_token(2, 2, "ka", TOKEN_JIKA);
-            }
-        }
-        break;
-    }
-
-    case 'k': {
-        if ((scanner.current - scanner.start) > 1)
-        {
-            switch (scanner.start[1])
-            {
-            case 'e': {
-                switch (scanner.start[2])
-                {
-                case 'l':
-                    switch (scanner.start[3])
-                    {
-                    case 'a':
-                        switch (scanner.start[4])
-                        {
-                        case 'r':
-                            return match_token(5, 0, "", TOKEN_KELAR);
-                        case 's':
-                            return match_token(5, 0, "", TOKEN_KELAS);
-                        }
-                    }
-                }
-                break;
-            }
-            case 'a':
-                return match_token(2, 3, "wal", TOKEN_KAWAL);
-            case 'o':
-                return match_token(2, 3, "nst", TOKEN_KONST);
-            }
-        }
-        break;
-    }
-    case 'l':
-        return match_token(1, 3, "agi", TOKEN_LAGI);
-    case 'n':
-        return match_token(1, 4, "ihil", TOKEN_NIHIL);
-    case 'p':
-        return match_token(1, 3, "ula", TOKEN_PULA);
-    case 's': {
-        if ((scanner.current - scanner.start) > 1)
+        const char *newline = memchr(scanner.current, '\n', scanner.end - scanner.current);
+        if (newline != NULL)
         {
-            switch (scanner.start[1])
-            {
-            case 'a': {
-                switch (scanner.start[2])
-                {
-                case 'a':
-                    return match_token(3, 1, "t", TOKEN_SAAT);
-                case 'h':
-                    return match_token(3, 0, "", TOKEN_SAH);
-                }
-            }
+            scanner.current = newline;
             break;
-            case 'e':
-                return match_token(2, 3, "sat", TOKEN_SESAT);
-            case 'u':
-                return match_token(2, 3, "per", TOKEN_SUPER);
-            }
         }
-        break;
-    }
-    case 't':
-        return match_token(1, 5, "ampil", TOKEN_TAMPIL);
-    case 'u':
-        return match_token(1, 4, "lang", TOKEN_ULANG);
-    }
+        scanner.current = scanner.end;
+    } while (refill(scanner.current));
 
-    return TOKEN_IDENTIFIER;
+    return make_token(TOKEN_COMMENT);
 }
 
-static Token identifier()
+static Token string()
 {
-    for (;;)
+    do
     {
-        char c = peek();
-        if (is_alpha(c) || is_digit(c))
-            advance();
-        else
-            break;
-    }
-    return make_token(get_token_type());
-}
-
-static Token comment()
-{
-    while (peek() != '\n' && !is_at_end())
-        advance();
+        const char *quote = memchr(scanner.current, '"', scanner.end - scanner.current);
+        if (quote != NULL)
+        {
+            scanner.line_number += count_lines(scanner.current, quote);
+            scanner.current = quote + 1;
+            return make_token(TOKEN_STRING);
+        }
+        scanner.line_number += count_lines(scanner.current, scanner.end);
+        scanner.current = scanner.end;
+    } while (refill(scanner.current));
 
-    return make_token(TOKEN_COMMENT);
+    return make_token(TOKEN_ERROR);
 }
 
-static Token string()
+#ifdef __SSE2__
+/*
+ * Skips whitespace 16 bytes at a time. A byte is skipped when it is a space,
+ * or below 0x0E (signed, so UTF-8 bytes count too) and neither NUL nor 0x08,
+ * the same set as CHAR_SPACE. Never reads past the terminator of the window.
+ * */
+static const char *skip_space_wide(const char *current)
 {
-    while (peek() != '"' && !is_at_end())
-    {
-        if (peek() == '\n')
-            scanner.line_number++;
-        advance();
-    }
+    const __m128i blank = _mm_set1_epi8(' ');
+    const __m128i below = _mm_set1_epi8(0x0E);
+    const __m128i nul = _mm_setzero_si128();
+    const __m128i backspace = _mm_set1_epi8(0x08);
+    const __m128i newline = _mm_set1_epi8('\n');
 
-    if (peek() == '"')
+    while (scanner.end - current >= 16)
     {
-        advance();
-        return make_token(TOKEN_STRING);
+        __m128i bytes = _mm_loadu_si128((const __m128i *)current);
+        __m128i excluded = _mm_or_si128(_mm_cmpeq_epi8(bytes, nul), _mm_cmpeq_epi8(bytes, backspace));
+        __m128i space = _mm_or_si128(_mm_andnot_si128(excluded, _mm_cmplt_epi8(bytes, below)),
+                                     _mm_cmpeq_epi8(bytes, blank));
+
+        unsigned stop = ~(unsigned)_mm_movemask_epi8(space) & 0xFFFF;
+        unsigned newlines = (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(bytes, newline));
+        if (stop != 0)
+        {
+            unsigned skipped = __builtin_ctz(stop);
+            scanner.line_number += __builtin_popcount(newlines & ((1u << skipped) - 1));
+            return current + skipped;
+        }
+
+        scanner.line_number += __builtin_popcount(newlines);
+        current += 16;
     }
 
-    return make_token(TOKEN_ERROR);
+    return current;
 }
+#endif
 
+/*
+ * Most runs are a space or a newline and a short indent, which the scalar
+ * loop handles best; runs longer than 16 bytes switch to skip_space_wide.
+ * */
 static void trim()
 {
-    for (;;)
+    do
     {
-        char c = peek();
-        if (isspace(c) || (c > '\x00' && c < '\x08') || (c < 0))
+        const char *current = scanner.current;
+        const char *wide = current + 16;
+        while (char_class[(uint8_t)*current] & CHAR_SPACE)
         {
-            advance();
+            if (*current == '\n')
+                scanner.line_number++;
+            current++;
+#ifdef __SSE2__
+            if (current == wide)
+                current = skip_space_wide(current);
+#endif
         }
-        else
-        {
-            return;
-        }
-        if (c == '\n')
-        {
-            scanner.line_number++;
-        }
-    }
+        scanner.current = current;
+    } while (refill(scanner.current));
 }
 
 Token scan_token()
 {
+    // Nothing before this token is needed once the window is refilled
+    scanner.start = scanner.current;
     trim();
     scanner.start = scanner.current;
 
+    // Never step over the terminator, the parser may ask again after TOKEN_EOF
+    if (is_at_end())
+        return make_token(TOKEN_EOF);
+
     char cur = advance();
     switch (cur)
     {
@@ -399,12 +416,22 @@ Token scan_token()
 
 void init_scanner(const char *source)
 {
-    scanner.start = NULL;
+    scanner.start = source;
     scanner.current = source;
+    scanner.end = source + strlen(source);
     scanner.line_number = 1;
+    scanner.stream = NULL;
+}
+
+void init_scanner_stream(SourceStream *stream)
+{
+    init_scanner(stream->buffer);
+    scanner.end = stream->buffer + stream->length;
+    scanner.stream = stream;
 }
 
 void setup_scanner(char *source)
 {
     scanner.current = source;
+    scanner.end = source + strlen(source);
 }
@@ -2,17 +2,23 @@
 #define CWS_SCANNER_H
 
 #include "common.h"
+#include "source.h"
 #include "token.h"
 
 typedef struct
 {
     const char *start;
     const char *current;
+    // The NUL that ends the source, or the current window of a stream
+    const char *end;
     int line_number;
 
+    // NULL when scanning a string held in memory
+    SourceStream *stream;
 } Scanner;
 
 void init_scanner(const char *source);
+void init_scanner_stream(SourceStream *stream);
 void setup_scanner(char *source);
 Token scan_token();
 
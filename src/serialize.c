@@ -0,0 +1,243 @@
+#include "serialize.h"
+#include "hash.h"
+
+#include <fcntl.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif
+
+/* ===== WRITER ===== */
+
+void init_writer(Writer *writer)
+{
+    writer->bytes = NULL;
+    writer->count = 0;
+    writer->capacity = 0;
+}
+
+void free_writer(Writer *writer)
+{
+    free(writer->bytes);
+    init_writer(writer);
+}
+
+void write_bytes(Writer *writer, const void *bytes, size_t count)
+{
+    if (writer->capacity < writer->count + count)
+    {
+        size_t capacity = writer->capacity < 256 ? 256 : writer->capacity;
+        while (capacity < writer->count + count)
+            capacity *= 2;
+
+        writer->bytes = realloc(writer->bytes, capacity);
+        if (writer->bytes == NULL)
+        {
+            fprintf(stderr, "Not enough memory to serialize\n");
+            exit(74);
+        }
+        writer->capacity = capacity;
+    }
+
+    memcpy(writer->bytes + writer->count, bytes, count);
+    writer->count += count;
+}
+
+void write_u8(Writer *writer, uint8_t value)
+{
+    write_bytes(writer, &value, 1);
+}
+
+void write_u32(Writer *writer, uint32_t value)
+{
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; ++i)
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    write_bytes(writer, bytes, 4);
+}
+
+void write_u64(Writer *writer, uint64_t value)
+{
+    uint8_t bytes[8];
+    for (int i = 0; i < 8; ++i)
+        bytes[i] = (uint8_t)(value >> (8 * i));
+    write_bytes(writer, bytes, 8);
+}
+
+void write_chars(Writer *writer, const char *chars, int length)
+{
+    write_u32(writer, length);
+    write_bytes(writer, chars, length);
+}
+
+/* Writes to a temporary file first so a concurrent reader never sees half a file */
+bool write_file(Writer *writer, const char *path)
+{
+    size_t temp_size = strlen(path) + 32;
+    char *temp_path = malloc(temp_size);
+    if (temp_path == NULL)
+        return false;
+
+    snprintf(temp_path, temp_size, "%s.%ld.tmp", path, (long)getpid());
+    FILE *fd = fopen(temp_path, "wb");
+    if (fd == NULL)
+    {
+        free(temp_path);
+        return false;
+    }
+
+    bool is_written = fwrite(writer->bytes, 1, writer->count, fd) == writer->count;
+    is_written = (fclose(fd) == 0) && is_written;
+
+    if (!is_written || rename(temp_path, path) != 0)
+    {
+        remove(temp_path);
+        is_written = false;
+    }
+
+    free(temp_path);
+    return is_written;
+}
+
+/* Writes a placeholder for the checksum, patch_checksum fills it in once the body is written */
+size_t reserve_checksum(Writer *writer)
+{
+    size_t offset = writer->count;
+    write_u64(writer, 0);
+    return offset;
+}
+
+void patch_checksum(Writer *writer, size_t offset)
+{
+    size_t body = offset + 8;
+    uint64_t checksum = fnv_64a_buf((const char *)writer->bytes + body, writer->count - body);
+    for (int i = 0; i < 8; ++i)
+        writer->bytes[offset + i] = (uint8_t)(checksum >> (8 * i));
+}
+
+/* ===== READER ===== */
+
+void init_reader(Reader *reader, const void *bytes, size_t size)
+{
+    reader->cursor = bytes;
+    reader->end = (const uint8_t *)bytes + size;
+    reader->is_error = false;
+}
+
+const uint8_t *read_bytes(Reader *reader, size_t count)
+{
+    if (reader->is_error || (size_t)(reader->end - reader->cursor) < count)
+    {
+        reader->is_error = true;
+        return NULL;
+    }
+
+    const uint8_t *bytes = reader->cursor;
+    reader->cursor += count;
+    return bytes;
+}
+
+uint8_t read_u8(Reader *reader)
+{
+    const uint8_t *bytes = read_bytes(reader, 1);
+    return bytes == NULL ? 0 : bytes[0];
+}
+
+uint32_t read_u32(Reader *reader)
+{
+    const uint8_t *bytes = read_bytes(reader, 4);
+    if (bytes == NULL)
+        return 0;
+
+    uint32_t value = 0;
+    for (int i = 0; i < 4; ++i)
+        value |= (uint32_t)bytes[i] << (8 * i);
+    return value;
+}
+
+uint64_t read_u64(Reader *reader)
+{
+    const uint8_t *bytes = read_bytes(reader, 8);
+    if (bytes == NULL)
+        return 0;
+
+    uint64_t value = 0;
+    for (int i = 0; i < 8; ++i)
+        value |= (uint64_t)bytes[i] << (8 * i);
+    return value;
+}
+
+/* Reads the checksum and compares it with the rest of the input, which is left for the caller to parse */
+bool read_checksum(Reader *reader)
+{
+    uint64_t checksum = read_u64(reader);
+    if (reader->is_error)
+        return false;
+
+    return checksum == fnv_64a_buf((const char *)reader->cursor, reader->end - reader->cursor);
+}
+
+ObjectString *read_string(Reader *reader)
+{
+    uint32_t length = read_u32(reader);
+    const uint8_t *chars = read_bytes(reader, length);
+    if (chars == NULL)
+        return NULL;
+
+    return copy_string((const char *)chars, length);
+}
+
+/* ===== FILES ===== */
+
+bool map_file(const char *path, MappedFile *file)
+{
+    int fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || st.st_size == 0)
+    {
+        close(fd);
+        return false;
+    }
+
+    file->size = st.st_size;
+#ifdef _WIN32
+    file->bytes = NULL;
+    file->is_mapped = false;
+#else
+    file->bytes = mmap(NULL, file->size, PROT_READ, MAP_PRIVATE, fd, 0);
+    file->is_mapped = file->bytes != MAP_FAILED;
+#endif
+
+    if (!file->is_mapped)
+    {
+        // Fall back to reading the whole file, e.g. on Windows or filesystems without mmap
+        file->bytes = malloc(file->size);
+        if (file->bytes == NULL || read(fd, file->bytes, file->size) != (ssize_t)file->size)
+        {
+            free(file->bytes);
+            close(fd);
+            return false;
+        }
+    }
+
+    close(fd);
+    return true;
+}
+
+void unmap_file(MappedFile *file)
+{
+#ifndef _WIN32
+    if (file->is_mapped)
+    {
+        munmap(file->bytes, file->size);
+        return;
+    }
+#endif
+    free(file->bytes);
+}
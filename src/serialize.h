@@ -0,0 +1,60 @@
+#ifndef CWS_SERIALIZE_H
+#define CWS_SERIALIZE_H
+
+#include "object.h"
+
+/*
+ * Little endian binary writer/reader shared by the bytecode cache and the
+ * heap snapshot. The reader never reads past `end`, it sets `is_error`
+ * instead and returns zeroes from then on.
+ */
+typedef struct
+{
+    uint8_t *bytes;
+    size_t count;
+    size_t capacity;
+} Writer;
+
+typedef struct
+{
+    const uint8_t *cursor;
+    const uint8_t *end;
+    bool is_error;
+} Reader;
+
+typedef struct
+{
+    void *bytes;
+    size_t size;
+    bool is_mapped;
+} MappedFile;
+
+void init_writer(Writer *writer);
+void free_writer(Writer *writer);
+void write_bytes(Writer *writer, const void *bytes, size_t count);
+void write_u8(Writer *writer, uint8_t value);
+void write_u32(Writer *writer, uint32_t value);
+void write_u64(Writer *writer, uint64_t value);
+void write_chars(Writer *writer, const char *chars, int length);
+bool write_file(Writer *writer, const char *path);
+
+/*
+ * Both files end their header with a u64 FNV-1a checksum of every byte that
+ * follows it. The header only says which source or version the file belongs
+ * to, the checksum rejects a body corrupted on disk before it is parsed.
+ */
+size_t reserve_checksum(Writer *writer);
+void patch_checksum(Writer *writer, size_t offset);
+bool read_checksum(Reader *reader);
+
+void init_reader(Reader *reader, const void *bytes, size_t size);
+const uint8_t *read_bytes(Reader *reader, size_t count);
+uint8_t read_u8(Reader *reader);
+uint32_t read_u32(Reader *reader);
+uint64_t read_u64(Reader *reader);
+ObjectString *read_string(Reader *reader);
+
+bool map_file(const char *path, MappedFile *file);
+void unmap_file(MappedFile *file);
+
+#endif // !CWS_SERIALIZE_H
@@ -0,0 +1,925 @@
+#include "snapshot.h"
+#include "bytecode.h"
+#include "serialize.h"
+#include "table.h"
+#include "vm.h"
+
+#include <string.h>
+
+/*
+ * HEAP SNAPSHOT
+ *
+ * Layout (every integer is little endian) :
+ *
+ *   header  : "CWSI", u32 snapshot version, u32 bytecode version,
+ *             u64 checksum of the objects and the globals (FNV-1a)
+ *   objects : u32 count, then one record per object :
+ *             u8 ObjType, u32 payload length, payload
+ *   globals : u32 count, then (name, value) for every defined global
+ *
+ * Objects refer to each other by their record index, which makes the image
+ * independent of the addresses it was taken at. Functions are stored in the
+ * bytecode cache format, natives by the name of the global holding them and
+ * string views as plain strings.
+ *
+ * Because objects can refer to each other in cycles, loading walks the records
+ * three times :
+ *  1. strings, functions and natives, which are complete on their own
+ *  2. empty shells for every other object
+ *  3. the fields of the shells, now that every index resolves
+ *
+ * An image is checked like a bytecode cache: the checksum rejects a damaged
+ * body, the code of every function goes through read_function and the
+ * globals have to take the slots their functions were compiled against.
+ * */
+
+typedef enum
+{
+    SNAPSHOT_NIL,
+    SNAPSHOT_TRUE,
+    SNAPSHOT_FALSE,
+    SNAPSHOT_NUMBER,
+    SNAPSHOT_OBJECT,
+    SNAPSHOT_UNDEFINED,
+} SnapshotTag;
+
+#define SNAPSHOT_NONE UINT32_MAX
+
+bool snapshot_path(const char *source_path, char *path, size_t size)
+{
+    int length = snprintf(path, size, "%si", source_path);
+    return length > 0 && (size_t)length < size;
+}
+
+/* ===== OBJECT INDEX ===== */
+
+typedef struct
+{
+    Obj *key;
+    uint32_t index;
+} IndexEntry;
+
+/* Assigns every reachable object its record index, `objects` doubles as the work list */
+typedef struct
+{
+    uint32_t capacity;
+    IndexEntry *entries;
+
+    uint32_t count;
+    uint32_t objects_cap;
+    Obj **objects;
+} ObjectIndex;
+
+static uint32_t hash_pointer(Obj *obj)
+{
+    uint64_t key = (uint64_t)(uintptr_t)obj;
+    return (uint32_t)((key >> 3) * 0x9E3779B97F4A7C15ULL >> 32);
+}
+
+static IndexEntry *find_entry(IndexEntry *entries, uint32_t capacity, Obj *obj)
+{
+    uint32_t idx = hash_pointer(obj) & (capacity - 1);
+    while (entries[idx].key != NULL && entries[idx].key != obj)
+        idx = (idx + 1) & (capacity - 1);
+
+    return &entries[idx];
+}
+
+static void grow_index(ObjectIndex *index)
+{
+    uint32_t capacity = index->capacity < 64 ? 64 : index->capacity * 2;
+    IndexEntry *entries = calloc(capacity, sizeof(IndexEntry));
+    if (entries == NULL)
+    {
+        fprintf(stderr, "Not enough memory to take the snapshot\n");
+        exit(74);
+    }
+
+    for (uint32_t i = 0; i < index->capacity; ++i)
+    {
+        if (index->entries[i].key != NULL)
+            *find_entry(entries, capacity, index->entries[i].key) = index->entries[i];
+    }
+
+    free(index->entries);
+    index->entries = entries;
+    index->capacity = capacity;
+}
+
+static uint32_t index_object(ObjectIndex *index, Obj *obj)
+{
+    if (obj == NULL)
+        return SNAPSHOT_NONE;
+
+    if (index->capacity == 0 || (index->count + 1) * 2 > index->capacity)
+        grow_index(index);
+
+    IndexEntry *entry = find_entry(index->entries, index->capacity, obj);
+    if (entry->key != NULL)
+        return entry->index;
+
+    if (index->count == index->objects_cap)
+    {
+        index->objects_cap = index->objects_cap < 64 ? 64 : index->objects_cap * 2;
+        index->objects = realloc(index->objects, index->objects_cap * sizeof(Obj *));
+        if (index->objects == NULL)
+        {
+            fprintf(stderr, "Not enough memory to take the snapshot\n");
+            exit(74);
+        }
+    }
+
+    entry->key = obj;
+    entry->index = index->count;
+    index->objects[index->count++] = obj;
+    return entry->index;
+}
+
+static void index_value(ObjectIndex *index, Value value)
+{
+    if (IS_OBJ(value))
+        index_object(index, AS_OBJ(value));
+}
+
+static void index_map(ObjectIndex *index, Map *map)
+{
+    for (size_t i = 0; i < map->capacity; ++i)
+    {
+        Entry *entry = &map->entries[i];
+        if (entry->key == NULL)
+            continue;
+
+        index_object(index, (Obj *)entry->key);
+        index_value(index, entry->value);
+    }
+}
+
+/* An open upvalue still points into the stack of the script that created it */
+static Value upvalue_value(ObjectUpValue *upvalue)
+{
+    return upvalue->p_val == NULL ? vm->stack.items[upvalue->idx] : *upvalue->p_val;
+}
+
+static void index_references(ObjectIndex *index, Obj *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_CLOSURE: {
+        ObjectClosure *closure = (ObjectClosure *)obj;
+        index_object(index, (Obj *)closure->function);
+        for (int i = 0; i < closure->upvalue_count; ++i)
+            index_object(index, (Obj *)closure->upvalues[i]);
+        break;
+    }
+    case OBJ_UPVALUE:
+        index_value(index, upvalue_value((ObjectUpValue *)obj));
+        break;
+    case OBJ_CLASS:
+        index_object(index, (Obj *)((ObjectClass *)obj)->name);
+        index_map(index, &((ObjectClass *)obj)->methods);
+        break;
+    case OBJ_INSTANCE:
+        index_object(index, (Obj *)((ObjectInstance *)obj)->klass);
+        index_map(index, &((ObjectInstance *)obj)->table);
+        break;
+    case OBJ_METHOD:
+        index_value(index, ((ObjectMethod *)obj)->receiver);
+        index_object(index, (Obj *)((ObjectMethod *)obj)->closure);
+        break;
+    case OBJ_TABLE: {
+        ObjectTable *table = (ObjectTable *)obj;
+        for (uint32_t i = 0; i < table->array_cap; ++i)
+            index_value(index, table->array[i]);
+        index_map(index, &table->values);
+        break;
+    }
+    case OBJ_ARRAY: {
+        // The push/pop methods are recreated by new_array
+        ObjectArray *array = (ObjectArray *)obj;
+        for (uint32_t i = 0; i < array->count; ++i)
+            index_value(index, array->values[i]);
+        break;
+    }
+    default:
+        // Strings, views, functions and natives do not refer to other heap objects
+        break;
+    }
+}
+
+static void free_index(ObjectIndex *index)
+{
+    free(index->entries);
+    free(index->objects);
+}
+
+/* ===== WRITER ===== */
+
+static void write_value(Writer *writer, ObjectIndex *index, Value value)
+{
+    if (IS_UNDEFINED(value))
+    {
+        write_u8(writer, SNAPSHOT_UNDEFINED);
+    }
+    else if (IS_NIL(value))
+    {
+        write_u8(writer, SNAPSHOT_NIL);
+    }
+    else if (IS_BOOLEAN(value))
+    {
+        write_u8(writer, AS_BOOL(value) ? SNAPSHOT_TRUE : SNAPSHOT_FALSE);
+    }
+    else if (IS_NUMBER(value))
+    {
+        double number = AS_NUMBER(value);
+        uint64_t bits;
+        memcpy(&bits, &number, sizeof(bits));
+
+        write_u8(writer, SNAPSHOT_NUMBER);
+        write_u64(writer, bits);
+    }
+    else
+    {
+        write_u8(writer, SNAPSHOT_OBJECT);
+        write_u32(writer, index_object(index, AS_OBJ(value)));
+    }
+}
+
+static void write_map(Writer *writer, ObjectIndex *index, Map *map)
+{
+    uint32_t count = 0;
+    for (size_t i = 0; i < map->capacity; ++i)
+    {
+        if (map->entries[i].key != NULL)
+            count++;
+    }
+
+    write_u32(writer, count);
+    for (size_t i = 0; i < map->capacity; ++i)
+    {
+        Entry *entry = &map->entries[i];
+        if (entry->key == NULL)
+            continue;
+
+        write_u32(writer, index_object(index, (Obj *)entry->key));
+        write_value(writer, index, entry->value);
+    }
+}
+
+/* Natives can't be serialized, they are looked up again by their global name */
+static ObjectString *native_name(ObjectNative *native)
+{
+    for (uint32_t i = 0; i < vm->global_values.count; ++i)
+    {
+        Value value = vm->global_values.values[i];
+        if (IS_NATIVE(value) && AS_NATIVE(value)->function == native->function &&
+            AS_NATIVE(value)->host == native->host && AS_NATIVE(value)->userdata == native->userdata)
+            return AS_STRING(vm->global_names.values[i]);
+    }
+
+    return NULL;
+}
+
+static bool write_record(Writer *writer, ObjectIndex *index, Obj *obj)
+{
+    switch (obj->type)
+    {
+    case OBJ_STRING: {
+        ObjectString *string = (ObjectString *)obj;
+        write_chars(writer, string->chars, string->length);
+        return true;
+    }
+    case OBJ_STRING_VIEW: {
+        StringRef ref = string_ref(VALUE_OBJ(obj));
+        write_chars(writer, ref.chars, ref.length);
+        return true;
+    }
+    case OBJ_FUNCTION:
+        return write_function(writer, (ObjectFunction *)obj);
+    case OBJ_NATIVE: {
+        ObjectString *name = native_name((ObjectNative *)obj);
+        if (name == NULL)
+            return false;
+
+        write_chars(writer, name->chars, name->length);
+        return true;
+    }
+    case OBJ_CLOSURE: {
+        ObjectClosure *closure = (ObjectClosure *)obj;
+        write_u32(writer, index_object(index, (Obj *)closure->function));
+        write_u32(writer, closure->upvalue_count);
+        for (int i = 0; i < closure->upvalue_count; ++i)
+            write_u32(writer, index_object(index, (Obj *)closure->upvalues[i]));
+        return true;
+    }
+    case OBJ_UPVALUE:
+        // Restored upvalues are always closed, they no longer belong to a running frame
+        write_value(writer, index, upvalue_value((ObjectUpValue *)obj));
+        return true;
+    case OBJ_CLASS: {
+        ObjectClass *klass = (ObjectClass *)obj;
+        write_u32(writer, index_object(index, (Obj *)klass->name));
+        write_map(writer, index, &klass->methods);
+        return true;
+    }
+    case OBJ_INSTANCE: {
+        ObjectInstance *instance = (ObjectInstance *)obj;
+        write_u32(writer, index_object(index, (Obj *)instance->klass));
+        write_map(writer, index, &instance->table);
+        return true;
+    }
+    case OBJ_METHOD: {
+        ObjectMethod *method = (ObjectMethod *)obj;
+        write_value(writer, index, method->receiver);
+        write_u32(writer, index_object(index, (Obj *)method->closure));
+        return true;
+    }
+    case OBJ_TABLE: {
+        ObjectTable *table = (ObjectTable *)obj;
+        write_u32(writer, table->array_count);
+        for (uint32_t i = 0; i < table->array_cap; ++i)
+        {
+            if (IS_UNDEFINED(table->array[i]))
+                continue;
+
+            write_u32(writer, i);
+            write_value(writer, index, table->array[i]);
+        }
+        write_map(writer, index, &table->values);
+        return true;
+    }
+    case OBJ_ARRAY: {
+        ObjectArray *array = (ObjectArray *)obj;
+        write_u32(writer, array->count);
+        for (uint32_t i = 0; i < array->count; ++i)
+            write_value(writer, index, array->values[i]);
+        return true;
+    }
+    default:
+        return false;
+    }
+}
+
+static void patch_u32(Writer *writer, size_t offset, uint32_t value)
+{
+    for (int i = 0; i < 4; ++i)
+        writer->bytes[offset + i] = (uint8_t)(value >> (8 * i));
+}
+
+/* Everything reachable from the objects indexed so far gets an index before any record is written */
+static void index_reachable(ObjectIndex *index)
+{
+    for (uint32_t i = 0; i < index->count; ++i)
+        index_references(index, index->objects[i]);
+}
+
+static bool write_records(Writer *writer, ObjectIndex *index)
+{
+    write_u32(writer, index->count);
+    for (uint32_t i = 0; i < index->count; ++i)
+    {
+        Obj *obj = index->objects[i];
+        write_u8(writer, obj->type == OBJ_STRING_VIEW ? OBJ_STRING : obj->type);
+
+        size_t length_offset = writer->count;
+        write_u32(writer, 0);
+        if (!write_record(writer, index, obj))
+            return false;
+
+        patch_u32(writer, length_offset, writer->count - length_offset - 4);
+    }
+
+    return true;
+}
+
+static bool write_snapshot(Writer *writer, ObjectIndex *index)
+{
+    for (uint32_t i = 0; i < vm->global_values.count; ++i)
+        index_value(index, vm->global_values.values[i]);
+    index_reachable(index);
+
+    write_bytes(writer, SNAPSHOT_MAGIC, 4);
+    write_u32(writer, SNAPSHOT_VERSION);
+    write_u32(writer, BYTECODE_VERSION);
+    size_t checksum = reserve_checksum(writer);
+
+    if (!write_records(writer, index))
+        return false;
+
+    write_u32(writer, vm->global_values.count);
+    for (uint32_t i = 0; i < vm->global_values.count; ++i)
+    {
+        ObjectString *name = AS_STRING(vm->global_names.values[i]);
+        write_chars(writer, name->chars, name->length);
+        write_value(writer, index, vm->global_values.values[i]);
+    }
+
+    patch_checksum(writer, checksum);
+    return true;
+}
+
+bool dump_snapshot(const char *path)
+{
+    ObjectIndex index = {0, NULL, 0, 0, NULL};
+    Writer writer;
+    init_writer(&writer);
+
+    bool is_written = write_snapshot(&writer, &index) && write_file(&writer, path);
+
+    free_writer(&writer);
+    free_index(&index);
+    return is_written;
+}
+
+/* ===== READER ===== */
+
+typedef struct
+{
+    Reader reader;
+    const uint8_t *records;
+    uint32_t count;
+
+    // Every restored object lives in a stack slot from `base` on, which keeps them alive while the image is loading
+    int base;
+} Restore;
+
+#define RESTORED(restore, idx) (vm->stack.items[(restore)->base + (idx)])
+
+static Obj *resolve_object(Restore *restore, Reader *reader, uint32_t idx, ObjType type)
+{
+    if (idx >= restore->count || !IS_OBJ(RESTORED(restore, idx)))
+    {
+        reader->is_error = true;
+        return NULL;
+    }
+
+    Obj *obj = AS_OBJ(RESTORED(restore, idx));
+    if (obj->type != type)
+    {
+        reader->is_error = true;
+        return NULL;
+    }
+    return obj;
+}
+
+static Value read_value(Restore *restore, Reader *reader)
+{
+    switch (read_u8(reader))
+    {
+    case SNAPSHOT_NIL:
+        return VALUE_NIL;
+    case SNAPSHOT_TRUE:
+        return VALUE_BOOL(true);
+    case SNAPSHOT_FALSE:
+        return VALUE_BOOL(false);
+    case SNAPSHOT_UNDEFINED:
+        return VALUE_UNDEFINED;
+    case SNAPSHOT_NUMBER: {
+        uint64_t bits = read_u64(reader);
+        double number;
+        memcpy(&number, &bits, sizeof(number));
+        return VALUE_NUMBER(number);
+    }
+    case SNAPSHOT_OBJECT: {
+        uint32_t idx = read_u32(reader);
+        if (idx >= restore->count || !IS_OBJ(RESTORED(restore, idx)))
+        {
+            reader->is_error = true;
+            return VALUE_NIL;
+        }
+        return RESTORED(restore, idx);
+    }
+    default:
+        reader->is_error = true;
+        return VALUE_NIL;
+    }
+}
+
+static bool read_map(Restore *restore, Reader *reader, Map *map)
+{
+    uint32_t count = read_u32(reader);
+    map_reserve(map, count);
+    for (uint32_t i = 0; i < count && !reader->is_error; ++i)
+    {
+        ObjectString *key = (ObjectString *)resolve_object(restore, reader, read_u32(reader), OBJ_STRING);
+        Value value = read_value(restore, reader);
+        if (reader->is_error)
+            return false;
+
+        map_set(map, key, value);
+    }
+
+    return !reader->is_error;
+}
+
+static void set_object(Restore *restore, uint32_t idx, Obj *obj)
+{
+    RESTORED(restore, idx) = VALUE_OBJ(obj);
+}
+
+/* Pass 1 : objects that are complete on their own */
+static bool restore_complete(Restore *restore, uint32_t idx, ObjType type, Reader *reader)
+{
+    switch (type)
+    {
+    case OBJ_STRING: {
+        ObjectString *string = read_string(reader);
+        if (string == NULL)
+            return false;
+        set_object(restore, idx, (Obj *)string);
+        return true;
+    }
+    case OBJ_FUNCTION: {
+        ObjectFunction *function = read_function(reader);
+        if (function == NULL)
+            return false;
+        set_object(restore, idx, (Obj *)function);
+        return true;
+    }
+    case OBJ_NATIVE: {
+        ObjectString *name = read_string(reader);
+        Value slot;
+        if (name == NULL || !map_get(&vm->globals, name, &slot))
+            return false;
+
+        Value native = vm->global_values.values[(uint32_t)AS_NUMBER(slot)];
+        if (!IS_NATIVE(native))
+            return false;
+        set_object(restore, idx, AS_OBJ(native));
+        return true;
+    }
+    default:
+        return true;
+    }
+}
+
+/* Pass 2 : empty objects that the other records can point to */
+static bool restore_shell(Restore *restore, uint32_t idx, ObjType type, Reader *reader)
+{
+    switch (type)
+    {
+    case OBJ_CLOSURE: {
+        ObjectFunction *function =
+            (ObjectFunction *)resolve_object(restore, reader, read_u32(reader), OBJ_FUNCTION);
+        if (function == NULL || (int)read_u32(reader) != function->upvalue_count)
+            return false;
+        set_object(restore, idx, (Obj *)new_closure(function));
+        return true;
+    }
+    case OBJ_UPVALUE: {
+        ObjectUpValue *upvalue = new_upvalue();
+        upvalue->val = VALUE_NIL;
+        upvalue->p_val = &upvalue->val;
+        set_object(restore, idx, (Obj *)upvalue);
+        return true;
+    }
+    case OBJ_CLASS:
+        set_object(restore, idx, (Obj *)new_class(NULL));
+        return true;
+    case OBJ_INSTANCE:
+        set_object(restore, idx, (Obj *)new_instance(NULL));
+        return true;
+    case OBJ_METHOD:
+        set_object(restore, idx, (Obj *)new_method(VALUE_NIL, NULL));
+        return true;
+    case OBJ_TABLE:
+        set_object(restore, idx, (Obj *)new_table());
+        return true;
+    case OBJ_ARRAY:
+        set_object(restore, idx, (Obj *)new_array());
+        return true;
+    case OBJ_STRING:
+    case OBJ_FUNCTION:
+    case OBJ_NATIVE:
+        return true;
+    default:
+        return false;
+    }
+}
+
+/* Pass 3 : the fields of the shells */
+static bool restore_fields(Restore *restore, uint32_t idx, ObjType type, Reader *reader)
+{
+    Obj *obj = AS_OBJ(RESTORED(restore, idx));
+
+    switch (type)
+    {
+    case OBJ_CLOSURE: {
+        ObjectClosure *closure = (ObjectClosure *)obj;
+        read_u32(reader);
+        read_u32(reader);
+        for (int i = 0; i < closure->upvalue_count; ++i)
+        {
+            uint32_t upvalue = read_u32(reader);
+            if (upvalue != SNAPSHOT_NONE)
+                closure->upvalues[i] = (ObjectUpValue *)resolve_object(restore, reader, upvalue, OBJ_UPVALUE);
+        }
+        break;
+    }
+    case OBJ_UPVALUE:
+        ((ObjectUpValue *)obj)->val = read_value(restore, reader);
+        break;
+    case OBJ_CLASS: {
+        ObjectClass *klass = (ObjectClass *)obj;
+        klass->name = (ObjectString *)resolve_object(restore, reader, read_u32(reader), OBJ_STRING);
+        read_map(restore, reader, &klass->methods);
+        break;
+    }
+    case OBJ_INSTANCE: {
+        ObjectInstance *instance = (ObjectInstance *)obj;
+        instance->klass = (ObjectClass *)resolve_object(restore, reader, read_u32(reader), OBJ_CLASS);
+        read_map(restore, reader, &instance->table);
+        break;
+    }
+    case OBJ_METHOD: {
+        ObjectMethod *method = (ObjectMethod *)obj;
+        method->receiver = read_value(restore, reader);
+        method->closure = (ObjectClosure *)resolve_object(restore, reader, read_u32(reader), OBJ_CLOSURE);
+        break;
+    }
+    case OBJ_TABLE: {
+        ObjectTable *table = (ObjectTable *)obj;
+        uint32_t count = read_u32(reader);
+        for (uint32_t i = 0; i < count && !reader->is_error; ++i)
+        {
+            uint32_t key = read_u32(reader);
+            table_set(table, VALUE_NUMBER(key), read_value(restore, reader));
+        }
+
+        uint32_t hash_count = read_u32(reader);
+        map_reserve(&table->values, hash_count);
+        for (uint32_t i = 0; i < hash_count && !reader->is_error; ++i)
+        {
+            Obj *key = resolve_object(restore, reader, read_u32(reader), OBJ_STRING);
+            Value value = read_value(restore, reader);
+            if (reader->is_error)
+                return false;
+
+            table_set(table, VALUE_OBJ(key), value);
+        }
+        break;
+    }
+    case OBJ_ARRAY: {
+        ObjectArray *array = (ObjectArray *)obj;
+        uint32_t count = read_u32(reader);
+        for (uint32_t i = 0; i < count && !reader->is_error; ++i)
+            append_array(array, read_value(restore, reader));
+        break;
+    }
+    default:
+        // Already complete after the first pass
+        return true;
+    }
+
+    return !reader->is_error && reader->cursor == reader->end;
+}
+
+typedef bool (*RestorePass)(Restore *restore, uint32_t idx, ObjType type, Reader *reader);
+
+static bool restore_records(Restore *restore, RestorePass pass)
+{
+    Reader reader;
+    init_reader(&reader, restore->records, restore->reader.end - restore->records);
+
+    for (uint32_t i = 0; i < restore->count; ++i)
+    {
+        ObjType type = read_u8(&reader);
+        uint32_t length = read_u32(&reader);
+        const uint8_t *payload = read_bytes(&reader, length);
+        if (payload == NULL)
+            return false;
+
+        Reader record;
+        init_reader(&record, payload, length);
+        if (!pass(restore, i, type, &record))
+            return false;
+    }
+
+    // Points right after the last record
+    restore->reader.cursor = reader.cursor;
+    return true;
+}
+
+static bool restore_globals(Restore *restore)
+{
+    Reader *reader = &restore->reader;
+    uint32_t count = read_u32(reader);
+    for (uint32_t i = 0; i < count && !reader->is_error; ++i)
+    {
+        ObjectString *name = read_string(reader);
+        if (name == NULL)
+            return false;
+
+        push(VALUE_OBJ(name));
+        uint32_t slot = global_slot(name);
+        pop();
+
+        // The functions of the image were compiled against these slots
+        if (slot != i)
+            return false;
+
+        Value value = read_value(restore, reader);
+        if (!IS_UNDEFINED(value))
+            vm->global_values.values[slot] = value;
+    }
+
+    return !reader->is_error && reader->cursor == reader->end;
+}
+
+static bool read_records(Restore *restore)
+{
+    Reader *reader = &restore->reader;
+    restore->count = read_u32(reader);
+    restore->records = reader->cursor;
+    restore->base = vm->stack_top;
+    if (reader->is_error)
+        return false;
+
+    for (uint32_t i = 0; i < restore->count; ++i)
+        push(VALUE_NIL);
+
+    // Records come in the bucket order of the maps they were found in, inserting
+    // them into a smaller table that is still growing would build long probe chains
+    map_reserve(&vm->strings, restore->count);
+
+    return restore_records(restore, restore_complete) && restore_records(restore, restore_shell) &&
+           restore_records(restore, restore_fields);
+}
+
+static bool read_snapshot(Restore *restore)
+{
+    Reader *reader = &restore->reader;
+    const uint8_t *magic = read_bytes(reader, 4);
+    if (magic == NULL || memcmp(magic, SNAPSHOT_MAGIC, 4) != 0 || read_u32(reader) != SNAPSHOT_VERSION ||
+        read_u32(reader) != BYTECODE_VERSION || !read_checksum(reader))
+        return false;
+
+    if (!read_records(restore))
+        return false;
+
+    // The globals start with their count, no function may use a slot past it
+    Reader globals = restore->reader;
+    uint32_t global_count = read_u32(&globals);
+    for (uint32_t i = 0; i < restore->count; ++i)
+    {
+        Value value = RESTORED(restore, i);
+        if (IS_FUNCTION(value) && !check_global_slots(AS_FUNCTION(value), global_count))
+            return false;
+    }
+
+    return restore_globals(restore);
+}
+
+bool load_snapshot(const char *path)
+{
+    MappedFile file;
+    if (!map_file(path, &file))
+        return false;
+
+    int stack_top = vm->stack_top;
+
+    Restore restore;
+    init_reader(&restore.reader, file.bytes, file.size);
+    bool is_loaded = read_snapshot(&restore);
+
+    vm->stack_top = stack_top;
+    unmap_file(&file);
+    return is_loaded;
+}
+
+/* ===== CLONES ===== */
+
+bool write_clone(Writer *writer, Value *values, uint32_t count)
+{
+    ObjectIndex index = {0, NULL, 0, 0, NULL};
+    for (uint32_t i = 0; i < count; ++i)
+        index_value(&index, values[i]);
+    index_reachable(&index);
+
+    // A copy of a class would be unrelated to the sender's, and so would its instances
+    bool has_function = false;
+    for (uint32_t i = 0; i < index.count; ++i)
+    {
+        ObjType type = index.objects[i]->type;
+        if (type == OBJ_CLASS || type == OBJ_INSTANCE || type == OBJ_METHOD)
+        {
+            free_index(&index);
+            return false;
+        }
+        has_function = has_function || type == OBJ_FUNCTION;
+    }
+
+    bool is_written = write_records(writer, &index);
+    if (is_written)
+    {
+        write_u32(writer, count);
+        for (uint32_t i = 0; i < count; ++i)
+            write_value(writer, &index, values[i]);
+
+        uint32_t global_count = has_function ? vm->global_names.count : 0;
+        write_u32(writer, global_count);
+        for (uint32_t i = 0; i < global_count; ++i)
+        {
+            ObjectString *name = AS_STRING(vm->global_names.values[i]);
+            write_chars(writer, name->chars, name->length);
+        }
+    }
+
+    free_index(&index);
+    return is_written;
+}
+
+/* Rewrites the global operands of `function` and of the functions it defines from the sender's slots to ours */
+static bool remap_globals(ObjectFunction *function, uint32_t *slots, uint32_t count)
+{
+    Chunk *chunk = &function->chunk;
+    for (uint32_t offset = 0; offset < chunk->count; offset += instruction_length(chunk, offset))
+    {
+        uint8_t opcode = chunk->code[offset];
+        if (opcode != OP_GLOBAL_VAR && opcode != OP_GET_GLOBAL && opcode != OP_SET_GLOBAL)
+            continue;
+
+        uint32_t at = offset + 1;
+        uint32_t slot = READ4BYTE(at);
+        if (slot >= count)
+            return false;
+
+        for (int i = 0; i < 4; ++i)
+            chunk->code[offset + 1 + i] = (uint8_t)(slots[slot] >> (8 * (3 - i)));
+    }
+
+    for (uint32_t i = 0; i < chunk->constants.count; ++i)
+    {
+        Value constant = chunk->constants.values[i];
+        if (IS_FUNCTION(constant) && !remap_globals(AS_FUNCTION(constant), slots, count))
+            return false;
+    }
+    return true;
+}
+
+static bool read_clone_globals(Restore *restore)
+{
+    Reader *reader = &restore->reader;
+    uint32_t count = read_u32(reader);
+    if (count == 0 || reader->is_error)
+        return !reader->is_error;
+
+    uint32_t *slots = malloc(count * sizeof(uint32_t));
+    if (slots == NULL)
+        return false;
+
+    bool is_moved = false;
+    for (uint32_t i = 0; i < count && !reader->is_error; ++i)
+    {
+        ObjectString *name = read_string(reader);
+        if (name == NULL)
+        {
+            reader->is_error = true;
+            break;
+        }
+
+        push(VALUE_OBJ(name));
+        slots[i] = global_slot(name);
+        pop();
+        is_moved = is_moved || slots[i] != i;
+    }
+
+    // Both VMs define the same natives first, the slots usually line up already
+    bool is_read = !reader->is_error;
+    for (uint32_t i = 0; i < restore->count && is_read && is_moved; ++i)
+    {
+        Value value = RESTORED(restore, i);
+        if (IS_FUNCTION(value))
+            is_read = remap_globals(AS_FUNCTION(value), slots, count);
+    }
+
+    free(slots);
+    return is_read;
+}
+
+bool read_clone(const uint8_t *bytes, size_t size)
+{
+    int stack_top = vm->stack_top;
+
+    Restore restore;
+    init_reader(&restore.reader, bytes, size);
+
+    Reader *reader = &restore.reader;
+    bool is_read = read_records(&restore);
+    uint32_t count = is_read ? read_u32(reader) : 0;
+    for (uint32_t i = 0; i < count && is_read; ++i)
+    {
+        push(read_value(&restore, reader));
+        is_read = !reader->is_error;
+    }
+
+    if (!is_read || !read_clone_globals(&restore) || reader->cursor != reader->end)
+    {
+        vm->stack_top = stack_top;
+        return false;
+    }
+
+    // The values take the place of the objects
+    memmove(&vm->stack.items[stack_top], &RESTORED(&restore, restore.count), count * sizeof(Value));
+    vm->stack_top = stack_top + count;
+    return true;
+}
@@ -0,0 +1,35 @@
+#ifndef CWS_SNAPSHOT_H
+#define CWS_SNAPSHOT_H
+
+#include "object.h"
+#include "serialize.h"
+
+/*
+ * A heap snapshot stores every global defined by a library script together
+ * with everything reachable from it, so a later process can restore the
+ * globals without running the library again (prelude.cws -> prelude.cwsi).
+ */
+#define SNAPSHOT_MAGIC "CWSI"
+#define SNAPSHOT_VERSION 4
+
+bool snapshot_path(const char *source_path, char *path, size_t size);
+bool dump_snapshot(const char *path);
+bool load_snapshot(const char *path);
+
+/*
+ * A clone carries values from the heap of one VM into another (the messages
+ * between workers, see worker.h) in the same records, so shared objects and
+ * cycles survive the copy :
+ *
+ *   objects : as in a snapshot
+ *   values  : u32 count, then the values
+ *   globals : u32 count, then the sender's global names in slot order when
+ *             a function is among the objects, its operands are remapped
+ *
+ * Classes, instances and bound methods can't be cloned. read_clone pushes
+ * the values on the stack of the current VM.
+ */
+bool write_clone(Writer *writer, Value *values, uint32_t count);
+bool read_clone(const uint8_t *bytes, size_t size);
+
+#endif // !CWS_SNAPSHOT_H
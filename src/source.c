@@ -0,0 +1,103 @@
+#include "source.h"
+
+#include <string.h>
+
+static void out_of_memory()
+{
+    fprintf(stderr, "Not enough memory to read\n");
+    exit(74);
+}
+
+/* Reads until `buffer` holds `capacity` bytes or the file ends */
+static void fill(SourceStream *stream, size_t capacity)
+{
+    while (!stream->is_eof && stream->length < capacity)
+    {
+        size_t bytes_read = fread(stream->buffer + stream->length, 1, capacity - stream->length, stream->fd);
+        stream->length += bytes_read;
+        if (bytes_read == 0)
+        {
+            if (ferror(stream->fd))
+            {
+                fprintf(stderr, "Failed to read the file\n");
+                exit(60);
+            }
+            stream->is_eof = true;
+        }
+    }
+
+    stream->buffer[stream->length] = '\0';
+}
+
+bool open_source(SourceStream *stream, const char *path)
+{
+    stream->fd = fopen(path, "r");
+    if (stream->fd == NULL)
+        return false;
+
+    stream->buffer = malloc(SOURCE_WINDOW_SIZE + 1);
+    if (stream->buffer == NULL)
+        out_of_memory();
+
+    stream->length = 0;
+    stream->is_eof = false;
+    stream->retired_count = 0;
+    stream->retired_capacity = 0;
+    stream->retired = NULL;
+
+    fill(stream, SOURCE_WINDOW_SIZE);
+    return true;
+}
+
+/*
+ * Starts a new window with the bytes from `keep` to the end of the current
+ * one and reads more after them. Returns where `keep` lives now, or `keep`
+ * itself when the file is exhausted.
+ * */
+const char *refill_source(SourceStream *stream, const char *keep)
+{
+    if (stream->is_eof)
+        return keep;
+
+    size_t kept = stream->length - (size_t)(keep - stream->buffer);
+    size_t capacity = kept * 2 > SOURCE_WINDOW_SIZE ? kept * 2 : SOURCE_WINDOW_SIZE;
+
+    char *buffer = malloc(capacity + 1);
+    if (buffer == NULL)
+        out_of_memory();
+    memcpy(buffer, keep, kept);
+
+    if (stream->retired_count == stream->retired_capacity)
+    {
+        stream->retired_capacity = stream->retired_capacity < 8 ? 8 : stream->retired_capacity * 2;
+        stream->retired = realloc(stream->retired, sizeof(char *) * stream->retired_capacity);
+        if (stream->retired == NULL)
+            out_of_memory();
+    }
+    stream->retired[stream->retired_count++] = stream->buffer;
+
+    stream->buffer = buffer;
+    stream->length = kept;
+    fill(stream, capacity);
+    return buffer;
+}
+
+/* Only call this when no token points into an older window */
+void release_source(SourceStream *stream)
+{
+    for (int i = 0; i < stream->retired_count; ++i)
+        free(stream->retired[i]);
+    stream->retired_count = 0;
+}
+
+void close_source(SourceStream *stream)
+{
+    release_source(stream);
+    free(stream->retired);
+    free(stream->buffer);
+    fclose(stream->fd);
+
+    stream->buffer = NULL;
+    stream->retired = NULL;
+    stream->fd = NULL;
+}
@@ -0,0 +1,33 @@
+#ifndef CWS_SOURCE_H
+#define CWS_SOURCE_H
+
+#include "common.h"
+
+/*
+ * A source file read in windows instead of all at once. The scanner works
+ * on `buffer`, which always ends with a NUL; when it reaches that NUL
+ * before the end of the file it asks for a refill, which moves the token
+ * being scanned into a new window followed by more input. The replaced
+ * windows stay alive because earlier tokens of the statement still point
+ * into them, release_source drops them between top-level statements.
+ * */
+#define SOURCE_WINDOW_SIZE (64 * 1024)
+
+typedef struct
+{
+    FILE *fd;
+    char *buffer;
+    size_t length;
+    bool is_eof;
+
+    int retired_count;
+    int retired_capacity;
+    char **retired;
+} SourceStream;
+
+bool open_source(SourceStream *stream, const char *path);
+const char *refill_source(SourceStream *stream, const char *keep);
+void release_source(SourceStream *stream);
+void close_source(SourceStream *stream);
+
+#endif // !CWS_SOURCE_H
@@ -0,0 +1,283 @@
+#include "table.h"
+#include "number.h"
+#include "vm.h"
+
+/*
+ * TABLE ARRAY PART
+ *
+ * Keys that look like an array index (an integer number in [0, TABLE_ARRAY_MAX)
+ * or its canonical string form such as "12") live in `array` as long as they are
+ * below `array_cap`. Everything else lives in the `values` hash part.
+ *
+ * The array part grows in two situations:
+ *  1. Appending right after a full array part (t[jmlh(t)] = x), it is doubled.
+ *  2. The hash part is about to be rehashed, the split is recomputed the same
+ *     way Lua does : the array size is the largest power of two n such that
+ *     more than half of the slots 0..n-1 would be in use.
+ * */
+
+static bool number_to_index(double number, uint32_t *index)
+{
+    if (number < 0 || number >= TABLE_ARRAY_MAX)
+        return false;
+
+    uint32_t idx = (uint32_t)number;
+    if ((double)idx != number)
+        return false;
+
+    *index = idx;
+    return true;
+}
+
+static bool string_to_index(ObjectString *key, uint32_t *index)
+{
+    if (key->length == 0 || key->length > 8)
+        return false;
+
+    if (key->chars[0] == '0' && key->length > 1)
+        return false;
+
+    uint32_t idx = 0;
+    for (int i = 0; i < key->length; ++i)
+    {
+        char c = key->chars[i];
+        if (c < '0' || c > '9')
+            return false;
+        idx = idx * 10 + (c - '0');
+    }
+
+    if (idx >= TABLE_ARRAY_MAX)
+        return false;
+
+    *index = idx;
+    return true;
+}
+
+static bool key_to_index(Value key, uint32_t *index)
+{
+    if (IS_NUMBER(key))
+        return number_to_index(AS_NUMBER(key), index);
+    if (IS_STRING(key))
+        return string_to_index(AS_STRING(key), index);
+
+    return false;
+}
+
+static ObjectString *hash_key(Value key)
+{
+    if (IS_STRING(key))
+        return AS_STRING(key);
+
+    return stringify(key);
+}
+
+/*
+ * hash_key for reads : a number is formatted on the stack and only looked
+ * up among the interned strings. When it was never interned no entry can
+ * have it, so a miss such as t[1.5] neither allocates nor starts the GC.
+ * */
+static ObjectString *find_hash_key(Value key)
+{
+    if (IS_STRING(key))
+        return AS_STRING(key);
+    if (!IS_NUMBER(key))
+        return hash_key(key);
+
+    char buffer[NUMBER_BUFFER_MAX];
+    int length = number_to_chars(AS_NUMBER(key), buffer);
+    return find_string(&vm->strings, buffer, length);
+}
+
+/* Index of the slice (2^(i-1), 2^i] which contains index + 1 */
+static int index_slice(uint32_t index)
+{
+    if (index == 0)
+        return 0;
+
+    return 32 - __builtin_clz(index);
+}
+
+static uint32_t compute_array_size(ObjectTable *table, bool has_pending, uint32_t pending)
+{
+    uint32_t nums[32] = {0};
+    uint32_t total = 0;
+
+    for (uint32_t i = 0; i < table->array_cap; ++i)
+    {
+        if (!IS_UNDEFINED(table->array[i]))
+        {
+            nums[index_slice(i)]++;
+            total++;
+        }
+    }
+
+    for (size_t i = 0; i < table->values.capacity; ++i)
+    {
+        Entry *entry = &table->values.entries[i];
+        uint32_t index;
+        if (entry->key != NULL && string_to_index(entry->key, &index))
+        {
+            nums[index_slice(index)]++;
+            total++;
+        }
+    }
+
+    if (has_pending)
+    {
+        nums[index_slice(pending)]++;
+        total++;
+    }
+
+    uint32_t used = 0;
+    uint32_t optimal = 0;
+    for (uint32_t i = 0, size = 1; size <= TABLE_ARRAY_MAX && size / 2 < total; ++i, size *= 2)
+    {
+        used += nums[i];
+        if (used > size / 2)
+            optimal = size;
+    }
+
+    return optimal;
+}
+
+static void migrate_hash_keys(ObjectTable *table)
+{
+    Map *values = &table->values;
+    size_t moved = 0;
+
+    for (size_t i = 0; i < values->capacity; ++i)
+    {
+        Entry *entry = &values->entries[i];
+        uint32_t index;
+        if (entry->key != NULL && string_to_index(entry->key, &index) && index < table->array_cap)
+        {
+            table->array[index] = entry->value;
+            table->array_count++;
+            moved++;
+        }
+    }
+
+    if (moved == 0)
+        return;
+
+    // Rebuild the hash part without the migrated keys (and its graves)
+    Map rest;
+    init_map(&rest);
+    for (size_t i = 0; i < values->capacity; ++i)
+    {
+        Entry *entry = &values->entries[i];
+        uint32_t index;
+        if (entry->key == NULL || (string_to_index(entry->key, &index) && index < table->array_cap))
+            continue;
+
+        map_set(&rest, entry->key, entry->value);
+    }
+
+    free_map(values);
+    table->values = rest;
+}
+
+static void resize_array(ObjectTable *table, uint32_t capacity)
+{
+    uint32_t old_capacity = table->array_cap;
+    table->array = GROW_ARRAY(Value, table->array, old_capacity, capacity);
+    for (uint32_t i = old_capacity; i < capacity; ++i)
+    {
+        table->array[i] = VALUE_UNDEFINED;
+    }
+    table->array_cap = capacity;
+
+    migrate_hash_keys(table);
+}
+
+static void array_set(ObjectTable *table, uint32_t index, Value value)
+{
+    if (IS_UNDEFINED(table->array[index]))
+        table->array_count++;
+
+    table->array[index] = value;
+}
+
+bool table_get(ObjectTable *table, Value key, Value *value)
+{
+    uint32_t index;
+    if (key_to_index(key, &index) && index < table->array_cap)
+    {
+        if (IS_UNDEFINED(table->array[index]))
+            return false;
+
+        *value = table->array[index];
+        return true;
+    }
+
+    if (table->values.capacity == 0)
+        return false;
+
+    ObjectString *key_string = find_hash_key(key);
+    return key_string != NULL && map_get(&table->values, key_string, value);
+}
+
+void table_set(ObjectTable *table, Value key, Value value)
+{
+    uint32_t index = 0;
+    bool is_index = key_to_index(key, &index);
+
+    if (is_index && index == table->array_cap && table->array_count == table->array_cap &&
+        table->array_cap < TABLE_ARRAY_MAX)
+    {
+        resize_array(table, table->array_cap < TABLE_ARRAY_MIN ? TABLE_ARRAY_MIN : table->array_cap * 2);
+    }
+
+    if (is_index && index < table->array_cap)
+    {
+        array_set(table, index, value);
+        return;
+    }
+
+    ObjectString *key_string = hash_key(key);
+    push(VALUE_OBJ(key_string));
+
+    Map *values = &table->values;
+    if (values->capacity * FACTOR_TERM <= values->size)
+    {
+        // The hash part is about to be rehashed, rebalance the split first
+        uint32_t capacity = compute_array_size(table, is_index, index);
+        if (capacity > table->array_cap)
+            resize_array(table, capacity);
+
+        if (is_index && index < table->array_cap)
+        {
+            array_set(table, index, value);
+            pop();
+            return;
+        }
+    }
+
+    map_set(&table->values, key_string, value);
+    pop();
+}
+
+bool table_delete(ObjectTable *table, Value key)
+{
+    uint32_t index;
+    if (key_to_index(key, &index) && index < table->array_cap)
+    {
+        if (IS_UNDEFINED(table->array[index]))
+            return false;
+
+        table->array[index] = VALUE_UNDEFINED;
+        table->array_count--;
+        return true;
+    }
+
+    if (table->values.capacity == 0)
+        return false;
+
+    ObjectString *key_string = find_hash_key(key);
+    return key_string != NULL && map_delete(&table->values, key_string);
+}
+
+size_t table_count(ObjectTable *table)
+{
+    return table->array_count + table->values.size;
+}
@@ -0,0 +1,14 @@
+#ifndef CWS_TABLE_H
+#define CWS_TABLE_H
+
+#include "object.h"
+
+#define TABLE_ARRAY_MIN 4
+#define TABLE_ARRAY_MAX (1u << 26)
+
+bool table_get(ObjectTable *table, Value key, Value *value);
+void table_set(ObjectTable *table, Value key, Value value);
+bool table_delete(ObjectTable *table, Value key);
+size_t table_count(ObjectTable *table);
+
+#endif // !CWS_TABLE_H
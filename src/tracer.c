@@ -0,0 +1,313 @@
+#include "tracer.h"
+#include "vm.h"
+
+#include <string.h>
+#include <time.h>
+
+/*
+ * CALL TRACER
+ *
+ * `calls` is the stack of open calls. Every distinct callee gets a
+ * TraceFunction holding its totals, found through an open addressing table
+ * keyed by the callee object; the callees and their names are GC roots so
+ * an address is never reused for another function while tracing.
+ *
+ * Inclusive time only counts the outermost call of a recursive function,
+ * otherwise fib(30) would be charged its own time thirty times over.
+ * */
+
+typedef struct
+{
+    Obj *callee;
+    ObjectString *owner;
+    ObjectString *name;
+    const char *label;
+
+    uint64_t calls;
+    uint64_t inclusive_ns;
+    uint64_t self_ns;
+    uint64_t alloc_bytes;
+    int active;
+} TraceFunction;
+
+typedef struct
+{
+    uint32_t function;
+    int level;
+    uint64_t start_ns;
+    uint64_t child_ns;
+    size_t start_bytes;
+    size_t child_bytes;
+} TraceCall;
+
+bool is_tracing = false;
+
+static struct
+{
+    VM *owner;
+    FILE *file;
+    uint64_t start_ns;
+    uint64_t events;
+    uint64_t dropped;
+
+    TraceCall *calls;
+    int call_count;
+    int call_capacity;
+
+    TraceFunction *functions;
+    uint32_t function_count;
+    uint32_t function_capacity;
+
+    uint32_t *slots;
+    uint32_t slot_capacity;
+} tracer;
+
+static uint64_t now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000u + (uint64_t)ts.tv_nsec;
+}
+
+static void *grow(void *array, int *capacity, size_t size)
+{
+    *capacity = *capacity < 64 ? 64 : *capacity * 2;
+    array = realloc(array, *capacity * size);
+    if (array == NULL)
+    {
+        fprintf(stderr, "Not enough memory to trace\n");
+        exit(74);
+    }
+    return array;
+}
+
+bool start_tracer(const char *path)
+{
+    tracer.file = fopen(path, "w");
+    if (tracer.file == NULL)
+        return false;
+
+    tracer.owner = vm;
+    tracer.start_ns = now_ns();
+    is_tracing = true;
+
+    fputs("{\"displayTimeUnit\": \"ns\", \"traceEvents\": [\n", tracer.file);
+    fputs("{\"name\": \"process_name\", \"ph\": \"M\", \"pid\": 1, \"tid\": 1, \"args\": {\"name\": \"cws\"}}",
+          tracer.file);
+    return true;
+}
+
+/* ===== FUNCTIONS ===== */
+
+/* Natives do not know their name, the globals and the string methods do */
+static ObjectString *native_name(Obj *native)
+{
+    for (uint32_t i = 0; i < vm->global_values.count; ++i)
+    {
+        if (IS_OBJ(vm->global_values.values[i]) && AS_OBJ(vm->global_values.values[i]) == native)
+            return AS_STRING(vm->global_names.values[i]);
+    }
+
+    for (size_t i = 0; i < vm->string_methods.capacity; ++i)
+    {
+        Entry *entry = &vm->string_methods.entries[i];
+        if (entry->key != NULL && IS_OBJ(entry->value) && AS_OBJ(entry->value) == native)
+            return entry->key;
+    }
+
+    return NULL;
+}
+
+static void rehash_functions()
+{
+    free(tracer.slots);
+    tracer.slots = calloc(tracer.slot_capacity, sizeof(uint32_t));
+    if (tracer.slots == NULL)
+    {
+        fprintf(stderr, "Not enough memory to trace\n");
+        exit(74);
+    }
+
+    uint32_t mask = tracer.slot_capacity - 1;
+    for (uint32_t i = 0; i < tracer.function_count; ++i)
+    {
+        uint32_t slot = (uint32_t)((uintptr_t)tracer.functions[i].callee >> 4) & mask;
+        while (tracer.slots[slot] != 0)
+            slot = (slot + 1) & mask;
+        tracer.slots[slot] = i + 1;
+    }
+}
+
+static uint32_t find_function(Obj *callee, ObjectString *owner, ObjectString *name)
+{
+    if ((tracer.function_count + 1) * 4 > tracer.slot_capacity * 3)
+    {
+        tracer.slot_capacity = tracer.slot_capacity < 256 ? 256 : tracer.slot_capacity * 2;
+        rehash_functions();
+    }
+
+    uint32_t mask = tracer.slot_capacity - 1;
+    uint32_t slot = (uint32_t)((uintptr_t)callee >> 4) & mask;
+    while (tracer.slots[slot] != 0)
+    {
+        uint32_t index = tracer.slots[slot] - 1;
+        if (tracer.functions[index].callee == callee)
+            return index;
+        slot = (slot + 1) & mask;
+    }
+
+    if (tracer.function_count == tracer.function_capacity)
+    {
+        int capacity = (int)tracer.function_capacity;
+        tracer.functions = grow(tracer.functions, &capacity, sizeof(TraceFunction));
+        tracer.function_capacity = (uint32_t)capacity;
+    }
+
+    TraceFunction *function = &tracer.functions[tracer.function_count];
+    memset(function, 0, sizeof(TraceFunction));
+    function->callee = callee;
+    function->owner = owner;
+    function->name = name;
+    if (callee->type == OBJ_NATIVE)
+    {
+        function->name = native_name(callee);
+        function->label = "<native>";
+    }
+    else
+    {
+        function->label = "script";
+    }
+
+    tracer.slots[slot] = ++tracer.function_count;
+    return tracer.function_count - 1;
+}
+
+static void write_name(FILE *file, TraceFunction *function)
+{
+    if (function->owner != NULL)
+        fprintf(file, "%.*s.", function->owner->length, function->owner->chars);
+
+    if (function->name != NULL)
+        fprintf(file, "%.*s", function->name->length, function->name->chars);
+    else
+        fputs(function->label, file);
+}
+
+/* ===== CALLS ===== */
+
+static void close_call(uint64_t end_ns)
+{
+    TraceCall *call = &tracer.calls[--tracer.call_count];
+    TraceFunction *function = &tracer.functions[call->function];
+
+    uint64_t duration = end_ns - call->start_ns;
+    size_t bytes = vm->allocated_bytes - call->start_bytes;
+    uint64_t self_ns = duration - call->child_ns;
+    size_t self_bytes = bytes - call->child_bytes;
+
+    function->self_ns += self_ns;
+    function->alloc_bytes += self_bytes;
+    if (--function->active == 0)
+        function->inclusive_ns += duration;
+
+    if (tracer.call_count > 0)
+    {
+        TraceCall *parent = &tracer.calls[tracer.call_count - 1];
+        parent->child_ns += duration;
+        parent->child_bytes += bytes;
+    }
+
+    if (tracer.events == TRACE_EVENTS_MAX)
+    {
+        tracer.dropped++;
+        return;
+    }
+    tracer.events++;
+
+    fputs(",\n{\"name\": \"", tracer.file);
+    write_name(tracer.file, function);
+    fprintf(tracer.file,
+            "\", \"cat\": \"%s\", \"ph\": \"X\", \"ts\": %.3f, \"dur\": %.3f, \"pid\": 1, \"tid\": 1, "
+            "\"args\": {\"self_us\": %.3f, \"alloc_bytes\": %zu, \"self_alloc_bytes\": %zu}}",
+            function->callee->type == OBJ_NATIVE ? "native" : "function", (call->start_ns - tracer.start_ns) / 1e3,
+            duration / 1e3, self_ns / 1e3, bytes, self_bytes);
+}
+
+void trace_return(int level)
+{
+    if (vm != tracer.owner)
+        return;
+
+    uint64_t end_ns = now_ns();
+    while (tracer.call_count > 0 && tracer.calls[tracer.call_count - 1].level >= level)
+        close_call(end_ns);
+}
+
+void trace_call(Obj *callee, ObjectString *owner, ObjectString *name, int level)
+{
+    if (vm != tracer.owner)
+        return;
+
+    // Calls left open at this level belong to frames a runtime error dropped
+    trace_return(level);
+
+    uint32_t index = find_function(callee, owner, name);
+    tracer.functions[index].calls++;
+    tracer.functions[index].active++;
+
+    if (tracer.call_count == tracer.call_capacity)
+        tracer.calls = grow(tracer.calls, &tracer.call_capacity, sizeof(TraceCall));
+
+    tracer.calls[tracer.call_count++] = (TraceCall){
+        .function = index,
+        .level = level,
+        .start_ns = now_ns(),
+        .start_bytes = vm->allocated_bytes,
+    };
+}
+
+void mark_tracer()
+{
+    if (vm != tracer.owner)
+        return;
+
+    for (uint32_t i = 0; i < tracer.function_count; ++i)
+    {
+        mark_obj(tracer.functions[i].callee);
+        mark_obj((Obj *)tracer.functions[i].owner);
+        mark_obj((Obj *)tracer.functions[i].name);
+    }
+}
+
+/* ===== SUMMARY ===== */
+
+bool stop_tracer()
+{
+    if (!is_tracing)
+        return true;
+
+    trace_return(0);
+    is_tracing = false;
+
+    FILE *file = tracer.file;
+    fprintf(file, "\n],\n\"otherData\": {\"dropped_events\": %llu, \"functions\": [",
+            (unsigned long long)tracer.dropped);
+    for (uint32_t i = 0; i < tracer.function_count; ++i)
+    {
+        TraceFunction *function = &tracer.functions[i];
+        fprintf(file, "%s\n  {\"name\": \"", i == 0 ? "" : ",");
+        write_name(file, function);
+        fprintf(file,
+                "\", \"calls\": %llu, \"inclusive_us\": %.3f, \"self_us\": %.3f, \"alloc_bytes\": %llu}",
+                (unsigned long long)function->calls, function->inclusive_ns / 1e3, function->self_ns / 1e3,
+                (unsigned long long)function->alloc_bytes);
+    }
+    fputs("\n]}}\n", file);
+
+    free(tracer.calls);
+    free(tracer.functions);
+    free(tracer.slots);
+    memset(&tracer, 0, sizeof(tracer));
+
+    return fclose(file) == 0;
+}
@@ -0,0 +1,36 @@
+#ifndef CWS_TRACER_H
+#define CWS_TRACER_H
+
+#include "object.h"
+
+/*
+ * CALL TRACER (`cws --trace out.json script.cws`)
+ *
+ * Records every call as a Chrome trace event (chrome://tracing, Perfetto,
+ * speedscope) with its self time and the bytes it allocated, and sums the
+ * calls, inclusive and self time and allocations of every function into
+ * `otherData.functions`. Deterministic, unlike --profile, but every call
+ * pays for two clock reads: meant for short scripts.
+ *
+ * Calls are nested by level: a closure running in frame f is at level 2f,
+ * a native called from frame f at 2f + 1. Entering or leaving a level
+ * closes whatever is still open at or above it, so frames dropped by a
+ * runtime error never leave a call open.
+ *
+ * Only the VM that started the tracer is traced.
+ */
+#define TRACE_FRAME_LEVEL(frame) (2 * (frame))
+#define TRACE_NATIVE_LEVEL(frame) (2 * (frame) + 1)
+
+// Events after this many are only summed, the trace file stays loadable
+#define TRACE_EVENTS_MAX 1000000
+
+extern bool is_tracing;
+
+bool start_tracer(const char *path);
+bool stop_tracer();
+void trace_call(Obj *callee, ObjectString *owner, ObjectString *name, int level);
+void trace_return(int level);
+void mark_tracer();
+
+#endif // !CWS_TRACER_H
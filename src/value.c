@@ -1,4 +1,5 @@
 #include "value.h"
+#include "number.h"
 #include "object.h"
 #include "vm.h"
 
@@ -28,6 +29,14 @@ void print_string(ObjectString *obj)
         printf("\"%s\"", obj->chars);
 }
 
+void print_string_view(ObjectStringView *view)
+{
+    if (view->length == 0)
+        printf("<empty string>");
+    else
+        printf("\"%.*s\"", view->length, view->parent->chars + view->start);
+}
+
 void print_function(ObjectFunction *obj)
 {
     if (obj->name == NULL)
@@ -60,7 +69,20 @@ void print_table(ObjectTable *obj, bool debug, int level)
         return;
     }
 
-    print_map(&obj->values, level);
+    printf("{\n");
+    for (uint32_t i = 0; i < obj->array_cap; ++i)
+    {
+        if (IS_UNDEFINED(obj->array[i]))
+            continue;
+
+        print_indent(level);
+        printf("%u: ", i);
+        print_value(obj->array[i], false, level + 1);
+        printf(",\n");
+    }
+    print_map_entries(&obj->values, level);
+    print_indent(level - 1);
+    printf("}");
 }
 
 void print_array(ObjectArray *array, bool debug)
@@ -71,7 +93,7 @@ void print_array(ObjectArray *array, bool debug)
         return;
     }
     printf("[");
-    for (int i = 0; i < array->count; ++i)
+    for (uint32_t i = 0; i < array->count; ++i)
     {
         print_value(array->values[i], debug, 1);
         if (i != array->count - 1)
@@ -89,6 +111,12 @@ void print_obj(Value value, bool debug, int level)
         return;
     }
 
+    if (IS_STRING_VIEW(value))
+    {
+        print_string_view(AS_STRING_VIEW(value));
+        return;
+    }
+
     if (IS_FUNCTION(value))
     {
         print_function(AS_FUNCTION(value));
@@ -145,6 +173,12 @@ void print_obj(Value value, bool debug, int level)
         return;
     }
 
+    if (IS_WORKER(value))
+    {
+        printf("<pekerja>");
+        return;
+    }
+
     assert(0 && "Unreachable");
 
 #else
@@ -154,6 +188,10 @@ void print_obj(Value value, bool debug, int level)
         print_string(AS_STRING(value));
         break;
     }
+    case OBJ_STRING_VIEW: {
+        print_string_view(AS_STRING_VIEW(value));
+        break;
+    }
     case OBJ_FUNCTION: {
         print_function(AS_FUNCTION(value));
         break;
@@ -198,6 +236,11 @@ void print_obj(Value value, bool debug, int level)
         break;
     }
 
+    case OBJ_WORKER: {
+        printf("<pekerja>");
+        break;
+    }
+
     default:
         assert(0 && "Unreachable");
         return;
@@ -211,10 +254,9 @@ void print_value(Value value, bool debug, int level)
 #ifdef NAN_BOXING
     if (IS_NUMBER(value))
     {
-        if (AS_NUMBER(value) == (int)AS_NUMBER(value))
-            printf("%i", (int)AS_NUMBER(value));
-        else
-            printf("%f", AS_NUMBER(value));
+        char buffer[NUMBER_BUFFER_MAX];
+        number_to_chars(AS_NUMBER(value), buffer);
+        fputs(buffer, stdout);
         return;
     }
     if (IS_NIL(value))
@@ -241,12 +283,12 @@ void print_value(Value value, bool debug, int level)
 
     switch (value.type)
     {
-    case TYPE_NUMBER:
-        if (value.as.decimal == (int)value.as.decimal)
-            printf("%i", (int)value.as.decimal);
-        else
-            printf("%f", value.as.decimal);
+    case TYPE_NUMBER: {
+        char buffer[NUMBER_BUFFER_MAX];
+        number_to_chars(value.as.decimal, buffer);
+        fputs(buffer, stdout);
         break;
+    }
 
     case TYPE_BOOLEAN:
         if (!!value.as.boolean)
@@ -279,15 +321,22 @@ void free_values(Values *values)
 
 int compare_string(Value a, Value b)
 {
-    ObjectString *string_a = AS_STRING(a);
-    ObjectString *string_b = AS_STRING(b);
-    return (string_a->length == string_b->length) && (memcmp(string_a->chars, string_b->chars, string_a->length) == 0);
+    StringRef string_a = string_ref(a);
+    StringRef string_b = string_ref(b);
+    return (string_a.length == string_b.length) && (memcmp(string_a.chars, string_b.chars, string_a.length) == 0);
 }
 
 bool compare(Value a, Value b)
 {
 #ifdef NAN_BOXING
-    return a == b;
+    if (a == b)
+        return true;
+
+    // Interned strings are equal by identity, views have to compare the content
+    if ((IS_STRING_VIEW(a) && IS_ANY_STRING(b)) || (IS_STRING_VIEW(b) && IS_STRING(a)))
+        return compare_string(a, b);
+
+    return false;
 #else
 
     if (a.type != b.type)
@@ -306,6 +355,9 @@ bool compare(Value a, Value b)
 
     case TYPE_OBJ: {
 
+        if (IS_ANY_STRING(a) && IS_ANY_STRING(b) && (IS_STRING_VIEW(a) || IS_STRING_VIEW(b)))
+            return compare_string(a, b);
+
         if (OBJ_TYPE(a) != OBJ_TYPE(b))
             return false;
 
@@ -326,19 +378,3 @@ bool compare(Value a, Value b)
 #endif
 }
 
-bool is_falsy(Value v)
-{
-#ifdef NAN_BOXING
-    return (IS_NIL(v) || (IS_BOOLEAN(v) && IS_FALSE(v)) || (IS_NUMBER(v) && !AS_NUMBER(v)));
-#else
-    return (v.type == TYPE_NIL || (v.type == TYPE_BOOLEAN && !v.as.boolean) ||
-            (v.type == TYPE_NUMBER && !v.as.decimal));
-#endif
-}
-
-Value value_number(double number)
-{
-    Value value;
-    memcpy(&value, &number, sizeof(number));
-    return value;
-}
@@ -8,6 +8,7 @@
 #define TYPE_NIL 1
 #define TYPE_FALSE 2
 #define TYPE_TRUE 3
+#define TYPE_UNDEFINED 4
 #else
 typedef enum
 {
@@ -15,6 +16,7 @@ typedef enum
     TYPE_NUMBER,
     TYPE_NIL,
     TYPE_OBJ,
+    TYPE_UNDEFINED,
 } ValueType;
 #endif
 
@@ -59,6 +61,7 @@ typedef struct
 #define VALUE_NIL (QNAN | TYPE_NIL)
 #define VALUE_TRUE (QNAN | TYPE_TRUE)
 #define VALUE_FALSE (QNAN | TYPE_FALSE)
+#define VALUE_UNDEFINED (QNAN | TYPE_UNDEFINED)
 
 #define VALUE_NUMBER(number) (value_number((number)))
 #define VALUE_BOOL(boolean) (boolean ? VALUE_TRUE : VALUE_FALSE)
@@ -69,6 +72,7 @@ typedef struct
 #define IS_FALSE(value) ((Value)(value) == VALUE_FALSE)
 #define IS_BOOLEAN(value) (((Value)(value) | 1) == VALUE_TRUE)
 #define IS_NIL(value) ((Value)(value) == VALUE_NIL)
+#define IS_UNDEFINED(value) ((Value)(value) == VALUE_UNDEFINED)
 #define IS_OBJ(value) (((Value)(value) & (SIGNED_BIT | QNAN)) == (SIGNED_BIT | QNAN))
 
 #else
@@ -96,10 +100,17 @@ typedef struct
         .type = TYPE_OBJ, .as = {.obj = (Obj *)(object) }                                                              \
     }
 
+#define VALUE_UNDEFINED                                                                                                \
+    (Value)                                                                                                            \
+    {                                                                                                                  \
+        .type = TYPE_UNDEFINED, .as = {.boolean = 0 }                                                                  \
+    }
+
 #define IS_NUMBER(value) (value.type == TYPE_NUMBER)
 #define IS_BOOLEAN(value) (value.type == TYPE_BOOLEAN)
 #define IS_NIL(value) (value.type == TYPE_NIL)
 #define IS_OBJ(value) (value.type == TYPE_OBJ)
+#define IS_UNDEFINED(value) (value.type == TYPE_UNDEFINED)
 #endif
 
 #define IS_OBJ_TYPE(obj, obj_type) (obj->type == obj_type)
@@ -108,13 +119,37 @@ void init_values(Values *values);
 void append_values(Values *values, Value newItem);
 void free_values(Values *values);
 bool compare(Value value1, Value value2);
-bool is_falsy(Value v);
 
 void mark_obj(Obj *obj);
 void mark_value(Value val);
 void print_value(Value value, bool debug, int level);
 void print_obj(Value value, bool debug, int level);
 
-Value value_number(double number);
+#ifdef NAN_BOXING
+// Inline, every number the VM computes goes through them
+static inline Value value_number(double number)
+{
+    Value value;
+    memcpy(&value, &number, sizeof(number));
+    return value;
+}
+
+static inline double number_value(Value value)
+{
+    double number;
+    memcpy(&number, &value, sizeof(Value));
+    return number;
+}
+#endif
+
+static inline bool is_falsy(Value v)
+{
+#ifdef NAN_BOXING
+    return (IS_NIL(v) || (IS_BOOLEAN(v) && IS_FALSE(v)) || (IS_NUMBER(v) && !number_value(v)));
+#else
+    return (v.type == TYPE_NIL || (v.type == TYPE_BOOLEAN && !v.as.boolean) ||
+            (v.type == TYPE_NUMBER && !v.as.decimal));
+#endif
+}
 
 #endif // !CWS_VALUE_H
@@ -22,58 +22,103 @@
 #include "vm.h"
 #include "chunk.h"
 #include "hashmap.h"
+#include "jit.h"
+#include "loop_trace.h"
 #include "native.h"
+#include "number.h"
 #include "object.h"
+#include "opstats.h"
+#include "profiler.h"
+#include "table.h"
+#include "tracer.h"
 #include "value.h"
+#include "worker.h"
 
-VM vm;
+_Thread_local VM *vm = NULL;
 
 static void define_native(const char *name, NativeFn function);
+static void define_method(Map *methods, const char *name, NativeFn function);
 
 void resetStack()
 {
-    vm.stack_top = 0;
-    vm.frame_count = 0;
+    vm->stack_top = 0;
+    vm->frame_count = 0;
 }
 
 void update_stack_ptr()
 {
-    vm.stack_top = 0;
+    vm->stack_top = 0;
 }
 
-void init_vm()
+/* Makes `instance` the current VM of this thread and returns the previous one */
+VM *use_vm(VM *instance)
 {
-    // vm.chunk = NULL;
-    // vm.ip = NULL;
-    vm.objects = NULL;
-    vm.frame_count = 0;
-    vm.upvalues = NULL;
-    vm.stack_top = 0;
-    vm.current_bytes = 0;
-    vm.next_gc = 10;
-
-    Stack *stack_ptr = malloc(sizeof(Stack));
-    vm.stack = stack_ptr;
-    init_stack(vm.stack);
-
-    init_map(&vm.strings);
-    init_map(&vm.globals);
-
-    vm.grey_count = 0;
-    vm.grey_cap = 0;
-    vm.grey_stack = NULL;
+    VM *previous = vm;
+    vm = instance;
+    return previous;
+}
+
+static void init_vm()
+{
+    vm->objects = NULL;
+    vm->frame_count = 0;
+    vm->exit_frame = 0;
+    vm->upvalues = NULL;
+    vm->stack_top = 0;
+    vm->current_bytes = 0;
+    vm->allocated_bytes = 0;
+    vm->next_gc = 10;
+    vm->gc_paused = 0;
+
+    init_stack(&vm->stack);
+    init_jit();
+    init_trace();
+
+    init_map(&vm->strings);
+    init_map(&vm->globals);
+    init_long_values(&vm->global_values);
+    init_long_values(&vm->global_names);
+    init_map(&vm->string_methods);
+    init_map(&vm->worker_methods);
+    init_long_values(&vm->refs);
+    vm->free_ref = -1;
+
+    vm->grey_count = 0;
+    vm->grey_cap = 0;
+    vm->grey_stack = NULL;
 
     update_stack_ptr();
 
-    vm.init_string = NULL;
-    vm.init_string = copy_string("init", 4);
+    vm->init_string = NULL;
+    vm->init_string = copy_string("init", 4);
 
     define_native("time", time_native);
+    define_native("heap_dump", heap_dump_native);
+    define_native("pekerja", spawn_worker_native);
+    define_native("kirim", parent_send_native);
+    define_native("terima", parent_receive_native);
+
+    define_method(&vm->string_methods, "split", string_split_native);
+    define_method(&vm->string_methods, "join", string_join_native);
+    define_method(&vm->string_methods, "indexOf", string_index_of_native);
+    define_method(&vm->string_methods, "replace", string_replace_native);
+    define_method(&vm->string_methods, "slice", string_slice_native);
+    define_method(&vm->string_methods, "substring", string_substring_native);
+    define_method(&vm->string_methods, "upper", string_upper_native);
+    define_method(&vm->string_methods, "lower", string_lower_native);
+    define_method(&vm->string_methods, "trim", string_trim_native);
+    define_method(&vm->string_methods, "startsWith", string_starts_with_native);
+    define_method(&vm->string_methods, "endsWith", string_ends_with_native);
+    define_method(&vm->string_methods, "charCodeAt", string_char_code_at_native);
+
+    define_method(&vm->worker_methods, "kirim", worker_send_native);
+    define_method(&vm->worker_methods, "terima", worker_receive_native);
+    define_method(&vm->worker_methods, "tunggu", worker_wait_native);
 }
 
 void freeObjects()
 {
-    Obj *object = vm.objects;
+    Obj *object = vm->objects;
     while (object != NULL)
     {
         Obj *next = object->next;
@@ -82,15 +127,38 @@ void freeObjects()
     }
 }
 
-void free_vm()
+VM *new_vm()
 {
-    freeObjects();
-    free(vm.stack);
-    free_map(&vm.strings);
-    free_map(&vm.globals);
+    VM *instance = malloc(sizeof(VM));
+    if (instance == NULL)
+    {
+        fprintf(stderr, "Not enough memory to create a VM\n");
+        exit(74);
+    }
+
+    VM *previous = use_vm(instance);
+    init_vm();
+    use_vm(previous);
+    return instance;
+}
+
+void free_vm(VM *instance)
+{
+    VM *previous = use_vm(instance);
 
-    free(vm.strings.entries);
-    vm.init_string = NULL;
+    freeObjects();
+    free(vm->stack.items);
+    free_map(&vm->strings);
+    free_map(&vm->globals);
+    free_long_values(&vm->global_values);
+    free_long_values(&vm->global_names);
+    free_map(&vm->string_methods);
+    free_map(&vm->worker_methods);
+    free_long_values(&vm->refs);
+    free(vm->grey_stack);
+
+    use_vm(previous == instance ? NULL : previous);
+    free(instance);
 }
 
 void runtime_error(char *format, ...)
@@ -104,30 +172,55 @@ void runtime_error(char *format, ...)
     fputs("\n", stderr);
 }
 
-void push(Value value)
+/* Grows the stack to hold at least `size` values */
+void reserve_stack(int size)
 {
-    if (vm.stack->size >= vm.stack->capacity)
+    int new_capacity = vm->stack.capacity;
+    while (new_capacity < size)
+        new_capacity = GROW_CAPACITY(new_capacity);
+
+    if (new_capacity != vm->stack.capacity)
     {
-        int old_capacity = vm.stack->capacity;
-        int new_capacity = GROW_CAPACITY(old_capacity);
-        vm.stack->capacity = new_capacity;
-        vm.stack->items = (Value *)realloc(vm.stack->items, new_capacity * sizeof(Value));
+        vm->stack.capacity = new_capacity;
+        vm->stack.items = (Value *)realloc(vm->stack.items, new_capacity * sizeof(Value));
     }
+}
 
-    vm.stack->items[vm.stack_top++] = value;
-    if (vm.stack_top > vm.stack->size)
-        vm.stack->size++;
+void push(Value value)
+{
+    if (vm->stack_top >= vm->stack.capacity)
+        reserve_stack(vm->stack_top + 1);
+
+    vm->stack.items[vm->stack_top++] = value;
 }
 
 Value pop()
 {
-    if (vm.stack->size == 0)
+    if (vm->stack_top == 0)
     {
         assert(0 && "Cannot Pop if stack is empty");
     }
 
-    vm.stack_top--;
-    return vm.stack->items[vm.stack_top];
+    vm->stack_top--;
+    return vm->stack.items[vm->stack_top];
+}
+
+uint32_t global_slot(ObjectString *name)
+{
+    Value slot;
+    if (map_get(&vm->globals, name, &slot))
+        return (uint32_t)AS_NUMBER(slot);
+
+    push(VALUE_OBJ(name));
+
+    append_long_values(&vm->global_values, VALUE_UNDEFINED);
+    append_long_values(&vm->global_names, VALUE_OBJ(name));
+
+    uint32_t idx = vm->global_values.count - 1;
+    map_set(&vm->globals, name, VALUE_NUMBER(idx));
+
+    pop();
+    return idx;
 }
 
 static void define_native(const char *name, NativeFn function)
@@ -140,7 +233,22 @@ static void define_native(const char *name, NativeFn function)
     Value fn = VALUE_OBJ(f);
     push(fn);
 
-    map_set(&vm.globals, AS_STRING(vm.stack->items[0]), vm.stack->items[1]);
+    uint32_t slot = global_slot(s);
+    vm->global_values.values[slot] = fn;
+
+    pop();
+    pop();
+}
+
+static void define_method(Map *methods, const char *name, NativeFn function)
+{
+    ObjectString *s = copy_string(name, strlen(name));
+    push(VALUE_OBJ(s));
+
+    ObjectNative *f = new_native(function);
+    push(VALUE_OBJ(f));
+
+    map_set(methods, s, VALUE_OBJ(f));
 
     pop();
     pop();
@@ -148,16 +256,17 @@ static void define_native(const char *name, NativeFn function)
 
 void print_error_line(uint8_t *ip)
 {
-    for (int i = vm.frame_count - 1; i >= 0; --i)
+    for (int i = vm->frame_count - 1; i >= 0; --i)
     {
-        CallFrame *frame = &vm.frame[i];
+        CallFrame *frame = &vm->frame[i];
 
-        if (i != vm.frame_count - 1)
+        if (i != vm->frame_count - 1)
             ip = frame->ip;
 
         ObjectFunction *function = frame->closure->function;
-        uint8_t idx = ip - function->chunk.code;
-        uint32_t line_number = get_line(&frame->closure->function->chunk, idx);
+        // ip points past the opcode of the failing instruction (or past the call in a caller frame)
+        uint32_t offset = ip - function->chunk.code;
+        uint32_t line_number = get_line(&function->chunk, offset > 0 ? offset - 1 : 0);
         fprintf(stderr, "[Baris %d] di ", line_number);
         if (function->name == NULL)
         {
@@ -183,7 +292,7 @@ void print_error_line(uint8_t *ip)
         push(VALUE_OBJ(concat(a, b)));                                                                                 \
     } while (0);
 
-#define PEEK(index) (vm.stack->items[vm.stack_top - 1 - (index)])
+#define PEEK(index) (vm->stack.items[vm->stack_top - 1 - (index)])
 
 ObjectString *stringify(Value value)
 {
@@ -191,25 +300,9 @@ ObjectString *stringify(Value value)
 
     if (IS_NUMBER(value))
     {
-        int len = 0;
-        char *start = {0};
-        if (AS_NUMBER(value) == (int)AS_NUMBER(value))
-        {
-            int int_num = (int)AS_NUMBER(value);
-            len = snprintf(NULL, 0, "%d", int_num);
-            start = malloc(len + 1);
-            snprintf(start, len + 1, "%d", int_num);
-        }
-        else
-        {
-            double double_num = (double)AS_NUMBER(value);
-            len = snprintf(NULL, 0, "%f", double_num);
-            start = malloc(len + 1);
-            snprintf(start, len + 1, "%f", double_num);
-        }
-
-        ObjectString *result = take_string(start, len);
-        return result;
+        char buffer[NUMBER_BUFFER_MAX];
+        int len = number_to_chars(AS_NUMBER(value), buffer);
+        return copy_string(buffer, len);
     }
     if (IS_NIL(value))
     {
@@ -224,21 +317,17 @@ ObjectString *stringify(Value value)
     }
     if (IS_OBJ(value))
     {
-        if (IS_STRING(value))
-            return AS_STRING(value);
+        if (IS_ANY_STRING(value))
+            return materialize_string(value);
     }
     assert(0 && "Unreachable at stringify");
 #else
     switch (value.type)
     {
     case TYPE_NUMBER: {
-        int len = snprintf(NULL, 0, "%f", value.as.decimal);
-
-        char *start = malloc(len + 1);
-        snprintf(start, len + 1, "%f", value.as.decimal);
-
-        ObjectString *result = take_string(start, len);
-        return result;
+        char buffer[NUMBER_BUFFER_MAX];
+        int len = number_to_chars(value.as.decimal, buffer);
+        return copy_string(buffer, len);
     }
     case TYPE_NIL: {
         return copy_string("VALUE_NIL", 3);
@@ -250,8 +339,8 @@ ObjectString *stringify(Value value)
         return copy_string("VALUE_FALSE", 5);
     }
     case TYPE_OBJ: {
-        if (IS_STRING(value))
-            return AS_STRING(value);
+        if (IS_ANY_STRING(value))
+            return materialize_string(value);
 
         assert(0 && "Unreachable at stringify");
     }
@@ -261,16 +350,29 @@ ObjectString *stringify(Value value)
 #endif
 }
 
+/* Numbers are formatted into `buffer`, so neither operand is interned first */
+static StringRef concat_operand(Value value, char *buffer)
+{
+    if (IS_NUMBER(value))
+    {
+        StringRef ref = {buffer, number_to_chars(AS_NUMBER(value), buffer)};
+        return ref;
+    }
+
+    return string_ref(value);
+}
+
 ObjectString *concatenate()
 {
-    ObjectString *b = stringify(PEEK(0));
-    ObjectString *a = stringify(PEEK(1));
+    char buffer_a[NUMBER_BUFFER_MAX], buffer_b[NUMBER_BUFFER_MAX];
+    StringRef b = concat_operand(PEEK(0), buffer_b);
+    StringRef a = concat_operand(PEEK(1), buffer_a);
 
-    int length = a->length + b->length;
+    int length = a.length + b.length;
     char *result = ALLOC(char, length + 1);
 
-    memcpy(result, a->chars, a->length);
-    memcpy(result + a->length, b->chars, b->length);
+    memcpy(result, a.chars, a.length);
+    memcpy(result + a.length, b.chars, b.length);
     result[length] = '\0';
 
     pop();
@@ -279,65 +381,125 @@ ObjectString *concatenate()
     return take_string(result, length);
 }
 
+/* Keys are compared by identity, so a view used as a key is interned in place */
+static void materialize_key(int index)
+{
+    if (IS_STRING_VIEW(PEEK(index)))
+    {
+        Value key = VALUE_OBJ(materialize_string(PEEK(index)));
+        PEEK(index) = key;
+    }
+}
+
 static bool call(ObjectClosure *callee, int args_count, uint8_t *ip)
 {
     if (callee->function->arity != args_count)
     {
-        runtime_error("Diharapkan %d arguments namun mendapat %d", callee->function->arity, args_count);
+        runtime_error("Diharapkan %d argumen namun mendapat %d", callee->function->arity, args_count);
         print_error_line(ip);
 
         return false;
     }
 
-    if (vm.frame_count >= FRAME_MAX)
+    if (vm->frame_count >= FRAME_MAX)
     {
         runtime_error("Jumlah melewati jumlah call frame maksimum");
         print_error_line(ip);
         return false;
     }
 
-    CallFrame *current = &vm.frame[vm.frame_count++];
-    current->slots = (vm.stack_top - args_count - 1);
+    CallFrame *current = &vm->frame[vm->frame_count++];
+    current->slots = (vm->stack_top - args_count - 1);
     current->ip = callee->function->chunk.code;
     current->closure = callee;
 
+#ifdef HAS_JIT
+    if (++callee->function->hotness == jit_threshold)
+        compile_jit(callee->function);
+#endif
+
+    return true;
+}
+
+/* The arguments stay on the stack for the host, its result is the last value it pushed */
+static bool call_host(ObjectNative *native, int args_count)
+{
+    int callee = vm->stack_top - args_count - 1;
+    if (!native->host(vm, args_count, native->userdata))
+        return false;
+
+    assert(vm->stack_top >= callee + args_count + 1 && "A native must not pop its arguments");
+    Value returned = vm->stack_top > callee + args_count + 1 ? vm->stack.items[vm->stack_top - 1] : VALUE_NIL;
+    vm->stack_top = callee;
+    push(returned);
     return true;
 }
 
+// Records the frame call() just pushed
+#define TRACE_CALL(closure, owner)                                                                                     \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (is_tracing)                                                                                                \
+            trace_call((Obj *)(closure)->function, (owner), (closure)->function->name,                                 \
+                       TRACE_FRAME_LEVEL(vm->frame_count));                                                            \
+    } while (0)
+
 static bool call_value(Value callee, int args_count, uint8_t *ip)
 {
     if (IS_OBJ(callee))
     {
         switch (OBJ_TYPE(callee))
         {
-        case OBJ_CLOSURE:
-            return call(AS_CLOSURE(callee), args_count, ip);
+        case OBJ_CLOSURE: {
+            ObjectClosure *closure = AS_CLOSURE(callee);
+            if (!call(closure, args_count, ip))
+                return false;
+
+            TRACE_CALL(closure, NULL);
+            return true;
+        }
 
         case OBJ_NATIVE: {
             ObjectNative *native = AS_NATIVE(callee);
-            NativeFn function = native->function;
-            Value returned;
-            if (!function(args_count, vm.stack_top - args_count, &returned))
+            if (is_tracing)
+                trace_call((Obj *)native, NULL, NULL, TRACE_NATIVE_LEVEL(vm->frame_count));
+
+            bool is_called;
+            if (native->host != NULL)
             {
-                return false;
+                is_called = call_host(native, args_count);
+            }
+            else
+            {
+                Value returned;
+                is_called = native->function(args_count, vm->stack_top - args_count, &returned);
+                if (is_called)
+                {
+                    vm->stack_top = vm->stack_top - args_count - 1;
+                    push(returned);
+                }
             }
 
-            vm.stack_top = vm.stack_top - args_count - 1;
-            push(returned);
-            return true;
+            if (is_tracing)
+                trace_return(TRACE_NATIVE_LEVEL(vm->frame_count));
+            return is_called;
         }
 
         case OBJ_CLASS: {
             ObjectClass *klass = AS_CLASS(callee);
             ObjectInstance *inst = new_instance(klass);
 
-            vm.stack->items[vm.stack_top - args_count - 1] = VALUE_OBJ(inst);
+            vm->stack.items[vm->stack_top - args_count - 1] = VALUE_OBJ(inst);
 
             Value init_val;
-            if (map_get(&klass->methods, vm.init_string, &init_val))
+            if (map_get(&klass->methods, vm->init_string, &init_val))
             {
                 assert(IS_CLOSURE(init_val));
-                return call(AS_CLOSURE(init_val), args_count, ip);
+                if (!call(AS_CLOSURE(init_val), args_count, ip))
+                    return false;
+
+                TRACE_CALL(AS_CLOSURE(init_val), klass->name);
+                return true;
             }
             else if (args_count != 0)
             {
@@ -347,13 +509,25 @@ static bool call_value(Value callee, int args_count, uint8_t *ip)
                 return false;
             }
 
+            // No init to run, the construction itself is the call
+            if (is_tracing)
+            {
+                trace_call((Obj *)klass, NULL, klass->name, TRACE_NATIVE_LEVEL(vm->frame_count));
+                trace_return(TRACE_NATIVE_LEVEL(vm->frame_count));
+            }
             return true;
         }
 
         case OBJ_METHOD: {
             ObjectMethod *method = AS_METHOD(callee);
-            vm.stack->items[vm.stack_top - args_count - 1] = method->receiver;
-            return call(method->closure, args_count, ip);
+            vm->stack.items[vm->stack_top - args_count - 1] = method->receiver;
+
+            if (!call(method->closure, args_count, ip))
+                return false;
+
+            TRACE_CALL(method->closure,
+                       IS_INSTANCE(method->receiver) ? AS_INSTANCE(method->receiver)->klass->name : NULL);
+            return true;
         }
 
         default:
@@ -368,7 +542,7 @@ static bool call_value(Value callee, int args_count, uint8_t *ip)
 static ObjectUpValue *get_from_uplist(int idx)
 {
     ObjectUpValue *prev_upvalue = NULL;
-    ObjectUpValue *curr_upvalue = vm.upvalues;
+    ObjectUpValue *curr_upvalue = vm->upvalues;
     while (curr_upvalue != NULL && curr_upvalue->idx > idx)
     {
         prev_upvalue = curr_upvalue;
@@ -386,7 +560,7 @@ static ObjectUpValue *get_from_uplist(int idx)
 
     if (prev_upvalue == NULL)
     {
-        vm.upvalues = created_upvalue;
+        vm->upvalues = created_upvalue;
         created_upvalue->next = curr_upvalue;
     }
     else
@@ -398,20 +572,100 @@ static ObjectUpValue *get_from_uplist(int idx)
 
 static void close_up_values(int last)
 {
-    while (vm.upvalues != NULL && vm.upvalues->idx >= last)
+    while (vm->upvalues != NULL && vm->upvalues->idx >= last)
     {
-        ObjectUpValue *upvalue = vm.upvalues;
-        upvalue->val = vm.stack->items[upvalue->idx];
+        ObjectUpValue *upvalue = vm->upvalues;
+        upvalue->val = vm->stack.items[upvalue->idx];
         upvalue->p_val = &upvalue->val;
-        vm.upvalues = vm.upvalues->next;
+        vm->upvalues = vm->upvalues->next;
+    }
+}
+
+/* Pops the returning frame and leaves `result` where its callee was */
+static inline void return_from(CallFrame *frame, Value result)
+{
+    close_up_values(frame->slots);
+
+    if (is_tracing)
+        trace_return(TRACE_FRAME_LEVEL(vm->frame_count));
+    vm->frame_count--;
+
+    vm->stack_top = frame->slots;
+    push(result);
+}
+
+/* Pushes the closure of OP_CLOSURE, `ip` is past the opcode. Returns the ip past the instruction */
+static uint8_t *capture_closure(CallFrame *frame, uint8_t *ip)
+{
+    uint32_t constant = (uint32_t)ip[0] << 24 | (uint32_t)ip[1] << 16 | (uint32_t)ip[2] << 8 | ip[3];
+    ip += 4;
+
+    ObjectFunction *function = AS_FUNCTION(frame->closure->function->chunk.constants.values[constant]);
+    ObjectClosure *closure = new_closure(function);
+
+    push(VALUE_OBJ(closure));
+
+    for (int i = 0; i < function->upvalue_count; ++i)
+    {
+        bool is_local = ip[0];
+        int index = (int)((uint32_t)ip[1] << 24 | (uint32_t)ip[2] << 16 | (uint32_t)ip[3] << 8 | ip[4]);
+        ip += 5;
+        if (is_local)
+        {
+            // Here get_from_uplist vanishing the upvalues[1]
+            closure->upvalues[i] = get_from_uplist(frame->slots + index);
+        }
+        else
+        {
+            closure->upvalues[i] = frame->closure->upvalues[index];
+        }
     }
+
+    return ip;
+}
+
+/* Sets the `table_count` key value pairs on top of the stack in the table below them */
+static void table_items(uint32_t table_count)
+{
+    for (size_t i = 0; i < table_count; ++i)
+    {
+        // A key of a literal is any expression after its first string, e.g. "abc".slice(1)
+        materialize_key(1);
+        Value key_val = PEEK(1);
+        Value value_val = PEEK(0);
+        Value inst = PEEK(table_count * 2 - (i * 2));
+
+        assert(IS_TABLE(inst));
+
+        ObjectTable *table = AS_TABLE(inst);
+        table_set(table, key_val, value_val);
+
+        pop();
+        pop();
+    }
+}
+
+/* Appends the `array_count` values on top of the stack to the array below them */
+static void array_items(int array_count)
+{
+    for (int i = 0; i < array_count; ++i)
+    {
+        Value inst = PEEK(array_count);
+
+        assert(IS_ARRAY(inst));
+
+        ObjectArray *array = AS_ARRAY(inst);
+        Value val = PEEK(array_count - 1 - i);
+        append_array(array, val);
+    }
+    vm->stack_top -= array_count;
 }
 
 static bool validate_array_key(ObjectArray *array, int *key_ptr)
 {
     int key_int = *key_ptr;
 
-    if (key_int > UINT16_MAX || key_int >= array->count)
+    if (key_int >= (int)array->count)
     {
         runtime_error("Indeks %d diluar jangkauan", key_int);
         return false;
@@ -419,7 +673,7 @@ static bool validate_array_key(ObjectArray *array, int *key_ptr)
 
     if (key_int < 0)
     {
-        key_int = key_int + array->count;
+        key_int = key_int + (int)array->count;
         if (key_int < 0)
         {
             runtime_error("Indeks %d diluar jangkauan", *key_ptr);
@@ -445,9 +699,13 @@ static bool len_expression(Value expr, Value *result)
         *result = VALUE_NUMBER(string->length);
         return true;
     }
+    case OBJ_STRING_VIEW: {
+        *result = VALUE_NUMBER(AS_STRING_VIEW(expr)->length);
+        return true;
+    }
     case OBJ_TABLE: {
         ObjectTable *table = AS_TABLE(expr);
-        *result = VALUE_NUMBER(table->values.size);
+        *result = VALUE_NUMBER(table_count(table));
         return true;
     }
     case OBJ_ARRAY: {
@@ -500,18 +758,17 @@ static bool get_field(Value container_val, Value key_value, Value *value)
     }
     case OBJ_TABLE: {
         ObjectTable *table = AS_TABLE(container_val);
-        if (!IS_STRING(key_value))
+        if (!IS_STRING(key_value) && !IS_NUMBER(key_value))
         {
-            runtime_error("Key harus bertipe string");
+            runtime_error("Key harus bertipe string atau number");
             return false;
         }
 
-        ObjectString *key = AS_STRING(key_value);
-        if (map_get(&table->values, key, value))
+        if (table_get(table, key_value, value))
         {
             return true;
         }
-        runtime_error("Objek 'table' tidak memiliki attribute '%s'", key->chars);
+        runtime_error("Objek 'table' tidak memiliki attribute '%s'", stringify(key_value)->chars);
         return false;
     }
     case OBJ_ARRAY: {
@@ -548,6 +805,16 @@ static bool get_field(Value container_val, Value key_value, Value *value)
         *value = array->values[key_int];
         return true;
     }
+    case OBJ_WORKER: {
+        if (IS_STRING(key_value) && map_get(&vm->worker_methods, AS_STRING(key_value), value))
+            return true;
+
+        if (IS_STRING(key_value))
+            runtime_error("Objek 'pekerja' tidak memiliki attribute '%s'", AS_C_STRING(key_value));
+        else
+            runtime_error("Objek 'pekerja' tidak memiliki attribute yang sesuai");
+        return false;
+    }
     default:
         return false;
     }
@@ -575,14 +842,13 @@ static bool set_field(Value container_val, Value key_value, Value new_val)
     case OBJ_TABLE: {
         ObjectTable *table = AS_TABLE(container_val);
 
-        if (!IS_STRING(key_value))
+        if (!IS_STRING(key_value) && !IS_NUMBER(key_value))
         {
-            runtime_error("Key harus bertipe string");
+            runtime_error("Key harus bertipe string atau number");
             return false;
         }
 
-        ObjectString *key_string = AS_STRING(key_value);
-        map_set(&table->values, key_string, new_val);
+        table_set(table, key_value, new_val);
         break;
     }
     case OBJ_ARRAY: {
@@ -614,7 +880,7 @@ static bool del_field(Value container_val, ObjectString *key)
     }
     case OBJ_TABLE: {
         ObjectTable *table = AS_TABLE(container_val);
-        return map_delete(&table->values, key);
+        return table_delete(table, VALUE_OBJ(key));
     }
     default:
         return false;
@@ -623,13 +889,15 @@ static bool del_field(Value container_val, ObjectString *key)
 
 static InterpretResult run()
 {
-    CallFrame *frame = &vm.frame[vm.frame_count - 1];
+    CallFrame *frame = &vm->frame[vm->frame_count - 1];
     uint8_t *ip = frame->ip;
 
+#ifdef DEBUG_OPCODE_STATS
+    OpcodeTimer opcode_timer = INIT_OPCODE_TIMER;
+#endif
+
 #define READ_BYTE() (*ip++)
 #define READ_SHORT() ((ip += 2), ((uint16_t)((uint16_t)(ip[-2] << 8) | ip[-1])))
-#define READ_CONSTANT() (frame->closure->function->chunk.constants->values[READ_BYTE()])
-#define STRING() (AS_STRING(READ_CONSTANT()))
 #define READ_LONG_BYTE()                                                                                               \
     ({                                                                                                                 \
         uint32_t res = 0;                                                                                              \
@@ -651,18 +919,75 @@ static InterpretResult run()
             res |= ((uint32_t)READ_BYTE() << (8 * (3 - i)));                                                           \
             ++i;                                                                                                       \
         } while (i < 4);                                                                                               \
-        frame->closure->function->chunk.constantsLong->values[res];                                                    \
+        frame->closure->function->chunk.constants.values[res];                                                         \
     })
 
 #define READ_STRING() AS_STRING(READ_LONG_CONSTANT())
 
+// Loop back edges, calls and returns take the sample the profiler's timer asked for
+#define SAFEPOINT()                                                                                                    \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (profile_pending)                                                                                           \
+        {                                                                                                              \
+            frame->ip = ip;                                                                                            \
+            take_sample();                                                                                             \
+        }                                                                                                              \
+    } while (0)
+
+#ifdef HAS_JIT
+// Hands the frame to the compiled code of its function, which returns from it or leaves at a later instruction
+#define ENTER_JIT()                                                                                                    \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (frame->closure->function->jit != NULL)                                                                     \
+        {                                                                                                              \
+            frame->ip = ip;                                                                                            \
+            JitStatus status = run_jit(frame, ip);                                                                     \
+            if (status == JIT_ERROR)                                                                                   \
+                return INTERPRET_RUNTIME_ERROR;                                                                        \
+            if (status == JIT_RETURNED)                                                                                \
+            {                                                                                                          \
+                if (vm->frame_count == vm->exit_frame)                                                                 \
+                    return INTERPRET_OK;                                                                               \
+                frame = &vm->frame[vm->frame_count - 1];                                                               \
+            }                                                                                                          \
+            ip = frame->ip;                                                                                            \
+        }                                                                                                              \
+    } while (0)
+#else
+#define ENTER_JIT()                                                                                                    \
+    do                                                                                                                 \
+    {                                                                                                                  \
+    } while (0)
+#endif
+
+#ifdef HAS_TRACE
+// A back edge to a loop header of a function without compiled code, the trace there runs until it leaves the loop
+#define ENTER_TRACE()                                                                                                  \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        if (frame->closure->function->jit == NULL)                                                                     \
+        {                                                                                                              \
+            frame->ip = ip;                                                                                            \
+            if (enter_trace(frame))                                                                                    \
+                ip = frame->ip;                                                                                        \
+        }                                                                                                              \
+    } while (0)
+#else
+#define ENTER_TRACE()                                                                                                  \
+    do                                                                                                                 \
+    {                                                                                                                  \
+    } while (0)
+#endif
+
 #define HANDLE_BINARY(value, op)                                                                                       \
     do                                                                                                                 \
     {                                                                                                                  \
         if (!IS_NUMBER(PEEK(0)) || !IS_NUMBER(PEEK(1)))                                                                \
                                                                                                                        \
         {                                                                                                              \
-            RUNTIME_ERROR(ip - 1, "Operand harus bertipe number");                                                     \
+            RUNTIME_ERROR(ip, "Operand harus bertipe number");                                                     \
             return INTERPRET_RUNTIME_ERROR;                                                                            \
         }                                                                                                              \
         double b = AS_NUMBER(pop());                                                                                   \
@@ -670,6 +995,33 @@ static InterpretResult run()
         push(value(a op b));                                                                                           \
     } while (0);
 
+// frame->ip is past the opcode of the running instruction
+#define QUICKEN(opcode) (frame->ip[-1] = (opcode))
+
+// The guard of a quickened instruction failed: it runs again as the generic one, which may quicken it anew
+#define DEQUICKEN(opcode)                                                                                              \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        frame->ip[-1] = (opcode);                                                                                      \
+        ip = frame->ip - 1;                                                                                            \
+    } while (0)
+
+#define HANDLE_BINARY_NUM(value, op, generic)                                                                          \
+    do                                                                                                                 \
+    {                                                                                                                  \
+        Value b = PEEK(0);                                                                                             \
+        Value a = PEEK(1);                                                                                             \
+        if (IS_NUMBER(a) && IS_NUMBER(b))                                                                              \
+        {                                                                                                              \
+            PEEK(1) = value(AS_NUMBER(a) op AS_NUMBER(b));                                                             \
+            vm->stack_top--;                                                                                           \
+        }                                                                                                              \
+        else                                                                                                           \
+        {                                                                                                              \
+            DEQUICKEN(generic);                                                                                        \
+        }                                                                                                              \
+    } while (0)
+
 #define HANDLE_EQUAL()                                                                                                 \
     do                                                                                                                 \
     {                                                                                                                  \
@@ -691,15 +1043,17 @@ static InterpretResult run()
             push(VALUE_NUMBER(false_expr));                                                                            \
     } while (0);
 
+    ENTER_JIT();
+
     for (;;)
     {
 
 #ifdef DEBUG_TRACE_EXECUTION
 
         printf("[");
-        for (int i = 0; i < vm.stack_top; ++i)
+        for (int i = 0; i < vm->stack_top; ++i)
         {
-            Value cur = vm.stack->items[i];
+            Value cur = vm->stack.items[i];
             print_value(cur, true, 0);
             printf(",");
         }
@@ -709,40 +1063,31 @@ static InterpretResult run()
         printf("\n");
 #endif
 
-        uint8_t instruction;
-        switch (instruction = READ_BYTE())
+        uint8_t instruction = READ_BYTE();
+        // Allocations are charged to the line of frame->ip, one store costs less than a branch
+        frame->ip = ip;
+
+#ifdef DEBUG_OPCODE_STATS
+        count_opcode(&opcode_timer, instruction);
+#endif
+
+        switch (instruction)
         {
         case OP_RETURN: {
             Value return_value = pop();
+            return_from(frame, return_value);
 
-            close_up_values(frame->slots);
-
-            vm.frame_count--;
-            if (vm.frame_count == 0)
-            {
-                pop();
+            // The script finished, or the function the host called returned
+            if (vm->frame_count == vm->exit_frame)
                 return INTERPRET_OK;
-            }
 
-            int dist = (int)(vm.stack_top - frame->slots);
-
-            vm.stack_top = frame->slots;
-            vm.stack->size -= dist;
-
-            push(return_value);
-
-            frame = &vm.frame[vm.frame_count - 1];
+            frame = &vm->frame[vm->frame_count - 1];
             ip = frame->ip;
+            SAFEPOINT();
 
             break;
         }
 
-        case OP_CONSTANT: {
-            Value constant_value = READ_CONSTANT();
-            push(constant_value);
-            break;
-        }
-
         case OP_CONSTANT_LONG: {
             Value constant_value = READ_LONG_CONSTANT();
             push(constant_value);
@@ -777,10 +1122,9 @@ static InterpretResult run()
         }
 
         case OP_NEGATE: {
-            uint8_t *prev_ip = ip - 1;
             if (!IS_NUMBER(PEEK(0)))
             {
-                RUNTIME_ERROR(prev_ip, "Diharapkan number");
+                RUNTIME_ERROR(ip, "Diharapkan number");
                 return INTERPRET_RUNTIME_ERROR;
             }
             double num = AS_NUMBER(PEEK(0)) * -1;
@@ -795,46 +1139,90 @@ static InterpretResult run()
         }
 
         case OP_ADD: {
-            uint8_t *prev_ip = ip - 1;
             if (IS_NUMBER(PEEK(0)) && IS_NUMBER(PEEK(1)))
             {
+                QUICKEN(OP_ADD_NUM);
                 HANDLE_BINARY(VALUE_NUMBER, +);
                 break;
             }
-            if ((IS_STRING(PEEK(0)) || (IS_NUMBER(PEEK(0)))) && ((IS_STRING(PEEK(1))) || IS_NUMBER(PEEK(1))))
+            if ((IS_ANY_STRING(PEEK(0)) || (IS_NUMBER(PEEK(0)))) && ((IS_ANY_STRING(PEEK(1))) || IS_NUMBER(PEEK(1))))
             {
+                if (IS_ANY_STRING(PEEK(0)) && IS_ANY_STRING(PEEK(1)))
+                    QUICKEN(OP_ADD_STR);
                 push(VALUE_OBJ(concatenate()));
                 break;
             }
             else
             {
-                RUNTIME_ERROR(prev_ip, "Operands harus bertipe number atau string");
+                RUNTIME_ERROR(ip, "Operands harus bertipe number atau string");
                 return INTERPRET_RUNTIME_ERROR;
             }
         }
         case OP_SUBTRACT:
+            QUICKEN(OP_SUBTRACT_NUM);
             HANDLE_BINARY(VALUE_NUMBER, -);
             break;
         case OP_MULTIPLY:
+            QUICKEN(OP_MULTIPLY_NUM);
             HANDLE_BINARY(VALUE_NUMBER, *);
             break;
         case OP_DIVIDE:
+            QUICKEN(OP_DIVIDE_NUM);
             HANDLE_BINARY(VALUE_NUMBER, /);
             break;
         case OP_GREATER:
+            QUICKEN(OP_GREATER_NUM);
             HANDLE_BINARY(VALUE_BOOL, >);
             break;
         case OP_LESS:
+            QUICKEN(OP_LESS_NUM);
             HANDLE_BINARY(VALUE_BOOL, <);
             break;
+
+        case OP_ADD_NUM:
+            HANDLE_BINARY_NUM(VALUE_NUMBER, +, OP_ADD);
+            break;
+        case OP_ADD_STR: {
+            if (!IS_ANY_STRING(PEEK(0)) || !IS_ANY_STRING(PEEK(1)))
+            {
+                DEQUICKEN(OP_ADD);
+                break;
+            }
+            push(VALUE_OBJ(concatenate()));
+            break;
+        }
+        case OP_SUBTRACT_NUM:
+            HANDLE_BINARY_NUM(VALUE_NUMBER, -, OP_SUBTRACT);
+            break;
+        case OP_MULTIPLY_NUM:
+            HANDLE_BINARY_NUM(VALUE_NUMBER, *, OP_MULTIPLY);
+            break;
+        case OP_DIVIDE_NUM:
+            HANDLE_BINARY_NUM(VALUE_NUMBER, /, OP_DIVIDE);
+            break;
+        case OP_GREATER_NUM:
+            HANDLE_BINARY_NUM(VALUE_BOOL, >, OP_GREATER);
+            break;
+        case OP_LESS_NUM:
+            HANDLE_BINARY_NUM(VALUE_BOOL, <, OP_LESS);
+            break;
         case OP_EQUAL_EQUAL:
             HANDLE_EQUAL();
             break;
         case OP_DOT_GET: {
+            Value key = READ_LONG_CONSTANT();
             Value container_val = pop();
 
             Value value;
-            if (!get_field(container_val, READ_LONG_CONSTANT(), &value))
+            if (IS_INSTANCE(container_val) && IS_STRING(key) &&
+                map_get(&AS_INSTANCE(container_val)->table, AS_STRING(key), &value))
+            {
+                QUICKEN(OP_DOT_GET_INSTANCE);
+                push(value);
+                break;
+            }
+
+            if (!get_field(container_val, key, &value))
             {
                 print_error_line(ip);
                 resetStack();
@@ -843,6 +1231,20 @@ static InterpretResult run()
             push(value);
             break;
         }
+        case OP_DOT_GET_INSTANCE: {
+            // A field of an instance: methods and every other container take the generic path
+            Value key = READ_LONG_CONSTANT();
+            Value container_val = PEEK(0);
+
+            Value value;
+            if (!IS_INSTANCE(container_val) || !map_get(&AS_INSTANCE(container_val)->table, AS_STRING(key), &value))
+            {
+                DEQUICKEN(OP_DOT_GET);
+                break;
+            }
+            PEEK(0) = value;
+            break;
+        }
         case OP_DOT_SET: {
             Value key = READ_LONG_CONSTANT();
             Value new_val = PEEK(0);
@@ -861,6 +1263,7 @@ static InterpretResult run()
             break;
         }
         case OP_SQR_BRACKET_GET: {
+            materialize_key(0);
             Value key_val = pop();
             Value container_val = pop();
 
@@ -875,6 +1278,7 @@ static InterpretResult run()
             break;
         }
         case OP_SQR_BRACKET_SET: {
+            materialize_key(1);
             Value new_val = PEEK(0);
             Value key_val = PEEK(1);
             Value container_val = PEEK(2);
@@ -909,7 +1313,7 @@ static InterpretResult run()
             break;
 
         case OP_CLOSE_UPVALUE: {
-            close_up_values(vm.stack_top - 1);
+            close_up_values(vm->stack_top - 1);
             pop();
             break;
         }
@@ -923,19 +1327,19 @@ static InterpretResult run()
         }
 
         case OP_GLOBAL_VAR: {
-            ObjectString *name = READ_STRING();
-            map_set(&vm.globals, name, pop());
+            uint32_t slot = READ_LONG_BYTE();
+            vm->global_values.values[slot] = pop();
 
             break;
         }
 
         case OP_GET_GLOBAL: {
-            uint8_t *prev_ip = ip - 1;
-            ObjectString *name = READ_STRING();
-            Value val;
-            if (!map_get(&vm.globals, name, &val))
+            uint32_t slot = READ_LONG_BYTE();
+            Value val = vm->global_values.values[slot];
+            if (IS_UNDEFINED(val))
             {
-                RUNTIME_ERROR(prev_ip, "Tidak dapat mengakses variabel yang tidak terdeklarasi: %s", name->chars);
+                RUNTIME_ERROR(ip, "Tidak dapat mengakses variabel yang tidak terdeklarasi: %s",
+                              AS_C_STRING(vm->global_names.values[slot]));
                 return INTERPRET_RUNTIME_ERROR;
             }
             push(val);
@@ -943,29 +1347,27 @@ static InterpretResult run()
         }
 
         case OP_SET_GLOBAL: {
-            uint8_t *prev_ip = ip - 1;
-            ObjectString *name = READ_STRING();
-            Value val = PEEK(0);
+            uint32_t slot = READ_LONG_BYTE();
 
-            if (map_set(&vm.globals, name, val))
+            if (IS_UNDEFINED(vm->global_values.values[slot]))
             {
-                map_delete(&vm.globals, name);
-                RUNTIME_ERROR(prev_ip, "Tidak dapat menetapkan nilai ke variabel yang tidak terdeklarasi : '%s'",
-                              name->chars);
+                RUNTIME_ERROR(ip, "Tidak dapat menetapkan nilai ke variabel yang tidak terdeklarasi : '%s'",
+                              AS_C_STRING(vm->global_names.values[slot]));
                 return INTERPRET_RUNTIME_ERROR;
             };
+            vm->global_values.values[slot] = PEEK(0);
             break;
         }
 
         case OP_GET_LOCAL: {
             uint32_t idx = READ_LONG_BYTE();
-            push(vm.stack->items[frame->slots + idx]);
+            push(vm->stack.items[frame->slots + idx]);
             break;
         }
 
         case OP_SET_LOCAL: {
             uint32_t idx = READ_LONG_BYTE();
-            vm.stack->items[frame->slots + idx] = PEEK(0);
+            vm->stack.items[frame->slots + idx] = PEEK(0);
             break;
         }
 
@@ -974,7 +1376,7 @@ static InterpretResult run()
             ObjectUpValue *upvalue = frame->closure->upvalues[idx];
             if (upvalue->p_val == NULL)
             {
-                push(vm.stack->items[upvalue->idx]);
+                push(vm->stack.items[upvalue->idx]);
             }
             else
             {
@@ -988,7 +1390,7 @@ static InterpretResult run()
             ObjectUpValue *upvalue = frame->closure->upvalues[idx];
             if (upvalue->p_val == NULL)
             {
-                vm.stack->items[upvalue->idx] = PEEK(0);
+                vm->stack.items[upvalue->idx] = PEEK(0);
             }
             else
             {
@@ -1024,6 +1426,15 @@ static InterpretResult run()
         case OP_LOOP: {
             uint16_t jump = READ_SHORT();
             ip -= jump;
+            SAFEPOINT();
+
+#ifdef HAS_JIT
+            // A script's own loops run once, back edges count toward compiling it like calls do
+            if (++frame->closure->function->hotness == jit_threshold)
+                compile_jit(frame->closure->function);
+#endif
+            ENTER_TRACE();
+            ENTER_JIT();
             break;
         }
 
@@ -1040,7 +1451,7 @@ static InterpretResult run()
         case OP_CASE_COMPARE: {
             Value b = pop();
             Value a = PEEK(1);
-            vm.stack->items[vm.stack_top - 1] = VALUE_BOOL(compare(a, b));
+            vm->stack.items[vm->stack_top - 1] = VALUE_BOOL(compare(a, b));
             break;
         }
 
@@ -1067,33 +1478,16 @@ static InterpretResult run()
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            frame = &vm.frame[vm.frame_count - 1];
+            frame = &vm->frame[vm->frame_count - 1];
             ip = frame->ip;
+            SAFEPOINT();
+            ENTER_JIT();
 
             break;
         }
 
         case OP_CLOSURE: {
-            ObjectFunction *function = AS_FUNCTION(READ_LONG_CONSTANT());
-            ObjectClosure *closure = new_closure(function);
-
-            push(VALUE_OBJ(closure));
-
-            for (int i = 0; i < function->upvalue_count; ++i)
-            {
-                bool is_local = READ_BYTE();
-                int index = READ_LONG_BYTE();
-                if (is_local)
-                {
-                    // Here get_from_uplist vanishing the upvalues[1]
-                    closure->upvalues[i] = get_from_uplist(frame->slots + index);
-                }
-                else
-                {
-                    closure->upvalues[i] = frame->closure->upvalues[index];
-                }
-            }
-
+            ip = capture_closure(frame, ip);
             break;
         }
 
@@ -1123,26 +1517,26 @@ static InterpretResult run()
         }
 
         case OP_DEL: {
-            uint8_t *prev_ip = ip - 1;
+            materialize_key(0);
             Value key_val = pop();
             Value container_val = pop();
 
             if (!IsObjType(key_val, OBJ_STRING))
             {
-                RUNTIME_ERROR(prev_ip, "Expression harus bertipe string");
+                RUNTIME_ERROR(ip, "Expression harus bertipe string");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
             if (!IS_OBJ(container_val))
             {
-                RUNTIME_ERROR(prev_ip, "Hanya instances yang memiliki fields");
+                RUNTIME_ERROR(ip, "Hanya instances yang memiliki fields");
                 return INTERPRET_RUNTIME_ERROR;
             }
 
             ObjectString *key = AS_STRING(key_val);
             if (!del_field(container_val, key))
             {
-                RUNTIME_ERROR(prev_ip, "Kesalahan field : '%s'", key->chars);
+                RUNTIME_ERROR(ip, "Kesalahan field : '%s'", key->chars);
                 return INTERPRET_RUNTIME_ERROR;
             };
 
@@ -1154,6 +1548,25 @@ static InterpretResult run()
             Value key = READ_LONG_CONSTANT();
             Value inst_val = PEEK(args_count);
 
+            if (IS_ANY_STRING(inst_val))
+            {
+                Value method;
+                if (!map_get(&vm->string_methods, AS_STRING(key), &method))
+                {
+                    RUNTIME_ERROR(ip, "Objek 'string' tidak memiliki method '%s'", AS_C_STRING(key));
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+
+                if (!call_value(method, args_count, ip))
+                {
+                    print_error_line(ip);
+                    resetStack();
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                SAFEPOINT();
+                break;
+            }
+
             Value val;
             if (!get_field(inst_val, key, &val))
             {
@@ -1169,8 +1582,10 @@ static InterpretResult run()
                 return INTERPRET_RUNTIME_ERROR;
             }
 
-            frame = &vm.frame[vm.frame_count - 1];
+            frame = &vm->frame[vm->frame_count - 1];
             ip = frame->ip;
+            SAFEPOINT();
+            ENTER_JIT();
 
             break;
         }
@@ -1181,23 +1596,7 @@ static InterpretResult run()
         }
 
         case OP_TABLE_ITEMS: {
-            uint32_t table_count = READ_LONG_BYTE();
-
-            for (size_t i = 0; i < table_count; ++i)
-            {
-                Value key_val = PEEK(1);
-                Value value_val = PEEK(0);
-                Value inst = PEEK(table_count * 2 - (i * 2));
-
-                assert(IS_TABLE(inst));
-
-                ObjectTable *table = AS_TABLE(inst);
-                map_set(&table->values, AS_STRING(key_val), value_val);
-
-                pop();
-                pop();
-            }
-
+            table_items(READ_LONG_BYTE());
             break;
         }
 
@@ -1207,19 +1606,7 @@ static InterpretResult run()
         }
 
         case OP_ARRAY_ITEMS: {
-            int array_count = READ_LONG_BYTE();
-
-            for (int i = 0; i < array_count; ++i)
-            {
-                Value inst = PEEK(array_count);
-
-                assert(IS_ARRAY(inst));
-
-                ObjectArray *array = AS_ARRAY(inst);
-                Value val = PEEK(array_count - 1 - i);
-                append_array(array, val);
-            }
-            vm.stack_top -= array_count;
+            array_items(READ_LONG_BYTE());
             break;
         }
 
@@ -1234,20 +1621,25 @@ static InterpretResult run()
         }
 
         case OP_ARRAY_POP: {
-            uint8_t *prev_ip = ip - 1;
             Value container_val = PEEK(0);
             assert(IS_ARRAY(container_val));
 
             ObjectArray *array = AS_ARRAY(container_val);
             if (array->count <= 0)
             {
-                RUNTIME_ERROR(prev_ip, "Tidak dapat melakukan pop pada array yang kosong");
+                RUNTIME_ERROR(ip, "Tidak dapat melakukan pop pada array yang kosong");
                 return INTERPRET_RUNTIME_ERROR;
             }
             pop_array(array);
             break;
         }
 
+        case OP_PAUSE: {
+            // The streamed script hands control back to compile its next declaration
+            frame->ip = ip;
+            return INTERPRET_OK;
+        }
+
         default:
             return INTERPRET_OK;
         }
@@ -1256,41 +1648,396 @@ static InterpretResult run()
 #undef READ_SHORT
 #undef READ_BYTE
 #undef STRING
-#undef READ_CONSTANT
 #undef READ_LONG_CONSTANT
 #undef READ_STRING
+#undef SAFEPOINT
+#undef ENTER_JIT
+#undef ENTER_TRACE
 #undef HANDLE_BINARY
+#undef HANDLE_BINARY_NUM
+#undef QUICKEN
+#undef DEQUICKEN
 #undef HANDLE_EQUAL
 #undef HANDLE_TERNARY
 #undef RUNTIME_ERROR
 }
 
+/* ===== JIT HELPERS ===== */
+
+/*
+ * Called by the compiled code (jit.h) for the instructions it does not
+ * handle inline. `stack_top` and the frame's ip are synced, so they work on
+ * the stack like run() and report errors the way it does, returning false.
+ * */
+
+/* Runs the frame call_value pushed until it returns to the compiled caller */
+static bool run_callee()
+{
+    CallFrame *frame = &vm->frame[vm->frame_count - 1];
+    if (frame->closure->function->jit != NULL)
+    {
+        JitStatus status = run_jit(frame, frame->ip);
+        if (status != JIT_EXITED)
+            return status == JIT_RETURNED;
+    }
+
+    int exit_frame = vm->exit_frame;
+    vm->exit_frame = vm->frame_count - 1;
+    InterpretResult result = run();
+    vm->exit_frame = exit_frame;
+    return result == INTERPRET_OK;
+}
+
+bool jit_call(int args_count)
+{
+    CallFrame *frame = &vm->frame[vm->frame_count - 1];
+    int frame_count = vm->frame_count;
+
+    if (!call_value(PEEK(args_count), args_count, frame->ip))
+        return false;
+
+    return vm->frame_count == frame_count || run_callee();
+}
+
+bool jit_invoke(int args_count, Value name)
+{
+    CallFrame *frame = &vm->frame[vm->frame_count - 1];
+    int frame_count = vm->frame_count;
+    Value receiver = PEEK(args_count);
+
+    Value method;
+    if (IS_ANY_STRING(receiver))
+    {
+        if (!map_get(&vm->string_methods, AS_STRING(name), &method))
+        {
+            runtime_error("Objek 'string' tidak memiliki method '%s'", AS_C_STRING(name));
+            print_error_line(frame->ip);
+            resetStack();
+            return false;
+        }
+
+        if (!call_value(method, args_count, frame->ip))
+        {
+            print_error_line(frame->ip);
+            resetStack();
+            return false;
+        }
+        return true;
+    }
+
+    if (!get_field(receiver, name, &method))
+    {
+        print_error_line(frame->ip);
+        resetStack();
+        return false;
+    }
+
+    if (!call_value(method, args_count, frame->ip))
+        return false;
+
+    return vm->frame_count == frame_count || run_callee();
+}
+
+void jit_return()
+{
+    Value return_value = pop();
+    return_from(&vm->frame[vm->frame_count - 1], return_value);
+}
+
+/* OP_ADD with anything but two numbers */
+bool jit_add()
+{
+    if ((IS_ANY_STRING(PEEK(0)) || (IS_NUMBER(PEEK(0)))) && ((IS_ANY_STRING(PEEK(1))) || IS_NUMBER(PEEK(1))))
+    {
+        push(VALUE_OBJ(concatenate()));
+        return true;
+    }
+
+    runtime_error("Operands harus bertipe number atau string");
+    print_error_line(vm->frame[vm->frame_count - 1].ip);
+    resetStack();
+    return false;
+}
+
+/* OP_EQUAL_EQUAL with two different objects */
+void jit_equal()
+{
+    Value b = pop();
+    Value a = pop();
+    push(VALUE_BOOL(compare(a, b)));
+}
+
+bool jit_dot_get(Value key)
+{
+    Value container_val = pop();
+
+    Value value;
+    if (!get_field(container_val, key, &value))
+    {
+        print_error_line(vm->frame[vm->frame_count - 1].ip);
+        resetStack();
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+bool jit_dot_set(Value key)
+{
+    Value new_val = PEEK(0);
+    Value container_val = PEEK(1);
+
+    if (!set_field(container_val, key, new_val))
+    {
+        print_error_line(vm->frame[vm->frame_count - 1].ip);
+        resetStack();
+        return false;
+    }
+    pop();
+    pop();
+    push(new_val);
+    return true;
+}
+
+bool jit_index_get()
+{
+    materialize_key(0);
+    Value key_val = pop();
+    Value container_val = pop();
+
+    Value value;
+    if (!get_field(container_val, key_val, &value))
+    {
+        print_error_line(vm->frame[vm->frame_count - 1].ip);
+        resetStack();
+        return false;
+    }
+    push(value);
+    return true;
+}
+
+bool jit_index_set()
+{
+    materialize_key(1);
+    Value new_val = PEEK(0);
+    Value key_val = PEEK(1);
+    Value container_val = PEEK(2);
+
+    if (!set_field(container_val, key_val, new_val))
+    {
+        print_error_line(vm->frame[vm->frame_count - 1].ip);
+        resetStack();
+        return false;
+    }
+
+    pop();
+    pop();
+    pop();
+    push(new_val);
+    return true;
+}
+
+bool jit_len()
+{
+    Value result = {0};
+    if (!len_expression(pop(), &result))
+    {
+        print_error_line(vm->frame[vm->frame_count - 1].ip);
+        resetStack();
+        return false;
+    }
+    push(result);
+    return true;
+}
+
+void jit_print()
+{
+    Value value = pop();
+    print_value(value, false, 1);
+    printf("\n");
+}
+
+void jit_closure(uint8_t *ip)
+{
+    capture_closure(&vm->frame[vm->frame_count - 1], ip);
+}
+
+void jit_close_upvalue()
+{
+    close_up_values(vm->stack_top - 1);
+    pop();
+}
+
+void jit_table()
+{
+    push(VALUE_OBJ(new_table()));
+}
+
+void jit_table_items(uint32_t count)
+{
+    table_items(count);
+}
+
+void jit_array()
+{
+    push(VALUE_OBJ(new_array()));
+}
+
+void jit_array_items(uint32_t count)
+{
+    array_items((int)count);
+}
+
+void jit_array_push()
+{
+    assert(IS_ARRAY(PEEK(1)));
+    append_array(AS_ARRAY(PEEK(1)), PEEK(0));
+}
+
+bool jit_array_pop()
+{
+    assert(IS_ARRAY(PEEK(0)));
+
+    ObjectArray *array = AS_ARRAY(PEEK(0));
+    if (array->count <= 0)
+    {
+        runtime_error("Tidak dapat melakukan pop pada array yang kosong");
+        print_error_line(vm->frame[vm->frame_count - 1].ip);
+        resetStack();
+        return false;
+    }
+    pop_array(array);
+    return true;
+}
+
 void init_call_frame(CallFrame *call_frame)
 {
     call_frame->ip = call_frame->closure->function->chunk.code;
     call_frame->slots = 0;
 }
 
-InterpretResult interpret(const char *source)
+static InterpretResult run_function(ObjectFunction *base_function)
+{
+    push(VALUE_OBJ(base_function));
+    ObjectClosure *closure = new_closure(base_function);
+    pop();
+    push(VALUE_OBJ(closure));
+
+    CallFrame *current = &vm->frame[vm->frame_count++];
+    current->slots = 0;
+    current->ip = base_function->chunk.code;
+    current->closure = closure;
+    TRACE_CALL(closure, NULL);
+
+    InterpretResult result = run();
+    if (result == INTERPRET_OK)
+        pop();
+    return result;
+}
+
+InterpretResult interpret(VM *instance, const char *source)
 {
+    VM *previous = use_vm(instance);
+
+    InterpretResult result = INTERPRET_COMPILE_ERROR;
     ObjectFunction *base_function = compile(source);
-    if (base_function == NULL)
-        return INTERPRET_COMPILE_ERROR;
+    if (base_function != NULL)
+        result = run_function(base_function);
+
+    use_vm(previous);
+    return result;
+}
+
+/* Runs an already compiled script, e.g. one loaded from the bytecode cache */
+InterpretResult interpret_function(VM *instance, ObjectFunction *base_function)
+{
+    VM *previous = use_vm(instance);
+    InterpretResult result = run_function(base_function);
+    use_vm(previous);
+    return result;
+}
+
+/* Compiles and runs a script one top-level declaration at a time while it is being read */
+InterpretResult interpret_stream(VM *instance, SourceStream *stream)
+{
+    VM *previous = use_vm(instance);
 
+    ObjectFunction *base_function = begin_stream(stream);
+    push(VALUE_OBJ(base_function));
     ObjectClosure *closure = new_closure(base_function);
+    pop();
     push(VALUE_OBJ(closure));
 
-    CallFrame *current = &vm.frame[vm.frame_count++];
+    CallFrame *current = &vm->frame[vm->frame_count++];
     current->slots = 0;
-    current->ip = base_function->chunk.code;
     current->closure = closure;
+    TRACE_CALL(closure, NULL);
+
+    InterpretResult result;
+    for (;;)
+    {
+        StreamStatus status = compile_stream(stream);
+        if (status == STREAM_ERROR)
+        {
+            result = INTERPRET_COMPILE_ERROR;
+            break;
+        }
+
+        // The chunk was emptied and refilled, it may have moved and its compiled code is stale
+        current->ip = base_function->chunk.code;
+        free_jit(base_function);
+        free_traces(base_function);
+        result = run();
+        if (result != INTERPRET_OK)
+            break;
+
+        if (status == STREAM_DONE)
+        {
+            pop();
+            break;
+        }
+    }
+
+    use_vm(previous);
+    return result;
+}
+
+/*
+ * Calls the value below the top `args_count` values on behalf of the host and
+ * leaves the result in its place. Nested calls from a native return to it:
+ * run() stops when the frames unwind to where the call was made.
+ * */
+InterpretResult interpret_call(VM *instance, int args_count)
+{
+    VM *previous = use_vm(instance);
+
+    int callee = vm->stack_top - args_count - 1;
+    int exit_frame = vm->exit_frame;
+    vm->exit_frame = vm->frame_count;
+
+    uint8_t *ip = vm->frame_count > 0 ? vm->frame[vm->frame_count - 1].ip : NULL;
+    InterpretResult result = INTERPRET_RUNTIME_ERROR;
+    if (call_value(vm->stack.items[callee], args_count, ip))
+        result = vm->frame_count > vm->exit_frame ? run() : INTERPRET_OK;
+
+    // An error resets the whole stack, only drop what belongs to this call
+    if (result != INTERPRET_OK)
+    {
+        vm->frame_count = vm->exit_frame;
+        if (is_tracing)
+            trace_return(TRACE_FRAME_LEVEL(vm->frame_count + 1));
+        close_up_values(callee);
+        vm->stack_top = callee;
+        push(VALUE_NIL);
+    }
 
-    return run();
+    vm->exit_frame = exit_frame;
+    use_vm(previous);
+    return result;
 }
 
 void init_stack(Stack *stack)
 {
     stack->items = NULL;
-    stack->size = 0;
     stack->capacity = 0;
 }
@@ -12,7 +12,6 @@
 typedef struct
 {
     int capacity;
-    int size;
 
     Value *items;
 } Stack;
@@ -28,12 +27,17 @@ typedef struct
 void init_call_frame(CallFrame *call_frame);
 void free_call_frame(CallFrame *call_frame);
 
-typedef struct
+/*
+ * Everything a running script owns: its stack, its heap and intern table,
+ * its globals. A process can hold any number of VMs, each used by one thread
+ * at a time. The code works on the thread's current VM, `vm`: use_vm sets
+ * it, and the entry points taking a VM (interpret, interpret_function, ...)
+ * run on theirs and restore the previous one, so the compiler, the GC and
+ * the natives need no extra argument.
+ * */
+typedef struct VM
 {
-    // Chunk *chunk;
-    // uint8_t *ip;
-
-    Stack *stack;
+    Stack stack;
 
     // Value stack[STACK_MAX];
     int stack_top;
@@ -41,10 +45,25 @@ typedef struct
     int frame_count;
     CallFrame frame[FRAME_MAX];
 
+    // run() returns to the host once a call made by interpret_call unwinds to this frame count
+    int exit_frame;
+
     Obj *objects;
 
     Map strings;
+
+    /*
+     * Globals are resolved to a slot at compile time, `globals` maps the name
+     * to its slot and is only consulted when compiling or defining natives.
+     * Slots that are not defined yet hold VALUE_UNDEFINED.
+     */
     Map globals;
+    LongValues global_values;
+    LongValues global_names;
+
+    Map string_methods;
+    // Methods of the handles pekerja() returns, see worker.h
+    Map worker_methods;
 
     ObjectUpValue *upvalues;
 
@@ -53,9 +72,16 @@ typedef struct
     Obj **grey_stack;
 
     size_t current_bytes;
+    // Every byte ever allocated, frees do not count: what a piece of code cost
+    size_t allocated_bytes;
     size_t next_gc;
+    int gc_paused;
 
     ObjectString *init_string;
+
+    // Values the host keeps with cws_ref, free slots are chained through `free_ref`
+    LongValues refs;
+    int free_ref;
 } VM;
 
 typedef enum
@@ -66,10 +92,11 @@ typedef enum
 
 } InterpretResult;
 
-extern VM vm;
+extern _Thread_local VM *vm;
 
-void init_vm();
-void free_vm();
+VM *new_vm();
+void free_vm(VM *instance);
+VM *use_vm(VM *instance);
 
 void init_stack(Stack *stack);
 void write_stack(Stack *stack, Value *value);
@@ -80,8 +107,12 @@ void push(Value value);
 Value pop();
 
 ObjectString *stringify(Value value);
+uint32_t global_slot(ObjectString *name);
 
-InterpretResult interpret(const char *code);
+InterpretResult interpret(VM *instance, const char *code);
+InterpretResult interpret_function(VM *instance, ObjectFunction *base_function);
+InterpretResult interpret_stream(VM *instance, SourceStream *stream);
+InterpretResult interpret_call(VM *instance, int args_count);
 
 #define RUNTIME_ERROR(ip, ...)                                                                                         \
     do                                                                                                                 \
@@ -0,0 +1,485 @@
+#include "worker.h"
+#include "native.h"
+#include "object.h"
+#include "snapshot.h"
+#include "source.h"
+
+#include <string.h>
+
+#ifdef HAS_WORKERS
+
+#include <errno.h>
+#include <pthread.h>
+#include <semaphore.h>
+#include <stdatomic.h>
+
+/*
+ * MESSAGE QUEUE
+ *
+ * A singly linked list that always holds at least one node: `first` is the
+ * node taken last (its bytes already belong to the receiver), the messages
+ * waiting follow it. The producer only touches `last` and the `next` of the
+ * node it appends to, the consumer only `first`, so the two never need a
+ * lock; the release store of `next` publishes the message.
+ * */
+
+typedef struct Message
+{
+    _Atomic(struct Message *) next;
+    uint8_t *bytes;
+    size_t size;
+} Message;
+
+typedef struct
+{
+    Message *first;
+    Message *last;
+
+    // One post per message, and one more once the producer is gone for good
+    sem_t ready;
+} MessageQueue;
+
+struct Worker
+{
+    // The handle and the thread, the last one to let go frees the worker
+    atomic_int refs;
+    pthread_t thread;
+    // Only read and written by the thread owning the handle
+    bool is_joined;
+
+    VM *vm;
+    // A script read from `source`, otherwise the closure and its arguments on the stack of `vm`
+    bool is_script;
+    SourceStream source;
+    int args_count;
+
+    // Parent to worker and worker to parent
+    MessageQueue inbox;
+    MessageQueue outbox;
+
+    // The closure's result, written by the thread before it ends
+    Message *result;
+};
+
+// The worker this thread runs, NULL on the main thread
+static _Thread_local Worker *current_worker = NULL;
+
+static Message *new_message(uint8_t *bytes, size_t size)
+{
+    Message *message = malloc(sizeof(Message));
+    if (message == NULL)
+    {
+        fprintf(stderr, "Not enough memory to send a message\n");
+        exit(74);
+    }
+
+    atomic_init(&message->next, NULL);
+    message->bytes = bytes;
+    message->size = size;
+    return message;
+}
+
+static void free_message(Message *message)
+{
+    free(message->bytes);
+    free(message);
+}
+
+static void init_queue(MessageQueue *queue)
+{
+    queue->first = new_message(NULL, 0);
+    queue->last = queue->first;
+    sem_init(&queue->ready, 0, 0);
+}
+
+static void free_queue(MessageQueue *queue)
+{
+    Message *message = queue->first;
+    while (message != NULL)
+    {
+        Message *next = atomic_load_explicit(&message->next, memory_order_relaxed);
+        free_message(message);
+        message = next;
+    }
+    sem_destroy(&queue->ready);
+}
+
+static void send_message(MessageQueue *queue, Message *message)
+{
+    atomic_store_explicit(&queue->last->next, message, memory_order_release);
+    queue->last = message;
+    sem_post(&queue->ready);
+}
+
+/* Waits for the next message and takes its bytes, false once the producer is gone and nothing is left */
+static bool receive_message(MessageQueue *queue, uint8_t **bytes, size_t *size)
+{
+    // SIGPROF of the profiler interrupts the wait
+    while (sem_wait(&queue->ready) != 0 && errno == EINTR)
+        continue;
+
+    Message *next = atomic_load_explicit(&queue->first->next, memory_order_acquire);
+    if (next == NULL)
+    {
+        // The post that woke us closed the queue, it stays closed for the receives after this one
+        sem_post(&queue->ready);
+        return false;
+    }
+
+    free_message(queue->first);
+    queue->first = next;
+
+    *bytes = next->bytes;
+    *size = next->size;
+    next->bytes = NULL;
+    return true;
+}
+
+/* ===== CLONING ===== */
+
+static Message *clone_message(Value *values, uint32_t count)
+{
+    Writer writer;
+    init_writer(&writer);
+    if (!write_clone(&writer, values, count))
+    {
+        free_writer(&writer);
+        runtime_error("Hanya nihil, boolean, number, string, array, table dan fungsi yang bisa dikirim ke pekerja");
+        return NULL;
+    }
+
+    return new_message(writer.bytes, writer.count);
+}
+
+/* Rebuilds a message in the heap of the current VM */
+static bool read_message(const uint8_t *bytes, size_t size, Value *returned)
+{
+    if (!read_clone(bytes, size))
+    {
+        runtime_error("Pesan tidak dapat dibaca di pekerja ini");
+        return false;
+    }
+
+    *returned = pop();
+    return true;
+}
+
+static bool receive_value(MessageQueue *queue, Value *returned)
+{
+    uint8_t *bytes;
+    size_t size;
+    if (!receive_message(queue, &bytes, &size))
+    {
+        *returned = VALUE_NIL;
+        return true;
+    }
+
+    bool is_read = read_message(bytes, size, returned);
+    free(bytes);
+    return is_read;
+}
+
+/* ===== THREADS ===== */
+
+static Worker *create_worker()
+{
+    Worker *worker = calloc(1, sizeof(Worker));
+    if (worker == NULL)
+    {
+        fprintf(stderr, "Not enough memory to create a worker\n");
+        exit(74);
+    }
+
+    atomic_init(&worker->refs, 2);
+    init_queue(&worker->inbox);
+    init_queue(&worker->outbox);
+    return worker;
+}
+
+static void release_worker(Worker *worker)
+{
+    if (atomic_fetch_sub_explicit(&worker->refs, 1, memory_order_acq_rel) != 1)
+        return;
+
+    free_queue(&worker->inbox);
+    free_queue(&worker->outbox);
+    if (worker->result != NULL)
+        free_message(worker->result);
+    free(worker);
+}
+
+static void *run_worker(void *argument)
+{
+    Worker *worker = argument;
+    current_worker = worker;
+
+    InterpretResult result;
+    if (worker->is_script)
+    {
+        result = interpret_stream(worker->vm, &worker->source);
+        close_source(&worker->source);
+    }
+    else
+    {
+        result = interpret_call(worker->vm, worker->args_count);
+    }
+
+    use_vm(worker->vm);
+    if (result == INTERPRET_OK && !worker->is_script)
+        worker->result = clone_message(&vm->stack.items[vm->stack_top - 1], 1);
+    free_vm(worker->vm);
+    worker->vm = NULL;
+
+    // Nothing else comes, a terima() of the parent returns nihil once the queue is drained
+    sem_post(&worker->outbox.ready);
+    release_worker(worker);
+    return NULL;
+}
+
+void drop_worker(Worker *worker)
+{
+    if (!worker->is_joined)
+        pthread_detach(worker->thread);
+
+    sem_post(&worker->inbox.ready);
+    release_worker(worker);
+}
+
+/* ===== NATIVES ===== */
+
+static bool prepare_script(Worker *worker, Value path)
+{
+    // A view is not terminated, fopen needs its own copy
+    StringRef ref = string_ref(path);
+    char *chars = malloc(ref.length + 1);
+    if (chars == NULL)
+        exit(69);
+    memcpy(chars, ref.chars, ref.length);
+    chars[ref.length] = '\0';
+
+    bool is_opened = open_source(&worker->source, chars);
+    if (!is_opened)
+        runtime_error("Tidak dapat membuka file '%s'", chars);
+    free(chars);
+    if (!is_opened)
+        return false;
+
+    worker->is_script = true;
+    worker->vm = new_vm();
+    return true;
+}
+
+/* The closure and its arguments are cloned on the stack of the worker's VM, ready for interpret_call */
+static bool prepare_call(Worker *worker, Value *values, int count)
+{
+    Message *message = clone_message(values, (uint32_t)count);
+    if (message == NULL)
+        return false;
+
+    worker->args_count = count - 1;
+    worker->vm = new_vm();
+
+    VM *previous = use_vm(worker->vm);
+    bool is_read = read_clone(message->bytes, message->size);
+    use_vm(previous);
+
+    free_message(message);
+    return is_read;
+}
+
+bool spawn_worker_native(int args_count, int stack_ptr, Value *returned)
+{
+    if (args_count < 1)
+    {
+        runtime_error("Diharapkan setidaknya 1 argumen namun mendapat 0");
+        return false;
+    }
+
+    Value target = vm->stack.items[stack_ptr];
+    if (IS_ANY_STRING(target) && !check_arity(1, args_count))
+        return false;
+
+    if (!IS_ANY_STRING(target) && !IS_CLOSURE(target))
+    {
+        runtime_error("Diharapkan argumen ke-1 bertipe fungsi atau string");
+        return false;
+    }
+
+    Worker *worker = create_worker();
+    bool is_ready = IS_ANY_STRING(target) ? prepare_script(worker, target)
+                                          : prepare_call(worker, &vm->stack.items[stack_ptr], args_count);
+
+    if (is_ready && pthread_create(&worker->thread, NULL, run_worker, worker) != 0)
+    {
+        runtime_error("Tidak dapat membuat thread pekerja");
+        if (worker->is_script)
+            close_source(&worker->source);
+        is_ready = false;
+    }
+
+    if (!is_ready)
+    {
+        if (worker->vm != NULL)
+            free_vm(worker->vm);
+        atomic_store(&worker->refs, 1);
+        release_worker(worker);
+        return false;
+    }
+
+    *returned = VALUE_OBJ(new_worker(worker));
+    return true;
+}
+
+static bool receiver_worker(int stack_ptr, Worker **worker)
+{
+    Value receiver = vm->stack.items[stack_ptr - 1];
+    if (!IS_WORKER(receiver))
+    {
+        runtime_error("Method pekerja harus dipanggil pada pekerja");
+        return false;
+    }
+
+    *worker = AS_WORKER(receiver)->worker;
+    return true;
+}
+
+bool worker_send_native(int args_count, int stack_ptr, Value *returned)
+{
+    Worker *worker;
+    if (!receiver_worker(stack_ptr, &worker) || !check_arity(1, args_count))
+        return false;
+
+    Message *message = clone_message(&vm->stack.items[stack_ptr], 1);
+    if (message == NULL)
+        return false;
+
+    send_message(&worker->inbox, message);
+    *returned = VALUE_NIL;
+    return true;
+}
+
+bool worker_receive_native(int args_count, int stack_ptr, Value *returned)
+{
+    Worker *worker;
+    if (!receiver_worker(stack_ptr, &worker) || !check_arity(0, args_count))
+        return false;
+
+    return receive_value(&worker->outbox, returned);
+}
+
+bool worker_wait_native(int args_count, int stack_ptr, Value *returned)
+{
+    Worker *worker;
+    if (!receiver_worker(stack_ptr, &worker) || !check_arity(0, args_count))
+        return false;
+
+    if (!worker->is_joined)
+    {
+        pthread_join(worker->thread, NULL);
+        worker->is_joined = true;
+    }
+
+    // The result stays with the worker, every tunggu() gets its own copy
+    if (worker->result == NULL)
+    {
+        *returned = VALUE_NIL;
+        return true;
+    }
+    return read_message(worker->result->bytes, worker->result->size, returned);
+}
+
+bool parent_send_native(int args_count, int stack_ptr, Value *returned)
+{
+    if (current_worker == NULL)
+    {
+        runtime_error("kirim() hanya dapat dipanggil di dalam pekerja");
+        return false;
+    }
+    if (!check_arity(1, args_count))
+        return false;
+
+    Message *message = clone_message(&vm->stack.items[stack_ptr], 1);
+    if (message == NULL)
+        return false;
+
+    send_message(&current_worker->outbox, message);
+    *returned = VALUE_NIL;
+    return true;
+}
+
+bool parent_receive_native(int args_count, int stack_ptr, Value *returned)
+{
+    (void)stack_ptr;
+    if (current_worker == NULL)
+    {
+        runtime_error("terima() hanya dapat dipanggil di dalam pekerja");
+        return false;
+    }
+    if (!check_arity(0, args_count))
+        return false;
+
+    return receive_value(&current_worker->inbox, returned);
+}
+
+#else
+
+void drop_worker(Worker *worker)
+{
+    (void)worker;
+}
+
+static bool unsupported()
+{
+    runtime_error("Pekerja tidak didukung di platform ini");
+    return false;
+}
+
+bool spawn_worker_native(int args_count, int stack_ptr, Value *returned)
+{
+    (void)args_count;
+    (void)stack_ptr;
+    (void)returned;
+    return unsupported();
+}
+
+bool parent_send_native(int args_count, int stack_ptr, Value *returned)
+{
+    (void)args_count;
+    (void)stack_ptr;
+    (void)returned;
+    return unsupported();
+}
+
+bool parent_receive_native(int args_count, int stack_ptr, Value *returned)
+{
+    (void)args_count;
+    (void)stack_ptr;
+    (void)returned;
+    return unsupported();
+}
+
+bool worker_send_native(int args_count, int stack_ptr, Value *returned)
+{
+    (void)args_count;
+    (void)stack_ptr;
+    (void)returned;
+    return unsupported();
+}
+
+bool worker_receive_native(int args_count, int stack_ptr, Value *returned)
+{
+    (void)args_count;
+    (void)stack_ptr;
+    (void)returned;
+    return unsupported();
+}
+
+bool worker_wait_native(int args_count, int stack_ptr, Value *returned)
+{
+    (void)args_count;
+    (void)stack_ptr;
+    (void)returned;
+    return unsupported();
+}
+
+#endif
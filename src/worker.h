@@ -0,0 +1,47 @@
+#ifndef CWS_WORKER_H
+#define CWS_WORKER_H
+
+#include "vm.h"
+
+/*
+ * WORKERS (`pekerja`)
+ *
+ * pekerja(f, args...) calls the closure f(args...) and pekerja("tugas.cws")
+ * runs a script, each on an OS thread of its own in a VM of its own. The
+ * two heaps share nothing: the closure with the variables it captured, its
+ * arguments and every message are cloned into the receiving VM (see
+ * write_clone in snapshot.h), so each VM keeps its own quickened code, JIT
+ * code and loop traces.
+ *
+ *   andai w = pekerja(hitung, 0, 1000);
+ *   w.kirim(data);      // to the worker
+ *   w.terima();         // the next message of the worker, nihil once it ended
+ *   w.tunggu();         // waits for the end, the result of `hitung` (nihil for a script)
+ *
+ * Inside the worker kirim(nilai) and terima() talk to the script that
+ * started it; terima() returns nihil once that script dropped the worker.
+ *
+ * Each direction is a lock-free linked queue with one producer and one
+ * consumer, the thread owning the handle and the worker, plus a semaphore
+ * counting the messages so a receiver sleeps instead of spinning. A worker
+ * that is neither awaited nor reachable anymore keeps running detached and
+ * the process does not wait for it when it exits.
+ * */
+#if !defined(_WIN32) && !defined(__EMSCRIPTEN__)
+#define HAS_WORKERS
+#endif
+
+typedef struct Worker Worker;
+
+void drop_worker(Worker *worker);
+
+bool spawn_worker_native(int args_count, int stack_ptr, Value *returned);
+bool parent_send_native(int args_count, int stack_ptr, Value *returned);
+bool parent_receive_native(int args_count, int stack_ptr, Value *returned);
+
+/* Methods of the handle, the receiver is at vm->stack.items[stack_ptr - 1] */
+bool worker_send_native(int args_count, int stack_ptr, Value *returned);
+bool worker_receive_native(int args_count, int stack_ptr, Value *returned);
+bool worker_wait_native(int args_count, int stack_ptr, Value *returned);
+
+#endif // !CWS_WORKER_H
@@ -0,0 +1,567 @@
+/*
+ * Reads a heap dump written by heap_dump() or `cws --heap-dump-on-exit` and
+ * reports what holds the memory: the totals per type, the roots retaining
+ * the most and the objects with the largest retained size, each with its
+ * shortest path from a root. The retained size of an object is what
+ * freeing it would free: itself and every object it dominates, i.e. that
+ * can only be reached through it. Dominators are computed with the
+ * iterative algorithm of Cooper, Harvey and Kennedy over the reverse
+ * postorder. Built by `make tools/heapdump`, see src/heap_dump.h.
+ *
+ * Usage : heapdump [-n count] dump.cwsd
+ * */
+#include "../src/heap_dump.h"
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+// In the order of ObjType in src/object.h
+static const char *const type_names[] = {
+    "string", "function", "native", "closure", "upvalue", "class",
+    "instance", "method", "table", "array", "string_view", "worker",
+};
+#define TYPE_COUNT (sizeof(type_names) / sizeof(type_names[0]))
+
+// Path elements printed at each end of a longer path
+#define PATH_ENDS 3
+
+typedef struct
+{
+    uint8_t kind;
+    const char *name;
+    uint32_t length;
+} Root;
+
+typedef struct
+{
+    uint64_t id;
+    uint8_t type;
+    uint64_t size;
+    uint64_t retainer_id;
+    uint32_t root;
+    const char *label;
+    uint32_t label_length;
+    const uint8_t *refs;
+    uint32_t ref_count;
+
+    int64_t retainer;
+    uint64_t retained;
+} Object;
+
+static struct
+{
+    uint8_t *bytes;
+    size_t size;
+    size_t position;
+    bool is_error;
+
+    Root *roots;
+    uint32_t root_count;
+
+    Object *objects;
+    size_t object_count;
+
+    // Object index + 1 by id, open addressing
+    uint64_t *slots;
+    size_t slot_capacity;
+} heap;
+
+static void *checked(void *pointer)
+{
+    if (pointer == NULL)
+    {
+        fprintf(stderr, "Not enough memory\n");
+        exit(74);
+    }
+    return pointer;
+}
+
+/* ===== READING ===== */
+
+static const uint8_t *take(size_t count)
+{
+    if (heap.is_error || heap.size - heap.position < count)
+    {
+        heap.is_error = true;
+        return NULL;
+    }
+    const uint8_t *bytes = heap.bytes + heap.position;
+    heap.position += count;
+    return bytes;
+}
+
+static uint64_t decode(const uint8_t *bytes, int count)
+{
+    uint64_t value = 0;
+    for (int i = 0; i < count; ++i)
+        value |= (uint64_t)bytes[i] << (8 * i);
+    return value;
+}
+
+static uint64_t take_uint(int count)
+{
+    const uint8_t *bytes = take(count);
+    return bytes == NULL ? 0 : decode(bytes, count);
+}
+
+static const char *take_chars(uint32_t *length)
+{
+    *length = (uint32_t)take_uint(4);
+    return (const char *)take(*length);
+}
+
+static bool read_dump(const char *path)
+{
+    FILE *file = fopen(path, "rb");
+    if (file == NULL)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    heap.size = (size_t)ftell(file);
+    rewind(file);
+    heap.bytes = checked(malloc(heap.size + 1));
+    bool is_read = fread(heap.bytes, 1, heap.size, file) == heap.size;
+    fclose(file);
+    if (!is_read)
+        return false;
+
+    const uint8_t *magic = take(4);
+    if (magic == NULL || memcmp(magic, HEAP_DUMP_MAGIC, 4) != 0 || take_uint(4) != HEAP_DUMP_VERSION)
+        return false;
+
+    size_t root_capacity = 0, object_capacity = 0;
+    for (;;)
+    {
+        uint64_t tag = take_uint(1);
+        if (heap.is_error)
+            return false;
+
+        if (tag == HEAP_DUMP_END)
+            return take_uint(8) == heap.object_count && !heap.is_error;
+
+        if (tag == HEAP_DUMP_ROOT)
+        {
+            if (heap.root_count == root_capacity)
+            {
+                root_capacity = root_capacity < 64 ? 64 : root_capacity * 2;
+                heap.roots = checked(realloc(heap.roots, root_capacity * sizeof(Root)));
+            }
+            Root *root = &heap.roots[heap.root_count++];
+            root->kind = (uint8_t)take_uint(1);
+            root->name = take_chars(&root->length);
+        }
+        else if (tag == HEAP_DUMP_OBJECT)
+        {
+            if (heap.object_count == object_capacity)
+            {
+                object_capacity = object_capacity < 1024 ? 1024 : object_capacity * 2;
+                heap.objects = checked(realloc(heap.objects, object_capacity * sizeof(Object)));
+            }
+            Object *object = &heap.objects[heap.object_count++];
+            object->id = take_uint(8);
+            object->type = (uint8_t)take_uint(1);
+            object->size = take_uint(8);
+            object->retainer_id = take_uint(8);
+            object->root = (uint32_t)take_uint(4);
+            object->label = take_chars(&object->label_length);
+            object->ref_count = (uint32_t)take_uint(4);
+            object->refs = take((size_t)object->ref_count * 8);
+
+            if (object->type >= TYPE_COUNT || object->root > heap.root_count)
+                return false;
+        }
+        else
+        {
+            return false;
+        }
+    }
+}
+
+/* ===== GRAPH ===== */
+
+static size_t slot_of(uint64_t id)
+{
+    return (size_t)((id >> 3) * 0x9e3779b97f4a7c15ull >> 20) & (heap.slot_capacity - 1);
+}
+
+static void index_objects()
+{
+    heap.slot_capacity = 1024;
+    while (heap.slot_capacity < heap.object_count * 2)
+        heap.slot_capacity *= 2;
+    heap.slots = checked(calloc(heap.slot_capacity, sizeof(uint64_t)));
+
+    for (size_t i = 0; i < heap.object_count; ++i)
+    {
+        size_t slot = slot_of(heap.objects[i].id);
+        while (heap.slots[slot] != 0)
+            slot = (slot + 1) & (heap.slot_capacity - 1);
+        heap.slots[slot] = i + 1;
+    }
+}
+
+/* -1 for an id that is not in the dump */
+static int64_t find_object(uint64_t id)
+{
+    for (size_t slot = slot_of(id); heap.slots[slot] != 0; slot = (slot + 1) & (heap.slot_capacity - 1))
+    {
+        if (heap.objects[heap.slots[slot] - 1].id == id)
+            return (int64_t)heap.slots[slot] - 1;
+    }
+    return -1;
+}
+
+/*
+ * Node 0 is a virtual root above every root, object i is node i + 1.
+ * Successors are built in compressed rows, predecessors the same way.
+ * */
+typedef struct
+{
+    size_t *start;
+    uint32_t *nodes;
+} Edges;
+
+static Edges successors()
+{
+    size_t node_count = heap.object_count + 1;
+    Edges edges = {checked(calloc(node_count + 1, sizeof(size_t))), NULL};
+
+    size_t total = 0;
+    for (size_t i = 0; i < heap.object_count; ++i)
+        total += heap.objects[i].ref_count + 1;
+    edges.nodes = checked(malloc((total + 1) * sizeof(uint32_t)));
+
+    size_t count = 0;
+    for (size_t i = 0; i < heap.object_count; ++i)
+    {
+        Object *object = &heap.objects[i];
+        if (object->root != 0 && object->retainer_id == 0)
+            edges.nodes[count++] = (uint32_t)(i + 1);
+    }
+    edges.start[1] = count;
+
+    for (size_t i = 0; i < heap.object_count; ++i)
+    {
+        Object *object = &heap.objects[i];
+        for (uint32_t j = 0; j < object->ref_count; ++j)
+        {
+            int64_t target = find_object(decode(object->refs + 8 * j, 8));
+            if (target >= 0)
+                edges.nodes[count++] = (uint32_t)(target + 1);
+        }
+        edges.start[i + 2] = count;
+    }
+    return edges;
+}
+
+/* Reverse postorder of the nodes reachable from the virtual root, returns how many */
+static size_t reverse_postorder(Edges *edges, uint32_t *order)
+{
+    size_t node_count = heap.object_count + 1;
+    bool *is_seen = checked(calloc(node_count, sizeof(bool)));
+    uint32_t *stack = checked(malloc(node_count * sizeof(uint32_t)));
+    size_t *next_edge = checked(malloc(node_count * sizeof(size_t)));
+
+    size_t depth = 0, finished = 0;
+    stack[depth++] = 0;
+    is_seen[0] = true;
+    next_edge[0] = edges->start[0];
+    while (depth > 0)
+    {
+        uint32_t node = stack[depth - 1];
+        if (next_edge[node] < edges->start[node + 1])
+        {
+            uint32_t target = edges->nodes[next_edge[node]++];
+            if (!is_seen[target])
+            {
+                is_seen[target] = true;
+                next_edge[target] = edges->start[target];
+                stack[depth++] = target;
+            }
+            continue;
+        }
+        order[finished++] = node;
+        depth--;
+    }
+
+    for (size_t i = 0; i < finished / 2; ++i)
+    {
+        uint32_t swap = order[i];
+        order[i] = order[finished - 1 - i];
+        order[finished - 1 - i] = swap;
+    }
+
+    free(is_seen);
+    free(stack);
+    free(next_edge);
+    return finished;
+}
+
+static uint32_t *dominators(Edges *edges, uint32_t *order, size_t reachable)
+{
+    size_t node_count = heap.object_count + 1;
+    uint32_t *rank = checked(malloc(node_count * sizeof(uint32_t)));
+    uint32_t *idom = checked(malloc(node_count * sizeof(uint32_t)));
+    for (size_t i = 0; i < node_count; ++i)
+    {
+        rank[i] = UINT32_MAX;
+        idom[i] = UINT32_MAX;
+    }
+    for (size_t i = 0; i < reachable; ++i)
+        rank[order[i]] = (uint32_t)i;
+
+    // Predecessors of the reachable nodes
+    Edges preds = {checked(calloc(node_count + 1, sizeof(size_t))), NULL};
+    for (size_t i = 0; i < reachable; ++i)
+    {
+        uint32_t node = order[i];
+        for (size_t e = edges->start[node]; e < edges->start[node + 1]; ++e)
+            preds.start[edges->nodes[e] + 1]++;
+    }
+    for (size_t i = 0; i < node_count; ++i)
+        preds.start[i + 1] += preds.start[i];
+    preds.nodes = checked(malloc((preds.start[node_count] + 1) * sizeof(uint32_t)));
+    size_t *fill = checked(malloc(node_count * sizeof(size_t)));
+    memcpy(fill, preds.start, node_count * sizeof(size_t));
+    for (size_t i = 0; i < reachable; ++i)
+    {
+        uint32_t node = order[i];
+        for (size_t e = edges->start[node]; e < edges->start[node + 1]; ++e)
+            preds.nodes[fill[edges->nodes[e]]++] = node;
+    }
+
+    idom[0] = 0;
+    for (bool is_changed = true; is_changed;)
+    {
+        is_changed = false;
+        for (size_t i = 1; i < reachable; ++i)
+        {
+            uint32_t node = order[i];
+            uint32_t new_idom = UINT32_MAX;
+            for (size_t e = preds.start[node]; e < preds.start[node + 1]; ++e)
+            {
+                uint32_t pred = preds.nodes[e];
+                if (idom[pred] == UINT32_MAX)
+                    continue;
+                if (new_idom == UINT32_MAX)
+                {
+                    new_idom = pred;
+                    continue;
+                }
+
+                // Walks both up the dominator tree until they meet
+                uint32_t a = pred, b = new_idom;
+                while (a != b)
+                {
+                    while (rank[a] > rank[b])
+                        a = idom[a];
+                    while (rank[b] > rank[a])
+                        b = idom[b];
+                }
+                new_idom = a;
+            }
+
+            if (idom[node] != new_idom)
+            {
+                idom[node] = new_idom;
+                is_changed = true;
+            }
+        }
+    }
+
+    free(rank);
+    free(fill);
+    free(preds.start);
+    free(preds.nodes);
+    return idom;
+}
+
+/* ===== REPORT ===== */
+
+static void print_label(Object *object)
+{
+    if (object->label_length == 0)
+        return;
+
+    bool is_string = object->type == 0 || object->type == 10;
+    fputs(is_string ? " \"" : " ", stdout);
+    for (uint32_t i = 0; i < object->label_length; ++i)
+    {
+        char c = object->label[i];
+        putchar(c >= ' ' && c < 127 ? c : '?');
+    }
+    if (is_string)
+        putchar('"');
+}
+
+static void print_object(Object *object)
+{
+    fputs(type_names[object->type], stdout);
+    print_label(object);
+}
+
+static void print_path(size_t index)
+{
+    size_t path[PATH_ENDS * 2 + 1];
+    size_t length = 0, skipped = 0;
+
+    // Walks up from the object, keeping the first and the last few steps
+    for (int64_t at = (int64_t)index; at >= 0; at = heap.objects[at].retainer)
+    {
+        if (length == PATH_ENDS * 2)
+        {
+            memmove(path + PATH_ENDS, path + PATH_ENDS + 1, (PATH_ENDS - 1) * sizeof(size_t));
+            length--;
+            skipped++;
+        }
+        path[length++] = (size_t)at;
+    }
+
+    Object *last = &heap.objects[path[length - 1]];
+    Root *root = &heap.roots[last->root - 1];
+    printf("%.*s", (int)root->length, root->name);
+    for (size_t i = length; i-- > 0;)
+    {
+        fputs(" > ", stdout);
+        print_object(&heap.objects[path[i]]);
+        if (i == PATH_ENDS && skipped > 0)
+            printf(" > (%zu more)", skipped);
+    }
+    putchar('\n');
+}
+
+static int compare_retained(const void *a, const void *b)
+{
+    uint64_t x = heap.objects[*(const size_t *)a].retained;
+    uint64_t y = heap.objects[*(const size_t *)b].retained;
+    return x < y ? 1 : x > y ? -1 : 0;
+}
+
+static void report(uint32_t *idom, uint32_t *order, size_t reachable, int top)
+{
+    uint64_t type_objects[TYPE_COUNT] = {0}, type_bytes[TYPE_COUNT] = {0};
+    uint64_t live_bytes = 0, garbage_objects = 0, garbage_bytes = 0;
+    for (size_t i = 0; i < heap.object_count; ++i)
+    {
+        Object *object = &heap.objects[i];
+        if (object->root == 0)
+        {
+            garbage_objects++;
+            garbage_bytes += object->size;
+            continue;
+        }
+        live_bytes += object->size;
+        type_objects[object->type]++;
+        type_bytes[object->type] += object->size;
+    }
+
+    printf("%zu objects (%llu bytes) reachable from %u roots, %llu objects (%llu bytes) waiting for the GC\n\n",
+           reachable - 1, (unsigned long long)live_bytes, heap.root_count, (unsigned long long)garbage_objects,
+           (unsigned long long)garbage_bytes);
+
+    printf("%-12s %12s %14s\n", "type", "objects", "bytes");
+    for (size_t t = 0; t < TYPE_COUNT; ++t)
+    {
+        if (type_objects[t] > 0)
+            printf("%-12s %12llu %14llu\n", type_names[t], (unsigned long long)type_objects[t],
+                   (unsigned long long)type_bytes[t]);
+    }
+
+    // Retained sizes, children before their dominator
+    for (size_t i = 0; i < heap.object_count; ++i)
+        heap.objects[i].retained = heap.objects[i].size;
+    uint64_t *root_retained = checked(calloc(heap.root_count + 1, sizeof(uint64_t)));
+    for (size_t i = reachable; i-- > 1;)
+    {
+        uint32_t node = order[i];
+        Object *object = &heap.objects[node - 1];
+        if (idom[node] == 0)
+            root_retained[object->root] += object->retained;
+        else
+            heap.objects[idom[node] - 1].retained += object->retained;
+    }
+
+    size_t *sorted = checked(malloc((heap.root_count + 1) * sizeof(size_t)));
+    size_t count = 0;
+    for (uint32_t r = 1; r <= heap.root_count; ++r)
+    {
+        if (root_retained[r] > 0)
+            sorted[count++] = r;
+    }
+    for (size_t i = 1; i < count; ++i)
+    {
+        size_t current = sorted[i], j = i;
+        for (; j > 0 && root_retained[sorted[j - 1]] < root_retained[current]; --j)
+            sorted[j] = sorted[j - 1];
+        sorted[j] = current;
+    }
+
+    printf("\n%14s  %s\n", "retained", "root");
+    for (size_t i = 0; i < count && (int)i < top; ++i)
+    {
+        Root *root = &heap.roots[sorted[i] - 1];
+        printf("%14llu  %.*s\n", (unsigned long long)root_retained[sorted[i]], (int)root->length, root->name);
+    }
+    free(sorted);
+    free(root_retained);
+
+    sorted = checked(malloc((reachable + 1) * sizeof(size_t)));
+    count = 0;
+    for (size_t i = 1; i < reachable; ++i)
+        sorted[count++] = order[i] - 1;
+    qsort(sorted, count, sizeof(size_t), compare_retained);
+
+    printf("\n%14s %12s  %s\n", "retained", "size", "object, path from its root");
+    for (size_t i = 0; i < count && (int)i < top; ++i)
+    {
+        Object *object = &heap.objects[sorted[i]];
+        printf("%14llu %12llu  ", (unsigned long long)object->retained, (unsigned long long)object->size);
+        print_object(object);
+        printf("\n%28s", "");
+        print_path(sorted[i]);
+    }
+    free(sorted);
+}
+
+int main(int argc, char **argv)
+{
+    int top = 20;
+    int arg = 1;
+    for (; arg + 1 < argc && strcmp(argv[arg], "-n") == 0; arg += 2)
+        top = atoi(argv[arg + 1]);
+
+    if (arg != argc - 1)
+    {
+        fprintf(stderr, "Usage : heapdump [-n count] dump.cwsd\n");
+        return 64;
+    }
+
+    if (!read_dump(argv[arg]))
+    {
+        fprintf(stderr, "Cannot read the heap dump %s\n", argv[arg]);
+        return 74;
+    }
+
+    index_objects();
+    for (size_t i = 0; i < heap.object_count; ++i)
+        heap.objects[i].retainer = heap.objects[i].retainer_id == 0 ? -1 : find_object(heap.objects[i].retainer_id);
+
+    Edges edges = successors();
+    uint32_t *order = checked(malloc((heap.object_count + 1) * sizeof(uint32_t)));
+    size_t reachable = reverse_postorder(&edges, order);
+    uint32_t *idom = dominators(&edges, order, reachable);
+
+    report(idom, order, reachable, top);
+
+    free(idom);
+    free(order);
+    free(edges.start);
+    free(edges.nodes);
+    free(heap.slots);
+    free(heap.objects);
+    free(heap.roots);
+    free(heap.bytes);
+    return 0;
+}